@@ -37,6 +37,14 @@ IN:
 						of an AP
 	*) Slope_tresh		Slope threshold that defines the beginning of the
 						AP (mV/ms)
+	*) Prefilter		Outlier rejection of the Vm that is seen by the upstroke
+						detector: 0 = off, 1 = sliding median, 2 = Hampel
+	*) Prefilter_window	Length of the sliding window of the prefilter (samples)
+	*) Hampel_k			Rejection threshold of the Hampel prefilter, in scaled
+						median absolute deviations
+	*) Detector			Upstroke detection: 0 = rise over the last ms, 1 = slope
+						over Detect_window with interpolated onset
+	*) Detect_window	Length of the window of the slope fit (ms)
 	*) BCL_cutoff		Threshold value for the end of an AP, given as a
 						percentage of the total APD
 	*) lognum			Number of APs that need to be logged as a reference
@@ -45,6 +53,37 @@ IN:
 	*) Rm_corr_down		Factor to decrease Rm with when necessary
 	*) noise_tresh		The noise level that is allowed around the ideal value
 						before correcting
+	*) Auto_thresh		value that indicates whether or not noise_tresh follows
+						the noise of Vm between the beats
+	*) Auto_k			noise_tresh in multiples of the standard deviation of
+						that noise
+	*) Alt_window		Number of beats over which alternans and short-term
+						variability of APD90 are computed
+	*) Alt_thresh		Alternans magnitude of APD90 above which alternans is
+						flagged (ms, 0 = off)
+	*) STV_thresh		Short-term variability of APD90 above which alternans
+						is flagged (ms, 0 = off)
+	*) Alt_backoff		Factor by which the correction is scaled
+						when alternans is flagged (1 = no back-off)
+	*) Err_split1		End of the first phase window of the error statistics
+						after the upstroke (ms)
+	*) Err_split2		End of the second phase window of the error statistics
+						after the upstroke (ms)
+	*) RLS_on			value that indicates whether or not the response of the cell
+						is identified online
+	*) RLS_lambda		Forgetting factor of the online identification
+	*) RLS_autoscale	value that indicates whether or not Rm is replaced by
+						the identified value at every upstroke
+	*) RLS_Tc			Time constant (ms) with which the rescaled controller
+						should remove an error
+	*) DC_on			value that indicates whether or not virtual ionic currents
+						are injected on top of the correction (dynamic clamp)
+	*) g_Na				Conductance of the virtual I_Na (nS/pF)
+	*) g_K1				Conductance of the virtual I_K1 (nS/pF)
+	*) g_CaL			Conductance of the virtual I_CaL (nS/pF)
+	*) E_Na				Reversal potential of the virtual I_Na (mV)
+	*) E_K				Reversal potential of the virtual I_K1 (mV)
+	*) E_CaL			Apparent reversal potential of the virtual I_CaL (mV)
 OUT:
 	*) Vout 			voltage that is used to inject the calculated amount
 						of current into the excitable system
@@ -86,10 +125,36 @@ static DefaultGUIModel::variable_t vars[] = {
 	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
 	{ "Slope_thresh (mV/ms)", "Slope threshold that defines the beginning of the AP (mV/ms)",
 	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "Prefilter", "Outlier rejection of the Vm seen by the upstroke detector (0 = off, 1 = median, 2 = Hampel)",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "Prefilter_window", "Length of the sliding window of the prefilter (samples)",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "Hampel_k", "Rejection threshold of the Hampel prefilter (scaled median absolute deviations)",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "Detector", "Upstroke detection (0 = rise over the last ms, 1 = slope over Detect_window with interpolated onset)",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "Detect_window (ms)", "Length of the window of the slope fit of the upstroke detector",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
 	{ "BCL_cutoff (pct)", "Threshold value for the end of an AP, given as a percentage of the total APD",
 	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
 	{ "noise_tresh (mV)", "The noise level that is allowed before correcting", DefaultGUIModel::PARAMETER
 	| DefaultGUIModel::DOUBLE, }, 
+	{ "Auto_thresh", "value that indicates whether or not noise_tresh follow the noise of Vm between the beats (0 or 1)",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "Auto_k", "noise_tresh in multiples of the estimated noise",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "Alt_window (beats)", "Number of beats over which alternans and short-term variability of APD90 are computed (4-32)",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "Alt_thresh (ms)", "Alternans magnitude of APD90 above which alternans is flagged (0 = off)",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "STV_thresh (ms)", "Short-term variability of APD90 above which alternans is flagged (0 = off)",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "Alt_backoff", "Factor by which the correction 1/Rm is scaled when alternans is flagged (1 = no back-off)",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "Err_split1 (ms)", "End of the first phase window (upstroke) of the error statistics after the upstroke",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "Err_split2 (ms)", "End of the second phase window (plateau) of the error statistics after the upstroke",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
 	{ "Rm (MOhm)", "MOhm", DefaultGUIModel::PARAMETER
 	| DefaultGUIModel::DOUBLE, },
 	{ "lognum", "Number of APs that need to be logged as a reference", DefaultGUIModel::PARAMETER
@@ -100,11 +165,70 @@ static DefaultGUIModel::variable_t vars[] = {
 	| DefaultGUIModel::DOUBLE, }, 
 	{ "Correction (0 or 1)", "Switch Rm correction off (0) or on (1)",
 	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "RLS_on", "value that indicates whether or not the response of the cell is identified online (0 or 1)",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "RLS_lambda", "Forgetting factor of the online identification (0-1)",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "RLS_autoscale", "value that indicates whether or not Rm is rescaled from the identified response (0 or 1)",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "RLS_Tc (ms)", "Time constant with which the rescaled controller should remove an error",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "b (mV/ms/V)", "Identified effect of the command output on Vm", DefaultGUIModel::STATE, },
+	{ "Cm_est (pF)", "Capacitance that follows from the identified effect of the command output", DefaultGUIModel::STATE, },
+	{ "tau_est (ms)", "Identified time constant with which an error relaxes without injected current", DefaultGUIModel::STATE, },
+	{ "DC_on", "value that indicates whether or not virtual ionic currents are injected (0 or 1)",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "g_Na (nS/pF)", "Conductance of the virtual I_Na", DefaultGUIModel::PARAMETER
+	| DefaultGUIModel::DOUBLE, },
+	{ "g_K1 (nS/pF)", "Conductance of the virtual I_K1", DefaultGUIModel::PARAMETER
+	| DefaultGUIModel::DOUBLE, },
+	{ "g_CaL (nS/pF)", "Conductance of the virtual I_CaL", DefaultGUIModel::PARAMETER
+	| DefaultGUIModel::DOUBLE, },
+	{ "E_Na (mV)", "Reversal potential of the virtual I_Na", DefaultGUIModel::PARAMETER
+	| DefaultGUIModel::DOUBLE, },
+	{ "E_K (mV)", "Reversal potential of the virtual I_K1", DefaultGUIModel::PARAMETER
+	| DefaultGUIModel::DOUBLE, },
+	{ "E_CaL (mV)", "Apparent reversal potential of the virtual I_CaL", DefaultGUIModel::PARAMETER
+	| DefaultGUIModel::DOUBLE, },
+	{ "I_dc (pA)", "Injected virtual ionic current", DefaultGUIModel::STATE, },
 	{ "Period (ms)", "Period (ms)", DefaultGUIModel::STATE, }, // To check that the period taken by the algorithm is the same as the one i nthe control panel module
 	{ "Time (ms)", "Time (ms)", DefaultGUIModel::STATE, }, // To check that the algorithm is running
 	{ "APs2", "APs", DefaultGUIModel::STATE, }, // To check whether APs are being logged and the counter increases
 	{ "BCL2", "BCL", DefaultGUIModel::STATE, }, // To check what the eventual BCL of the ideal AP has become. You can see then if the APs were logged correctly
 	{ "act2", "0 or 1", DefaultGUIModel::STATE, }, // Switches from 0 to 1 and back continuously as a check to see whether you are computing error values and corrected values
+	{ "Phase", "0 = REST, 1 = LOGGING, 2 = REFRACTORY, 3 = CORRECTING, 4 = PAUSED", DefaultGUIModel::STATE, },
+	{ "Memory locked", "1 when the hot state and the logs of the module are locked in RAM", DefaultGUIModel::STATE, },
+	{ "Saturated", "time-steps on which the requested output exceeded its range", DefaultGUIModel::STATE, },
+	{ "Overruns", "time-steps that started more than 1.5 periods after the previous one", DefaultGUIModel::STATE, },
+	{ "Missed upstrokes", "beats without an upstroke within twice their expected length", DefaultGUIModel::STATE, },
+	{ "APD30 (ms)", "time from dV/dt max to 30% repolarization of the last beat", DefaultGUIModel::STATE, },
+	{ "APD50 (ms)", "time from dV/dt max to 50% repolarization of the last beat", DefaultGUIModel::STATE, },
+	{ "APD90 (ms)", "time from dV/dt max to 90% repolarization of the last beat", DefaultGUIModel::STATE, },
+	{ "AP_amplitude (mV)", "peak minus RMP of the last beat", DefaultGUIModel::STATE, },
+	{ "dVdt_max (mV/ms)", "maximal upstroke velocity of the last beat", DefaultGUIModel::STATE, },
+	{ "RMP (mV)", "lowest potential of the beat before the last beat", DefaultGUIModel::STATE, },
+	{ "Ref_APD30 (ms)", "time from dV/dt max to 30% repolarization of the reference AP of the last beat", DefaultGUIModel::STATE, },
+	{ "Ref_APD50 (ms)", "time from dV/dt max to 50% repolarization of the reference AP of the last beat", DefaultGUIModel::STATE, },
+	{ "Ref_APD90 (ms)", "time from dV/dt max to 90% repolarization of the reference AP of the last beat", DefaultGUIModel::STATE, },
+	{ "Ref_AP_amplitude (mV)", "peak minus RMP of the reference AP of the last beat", DefaultGUIModel::STATE, },
+	{ "Ref_dVdt_max (mV/ms)", "maximal upstroke velocity of the reference AP of the last beat", DefaultGUIModel::STATE, },
+	{ "Ref_RMP (mV)", "lowest potential of the reference AP of the beat before the last beat", DefaultGUIModel::STATE, },
+	{ "Noise (mV)", "estimated standard deviation of the noise of Vm between the beats", DefaultGUIModel::STATE, },
+	{ "Alternans (ms)", "alternans magnitude of APD90 over the last Alt_window beats", DefaultGUIModel::STATE, },
+	{ "STV (ms)", "short-term variability of APD90 over the last Alt_window beats", DefaultGUIModel::STATE, },
+	{ "Alternans_flag", "1 when the last full window crossed Alt_thresh or STV_thresh", DefaultGUIModel::STATE, },
+	{ "Err_RMS (mV)", "root mean square of Vm - reference of the last corrected beat", DefaultGUIModel::STATE, },
+	{ "Err_max (mV)", "largest absolute Vm - reference of the last corrected beat", DefaultGUIModel::STATE, },
+	{ "Err_bias (mV)", "mean Vm - reference of the last corrected beat", DefaultGUIModel::STATE, },
+	{ "Err_RMS_w1 (mV)", "root mean square of Vm - reference in the first phase window of the last corrected beat", DefaultGUIModel::STATE, },
+	{ "Err_max_w1 (mV)", "largest absolute Vm - reference in the first phase window of the last corrected beat", DefaultGUIModel::STATE, },
+	{ "Err_bias_w1 (mV)", "mean Vm - reference in the first phase window of the last corrected beat", DefaultGUIModel::STATE, },
+	{ "Err_RMS_w2 (mV)", "root mean square of Vm - reference in the second phase window of the last corrected beat", DefaultGUIModel::STATE, },
+	{ "Err_max_w2 (mV)", "largest absolute Vm - reference in the second phase window of the last corrected beat", DefaultGUIModel::STATE, },
+	{ "Err_bias_w2 (mV)", "mean Vm - reference in the second phase window of the last corrected beat", DefaultGUIModel::STATE, },
+	{ "Err_RMS_w3 (mV)", "root mean square of Vm - reference after the second split of the last corrected beat", DefaultGUIModel::STATE, },
+	{ "Err_max_w3 (mV)", "largest absolute Vm - reference after the second split of the last corrected beat", DefaultGUIModel::STATE, },
+	{ "Err_bias_w3 (mV)", "mean Vm - reference after the second split of the last corrected beat", DefaultGUIModel::STATE, },
 };
 
 /*
@@ -114,6 +238,58 @@ variable denoting the amount of variables that is displayed in the GUI
 */
 static size_t num_vars = sizeof(vars) / sizeof(DefaultGUIModel::variable_t);
 
+/*
+live_vars[]
+-----------
+Parameters that Modify hands to execute() without a reset (see LiveParams.h).
+All other parameters are structural: changing them resets the module and its logs.
+*/
+static const char* live_vars[] = {
+	"Cm (pF)",
+	"Rm (MOhm)",
+	"Rm_corr_up",
+	"Rm_corr_down",
+	"noise_tresh (mV)",
+	"Auto_thresh",
+	"Auto_k",
+	"Alt_thresh (ms)",
+	"STV_thresh (ms)",
+	"Alt_backoff",
+	"Err_split1 (ms)",
+	"Err_split2 (ms)",
+	"Slope_thresh (mV/ms)",
+	"V_cutoff (mV)",
+	"BCL_cutoff (pct)",
+};
+
+static size_t num_live_vars = sizeof(live_vars) / sizeof(const char*);
+
+/*
+beat_vars[]
+-----------
+Parameters that Modify hands to execute() as commands, which take effect at a beat
+boundary (see CommandQueue.h): at the next upstroke or at the end of the beat.
+*/
+enum {SET_CORRECTION};
+
+static const struct {const char* name; int id; int when;} beat_vars[] = {
+	{"Correction (0 or 1)", SET_CORRECTION, BeatCommands::AT_UPSTROKE},
+};
+
+static size_t num_beat_vars = sizeof(beat_vars) / sizeof(beat_vars[0]);
+
+/*
+SyncEvent
+---------
+Event without an action. The real-time thread handles events between two
+time-steps, so posting one waits until execute() has returned (see holdExecute).
+*/
+class SyncEvent : public RT::Event
+{
+public:
+	int callback(void){return 0;}
+};
+
 /*
 gAPqr7
 ------
@@ -137,13 +313,47 @@ gAPqr7::gAPqr7(void) : DefaultGUIModel("APqr7", ::vars, ::num_vars)
 	resizeMe();
 }
 
+/*
+operator new
+------------
+Allocates the module on a cache line boundary, such that the alignas() of its
+hot state and of its logs holds on the heap (see RTMemory.h).
+
+IN:
+	*) bytes	size of the module
+OUT:
+	*) p		pointer to the memory
+*/
+void* gAPqr7::operator new(size_t bytes)
+{
+	return alignedAlloc(bytes);
+}
+
+/*
+operator delete
+---------------
+Frees a module that was allocated with operator new.
+
+IN:
+	*) p		pointer to the module
+OUT:
+	*) None
+*/
+void gAPqr7::operator delete(void* p)
+{
+	alignedFree(p);
+}
+
 gAPqr7::~gAPqr7(void) {}
 
 /*
 cleanup
 -------
 The APqr software makes use of three list structures which need cleaning after
-a reset of parameters. The cleanup function takes care of this.
+a reset of parameters. The cleanup function takes care of this by starting a
+new epoch of each log, after which every entry reads as 0 until it is written
+again (see EpochBuffer.h). This takes constant time, so a Modify no longer
+stalls on clearing the logs.
 
 IN:
 	*) None
@@ -152,142 +362,597 @@ OUT:
 */
 void gAPqr7::cleanup()
 {
-	for(i=0;i<10000;i++){
-		Vm_log[i]=0;
-		Vm_diff_log[i]=0;
-		ideal_AP[i]=0;
-	}
+	Vm_log.invalidate();
+	Vm_diff_log.invalidate();
+	ideal_AP.invalidate();
 }
 
 /*
-execute
--------
-This is the main funtcion of the code that is looped through real-time.
-It contains the four main parts of the algorithm:
-	1) Recording the ideal AP
-	2) Detecting AP upstrokes
-	3) Computing AP correction and outputting this
-	4) Updating the necessary variables
+lockBuffers
+-----------
+Touches every page of the module, its hot state and its logs, and locks them in
+RAM, such that execute() does not take page faults on them after a swap or a
+fork of the process. Called from MODIFY and PERIOD, outside of the real-time
+loop. Sets memory_locked to 0 when the lock is refused (RLIMIT_MEMLOCK).
 
 IN:
 	*) None
 OUT:
-	*) Vout				voltage that is used to inject the calculated amount
-						of current into the excitable system
+	*) None
 */
-void gAPqr7::execute(void)
+void gAPqr7::lockBuffers()
 {
-	systime = count * period; 	// time in milli-seconds
-	Vm = input(0) * 1e2; 		// convert 10V to mV. Divided by 10 because
-								// the amplifier produces 10-fold amplified
-								// voltages. Multiplied by 1000 to convert
-								// V to mV.
+	memory_locked = lockMemory(this, sizeof(*this));
+}
 
-	Vm_log[count % (int)modulo] = Vm; 	// Logging the measured Vm in a list
-										// where the modulo component makes
-										// sure you keep cycling when you have
-										// reached the maximum number in the list.
+/*
+readLive
+--------
+Reads the live-tunable parameters (see live_vars[]) from the GUI.
 
-	// ****************************
-	// ****************************
-	// ** Recording the ideal AP **
-	// ****************************
-	// ****************************
-	if(count>(int)(1/period)-1 && (Vm - Vm_log[(count-(int)(1/period)) % (int)modulo]) >= slope_thresh && APs<lognum && enter == 0 && Vm > V_cutoff)
+IN:
+	*) None
+OUT:
+	*) p		block with the live-tunable parameters
+*/
+gAPqr7::LiveBlock gAPqr7::readLive()
+{
+	LiveBlock p;
+	p.Cm = getParameter("Cm (pF)").toDouble();
+	p.Rm = getParameter("Rm (MOhm)").toDouble();
+	p.Rm_corr_up = getParameter("Rm_corr_up").toDouble();
+	p.Rm_corr_down = getParameter("Rm_corr_down").toDouble();
+	p.noise_tresh = getParameter("noise_tresh (mV)").toDouble();
+	p.auto_thresh = getParameter("Auto_thresh").toDouble();
+	p.auto_k = getParameter("Auto_k").toDouble();
+	p.alt_thresh = getParameter("Alt_thresh (ms)").toDouble();
+	p.stv_thresh = getParameter("STV_thresh (ms)").toDouble();
+	p.alt_backoff = getParameter("Alt_backoff").toDouble();
+	p.err_split1 = getParameter("Err_split1 (ms)").toDouble();
+	p.err_split2 = getParameter("Err_split2 (ms)").toDouble();
+	p.slope_thresh = getParameter("Slope_thresh (mV/ms)").toDouble();
+	p.V_cutoff = getParameter("V_cutoff (mV)").toDouble();
+	p.BCL_cutoff = getParameter("BCL_cutoff (pct)").toDouble();
+	return p;
+}
+
+/*
+applyLive
+---------
+Takes over a block of live-tunable parameters. Called from execute() when Modify
+published a new block, and from Modify itself before a reset. Only assignments,
+so it is safe in the real-time loop.
+
+IN:
+	*) p		block with the live-tunable parameters
+OUT:
+	*) None
+*/
+void gAPqr7::applyLive(const LiveBlock& p)
+{
+	Cm = p.Cm;
+	Rm = p.Rm;
+	Rm_corr_up = p.Rm_corr_up;
+	Rm_corr_down = p.Rm_corr_down;
+	noise_tresh = p.noise_tresh;
+	auto_thresh = p.auto_thresh;
+	auto_k = p.auto_k;
+	alt_thresh = p.alt_thresh;
+	stv_thresh = p.stv_thresh;
+	alt_backoff = p.alt_backoff;
+	err_split1 = p.err_split1;
+	err_split2 = p.err_split2;
+	beat_err.setSplits(err_split1, err_split2);
+	slope_thresh = p.slope_thresh;
+	V_cutoff = p.V_cutoff;
+	BCL_cutoff = p.BCL_cutoff;
+	autoThresholds(); // The hand-entered thresholds only hold while Auto_thresh is off
+}
+
+/*
+structuralChange
+----------------
+Compares the structural parameters in the GUI, i.e. all parameters that are not
+in live_vars[] or beat_vars[], with their values at the previous Modify.
+
+IN:
+	*) None
+OUT:
+	*) changed	true when a structural parameter changed, and at the first Modify
+*/
+bool gAPqr7::structuralChange()
+{
+	std::vector<double> values;
+	for (size_t k = 0; k < num_vars; k++)
 	{
-		// This statement is entered whenever an upstroke is detected and the amount of
-		// recorded APs is smaller than lognum.
-		// The if conditions measure the following:
-		// 1) Whether you are far enough in the recording such that you don't accidentaly
-		//    start in an ongoing AP
-		// 2) Whether two consecutive measuring points show a large enough slope that can
-		//    be identified with an upstroke
-		// 3) Whether less than lognum APs were recorded
-		// 4) Whether you are currently not in an action potential
-		// 5) Whether the mesured voltage is above a voltage treshold
-
-		BCL = (APs==-1? 0: (BCL*APs + count2)/(APs+1)); // Rolling average of the basic cycle length
-		log_ideal_on = 1; // Switches on logging the AP
-		count2 = 0; // Resets the logging counter
-		enter = 1; // Switches on the indicator that an AP has started
-		APs++; // Counts the AP upstrokes that have passed
+		if (!(vars[k].flags & DefaultGUIModel::PARAMETER)){continue;}
+		bool is_live = false;
+		for (size_t j = 0; j < num_live_vars; j++){is_live = is_live || vars[k].name == live_vars[j];}
+		for (size_t j = 0; j < num_beat_vars; j++){is_live = is_live || vars[k].name == beat_vars[j].name;}
+		if (!is_live){values.push_back(getParameter(QString::fromStdString(vars[k].name)).toDouble());}
 	}
+	bool changed = (structural.empty() || values != structural);
+	structural = values;
+	return changed;
+}
+
+/*
+postCommands
+------------
+Posts the beat-synchronous parameters (see beat_vars[]) that changed since they
+were last posted as commands for the real-time loop. A command that does not fit
+in the queue is posted again at the next Modify.
 
-	if((Vm - Vm_log[(count-(int)(1/period)) % (int)modulo]) < 0 && enter == 1)
+IN:
+	*) None
+OUT:
+	*) None
+*/
+void gAPqr7::postCommands()
+{
+	beat_posted.resize(num_beat_vars, NAN);
+	for (size_t j = 0; j < num_beat_vars; j++)
 	{
-		// This statement is entered whenever the upstroke phase of an AP is over.
-		// The if conditions measure the following:
-		// 1) Whether two consecutive measuring points show a negative slope
-		// 2) Whether you currently are in an ongoing AP
+		double value = getParameter(beat_vars[j].name).toDouble();
+		if (value != beat_posted[j] && commands.post(beat_vars[j].when, beat_vars[j].id, value))
+			{beat_posted[j] = value;}
+	}
+}
+
+/*
+applyCommand
+------------
+Carries out a command from the GUI thread.
 
-		enter = 0; // Switches off the indicator that an AP has started
+IN:
+	*) c		the command
+OUT:
+	*) None
+*/
+void gAPqr7::applyCommand(const BeatCommand& c)
+{
+	switch (c.id)
+	{
+	case SET_CORRECTION:
+		corr = c.value;
+		break;
+	default:
+		break;
 	}
+}
 
-	if(APs<lognum && log_ideal_on == 1)
+/*
+drainCommands
+-------------
+Carries out all commands that wait for a beat boundary, in the order in which
+they were posted. Called from the beat boundaries in the real-time loop.
+
+IN:
+	*) when		BeatCommands::AT_UPSTROKE or BeatCommands::AT_BEAT_END
+OUT:
+	*) None
+*/
+void gAPqr7::drainCommands(int when)
+{
+	BeatCommand c;
+	while (commands.next(when, c)){applyCommand(c);}
+}
+
+/*
+holdExecute
+-----------
+Deactivates the module and waits until the real-time thread is no longer inside
+execute(), as DefaultGUIModel::modify() does, such that the GUI thread can reset
+the state that execute() works on. pause() only deactivates the module, which
+does not stop a time-step that is already running.
+The caller restores the returned state with setActive() once it is done.
+
+IN:
+	*) None
+OUT:
+	*) active	whether the module was active
+*/
+bool gAPqr7::holdExecute()
+{
+	bool active = getActive();
+	setActive(false);
+	SyncEvent sync;
+	RT::System::getInstance()->postEvent(&sync); // Returns once the real-time thread handled it
+	return active;
+}
+
+/*
+publishStates
+-------------
+Copies the states of the current time-step into one snapshot and publishes it
+to the GUI thread (see Seqlock.h), such that refresh() never shows values of two
+different time-steps. Called at the end of execute(), and from the GUI thread
+only while execute() does not run.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+void gAPqr7::publishStates()
+{
+	GuiStates s;
+	s.systime = systime;
+	s.APs = APs;
+	s.BCL = BCL;
+	s.act = act;
+	s.phase = (double)phase;
+	s.Rm = Rm;
+	s.b = b;
+	s.Cm_est = Cm_est;
+	s.tau_est = tau_est;
+	s.I_dc = I_dc;
+	const BeatShape& vm_shape = vm_beat.result();
+	const BeatShape& ref_shape = ref_beat.result();
+	s.apd30 = vm_shape.apd30;
+	s.apd50 = vm_shape.apd50;
+	s.apd90 = vm_shape.apd90;
+	s.amplitude = vm_shape.amplitude;
+	s.dvdt_max = vm_shape.dvdt_max;
+	s.rmp = vm_shape.rmp;
+	s.ref_apd30 = ref_shape.apd30;
+	s.ref_apd50 = ref_shape.apd50;
+	s.ref_apd90 = ref_shape.apd90;
+	s.ref_amplitude = ref_shape.amplitude;
+	s.ref_dvdt_max = ref_shape.dvdt_max;
+	s.ref_rmp = ref_shape.rmp;
+	s.noise = noise.sigma();
+	s.alternans = alternans.alternans();
+	s.stv = alternans.stv();
+	s.alt_flag = alt_flag;
+	s.err_rms = beat_err.beat().rms;
+	s.err_max = beat_err.beat().max_abs;
+	s.err_bias = beat_err.beat().bias;
+	s.err_rms1 = beat_err.window(0).rms;
+	s.err_max1 = beat_err.window(0).max_abs;
+	s.err_bias1 = beat_err.window(0).bias;
+	s.err_rms2 = beat_err.window(1).rms;
+	s.err_max2 = beat_err.window(1).max_abs;
+	s.err_bias2 = beat_err.window(1).bias;
+	s.err_rms3 = beat_err.window(2).rms;
+	s.err_max3 = beat_err.window(2).max_abs;
+	s.err_bias3 = beat_err.window(2).bias;
+	states.write(s);
+	// An Rm changed by execute() is reported only after the snapshot that holds it,
+	// such that refresh() finds it in the copy it reads after taking the event
+	if (gains_tuned)
 	{
-		// This statement is entered whenever logging of the AP is on
-		// The if conditions measure the following:
-		// 1) Whether less than lognum APs were recorded
-		// 2) Whether the AP should be logged
-		
-		ideal_AP[count2] = (ideal_AP[count2]*APs + Vm)/(APs+1); // Rolling average of the AP values
-		count2++; // Increasing the logging counter
+		gains_tuned = false;
+		events.post(EventMailbox::GAINS_TUNED);
+	}
+}
+
+/*
+autoThresholds
+--------------
+When Auto_thresh is on and the noise estimate is valid (see NoiseFloor.h), sets
+noise_tresh to Auto_k times the estimated noise of Vm. Otherwise the
+hand-entered value stays in use. Called at every upstroke and after new
+live-tunable parameters.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+void gAPqr7::autoThresholds()
+{
+	if (auto_thresh && noise.valid()){noise_tresh = auto_k*noise.sigma();}
+}
+
+/*
+checkAlternans
+--------------
+Beat boundary of the alternans detection (see AlternansDetector.h). The APD90
+of the beat that just ended is added to the window, unless the beat did not
+repolarize that far. Once the window is full, alternans is flagged when its
+magnitude exceeds Alt_thresh or the short-term variability exceeds STV_thresh.
+When Alt_backoff is below 1, a flag scales the correction 1/Rm by it, after
+which a full window of beats with the weaker correction is awaited before the
+next back-off.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+void gAPqr7::checkAlternans()
+{
+	double apd90 = vm_beat.result().apd90;
+	if (apd90 <= 0){return;}
+	alternans.update(apd90);
+	if (!alternans.full()){return;}
+
+	alt_flag = ((alt_thresh > 0 && alternans.alternans() > alt_thresh) || (stv_thresh > 0 && alternans.stv() > stv_thresh));
+	if (alt_flag && alt_backoff > 0 && alt_backoff < 1)
+	{
+		Rm /= alt_backoff; // A larger Rm gives a weaker correction
+		gains_tuned = true; // Handed to refresh() with the states of this time-step
+		alternans.reset(); // A full window with the weaker correction before the next back-off
 	}
+}
+
+/*
+rise
+----
+Rise of the membrane potential over the last millisecond, which is compared to
+Slope_thresh to detect upstrokes.
+
+IN:
+	*) None
+OUT:
+	*) rise		Vm minus the Vm of 1 ms ago (mV)
+*/
+double gAPqr7::rise()
+{
+	return Vm_det - Vm_log[ringIndex(count-(int)(1/period), (int)modulo)];
+}
+
+/*
+upstroke
+--------
+Whether the membrane potential rises fast enough to be an upstroke: either the
+rise over the last millisecond (Detector = 0) or the slope of the
+UpstrokeDetector (Detector = 1) is compared to Slope_thresh.
+
+IN:
+	*) None
+OUT:
+	*) upstroke	true when the slope threshold is reached
+*/
+bool gAPqr7::upstroke()
+{
+	return (detector_mode ? detector.slope : rise()) >= slope_thresh;
+}
 
+/*
+reference
+---------
+Reference AP at the given number of time-steps after the detected upstroke. The
+interpolated onset of the upstroke lies onset_frac time-steps before the
+time-step at which it was detected, so the reference is sampled in between
+two recorded points.
+
+IN:
+	*) n		time-steps since the detection of the upstroke
+OUT:
+	*) V		reference membrane potential (mV)
+*/
+double gAPqr7::reference(long long n)
+{
+	return interpolate(ideal_AP, 10000, n + onset_frac);
+}
+
+/*
+setPhase
+--------
+Switches the control loop to another phase (see BeatPhase.h) and keeps the act
+flag in line with it.
+
+IN:
+	*) next		the new phase
+OUT:
+	*) None
+*/
+void gAPqr7::setPhase(BeatPhase next)
+{
+	phase = next;
+	act = (next == CORRECTING);
+}
+
+/*
+restTick
+--------
+Tick handler of the REST phase. Waits for an upstroke, which either starts the
+recording of a reference AP or the correction of the AP.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+void gAPqr7::restTick()
+{
 	// ****************************
 	// ****************************
 	// ** Detecting AP upstrokes **
 	// ****************************
 	// ****************************
-	if (act == 0 && (Vm - Vm_log[(count-(int)(1/period)) % (int)modulo]) >= slope_thresh && APs >= lognum && Vm > V_cutoff)
+	// The if conditions measure the following:
+	// 1) Whether you are far enough in the recording such that the rise over the last ms is known
+	// 2) Whether the rise is large enough to be identified with an upstroke
+	// 3) Whether the mesured voltage is above a voltage treshold
+	if (count > (int)(1/period)-1 && upstroke() && Vm_det > V_cutoff)
 	{
-		// This statement is entered whenever an upstroke is detected after the
-		// ideal APs have been recorded.
-		// The if conditions measure the following:
-		// 1) Whether currently nothing is being done or corrected
-		// 2) Whether two consecutive measuring points show a large enough slope that can
-		//    be identified with an upstroke
-		// 3) Whether lognum APs were already recorded before
-		// 4) Whether the mesured voltage is above a voltage treshold
-
-		count = 0; // Reset the correction counter
-		act = 1; // Switch the correction on
+		if (APs < lognum)
+			{logUpstroke();} // Start recording the ideal AP
+		else
+		{
+			startCorrection();
+			correctingTick();
+		}
 	}
+	else if (APs >= lognum && BCL > 0 && count == (long long)(2*BCL))
+		{events.post(EventMailbox::UPSTROKE_MISSED);} // No upstroke within twice the basic cycle length
+}
+
+/*
+loggingTick
+-----------
+Tick handler of the LOGGING phase. Adds the current sample to the ideal AP,
+unless an upstroke starts the next AP.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+void gAPqr7::loggingTick()
+{
+	if (count > (int)(1/period)-1 && upstroke() && Vm_det > V_cutoff)
+		{logUpstroke();}
+	else
+		{logSample();}
+}
+
+/*
+refractoryTick
+--------------
+Tick handler of the REFRACTORY phase. Keeps recording the ideal AP, while the
+upstroke that was just detected cannot be detected a second time.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+void gAPqr7::refractoryTick()
+{
+	// The upstroke phase of the AP is over as soon as Vm falls again
+	if (rise() < 0){setPhase(LOGGING);}
+	logSample();
+}
+
+/*
+logUpstroke
+-----------
+Handles an upstroke while fewer than lognum APs were recorded: the basic cycle
+length is updated and the recording of the next AP starts. When this upstroke
+completes the ideal AP, the correction of the AP starts instead.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+void gAPqr7::logUpstroke()
+{
+	vm_beat.begin(); // The metrics of the previous beat are complete
+	drainCommands(BeatCommands::AT_BEAT_END);
+	drainCommands(BeatCommands::AT_UPSTROKE);
+	BCL = (APs==-1? 0: (BCL*APs + count2)/(APs+1)); // Rolling average of the basic cycle length
+	count2 = 0; // Resets the logging counter
+	onset_frac = (detector_mode ? detector.onset(slope_thresh, V_cutoff) : 0); // Latest crossing of both conditions
+	APs++; // Counts the AP upstrokes that have passed
+
+	if (APs < lognum)
+	{
+		setPhase(REFRACTORY); // Switches on logging the AP
+		logSample();
+	}
+	else
+	{
+		startCorrection();
+		correctingTick();
+	}
+}
 
+/*
+logSample
+---------
+Adds the current membrane potential to the rolling average of the ideal AP.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+void gAPqr7::logSample()
+{
+	// The sample is interpolated back to a whole number of time-steps after the onset of the upstroke
+	double V = Vm - onset_frac*(Vm - Vm_prev);
+	averageInto(ideal_AP.at(count2), V, APs); // Rolling average of the AP values
+	count2++; // Increasing the logging counter
+}
+
+/*
+startCorrection
+---------------
+Beat boundary of the correction. Everything that is updated once per AP happens
+here, after which the correction of the new AP starts.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+void gAPqr7::startCorrection()
+{
+	vm_beat.begin(); // The metrics of the previous beat are complete
+	ref_beat.begin();
+	beat_err.begin();
+	checkAlternans(); // With the APD90 of the beat that just ended
+	autoThresholds(); // From the noise of the rest before this beat
+	drainCommands(BeatCommands::AT_UPSTROKE);
+	// At every upstroke the identified response of the cell is published and, when requested,
+	// used to rescale Rm such that an error would be removed with the time constant RLS_Tc.
+	if (rls_on)
+	{
+		b = plant.gain(0);
+		Cm_est = (b > 0 ? 400/b : 0); // 400 pA/V external command sensitivity of the Multiclamp 700B
+		tau_est = plant.tau();
+		if (rls_autoscale && plant.valid(0, 1000) && b > 0){Rm = b*Cm*2.5e-3*rls_Tc; gains_tuned = true;}
+	}
+	count = 0; // Reset the correction counter
+	onset_frac = (detector_mode ? detector.onset(slope_thresh, V_cutoff) : 0); // Latest crossing of both conditions
+	setPhase(CORRECTING); // Switch the correction on
+}
+
+/*
+correctingTick
+--------------
+Tick handler of the CORRECTING phase. Computes and outputs the correction, and
+returns to REST at the end of the correction window.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+void gAPqr7::correctingTick()
+{
 	// *************************************************
 	// *************************************************
 	// ** Computing AP correction and outputting this **
 	// *************************************************
 	// *************************************************
-	if (act == 1)
-	{
-		// This statement is entered whenever the instruction to correct the AP has
-		// been given.
-
-		Iout = Cm * (1/Rm) * (Vm - ideal_AP[count]); 	// Calculate the outward going current as
-														// a value proportional to capacitance,
-														// conductivity (1/resistance), and the error
-		output(0) = -Iout * 2.5e-3; 	// This is equal to Vout
-										// The factor 2.5e-3 comes from the conversion between current
-										// and voltage that is associated to the external command
-										// sensitivity of the Multiclamp 700B patch-clamp amplifier,
-										// which is 400 pA/V to be precise
-		Vm_diff_log[count] = Vm - ideal_AP[count]; // Log the errors
-	}
+	// This statement is entered whenever the instruction to correct the AP has
+	// been given.
+
+	// The change in error is related to the injected current of the previous time-step (still present
+	// on the output) to learn how strongly the output acts on the membrane potential.
+	if (rls_on && count > 0)
+		{plant.update(Vm_diff_log[count-1], Vm - reference(count), output(0), 0);}
+
+	Iout = Cm * (1/Rm) * (Vm - reference(count)); 	// Calculate the outward going current as
+													// a value proportional to capacitance,
+													// conductivity (1/resistance), and the error
+	Vout = -Iout * 2.5e-3; 	// Correction part of the command output
+									// The factor 2.5e-3 comes from the conversion between current
+									// and voltage that is associated to the external command
+									// sensitivity of the Multiclamp 700B patch-clamp amplifier,
+									// which is 400 pA/V to be precise
+	Vm_diff_log.set(count, Vm - reference(count)); // Log the errors
+	ref_beat.sample(reference(count)); // Per-beat AP metrics of the reference
+	beat_err.sample(Vm_diff_log[count]); // Error statistics of this beat (see ErrorStats.h)
 
 	// **************************************
 	// **************************************
 	// ** Updating the necessary variables **
 	// **************************************
 	// **************************************
-	if(corr == 1 && act == 1 && count > 1 && abs(Vm_diff_log[count])>noise_tresh)
+	if(corr == 1 && count > 1 && abs(Vm_diff_log[count])>noise_tresh)
 	{
 		// This statement is entered whenever an update is needed in the resistance.
 		// The if conditions measure the following:
 		// 1) Whether correction adaptation is on
-		// 2) Whether currently there is correction going on
-		// 3) whether we are not in the very first step (gives errors)
-		// 4) whether the current error is larger than the noise threshold
+		// 2) whether we are not in the very first step (gives errors)
+		// 3) whether the current error is larger than the noise threshold
 
 		if((Vm_diff_log[count-1] / Vm_diff_log[count]) < 0)
 		{
@@ -296,6 +961,7 @@ void gAPqr7::execute(void)
 			// Therefore Iout should become less, and hence Rm should be increased. 
 
 			Rm = Rm * Rm_corr_up; // Increase the resistance
+			gains_tuned = true;
 		}
 		if(abs(Vm_diff_log[count-1]) < abs(Vm_diff_log[count]) && (Vm_diff_log[count-1] / Vm_diff_log[count]) > 0)
 		{
@@ -305,6 +971,7 @@ void gAPqr7::execute(void)
 			// should increase. As a consequence the resistance Rm should be decreased.
 
 			Rm = Rm / Rm_corr_down; // Decrease the resistance
+			gains_tuned = true;
 		}
 	}
 
@@ -314,10 +981,89 @@ void gAPqr7::execute(void)
 		// The if condition measures the following:
 		// 1) Whether the current AP is further than a chosen cutoff of the pre-determined basic cycle length
 
-		act = 0; // Stop correcting during the last phase of the AP (is RMP)
-		output(0) = 0; // Send a 0 output since the last output is otherwise kept
+		setPhase(REST); // Stop correcting during the last phase of the AP (is RMP)
+		Vout = 0; // Send a 0 output since the last output is otherwise kept
+		beat_err.end(); // The error statistics of this beat are complete
+		drainCommands(BeatCommands::AT_BEAT_END);
 	}
+}
 
+/*
+execute
+-------
+This is the main funtcion of the code that is looped through real-time.
+Every time-step the tick handler of the current phase (see BeatPhase.h) is run:
+	1) REST: detecting AP upstrokes
+	2) LOGGING, REFRACTORY: recording the ideal AP
+	3) CORRECTING: computing AP correction and outputting this, and updating
+	   the necessary variables
+
+IN:
+	*) None
+OUT:
+	*) Vout				voltage that is used to inject the calculated amount
+						of current into the excitable system
+*/
+void gAPqr7::execute(void)
+{
+	if (live.pending()){applyLive(live.acquire());} // Parameters changed by Modify without a reset
+	// A time-step that starts more than 1.5 periods after the previous one means that
+	// the real-time loop fell behind
+	long long now = RT::OS::getTime();
+	if (t_prev && now - t_prev > 1.5e6*period){events.post(EventMailbox::OVERRUN);}
+	t_prev = now;
+	systime = count * period; 	// time in milli-seconds
+	Vm = input(0) * 1e2; 		// convert 10V to mV. Divided by 10 because
+								// the amplifier produces 10-fold amplified
+								// voltages. Multiplied by 1000 to convert
+								// V to mV.
+
+	Vm_det = prefilter.filter(Vm); // Only the upstroke detector sees the prefiltered Vm
+	detector.update(Vm_det);
+	vm_beat.sample(Vm); // Per-beat AP metrics of the measured Vm (see BeatMetrics.h)
+	if (phase == REST){noise.update(Vm);} else {noise.skip();} // Noise of Vm between the beats
+	Vm_log.set(count % (int)modulo, Vm_det); 	// Logging the measured Vm in a list
+										// where the modulo component makes
+										// sure you keep cycling when you have
+										// reached the maximum number in the list.
+
+	// Only the tick handler of the current phase runs, and it only tests the transitions
+	// that can occur from that phase (see BeatPhase.h)
+	switch (phase)
+	{
+	case REST:
+		restTick();
+		break;
+	case LOGGING:
+		loggingTick();
+		break;
+	case REFRACTORY:
+		refractoryTick();
+		break;
+	case CORRECTING:
+		correctingTick();
+		break;
+	default:
+		break;
+	}
+
+	// *******************
+	// *******************
+	// ** Dynamic clamp **
+	// *******************
+	// *******************
+	// The virtual ionic currents are computed from the measured Vm on every time-step and injected
+	// through the same command output as the correction. They are outward positive membrane currents,
+	// so the injected current has the opposite sign.
+	if (dc_on)
+		{I_dc = -Cm * dclamp.update(Vm);}
+	else
+		{I_dc = 0;}
+	output(0) = Vout + I_dc * 2.5e-3; // Correction and dynamic clamp share the 400 pA/V command input
+	if (fabs(output(0)) > 10){events.post(EventMailbox::SATURATED);} // Beyond the 10V range of the analog output
+
+	Vm_prev = Vm;
+	publishStates(); // One consistent snapshot of this time-step for the GUI
 	count++; // End of the real-time loop, adjust the counter
 }
 
@@ -349,53 +1095,210 @@ void gAPqr7::update(DefaultGUIModel::update_flags_t flag)
 		setParameter("Rm_corr_up", Rm_corr_up);
 		setParameter("Rm_corr_down", Rm_corr_down);
 		setParameter("noise_tresh (mV)", noise_tresh);
+		setParameter("Auto_thresh", auto_thresh);
+		setParameter("Auto_k", auto_k);
+		setParameter("Alt_window (beats)", alt_window);
+		setParameter("Alt_thresh (ms)", alt_thresh);
+		setParameter("STV_thresh (ms)", stv_thresh);
+		setParameter("Alt_backoff", alt_backoff);
+		setParameter("Err_split1 (ms)", err_split1);
+		setParameter("Err_split2 (ms)", err_split2);
 		setParameter("lognum", lognum);
 		setParameter("BCL_cutoff (pct)", BCL_cutoff);
 		setParameter("Slope_thresh (mV/ms)", slope_thresh);
+		setParameter("Prefilter", prefilter_mode);
+		setParameter("Prefilter_window", prefilter_window);
+		setParameter("Hampel_k", hampel_k);
+		setParameter("Detector", detector_mode);
+		setParameter("Detect_window (ms)", detect_window);
 		setParameter("Correction (0 or 1)", corr);
-		setState("Time (ms)", systime);
+		setState("Time (ms)", shown.systime);
 		setState("Period (ms)", period);
-		setState("APs2", APs);
-		setState("BCL2", BCL);
-		setState("act2", act);
+		setState("APs2", shown.APs);
+		setState("BCL2", shown.BCL);
+		setState("act2", shown.act);
+		setState("Phase", shown.phase);
+		setState("Memory locked", memory_locked);
+		setState("Saturated", saturated);
+		setState("Overruns", overruns);
+		setState("Missed upstrokes", missed);
+		setState("APD30 (ms)", shown.apd30);
+		setState("APD50 (ms)", shown.apd50);
+		setState("APD90 (ms)", shown.apd90);
+		setState("AP_amplitude (mV)", shown.amplitude);
+		setState("dVdt_max (mV/ms)", shown.dvdt_max);
+		setState("RMP (mV)", shown.rmp);
+		setState("Ref_APD30 (ms)", shown.ref_apd30);
+		setState("Ref_APD50 (ms)", shown.ref_apd50);
+		setState("Ref_APD90 (ms)", shown.ref_apd90);
+		setState("Ref_AP_amplitude (mV)", shown.ref_amplitude);
+		setState("Ref_dVdt_max (mV/ms)", shown.ref_dvdt_max);
+		setState("Ref_RMP (mV)", shown.ref_rmp);
+		setState("Noise (mV)", shown.noise);
+		setState("Alternans (ms)", shown.alternans);
+		setState("STV (ms)", shown.stv);
+		setState("Alternans_flag", shown.alt_flag);
+		setState("Err_RMS (mV)", shown.err_rms);
+		setState("Err_max (mV)", shown.err_max);
+		setState("Err_bias (mV)", shown.err_bias);
+		setState("Err_RMS_w1 (mV)", shown.err_rms1);
+		setState("Err_max_w1 (mV)", shown.err_max1);
+		setState("Err_bias_w1 (mV)", shown.err_bias1);
+		setState("Err_RMS_w2 (mV)", shown.err_rms2);
+		setState("Err_max_w2 (mV)", shown.err_max2);
+		setState("Err_bias_w2 (mV)", shown.err_bias2);
+		setState("Err_RMS_w3 (mV)", shown.err_rms3);
+		setState("Err_max_w3 (mV)", shown.err_max3);
+		setState("Err_bias_w3 (mV)", shown.err_bias3);
+		setParameter("RLS_on", rls_on);
+		setParameter("RLS_lambda", rls_lambda);
+		setParameter("RLS_autoscale", rls_autoscale);
+		setParameter("RLS_Tc (ms)", rls_Tc);
+		setState("b (mV/ms/V)", shown.b);
+		setState("Cm_est (pF)", shown.Cm_est);
+		setState("tau_est (ms)", shown.tau_est);
+		setParameter("DC_on", dc_on);
+		setParameter("g_Na (nS/pF)", g_Na);
+		setParameter("g_K1 (nS/pF)", g_K1);
+		setParameter("g_CaL (nS/pF)", g_CaL);
+		setParameter("E_Na (mV)", E_Na);
+		setParameter("E_K (mV)", E_K);
+		setParameter("E_CaL (mV)", E_CaL);
+		setState("I_dc (pA)", shown.I_dc);
 		break;
 	case MODIFY:
-		Cm = getParameter("Cm (pF)").toDouble();
-		Rm = getParameter("Rm (MOhm)").toDouble();
+		// The live-tunable parameters are always handed to execute(), which applies them
+		// at its next time-step, and the beat-synchronous ones are queued for the next beat
+		// boundary. Only a change of a structural parameter resets the module.
+		live_gui = readLive();
+		live.publish(live_gui);
+		postCommands();
+		if (!structuralChange()){break;}
+		applyLive(live_gui);
+		alt_window = getParameter("Alt_window (beats)").toDouble();
+		alternans.configure((int)alt_window);
+		alt_flag = 0;
+		corr = getParameter("Correction (0 or 1)").toDouble();
 		lognum = getParameter("lognum").toDouble();
-		V_cutoff = getParameter("V_cutoff (mV)").toDouble();
-		BCL_cutoff = getParameter("BCL_cutoff (pct)").toDouble();
-		noise_tresh = getParameter("noise_tresh (mV)").toDouble();
-		Rm_corr_up = getParameter("Rm_corr_up").toDouble();
-		Rm_corr_down = getParameter("Rm_corr_down").toDouble();
-		slope_thresh = getParameter("Slope_thresh (mV/ms)").toDouble();
-		corr = getParameter("Correction (0 or 1)").toDouble();		
+		prefilter_mode = getParameter("Prefilter").toDouble();
+		prefilter_window = getParameter("Prefilter_window").toDouble();
+		hampel_k = getParameter("Hampel_k").toDouble();
+		detector_mode = getParameter("Detector").toDouble();
+		detect_window = getParameter("Detect_window (ms)").toDouble();
+		rls_on = getParameter("RLS_on").toDouble();
+		rls_lambda = getParameter("RLS_lambda").toDouble();
+		rls_autoscale = getParameter("RLS_autoscale").toDouble();
+		rls_Tc = getParameter("RLS_Tc (ms)").toDouble();
+		dc_on = getParameter("DC_on").toDouble();
+		g_Na = getParameter("g_Na (nS/pF)").toDouble();
+		g_K1 = getParameter("g_K1 (nS/pF)").toDouble();
+		g_CaL = getParameter("g_CaL (nS/pF)").toDouble();
+		E_Na = getParameter("E_Na (mV)").toDouble();
+		E_K = getParameter("E_K (mV)").toDouble();
+		E_CaL = getParameter("E_CaL (mV)").toDouble();
 		systime = 0;
 		count = 0;
 		APs = -1;
 		BCL = 0;
-		log_ideal_on = 0;
-		enter = 0;
+		setPhase(REST);
 		count2 = 0;
+		plant.configure(rls_lambda, period);
+		plant.reset();
+		prefilter.configure((int)prefilter_mode, (int)prefilter_window, hampel_k);
+		detector.configure(period, detect_window);
+		dclamp.configure(period, E_Na, E_K, E_CaL);
+		dclamp.setConductances(g_Na, g_K1, g_CaL);
+		dclamp.reset(Vm);
+		I_dc = 0;
+		Vout = 0;
+		vm_beat.reset();
+		ref_beat.reset();
+		beat_err.reset();
 		cleanup();
+		lockBuffers();
 		break;
 	case PERIOD:
-		period = RT::System::getInstance()->getPeriod() * 1e-6; // time in milli-seconds
-		modulo = (1.0/(RT::System::getInstance()->getPeriod() * 1e-6)) * 1000.0;
+	{
+		// The gate tables of the dynamic clamp take an exp() per point, so they are rebuilt
+		// aside while execute() keeps stepping the gates with the current ones. They are
+		// copied in, together with the other period-dependent state, while execute() is held.
+		double next = RT::System::getInstance()->getPeriod() * 1e-6; // time in milli-seconds
+		IonicCurrents *rebuilt = new IonicCurrents;
+		rebuilt->configure(next, E_Na, E_K, E_CaL);
+		bool active = holdExecute();
+		period = next;
+		t_prev = 0;
+		vm_beat.configure(period);
+		ref_beat.configure(period);
+		beat_err.configure(period);
+		modulo = (1.0/period) * 1000.0;
+		plant.configure(rls_lambda, period);
+		detector.configure(period, detect_window);
+		dclamp.copyTables(*rebuilt);
+		setActive(active);
+		delete rebuilt;
+		lockBuffers();
 		break;
+	}
 	case PAUSE:
+	{
+		// pause() does not wait for a time-step that is still running
+		bool active = holdExecute();
 		output(0) = 0.0;
+		Vout = 0;
 		Iout = 0;
-		act = 0;
+		I_dc = 0;
+		dclamp.reset(Vm);
+		prefilter.reset();
+		detector.reset();
+		if (phase != PAUSED){resume_phase = (phase == CORRECTING ? REST : phase);}
+		setPhase(PAUSED);
 		systime = 0;
+		t_prev = 0;
+		vm_beat.reset(); // A pause breaks the beat
+		ref_beat.reset();
+		beat_err.reset();
+		noise.skip();
+		publishStates(); // execute() is held, so the GUI thread is the only writer
+		setActive(active);
 		break;
+	}
 	case UNPAUSE:
+		setPhase(resume_phase); // Continue recording where it was left, or wait for the next upstroke
 		break;
 	default:
 		break;
 	}
 }
 
+/*
+refresh
+-------
+This function is called periodically by the GUI timer. An Rm that execute()
+adapted during the correction, rescaled by RLS_autoscale or backed off after
+alternans is written back to its parameter field here, such that a later Modify
+keeps it. It is taken from the copy of the states, after the GAINS_TUNED event,
+and never from the variables of the real-time thread. The events reported by
+the real-time thread are counted (see EventMailbox.h) and the newest snapshot of
+the states is copied (see Seqlock.h), after which the default refresh updates
+the displayed states.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+void gAPqr7::refresh(void)
+{
+	unsigned int tuned = events.take(EventMailbox::GAINS_TUNED);
+	saturated += events.take(EventMailbox::SATURATED);
+	overruns += events.take(EventMailbox::OVERRUN);
+	missed += events.take(EventMailbox::UPSTROKE_MISSED);
+	states.read(shown);
+	if (tuned > 0){setParameter("Rm (MOhm)", shown.Rm);}
+	DefaultGUIModel::refresh();
+}
+
 /*
 initParameters
 --------------
@@ -411,32 +1314,90 @@ void gAPqr7::initParameters()
 {
 	// system related parameters
 	systime = 0;
+	memory_locked = 0;
+	t_prev = 0;
+	saturated = 0;
+	overruns = 0;
+	missed = 0;
 	period = RT::System::getInstance()->getPeriod() * 1e-6; // ms
 	// cell related parameters
 	Vm = -80; 			// mV
 	Cm = 150; 			// pF
 	Rm = 150; 			// MOhm
+	gains_tuned = false;
 	// upstroke related parameters
 	slope_thresh = 5.0; // mV
 	V_cutoff = -40;		// mV
+	prefilter_mode = 0;
+	prefilter_window = 5;	// samples
+	hampel_k = 3;
+	prefilter.configure((int)prefilter_mode, (int)prefilter_window, hampel_k);
+	detector_mode = 0;
+	detect_window = 0.3;	// ms
+	detector.configure(period, detect_window);
+	onset_frac = 0;
+	Vm_prev = Vm;
 	// logging parameters
-	log_ideal_on = 0;
 	lognum = 3;
 	APs = -1;
 	count2 = 0;
 	// correction parameters
-	act = 0;
+	setPhase(REST);
+	resume_phase = REST;
 	corr = 1;
 	noise_tresh = 0.5; 	// mV
+	auto_thresh = 0;
+	auto_k = 3;
+
+	// alternans detection
+	alt_window = 16;		// beats
+	alt_thresh = 5;			// ms
+	stv_thresh = 0;			// ms, off
+	alt_backoff = 1;		// no back-off
+	alt_flag = 0;
+	alternans.configure((int)alt_window);
+
+	// error statistics per beat
+	err_split1 = 50;		// ms, upstroke
+	err_split2 = 250;		// ms, plateau
+	beat_err.setSplits(err_split1, err_split2);
 	Rm_corr_up=8;
 	Rm_corr_down=2;
 
 	// standard loop parameters
 	count = 0;
-	enter = 0;
 	BCL = 0;			// ms
 	BCL_cutoff = 0.98;
 	modulo = (1.0/(RT::System::getInstance()->getPeriod() * 1e-6)) * 1000.0;
 	Iout = 0;			// pA
+	Vout = 0;			// V
 	output(0) = -Iout * 0.5e-3;
+
+	// plant identification
+	rls_on = 0;
+	rls_lambda = 0.9999;
+	rls_autoscale = 0;
+	rls_Tc = 1;			// ms
+	b = 0;				// mV/ms/V
+	Cm_est = 0;			// pF
+	tau_est = 0;		// ms
+	plant.configure(rls_lambda, period);
+
+	// dynamic clamp
+	dc_on = 0;
+	g_Na = 0;			// nS/pF
+	g_K1 = 0;			// nS/pF
+	g_CaL = 0;			// nS/pF
+	E_Na = 40;			// mV
+	E_K = -85;			// mV
+	E_CaL = 60;			// mV
+	I_dc = 0;			// pA
+	dclamp.configure(period, E_Na, E_K, E_CaL);
+	dclamp.setConductances(g_Na, g_K1, g_CaL);
+	dclamp.reset(Vm);
+	vm_beat.configure(period);
+	ref_beat.configure(period);
+	beat_err.configure(period);
+
+	publishStates();
 }
@@ -20,6 +20,21 @@
 #include <math.h>
 #include <string>
 #include <vector>
+#include "../APqrCommon/BeatPhase.h"
+#include "../APqrCommon/RTMemory.h"
+#include "../APqrCommon/LiveParams.h"
+#include "../APqrCommon/CommandQueue.h"
+#include "../APqrCommon/Seqlock.h"
+#include "../APqrCommon/EventMailbox.h"
+#include "../APqrCommon/BeatMetrics.h"
+#include "../APqrCommon/NoiseFloor.h"
+#include "../APqrCommon/AlternansDetector.h"
+#include "../APqrCommon/ErrorStats.h"
+#include "../APqrCommon/ControlKernels.h"
+#include "../APqrCommon/SlidingMedian.h"
+#include "../APqrCommon/UpstrokeDetector.h"
+#include "../APqrCommon/PlantEstimator.h"
+#include "../APqrCommon/IonicCurrents.h"
 
 // All parameters and functions related to the gAPqr7 class.
 class gAPqr7 : public DefaultGUIModel
@@ -30,46 +45,202 @@ class gAPqr7 : public DefaultGUIModel
 		virtual ~gAPqr7(void);
 
 		virtual void execute(void);
+		virtual void refresh(void);
+
+		static void* operator new(size_t bytes);
+		static void operator delete(void* p);
 		
 	protected:
 		virtual void update(DefaultGUIModel::update_flags_t);
 		
 	private:
+		// parameters that Modify changes without a reset (see live_vars[])
+		struct LiveBlock
+		{
+			double Cm;
+			double Rm;
+			double Rm_corr_up;
+			double Rm_corr_down;
+			double noise_tresh;
+			double auto_thresh;
+			double auto_k;
+			double alt_thresh;
+			double stv_thresh;
+			double alt_backoff;
+			double err_split1;
+			double err_split2;
+			double slope_thresh;
+			double V_cutoff;
+			double BCL_cutoff;
+		};
+
+		// states that execute() publishes for refresh() (see Seqlock.h)
+		struct GuiStates
+		{
+			double systime;
+			double APs;
+			double BCL;
+			double act;
+			double phase;
+			double Rm;
+			double b;
+			double Cm_est;
+			double tau_est;
+			double I_dc;
+			double apd30;
+			double apd50;
+			double apd90;
+			double amplitude;
+			double dvdt_max;
+			double rmp;
+			double ref_apd30;
+			double ref_apd50;
+			double ref_apd90;
+			double ref_amplitude;
+			double ref_dvdt_max;
+			double ref_rmp;
+			double noise;
+			double alternans;
+			double stv;
+			double alt_flag;
+			double err_rms;
+			double err_max;
+			double err_bias;
+			double err_rms1;
+			double err_max1;
+			double err_bias1;
+			double err_rms2;
+			double err_max2;
+			double err_bias2;
+			double err_rms3;
+			double err_max3;
+			double err_bias3;
+		};
+
 		// functions
 		void cleanup();
 		int i;
 		void initParameters();
-		// system related parameters
-		double systime;
+		double rise();
+		bool upstroke();
+		double reference(long long n);
+		void setPhase(BeatPhase next);
+		void restTick();
+		void loggingTick();
+		void refractoryTick();
+		void logUpstroke();
+		void logSample();
+		void startCorrection();
+		void correctingTick();
+		void lockBuffers();
+		LiveBlock readLive();
+		void applyLive(const LiveBlock& p);
+		bool structuralChange();
+		void postCommands();
+		void applyCommand(const BeatCommand& c);
+		void drainCommands(int when);
+		void publishStates();
+		void autoThresholds();
+		void checkAlternans();
+		bool holdExecute();
+		// hot state: the loop state that execute() writes on every time-step, packed
+		// together from the start of a cache line (see RTMemory.h): 112 bytes, two cache lines.
+		// The parameters that it reads on every time-step (Rm, slope_thresh, V_cutoff, BCL, ...)
+		// stay with their groups below.
+		alignas(APQR_CACHE_LINE) long long count;
+		double modulo;
 		double period;
+		double systime;
+		double Vm;
+		double Vm_det;				// Vm as seen by the upstroke detector
+		double Vm_prev;				// Vm of the previous time-step
+		long long t_prev;			// start of the previous time-step (ns), 0 after a pause
+		BeatPhase phase;			// phase of the control loop
+		double act;
+		double Vout;
+		double Iout;
+		double I_dc;
+		double dc_on;
+		// system related parameters
+		double memory_locked;		// 1 when the module is locked in RAM
+		LiveParams<LiveBlock> live;	// live-tunable parameters on their way to execute()
+		LiveBlock live_gui;			// live-tunable parameters last read by Modify
+		std::vector<double> structural;	// structural parameters at the previous Modify
+		BeatCommands commands;		// beat-synchronous parameters on their way to execute()
+		std::vector<double> beat_posted;	// beat-synchronous parameters as last posted
+		Seqlock<GuiStates> states;	// states of the last time-step on their way to refresh()
+		GuiStates shown;			// states as displayed by refresh()
+		EventMailbox events;		// events of execute() on their way to refresh()
+		double saturated;			// time-steps with a saturated output
+		double overruns;			// time-steps that started too late
+		double missed;				// beats without a detected upstroke
 		// arrays
-		double Vm_log[10000] = {0};		
-		double ideal_AP[10000] = {0};
-		double Vm_diff_log[10000] = {0};
+		alignas(APQR_CACHE_LINE) apqr_log_t Vm_log;
+		alignas(APQR_CACHE_LINE) apqr_log_t ideal_AP;
+		alignas(APQR_CACHE_LINE) apqr_log_t Vm_diff_log;
+		// AP metrics per beat
+		BeatMetrics vm_beat;		// of the measured Vm
+		BeatMetrics ref_beat;		// of the reference AP
 		// cell related parameters
-		double Vm;
 		double Cm;
 		double Rm;
+		bool gains_tuned;		// real-time thread only, handed over in publishStates()
 		// Upstroke related parameters
 		double slope_thresh;
 		double V_cutoff;
+		double prefilter_mode;
+		double prefilter_window;
+		double hampel_k;
+		HampelFilter prefilter;
+		double detector_mode;
+		double detect_window;
+		double onset_frac;			// interpolated onset of the last upstroke (time-steps before its detection)
+		UpstrokeDetector detector;
 		// logging parameters
-		double log_ideal_on;
 		double lognum;
 		double APs;
 		long long count2;
 		// correction parameters
-		double act;
+		BeatPhase resume_phase;	// phase to continue with after a pause
 		int corr;
 		double noise_tresh;
+		double auto_thresh;		// 1 when the thresholds follow the noise estimate
+		double auto_k;			// thresholds in multiples of the noise
+		NoiseFloor noise;		// noise of Vm between the beats
+		// alternans detection
+		double alt_window;
+		double alt_thresh;
+		double stv_thresh;
+		double alt_backoff;
+		double alt_flag;			// 1 when the last full window crossed a threshold
+		AlternansDetector alternans;	// beat-to-beat variability of APD90
+		// error statistics per beat
+		double err_split1;
+		double err_split2;
+		BeatErrors beat_err;			// RMS, maximal and mean error of the corrected beat
 		double Rm_corr_up;
 		double Rm_corr_down;
 
 		// standard loop parameters
-		long long count;
-		double enter;
 		double BCL;
 		double BCL_cutoff;
-		double modulo;
-		double Iout;
+
+		// plant identification
+		double rls_on;
+		double rls_lambda;
+		double rls_autoscale;
+		double rls_Tc;
+		double b;
+		double Cm_est;
+		double tau_est;
+		PlantEstimator plant;
+
+		// dynamic clamp
+		double g_Na;
+		double g_K1;
+		double g_CaL;
+		double E_Na;
+		double E_K;
+		double E_CaL;
+		IonicCurrents dclamp;
 };
@@ -0,0 +1,200 @@
+/*
+ Copyright (C) 2022 Leiden University Medical Center
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#ifndef APQR_ALTERNANS_DETECTOR_H
+#define APQR_ALTERNANS_DETECTOR_H
+
+#include <math.h>
+
+/*
+ *********************
+ * AlternansDetector *
+ *********************
+
+Beat-to-beat variability of a per-beat metric (APD90 in the modules) over a
+sliding window of the last N beats:
+	*) alternans	magnitude of a long-short alternation: half the mean of the
+					successive differences x_n - x_(n-1) with every other one
+					negated. For x_n = m + a(-1)^n this is |a|; a steady trend or
+					random variation averages out.
+	*) stv			short-term variability, sum |x_n - x_(n-1)| / (N sqrt(2)),
+					the mean distance to the identity line of a Poincare plot
+
+Both are running sums over a ring buffer of the last N differences, so an update
+at a beat boundary costs the same for any window.
+*/
+class AlternansDetector
+{
+	public:
+		enum {MIN_WINDOW = 4, MAX_WINDOW = 32};
+
+		AlternansDetector(void);
+
+		void configure(int window);
+		void reset(void);
+		void update(double x);
+		bool full(void) const;
+		double alternans(void) const;
+		double stv(void) const;
+
+	private:
+		int N;						// window (beats)
+		double x_prev;				// metric of the previous beat
+		bool has_prev;
+		long long n;				// number of differences, for the alternating sign
+		int head;					// next slot of the ring buffers
+		int count;					// differences in the window
+		double alt_d[MAX_WINDOW];	// successive differences with alternating sign
+		double abs_d[MAX_WINDOW];	// absolute successive differences
+		double sum_alt;
+		double sum_abs;
+};
+
+/*
+AlternansDetector
+-----------------
+Constructs a detector with a window of 16 beats.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+inline AlternansDetector::AlternansDetector(void)
+{
+	configure(16);
+}
+
+/*
+configure
+---------
+Sets the window, clipped to [MIN_WINDOW, MAX_WINDOW], and forgets all beats.
+
+IN:
+	*) window	number of successive differences (beats)
+OUT:
+	*) None
+*/
+inline void AlternansDetector::configure(int window)
+{
+	N = (window < MIN_WINDOW ? MIN_WINDOW : (window > MAX_WINDOW ? MAX_WINDOW : window));
+	reset();
+}
+
+/*
+reset
+-----
+Forgets all beats, such that a full window of new beats is needed again.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+inline void AlternansDetector::reset(void)
+{
+	x_prev = 0;
+	has_prev = false;
+	n = 0;
+	head = 0;
+	count = 0;
+	sum_alt = 0;
+	sum_abs = 0;
+	for (int k = 0; k < MAX_WINDOW; k++){alt_d[k] = 0; abs_d[k] = 0;}
+}
+
+/*
+update
+------
+Adds the metric of the next beat.
+
+IN:
+	*) x		per-beat metric
+OUT:
+	*) None
+*/
+inline void AlternansDetector::update(double x)
+{
+	if (has_prev)
+	{
+		double d = x - x_prev;
+		double a = (n % 2 ? -d : d);
+		if (count == N)
+		{
+			sum_alt -= alt_d[head];
+			sum_abs -= abs_d[head];
+		}
+		else
+			{count++;}
+		alt_d[head] = a;
+		abs_d[head] = fabs(d);
+		sum_alt += a;
+		sum_abs += fabs(d);
+		head = (head + 1) % N;
+		n++;
+	}
+	x_prev = x;
+	has_prev = true;
+}
+
+/*
+full
+----
+Whether the window holds N differences.
+
+IN:
+	*) None
+OUT:
+	*) full
+*/
+inline bool AlternansDetector::full(void) const
+{
+	return count == N;
+}
+
+/*
+alternans
+---------
+Magnitude of the alternation over the window.
+
+IN:
+	*) None
+OUT:
+	*) a		units of the metric, 0 without differences
+*/
+inline double AlternansDetector::alternans(void) const
+{
+	return (count > 0 ? fabs(sum_alt)/(2*count) : 0);
+}
+
+/*
+stv
+---
+Short-term variability over the window.
+
+IN:
+	*) None
+OUT:
+	*) stv		units of the metric, 0 without differences
+*/
+inline double AlternansDetector::stv(void) const
+{
+	return (count > 0 ? sum_abs/(count*sqrt(2.0)) : 0);
+}
+
+#endif
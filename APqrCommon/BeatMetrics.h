@@ -0,0 +1,242 @@
+/*
+ Copyright (C) 2022 Leiden University Medical Center
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#ifndef APQR_BEAT_METRICS_H
+#define APQR_BEAT_METRICS_H
+
+#include <math.h>
+
+/*
+ *************
+ * BeatShape *
+ *************
+
+AP metrics of one beat:
+	*) apd30, apd50, apd90	time from the maximal upstroke velocity until the AP
+							has repolarized by 30, 50 and 90% of its amplitude (ms);
+							0 when that level was not reached within the beat
+	*) amplitude			peak minus resting membrane potential (mV)
+	*) dvdt_max				maximal upstroke velocity (mV/ms)
+	*) rmp					resting membrane potential, the lowest potential of
+							the preceding beat (mV)
+*/
+struct BeatShape
+{
+	double apd30;
+	double apd50;
+	double apd90;
+	double amplitude;
+	double dvdt_max;
+	double rmp;
+};
+
+/*
+ ***************
+ * BeatMetrics *
+ ***************
+
+Computes the AP metrics of a signal (the measured Vm or the reference AP) while
+it streams through execute(), without storing the beat. Every sample updates
+the running minimum, the peak and the maximal upstroke velocity, and checks the
+three repolarization levels that follow from the peak, so a sample costs the
+same amount of work at any point in the beat. A new peak moves the levels and
+clears their crossings; once the AP falls, the first sample below a level gives
+the crossing time, interpolated between the two samples around it.
+
+The modules call begin() at every detected upstroke, after which result() holds
+the metrics of the beat that just ended. The samples of the new upstroke before
+its detection still belong to the old beat; they are too early to change its
+metrics except in the rare case that they are steeper than its own upstroke.
+The pair of samples around begin() counts for the new beat, since the detection
+often falls just before the steepest part of the upstroke.
+*/
+class BeatMetrics
+{
+	public:
+		BeatMetrics(void);
+
+		void configure(double period);
+		void reset(void);
+		void begin(void);
+		void sample(double v);
+		const BeatShape& result(void) const;
+
+	private:
+		double period;		// time-step (ms)
+		bool started;		// whether begin() was called since reset()
+		long long n;		// samples since begin()
+		double v_prev;		// previous sample (mV), NAN before the first one
+		double vmin;		// lowest sample since begin() (mV)
+		double rmp;			// resting potential of this beat (mV), NAN until known
+		double peak;		// highest sample since begin() (mV)
+		double dvdt_max;	// maximal upstroke velocity since begin() (mV/ms)
+		double t_act;		// time of the maximal upstroke velocity (ms)
+		double level[3];	// repolarization levels of 30, 50 and 90% (mV)
+		double apd[3];		// their crossing times after t_act (ms), 0 before crossing
+		BeatShape last;		// metrics of the previous beat
+};
+
+/*
+BeatMetrics
+-----------
+Constructs the metrics for a time-step of 0.1 ms.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+inline BeatMetrics::BeatMetrics(void)
+{
+	configure(0.1);
+	reset();
+}
+
+/*
+configure
+---------
+Sets the time-step.
+
+IN:
+	*) period	the length of a single time-step (ms)
+OUT:
+	*) None
+*/
+inline void BeatMetrics::configure(double period)
+{
+	this->period = (period > 0 ? period : 0.1);
+}
+
+/*
+reset
+-----
+Forgets the current beat and the metrics of the previous one.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+inline void BeatMetrics::reset(void)
+{
+	started = false;
+	n = 0;
+	v_prev = NAN;
+	vmin = INFINITY;
+	rmp = NAN;
+	peak = -INFINITY;
+	dvdt_max = 0;
+	t_act = 0;
+	for (int k = 0; k < 3; k++){level[k] = -INFINITY; apd[k] = 0;}
+	last.apd30 = 0;
+	last.apd50 = 0;
+	last.apd90 = 0;
+	last.amplitude = 0;
+	last.dvdt_max = 0;
+	last.rmp = 0;
+}
+
+/*
+begin
+-----
+Beat boundary: closes the current beat, whose metrics are then in result(), and
+starts a new one whose resting potential is the lowest sample of the closed
+beat. The first call after reset() only starts a beat, since the samples before
+it are no complete beat. Does nothing when no sample arrived since the last
+call, such that two boundaries on the same time-step count once.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+inline void BeatMetrics::begin(void)
+{
+	if (started && n == 0){return;}
+	if (started)
+	{
+		last.apd30 = apd[0];
+		last.apd50 = apd[1];
+		last.apd90 = apd[2];
+		last.amplitude = peak - rmp;
+		last.dvdt_max = dvdt_max;
+		last.rmp = rmp;
+	}
+	rmp = (n > 0 ? vmin : NAN);
+	started = true;
+	n = 0;
+	vmin = INFINITY;
+	peak = -INFINITY;
+	dvdt_max = 0;
+	t_act = 0;
+	for (int k = 0; k < 3; k++){level[k] = -INFINITY; apd[k] = 0;}
+}
+
+/*
+sample
+------
+Adds the next sample of the signal.
+
+IN:
+	*) v		the signal (mV)
+OUT:
+	*) None
+*/
+inline void BeatMetrics::sample(double v)
+{
+	static const double frac[3] = {0.3, 0.5, 0.9};
+	double t = n*period;
+	if (started && isnan(rmp)){rmp = v;} // No samples before this beat to take the resting potential from
+	if (!isnan(v_prev) && (v - v_prev)/period > dvdt_max)
+	{
+		dvdt_max = (v - v_prev)/period;
+		t_act = t - 0.5*period; // Midway between the two samples
+	}
+	if (v > peak)
+	{
+		peak = v;
+		for (int k = 0; k < 3; k++){level[k] = peak - frac[k]*(peak - rmp); apd[k] = 0;}
+	}
+	else
+	{
+		for (int k = 0; k < 3; k++){
+			if (apd[k] == 0 && v <= level[k] && v_prev > level[k])
+				{apd[k] = t - period*(level[k] - v)/(v_prev - v) - t_act;}
+		}
+	}
+	if (v < vmin){vmin = v;}
+	v_prev = v;
+	n++;
+}
+
+/*
+result
+------
+Metrics of the last completed beat.
+
+IN:
+	*) None
+OUT:
+	*) shape	APD30/50/90, amplitude, dV/dt max and resting potential
+*/
+inline const BeatShape& BeatMetrics::result(void) const
+{
+	return last;
+}
+
+#endif
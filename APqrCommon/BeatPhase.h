@@ -0,0 +1,48 @@
+/*
+ Copyright (C) 2022 Leiden University Medical Center
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#ifndef APQR_BEAT_PHASE_H
+#define APQR_BEAT_PHASE_H
+
+/*
+ *************
+ * BeatPhase *
+ *************
+
+Phase of the beat-to-beat control loop. execute() only runs the tick handler
+of the current phase, which in turn only tests the transitions that can occur
+from that phase:
+
+	REST		no reference is being recorded and nothing is corrected; waits
+				for an upstroke, which starts LOGGING (fewer than lognum
+				reference APs) or CORRECTING
+	LOGGING		the reference AP is being recorded; an upstroke starts the
+				next reference AP (REFRACTORY) or, once lognum APs were
+				recorded, CORRECTING
+	REFRACTORY	still recording, but within the upstroke of the AP that was
+				just detected; returns to LOGGING once Vm falls again, so one
+				upstroke is never counted twice
+	CORRECTING	the correction of the current AP is running; returns to REST
+				at the end of the correction window
+	PAUSED		the module is paused; execute() does nothing
+
+The numeric values are published as the "Phase" state of the modules.
+*/
+enum BeatPhase {REST = 0, LOGGING = 1, REFRACTORY = 2, CORRECTING = 3, PAUSED = 4};
+
+#endif
@@ -0,0 +1,182 @@
+/*
+ Copyright (C) 2022 Leiden University Medical Center
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#ifndef APQR_COMMAND_QUEUE_H
+#define APQR_COMMAND_QUEUE_H
+
+#include <atomic>
+
+/*
+ ***************
+ * BeatCommand *
+ ***************
+
+A change that the GUI thread (or a protocol script) asks the real-time loop to
+make: which setting (id, defined by the module) and its new value.
+*/
+struct BeatCommand
+{
+	int id;			// setting to change, defined by the module
+	double value;	// new value
+};
+
+/*
+ ****************
+ * CommandQueue *
+ ****************
+
+Bounded single-producer/single-consumer queue of BeatCommands. The producer
+only writes the tail and the consumer only writes the head, so both sides are
+wait-free and nothing is allocated after construction. N is a power of 2; at
+most N-1 commands can be waiting.
+*/
+template<int N>
+class CommandQueue
+{
+	public:
+		CommandQueue(void);
+
+		bool push(const BeatCommand& c);
+		bool pop(BeatCommand& c);
+
+	private:
+		BeatCommand ring[N];
+		std::atomic<unsigned int> head;	// next slot to read, written by the consumer
+		std::atomic<unsigned int> tail;	// next slot to write, written by the producer
+};
+
+/*
+CommandQueue
+------------
+Constructs an empty queue.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+template<int N>
+inline CommandQueue<N>::CommandQueue(void) : ring(), head(0), tail(0)
+{
+}
+
+/*
+push
+----
+Appends a command. Only called by the producer.
+
+IN:
+	*) c		the command
+OUT:
+	*) pushed	false when the queue is full and the command was dropped
+*/
+template<int N>
+inline bool CommandQueue<N>::push(const BeatCommand& c)
+{
+	unsigned int t = tail.load(std::memory_order_relaxed);
+	if (t - head.load(std::memory_order_acquire) >= (unsigned int)N - 1){return false;}
+	ring[t % N] = c;
+	tail.store(t + 1, std::memory_order_release);
+	return true;
+}
+
+/*
+pop
+---
+Takes the oldest command. Only called by the consumer.
+
+IN:
+	*) None
+OUT:
+	*) c		the command, when there was one
+	*) popped	false when the queue is empty
+*/
+template<int N>
+inline bool CommandQueue<N>::pop(BeatCommand& c)
+{
+	unsigned int h = head.load(std::memory_order_relaxed);
+	if (h == tail.load(std::memory_order_acquire)){return false;}
+	c = ring[h % N];
+	head.store(h + 1, std::memory_order_release);
+	return true;
+}
+
+/*
+ ****************
+ * BeatCommands *
+ ****************
+
+Commands for the real-time loop that only take effect at a beat boundary: at the
+next detected upstroke (AT_UPSTROKE) or at the end of the current beat
+(AT_BEAT_END). Each boundary has its own queue, so a command never waits behind
+one for the other boundary. The modules drain a queue in their beat boundary
+handlers, so every command of a boundary takes effect on the same time-step no
+matter when the GUI thread posted it, and draining costs one atomic load when
+nothing is waiting.
+*/
+class BeatCommands
+{
+	public:
+		enum {AT_UPSTROKE = 0, AT_BEAT_END = 1};
+		enum {CAPACITY = 64};
+
+		bool post(int when, int id, double value);
+		bool next(int when, BeatCommand& c);
+
+	private:
+		CommandQueue<CAPACITY> queue[2];
+};
+
+/*
+post
+----
+Queues a command for a beat boundary. Only called from one non-real-time thread.
+
+IN:
+	*) when		AT_UPSTROKE or AT_BEAT_END
+	*) id		setting to change
+	*) value	new value
+OUT:
+	*) posted	false when the queue of that boundary is full
+*/
+inline bool BeatCommands::post(int when, int id, double value)
+{
+	BeatCommand c;
+	c.id = id;
+	c.value = value;
+	return queue[when == AT_BEAT_END ? 1 : 0].push(c);
+}
+
+/*
+next
+----
+Takes the next command of a boundary, in the order in which they were posted.
+Only called from the real-time thread.
+
+IN:
+	*) when		AT_UPSTROKE or AT_BEAT_END
+OUT:
+	*) c		the command, when there was one
+	*) found	false when no command is waiting for this boundary
+*/
+inline bool BeatCommands::next(int when, BeatCommand& c)
+{
+	return queue[when == AT_BEAT_END ? 1 : 0].pop(c);
+}
+
+#endif
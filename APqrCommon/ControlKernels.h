@@ -0,0 +1,167 @@
+/*
+ Copyright (C) 2022 Leiden University Medical Center
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#ifndef APQR_CONTROL_KERNELS_H
+#define APQR_CONTROL_KERNELS_H
+
+#include "SampleTypes.h"
+#include "EpochBuffer.h"
+
+/*
+ ******************
+ * ControlKernels *
+ ******************
+
+Kernels on the logged signals of the modules, templated on the buffer and
+through it on the sample type (see SampleTypes.h). A buffer is a plain array or
+an EpochBuffer. All buffers are rings of 'modulo' samples indexed with the
+running counter, like Vm_log and Vm_diff_log. Indices before the start of the
+ring wrap around to its end.
+*/
+
+/*
+apqr_log_t
+----------
+Type of the logs and reference APs in the modules (Vm_log, ideal_AP,
+Vm_diff_log): 10000 samples that are cleared in O(1) (see EpochBuffer.h).
+*/
+typedef EpochBuffer<apqr_sample_t, 10000> apqr_log_t;
+
+/*
+SampleOf
+--------
+Sample type of a buffer: the element type of an array or pointer, or the
+value_type of a buffer class.
+*/
+template<typename A> struct SampleOf {typedef typename A::value_type type;};
+template<typename T> struct SampleOf<T*> {typedef T type;};
+template<typename T> struct SampleOf<const T*> {typedef T type;};
+template<typename T, int N> struct SampleOf<T[N]> {typedef T type;};
+
+/*
+ringIndex
+---------
+Position of a running index in a ring buffer.
+
+IN:
+	*) i		running index, may be negative
+	*) modulo	length of the ring
+OUT:
+	*) k		index between 0 and modulo-1
+*/
+inline int ringIndex(int i, int modulo)
+{
+	int k = i % modulo;
+	return (k < 0 ? k + modulo : k);
+}
+
+/*
+windowSum
+---------
+Sum of the last 'length' samples up to and including index n.
+
+IN:
+	*) arr		ring buffer
+	*) n		index of the newest sample
+	*) length	number of samples
+	*) modulo	length of the ring
+OUT:
+	*) sum		sum of the samples
+*/
+template<typename A>
+inline double windowSum(const A& arr, int n, int length, int modulo)
+{
+	typedef typename SampleOf<A>::type T;
+	typename SampleTraits<T>::acc_t acc = 0;
+	for (int i = n - length + 1; i < n + 1; i++)
+		{acc += SampleTraits<T>::load(arr[ringIndex(i, modulo)]);}
+	return SampleTraits<T>::toDouble(acc);
+}
+
+/*
+windowMoment
+------------
+First moment of the last 'length' samples up to and including index n, where
+the oldest sample has weight 0 and the newest weight length-1. Multiplied by
+the time-step this is the sum of x*y of a linear regression.
+
+IN:
+	*) arr		ring buffer
+	*) n		index of the newest sample
+	*) length	number of samples
+	*) modulo	length of the ring
+OUT:
+	*) moment	sum of j*arr[n-length+1+j]
+*/
+template<typename A>
+inline double windowMoment(const A& arr, int n, int length, int modulo)
+{
+	typedef typename SampleOf<A>::type T;
+	typename SampleTraits<T>::acc_t acc = 0;
+	int j = 0;
+	for (int i = n - length + 1; i < n + 1; i++)
+	{
+		acc += SampleTraits<T>::load(arr[ringIndex(i, modulo)]) * j;
+		j++;
+	}
+	return SampleTraits<T>::toDouble(acc);
+}
+
+/*
+averageInto
+-----------
+Adds a value to a rolling average over the previous n values, as used for the
+reference AP.
+
+IN:
+	*) slot		current average
+	*) x		new value
+	*) n		number of values in the current average
+OUT:
+	*) slot		average including x
+*/
+template<typename T>
+inline void averageInto(T& slot, double x, double n)
+{
+	slot = (slot*n + x)/(n + 1);
+}
+
+/*
+interpolate
+-----------
+Linearly interpolated value of a buffer at a fractional index, clipped to the
+ends of the buffer.
+
+IN:
+	*) arr		buffer
+	*) size		number of samples in the buffer
+	*) pos		fractional index
+OUT:
+	*) value	interpolated value
+*/
+template<typename A>
+inline double interpolate(const A& arr, int size, double pos)
+{
+	if (pos <= 0){return arr[0];}
+	if (pos >= size - 1){return arr[size - 1];}
+	int n = (int)pos;
+	double frac = pos - n;
+	return (double)arr[n] + frac*((double)arr[n + 1] - (double)arr[n]);
+}
+
+#endif
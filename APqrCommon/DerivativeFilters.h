@@ -0,0 +1,347 @@
+/*
+ Copyright (C) 2022 Leiden University Medical Center
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#ifndef APQR_DERIVATIVE_FILTERS_H
+#define APQR_DERIVATIVE_FILTERS_H
+
+#include <math.h>
+#include <stdlib.h>
+#include "ControlKernels.h"
+
+/*
+ ********************
+ * DerivativeFilter *
+ ********************
+
+Family of FIR estimators of the derivative of a logged signal (mV/ms), for the
+D term of the PID modules. Every filter is a set of weights over the last N
+samples:
+	*) REGRESSION		slope of the least-squares line, as computed by sumxy/sumy;
+						it estimates the slope in the middle of the window
+	*) SAVITZKY_GOLAY	derivative at the newest sample of a least-squares
+						polynomial of order 2 to 4; no lag for signals that are
+						such polynomials, at the cost of more noise
+	*) NOISE_ROBUST		smooth noise-robust differentiator (Holoborodko), exact
+						for polynomials up to order 2 and with a gain that falls
+						to 0 at the Nyquist frequency; it estimates the slope
+						(N-1)/2 samples ago
+
+The weights depend only on the filter, the window and the time-step, and are
+computed in configure(), outside of the real-time loop. The window is one of a
+fixed set of lengths, each of which has its own instantiation of the kernel,
+so the dot product has a compile-time trip count that the compiler unrolls and
+vectorizes.
+*/
+class DerivativeFilter
+{
+	public:
+		enum {REGRESSION = 0, SAVITZKY_GOLAY = 1, NOISE_ROBUST = 2};
+		enum {MAX_WINDOW = 31};
+
+		DerivativeFilter(void);
+
+		void configure(int type, int window, int order, double period);
+		template<typename A> double slope(const A& arr, int n, int modulo) const;
+		int window(void) const;
+		double lag(void) const;
+
+	private:
+		static int supportedWindow(int window);
+		static double binomial(int n, int k);
+		template<int W, typename A> double apply(const A& arr, int n, int modulo) const;
+		void regressionWeights(void);
+		void savitzkyGolayWeights(int order);
+		void noiseRobustWeights(void);
+
+		int type;
+		int N;						// window (samples)
+		double period;				// time-step (ms)
+		double delay;				// lag of the estimate (ms)
+		double weight[MAX_WINDOW];	// weights, oldest sample first (1/ms)
+};
+
+/*
+DerivativeFilter
+----------------
+Constructs a 5-point regression for a time-step of 0.1 ms.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+inline DerivativeFilter::DerivativeFilter(void)
+{
+	configure(REGRESSION, 5, 2, 0.1);
+}
+
+/*
+configure
+---------
+Computes the weights of a filter. The window is rounded to the nearest
+supported length (5, 7, 9, 11, 15, 21 or 31 samples) and the polynomial order
+of the Savitzky-Golay filter is clipped to [2, 4].
+
+IN:
+	*) type		REGRESSION, SAVITZKY_GOLAY or NOISE_ROBUST
+	*) window	number of samples
+	*) order	polynomial order of the Savitzky-Golay filter
+	*) period	the length of a single time-step (ms)
+OUT:
+	*) None
+*/
+inline void DerivativeFilter::configure(int type, int window, int order, double period)
+{
+	this->type = (type < REGRESSION || type > NOISE_ROBUST ? REGRESSION : type);
+	this->period = (period > 0 ? period : 1);
+	N = supportedWindow(window);
+	if (order < 2){order = 2;}
+	if (order > 4){order = 4;}
+
+	switch (this->type)
+	{
+	case SAVITZKY_GOLAY:
+		savitzkyGolayWeights(order);
+		delay = 0;
+		break;
+	case NOISE_ROBUST:
+		noiseRobustWeights();
+		delay = (N - 1)/2*this->period;
+		break;
+	default:
+		regressionWeights();
+		delay = (N - 1)/2*this->period;
+		break;
+	}
+}
+
+/*
+slope
+-----
+Derivative of a logged signal at index n.
+
+IN:
+	*) arr		ring buffer with the signal (mV)
+	*) n		index of the newest sample
+	*) modulo	length of the ring
+OUT:
+	*) slope	derivative (mV/ms)
+*/
+template<typename A>
+inline double DerivativeFilter::slope(const A& arr, int n, int modulo) const
+{
+	switch (N)
+	{
+	case 5: return apply<5>(arr, n, modulo);
+	case 7: return apply<7>(arr, n, modulo);
+	case 9: return apply<9>(arr, n, modulo);
+	case 11: return apply<11>(arr, n, modulo);
+	case 15: return apply<15>(arr, n, modulo);
+	case 21: return apply<21>(arr, n, modulo);
+	default: return apply<31>(arr, n, modulo);
+	}
+}
+
+/*
+window
+------
+Window of the filter after rounding to a supported length.
+
+IN:
+	*) None
+OUT:
+	*) N		number of samples
+*/
+inline int DerivativeFilter::window(void) const
+{
+	return N;
+}
+
+/*
+lag
+---
+Time by which the estimate lags the derivative at the newest sample for a
+smoothly curving signal.
+
+IN:
+	*) None
+OUT:
+	*) lag		(ms)
+*/
+inline double DerivativeFilter::lag(void) const
+{
+	return delay;
+}
+
+/*
+apply
+-----
+Dot product of the weights with the last W samples. The samples are copied to
+a contiguous array first, directly when the window does not wrap around the
+end of the ring.
+
+IN:
+	*) arr		ring buffer with the signal (mV)
+	*) n		index of the newest sample
+	*) modulo	length of the ring
+OUT:
+	*) slope	derivative (mV/ms)
+*/
+template<int W, typename A>
+inline double DerivativeFilter::apply(const A& arr, int n, int modulo) const
+{
+	double x[W];
+	int start = n - W + 1;
+	if (start >= 0 && n < modulo)
+		{for (int j = 0; j < W; j++){x[j] = arr[start + j];}}
+	else
+		{for (int j = 0; j < W; j++){x[j] = arr[ringIndex(start + j, modulo)];}}
+
+	double s = 0;
+	for (int j = 0; j < W; j++){s += weight[j]*x[j];}
+	return s;
+}
+
+/*
+supportedWindow
+---------------
+Nearest window length for which the kernel is instantiated.
+
+IN:
+	*) window	requested number of samples
+OUT:
+	*) N		supported number of samples
+*/
+inline int DerivativeFilter::supportedWindow(int window)
+{
+	static const int windows[] = {5, 7, 9, 11, 15, 21, 31};
+	int best = windows[0];
+	for (int i = 1; i < 7; i++){
+		if (abs(windows[i] - window) < abs(best - window)){best = windows[i];}
+	}
+	return best;
+}
+
+/*
+binomial
+--------
+Binomial coefficient, 0 outside of 0 <= k <= n.
+
+IN:
+	*) n, k
+OUT:
+	*) C(n, k)
+*/
+inline double DerivativeFilter::binomial(int n, int k)
+{
+	if (k < 0 || k > n){return 0;}
+	double c = 1;
+	for (int i = 1; i <= k; i++){c = c*(n - k + i)/i;}
+	return c;
+}
+
+/*
+regressionWeights
+-----------------
+Weights of the slope of the least-squares line, (x_j - mean(x))/sum (x - mean(x))^2.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+inline void DerivativeFilter::regressionWeights(void)
+{
+	double mean = (N - 1)/2.0;
+	double sxx = 0;
+	for (int j = 0; j < N; j++){sxx += (j - mean)*(j - mean);}
+	for (int j = 0; j < N; j++){weight[j] = (j - mean)/(sxx*period);}
+}
+
+/*
+savitzkyGolayWeights
+--------------------
+Weights of the first derivative at the newest sample of the least-squares
+polynomial of the given order. With the newest sample at x = 0 and the design
+matrix A (A_jk = x_j^k), the derivative is the coefficient of x, so the weights
+are w_j = sum_k z_k x_j^k with (A'A) z = e_1. The normal equations are at most
+5x5 and are solved by Gaussian elimination with partial pivoting.
+
+IN:
+	*) order	polynomial order (2 to 4)
+OUT:
+	*) None
+*/
+inline void DerivativeFilter::savitzkyGolayWeights(int order)
+{
+	int p = order + 1;
+	double M[5][6];
+	for (int r = 0; r < p; r++){
+		for (int c = 0; c < p; c++){
+			M[r][c] = 0;
+			for (int j = 0; j < N; j++){M[r][c] += pow(j - (N - 1), r + c);}
+		}
+		M[r][p] = (r == 1 ? 1 : 0);
+	}
+
+	for (int c = 0; c < p; c++){
+		int piv = c;
+		for (int r = c + 1; r < p; r++){
+			if (fabs(M[r][c]) > fabs(M[piv][c])){piv = r;}
+		}
+		for (int k = 0; k <= p; k++){double t = M[c][k]; M[c][k] = M[piv][k]; M[piv][k] = t;}
+		for (int r = 0; r < p; r++){
+			if (r == c){continue;}
+			double f = M[r][c]/M[c][c];
+			for (int k = c; k <= p; k++){M[r][k] -= f*M[c][k];}
+		}
+	}
+
+	for (int j = 0; j < N; j++){
+		double w = 0;
+		for (int k = 0; k < p; k++){w += M[k][p]/M[k][k]*pow(j - (N - 1), k);}
+		weight[j] = w/period;
+	}
+}
+
+/*
+noiseRobustWeights
+------------------
+Weights of the smooth noise-robust differentiator of Holoborodko (2008) with
+N = 2M+1 points: f'(0) = sum_k c_k (f(k) - f(-k)), with
+c_k = (C(2m, m-k+1) - C(2m, m-k-1))/2^(2m+1) and m = (N-3)/2.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+inline void DerivativeFilter::noiseRobustWeights(void)
+{
+	int M = (N - 1)/2;
+	int m = (N - 3)/2;
+	double scale = pow(2.0, 2*m + 1)*period;
+	weight[M] = 0;
+	for (int k = 1; k <= M; k++){
+		double c = (binomial(2*m, m - k + 1) - binomial(2*m, m - k - 1))/scale;
+		weight[M + k] = c;
+		weight[M - k] = -c;
+	}
+}
+
+#endif
@@ -0,0 +1,181 @@
+/*
+ Copyright (C) 2022 Leiden University Medical Center
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#ifndef APQR_EPOCH_BUFFER_H
+#define APQR_EPOCH_BUFFER_H
+
+/*
+ ***************
+ * EpochBuffer *
+ ***************
+
+Fixed-size log (Vm_log, ideal_AP, Vm_diff_log) that is cleared in O(1). Next to
+the values the buffer only keeps the length of its valid part: every slot from
+index 0 up to the highest index written since the last invalidate(). Slots at
+or beyond that length read as 0, exactly as if the whole buffer had been
+zeroed, and invalidate() only sets the length to 0 to start a new epoch. The
+buffer therefore takes no more memory than a plain array, and a read costs one
+comparison against a length that stays in a register or in L1.
+
+The logs are written in order from index 0 after a Modify, so a write normally
+extends the valid part by one slot. A write further ahead first zeroes the
+skipped slots, which happens at most once per slot and epoch.
+
+Reads go through operator[], which is const and never writes. Writes go through
+set(), or through at() for read-modify-write updates such as the rolling
+average of the reference AP. Indices are not checked.
+*/
+template<typename T, int N>
+class EpochBuffer
+{
+	public:
+		typedef T value_type;
+
+		EpochBuffer(void);
+
+		void invalidate(void);
+		T operator[](int i) const;
+		void set(int i, T x);
+		T& at(int i);
+		int size(void) const;
+
+	private:
+		void extend(int i);
+
+		int length;		// valid slots of the current epoch, the others read as 0
+		T v[N];
+};
+
+/*
+EpochBuffer
+-----------
+Constructs a buffer in which every slot reads as 0.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+template<typename T, int N>
+inline EpochBuffer<T, N>::EpochBuffer(void) : length(0)
+{
+	for (int i = 0; i < N; i++){v[i] = T();}
+}
+
+/*
+invalidate
+----------
+Makes every slot read as 0 by starting a new epoch.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+template<typename T, int N>
+inline void EpochBuffer<T, N>::invalidate(void)
+{
+	length = 0;
+}
+
+/*
+operator[]
+----------
+Value of a slot, 0 when it has not been written in the current epoch.
+
+IN:
+	*) i		index between 0 and N-1
+OUT:
+	*) value
+*/
+template<typename T, int N>
+inline T EpochBuffer<T, N>::operator[](int i) const
+{
+	return (i < length ? v[i] : T());
+}
+
+/*
+set
+---
+Writes a slot.
+
+IN:
+	*) i		index between 0 and N-1
+	*) x		value
+OUT:
+	*) None
+*/
+template<typename T, int N>
+inline void EpochBuffer<T, N>::set(int i, T x)
+{
+	if (i >= length){extend(i);}
+	v[i] = x;
+}
+
+/*
+at
+--
+Writable reference to a slot. A slot beyond the valid part is set to 0 first.
+
+IN:
+	*) i		index between 0 and N-1
+OUT:
+	*) slot		reference to the value
+*/
+template<typename T, int N>
+inline T& EpochBuffer<T, N>::at(int i)
+{
+	if (i >= length){extend(i);}
+	return v[i];
+}
+
+/*
+extend
+------
+Zeroes the slots from the current length up to and including slot i, which
+then all belong to the valid part.
+
+IN:
+	*) i		index at or beyond the current length
+OUT:
+	*) None
+*/
+template<typename T, int N>
+inline void EpochBuffer<T, N>::extend(int i)
+{
+	for (int j = length; j <= i; j++){v[j] = T();}
+	length = i + 1;
+}
+
+/*
+size
+----
+Number of slots.
+
+IN:
+	*) None
+OUT:
+	*) N
+*/
+template<typename T, int N>
+inline int EpochBuffer<T, N>::size(void) const
+{
+	return N;
+}
+
+#endif
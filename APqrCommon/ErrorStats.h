@@ -0,0 +1,341 @@
+/*
+ Copyright (C) 2022 Leiden University Medical Center
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#ifndef APQR_ERROR_STATS_H
+#define APQR_ERROR_STATS_H
+
+#include <math.h>
+
+/*
+ ****************
+ * ErrorSummary *
+ ****************
+
+Statistics of the error Vm - reference over a stretch of samples:
+	*) rms			root mean square of the error (mV)
+	*) max_abs		largest absolute error (mV)
+	*) bias			mean error (mV); positive when Vm lies above the reference
+All are 0 when the stretch holds no samples.
+*/
+struct ErrorSummary
+{
+	double rms;
+	double max_abs;
+	double bias;
+};
+
+/*
+ **************
+ * ErrorStats *
+ **************
+
+Streaming mean, variance and maximum of the error with Welford's update, which
+stays accurate when the variance is small compared to the squared mean, as for
+a constant offset between Vm and the reference. The RMS follows from both as
+sqrt(variance + mean^2).
+*/
+class ErrorStats
+{
+	public:
+		ErrorStats(void);
+
+		void reset(void);
+		void update(double e);
+		ErrorSummary summary(void) const;
+
+	private:
+		long long n;		// number of samples
+		double mean;		// running mean (mV)
+		double m2;			// sum of squared deviations from the mean (mV^2)
+		double max_abs;		// largest absolute error (mV)
+};
+
+/*
+ErrorStats
+----------
+Constructs the statistics without samples.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+inline ErrorStats::ErrorStats(void)
+{
+	reset();
+}
+
+/*
+reset
+-----
+Forgets all samples.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+inline void ErrorStats::reset(void)
+{
+	n = 0;
+	mean = 0;
+	m2 = 0;
+	max_abs = 0;
+}
+
+/*
+update
+------
+Adds the next error.
+
+IN:
+	*) e		error (mV)
+OUT:
+	*) None
+*/
+inline void ErrorStats::update(double e)
+{
+	n++;
+	double d = e - mean;
+	mean += d/n;
+	m2 += d*(e - mean);
+	if (fabs(e) > max_abs){max_abs = fabs(e);}
+}
+
+/*
+summary
+-------
+RMS, maximal absolute and mean error of the samples so far.
+
+IN:
+	*) None
+OUT:
+	*) s		see ErrorSummary
+*/
+inline ErrorSummary ErrorStats::summary(void) const
+{
+	ErrorSummary s;
+	s.rms = (n > 0 ? sqrt(m2/n + mean*mean) : 0);
+	s.max_abs = max_abs;
+	s.bias = mean;
+	return s;
+}
+
+/*
+ **************
+ * BeatErrors *
+ **************
+
+Error statistics of one corrected beat, for the whole beat and for three phase
+windows that follow from two split times after the upstroke:
+	*) window 1		[0, split1): the upstroke and early repolarization
+	*) window 2		[split1, split2): the plateau
+	*) window 3		[split2, end of the beat): the final repolarization
+Every sample updates the statistics of the beat and of the window it falls in,
+so a sample costs the same amount of work at any point in the beat.
+
+The modules call begin() when the correction of a beat starts, sample() on every
+time-step of the correction and end() when the correction stops, after which
+beat() and window() hold the statistics of that beat until the next end().
+*/
+class BeatErrors
+{
+	public:
+		enum {NUM_WINDOWS = 3};
+
+		BeatErrors(void);
+
+		void configure(double period);
+		void setSplits(double split1, double split2);
+		void reset(void);
+		void begin(void);
+		void sample(double e);
+		void end(void);
+		const ErrorSummary& beat(void) const;
+		const ErrorSummary& window(int w) const;
+
+	private:
+		double period;						// time-step (ms)
+		double split[NUM_WINDOWS - 1];		// window boundaries after the upstroke (ms)
+		bool open;							// whether a beat is being sampled
+		long long n;						// samples since begin()
+		ErrorStats whole;					// the current beat
+		ErrorStats win[NUM_WINDOWS];		// the windows of the current beat
+		ErrorSummary last;					// the previous beat
+		ErrorSummary last_win[NUM_WINDOWS];	// the windows of the previous beat
+};
+
+/*
+BeatErrors
+----------
+Constructs the statistics for a time-step of 0.1 ms and splits at 50 and 250 ms.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+inline BeatErrors::BeatErrors(void)
+{
+	configure(0.1);
+	setSplits(50, 250);
+	reset();
+}
+
+/*
+configure
+---------
+Sets the time-step.
+
+IN:
+	*) period	the length of a single time-step (ms)
+OUT:
+	*) None
+*/
+inline void BeatErrors::configure(double period)
+{
+	this->period = (period > 0 ? period : 0.1);
+}
+
+/*
+setSplits
+---------
+Sets the boundaries of the phase windows. A second split before the first one
+is moved onto it, which leaves the plateau window empty.
+
+IN:
+	*) split1	end of window 1 after the upstroke (ms)
+	*) split2	end of window 2 after the upstroke (ms)
+OUT:
+	*) None
+*/
+inline void BeatErrors::setSplits(double split1, double split2)
+{
+	split[0] = (split1 > 0 ? split1 : 0);
+	split[1] = (split2 > split[0] ? split2 : split[0]);
+}
+
+/*
+reset
+-----
+Forgets the current beat and the statistics of the previous one.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+inline void BeatErrors::reset(void)
+{
+	ErrorSummary zero = {0, 0, 0};
+	open = false;
+	n = 0;
+	whole.reset();
+	last = zero;
+	for (int w = 0; w < NUM_WINDOWS; w++){win[w].reset(); last_win[w] = zero;}
+}
+
+/*
+begin
+-----
+Starts a new beat. A beat that was not ended yet is ended first.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+inline void BeatErrors::begin(void)
+{
+	end();
+	open = true;
+	n = 0;
+	whole.reset();
+	for (int w = 0; w < NUM_WINDOWS; w++){win[w].reset();}
+}
+
+/*
+sample
+------
+Adds the error of the next time-step; ignored outside a beat.
+
+IN:
+	*) e		error Vm - reference (mV)
+OUT:
+	*) None
+*/
+inline void BeatErrors::sample(double e)
+{
+	if (!open){return;}
+	double t = n*period;
+	int w = (t < split[0] ? 0 : (t < split[1] ? 1 : 2));
+	whole.update(e);
+	win[w].update(e);
+	n++;
+}
+
+/*
+end
+---
+Ends the current beat, whose statistics are then in beat() and window(). Does
+nothing outside a beat.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+inline void BeatErrors::end(void)
+{
+	if (!open){return;}
+	last = whole.summary();
+	for (int w = 0; w < NUM_WINDOWS; w++){last_win[w] = win[w].summary();}
+	open = false;
+}
+
+/*
+beat
+----
+Statistics of the last ended beat.
+
+IN:
+	*) None
+OUT:
+	*) s		see ErrorSummary
+*/
+inline const ErrorSummary& BeatErrors::beat(void) const
+{
+	return last;
+}
+
+/*
+window
+------
+Statistics of a phase window of the last ended beat.
+
+IN:
+	*) w		0, 1 or 2 for window 1, 2 or 3
+OUT:
+	*) s		see ErrorSummary
+*/
+inline const ErrorSummary& BeatErrors::window(int w) const
+{
+	return last_win[w];
+}
+
+#endif
@@ -0,0 +1,119 @@
+/*
+ Copyright (C) 2022 Leiden University Medical Center
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#ifndef APQR_EVENT_MAILBOX_H
+#define APQR_EVENT_MAILBOX_H
+
+#include <atomic>
+
+/*
+ ****************
+ * EventMailbox *
+ ****************
+
+Events that the real-time loop reports to the GUI thread, which reacts to them
+in refresh() (pausing the module, counting them in a state, ...), such that
+execute() never calls into Qt:
+	*) LOOPS_FINISHED	the requested number of loops through the AP file is done
+	*) FILE_MISSING		no AP file has been loaded
+	*) SATURATED		the requested output exceeded the range of the output,
+						i.e. an actuator was clamped at its maximum
+	*) OVERRUN			a time-step started more than 1.5 periods after the
+						previous one
+	*) UPSTROKE_MISSED	no upstroke was detected within twice the expected
+						length of a beat
+	*) GAINS_TUNED		execute() changed the live gains (auto-tuning, adopted
+						shadow gains, RLS rescaling, Rm adaptation, alternans
+						back-off); posted after the snapshot of the states
+						that holds them (see Seqlock.h)
+	*) AUTOTUNE_DONE	an auto-tuning experiment ended
+
+Every event has a counter that only the real-time thread writes, with a plain
+load and store, so posting is wait-free and costs no atomic read-modify-write.
+The GUI thread remembers how far it has read every counter. An event that is
+posted on every time-step, such as LOOPS_FINISHED while the pause has not taken
+effect yet, therefore costs the real-time thread no more than one that is
+posted once, and none of its posts is lost.
+
+One thread may post and one other thread may take.
+*/
+class EventMailbox
+{
+	public:
+		enum {LOOPS_FINISHED = 0, FILE_MISSING = 1, SATURATED = 2, OVERRUN = 3, UPSTROKE_MISSED = 4, GAINS_TUNED = 5, AUTOTUNE_DONE = 6, NUM_EVENTS = 7};
+
+		EventMailbox(void);
+
+		void post(int event);
+		unsigned int take(int event);
+
+	private:
+		std::atomic<unsigned int> posted[NUM_EVENTS];	// written by the real-time thread
+		unsigned int taken[NUM_EVENTS];					// written by the GUI thread
+};
+
+/*
+EventMailbox
+------------
+Constructs a mailbox without events.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+inline EventMailbox::EventMailbox(void)
+{
+	for (int e = 0; e < NUM_EVENTS; e++){posted[e].store(0); taken[e] = 0;}
+}
+
+/*
+post
+----
+Reports an event. Only called from the real-time thread; never waits.
+
+IN:
+	*) event	one of the events above
+OUT:
+	*) None
+*/
+inline void EventMailbox::post(int event)
+{
+	posted[event].store(posted[event].load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+/*
+take
+----
+Number of times an event was posted since the previous take() of that event.
+Only called from the GUI thread.
+
+IN:
+	*) event	one of the events above
+OUT:
+	*) n		0 when the event did not occur
+*/
+inline unsigned int EventMailbox::take(int event)
+{
+	unsigned int p = posted[event].load(std::memory_order_acquire);
+	unsigned int n = p - taken[event];
+	taken[event] = p;
+	return n;
+}
+
+#endif
@@ -0,0 +1,154 @@
+/*
+ Copyright (C) 2022 Leiden University Medical Center
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#ifndef APQR_GATE_TABLE_H
+#define APQR_GATE_TABLE_H
+
+#include <math.h>
+
+/*
+ *************
+ * GateTable *
+ *************
+
+Voltage-indexed lookup table of a Hodgkin-Huxley type gating variable for a
+fixed time-step. For every tabulated membrane potential it stores the steady
+state x_inf(V) and the Rush-Larsen decay factor exp(-period/tau(V)), such that
+one time-step of the gate is
+
+	x[k+1] = x_inf(V) - (x_inf(V) - x[k])*exp(-period/tau(V))
+
+which is exact for a constant V and stable for any time-step. Both columns are
+interpolated linearly between the tabulated points, so a step costs a handful
+of multiplications and no call to exp(). A gate without kinetics (tau = 0)
+follows x_inf instantaneously.
+
+The table covers -120 to 80 mV in steps of 0.1 mV; membrane potentials outside
+of this range use the nearest end of the table. It has to be rebuilt with
+build() whenever the period changes, which calls exp() and should therefore
+happen outside of execute().
+*/
+class GateTable
+{
+	public:
+		enum {POINTS = 2001};
+		static constexpr double V_MIN = -120;	// mV
+		static constexpr double STEP = 0.1;		// mV
+
+		typedef double (*rate_t)(double V, double p);
+
+		GateTable(void);
+
+		void build(rate_t x_inf, rate_t tau, double period, double p);
+		double steadyState(double V) const;
+		double step(double x, double V) const;
+
+	private:
+		double inf[POINTS];	// steady state of the gate
+		double rl[POINTS];	// Rush-Larsen factor exp(-period/tau)
+};
+
+/*
+GateTable
+---------
+Constructs a table of a gate that is always open.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+inline GateTable::GateTable(void)
+{
+	for (int n = 0; n < POINTS; n++){
+		inf[n] = 1;
+		rl[n] = 0;
+	}
+}
+
+/*
+build
+-----
+Tabulates the steady state and the Rush-Larsen factor of a gate.
+
+IN:
+	*) x_inf	steady state of the gate as a function of V (mV) and p
+	*) tau		time constant of the gate (ms) as a function of V (mV) and p,
+				or NULL for an instantaneous gate
+	*) period	the length of a single time-step (ms)
+	*) p		extra argument of the rate functions, e.g. a reversal potential
+OUT:
+	*) None
+*/
+inline void GateTable::build(rate_t x_inf, rate_t tau, double period, double p)
+{
+	for (int n = 0; n < POINTS; n++){
+		double V = V_MIN + n*STEP;
+		double t = (tau ? tau(V, p) : 0);
+		inf[n] = x_inf(V, p);
+		rl[n] = (t > 0 ? exp(-period/t) : 0);
+	}
+}
+
+/*
+steadyState
+-----------
+Interpolated steady state of the gate.
+
+IN:
+	*) V		membrane potential (mV)
+OUT:
+	*) x_inf	steady state of the gate
+*/
+inline double GateTable::steadyState(double V) const
+{
+	double pos = (V - V_MIN)/STEP;
+	if (pos <= 0){return inf[0];}
+	if (pos >= POINTS - 1){return inf[POINTS - 1];}
+	int n = (int)pos;
+	double frac = pos - n;
+	return inf[n] + frac*(inf[n+1] - inf[n]);
+}
+
+/*
+step
+----
+Advances the gate by one time-step with the Rush-Larsen scheme.
+
+IN:
+	*) x		gate at the previous time-step
+	*) V		membrane potential (mV)
+OUT:
+	*) x		gate at the current time-step
+*/
+inline double GateTable::step(double x, double V) const
+{
+	double pos = (V - V_MIN)/STEP;
+	int n;
+	double frac;
+
+	if (pos <= 0){n = 0; frac = 0;}
+	else if (pos >= POINTS - 1){n = POINTS - 2; frac = 1;}
+	else {n = (int)pos; frac = pos - n;}
+
+	double x_inf = inf[n] + frac*(inf[n+1] - inf[n]);
+	double decay = rl[n] + frac*(rl[n+1] - rl[n]);
+	return x_inf - (x_inf - x)*decay;
+}
+
+#endif
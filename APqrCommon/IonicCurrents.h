@@ -0,0 +1,322 @@
+/*
+ Copyright (C) 2022 Leiden University Medical Center
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#ifndef APQR_IONIC_CURRENTS_H
+#define APQR_IONIC_CURRENTS_H
+
+#include <math.h>
+#include <stddef.h>
+#include "GateTable.h"
+
+/*
+ *****************
+ * IonicCurrents *
+ *****************
+
+Virtual ionic conductances for dynamic clamp. The gating kinetics follow the
+human ventricular model of ten Tusscher and Panfilov (2006):
+	*) I_Na		= g_Na*m^3*h*j*(V - E_Na)
+	*) I_K1		= g_K1*xK1_inf(V - E_K)*(V - E_K)		(instantaneous rectification)
+	*) I_CaL	= g_CaL*d*f*f2*(V - E_CaL)
+
+I_CaL uses an ohmic driving force towards an apparent reversal potential and
+leaves out the calcium-dependent inactivation, since the virtual current has no
+intracellular calcium to act on. The conductances are given per unit of
+membrane capacitance (nS/pF), so all currents come out in pA/pF; the values of
+the original model are g_Na = 14.838 and g_K1 = 5.405 nS/pF.
+
+Every gate has its own GateTable, so an update costs a fixed number of table
+look-ups and multiplications and no call to exp(). The currents are outward
+positive, like membrane currents: the current that has to be injected to add
+them to the cell is -Cm*update(V).
+*/
+class IonicCurrents
+{
+	public:
+		IonicCurrents(void);
+
+		void configure(double period, double E_Na, double E_K, double E_CaL);
+		void copyTables(const IonicCurrents& other);
+		void setConductances(double g_Na, double g_K1, double g_CaL);
+		void reset(double V);
+		double update(double V);
+
+		double I_Na;	// pA/pF
+		double I_K1;	// pA/pF
+		double I_CaL;	// pA/pF
+
+	private:
+		static double m_inf(double V, double p);
+		static double tau_m(double V, double p);
+		static double h_inf(double V, double p);
+		static double tau_h(double V, double p);
+		static double tau_j(double V, double p);
+		static double xK1_inf(double V, double E_K);
+		static double d_inf(double V, double p);
+		static double tau_d(double V, double p);
+		static double f_inf(double V, double p);
+		static double tau_f(double V, double p);
+		static double f2_inf(double V, double p);
+		static double tau_f2(double V, double p);
+
+		GateTable m_table, h_table, j_table, xK1_table, d_table, f_table, f2_table;
+		double m, h, j, d, f, f2;	// gates
+		double g_Na, g_K1, g_CaL;	// nS/pF
+		double E_Na, E_K, E_CaL;	// mV
+};
+
+/*
+IonicCurrents
+-------------
+Constructs the currents for a time-step of 0.1 ms with all conductances at 0.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+inline IonicCurrents::IonicCurrents(void)
+{
+	setConductances(0, 0, 0);
+	configure(0.1, 40, -85, 60);
+	reset(-85);
+}
+
+/*
+configure
+---------
+Sets the reversal potentials and rebuilds the tables of all gates for the given
+time-step. This calls exp() for every tabulated point and should not be used
+from execute().
+
+IN:
+	*) period	the length of a single time-step (ms)
+	*) E_Na		reversal potential of I_Na (mV)
+	*) E_K		reversal potential of I_K1 (mV)
+	*) E_CaL	apparent reversal potential of I_CaL (mV)
+OUT:
+	*) None
+*/
+inline void IonicCurrents::configure(double period, double E_Na, double E_K, double E_CaL)
+{
+	this->E_Na = E_Na;
+	this->E_K = E_K;
+	this->E_CaL = E_CaL;
+
+	m_table.build(m_inf, tau_m, period, 0);
+	h_table.build(h_inf, tau_h, period, 0);
+	j_table.build(h_inf, tau_j, period, 0); // j has the same steady state as h
+	xK1_table.build(xK1_inf, NULL, period, E_K);
+	d_table.build(d_inf, tau_d, period, 0);
+	f_table.build(f_inf, tau_f, period, 0);
+	f2_table.build(f2_inf, tau_f2, period, 0);
+}
+
+/*
+copyTables
+----------
+Takes over the reversal potentials and the gate tables of another instance,
+e.g. one that was configured for a new time-step while this one was still in
+use, and keeps the gates and the conductances. Only copies, so it is short
+enough to run while execute() is held.
+
+IN:
+	*) other	the instance to copy the tables from
+OUT:
+	*) None
+*/
+inline void IonicCurrents::copyTables(const IonicCurrents& other)
+{
+	E_Na = other.E_Na;
+	E_K = other.E_K;
+	E_CaL = other.E_CaL;
+	m_table = other.m_table;
+	h_table = other.h_table;
+	j_table = other.j_table;
+	xK1_table = other.xK1_table;
+	d_table = other.d_table;
+	f_table = other.f_table;
+	f2_table = other.f2_table;
+}
+
+/*
+setConductances
+---------------
+Sets the maximal conductances. A conductance of 0 switches a current off.
+
+IN:
+	*) g_Na		maximal conductance of I_Na (nS/pF)
+	*) g_K1		maximal conductance of I_K1 (nS/pF)
+	*) g_CaL	maximal conductance of I_CaL (nS/pF)
+OUT:
+	*) None
+*/
+inline void IonicCurrents::setConductances(double g_Na, double g_K1, double g_CaL)
+{
+	this->g_Na = g_Na;
+	this->g_K1 = g_K1;
+	this->g_CaL = g_CaL;
+}
+
+/*
+reset
+-----
+Puts all gates in their steady state at the given membrane potential.
+
+IN:
+	*) V		membrane potential (mV)
+OUT:
+	*) None
+*/
+inline void IonicCurrents::reset(double V)
+{
+	m = m_table.steadyState(V);
+	h = h_table.steadyState(V);
+	j = j_table.steadyState(V);
+	d = d_table.steadyState(V);
+	f = f_table.steadyState(V);
+	f2 = f2_table.steadyState(V);
+	I_Na = 0;
+	I_K1 = 0;
+	I_CaL = 0;
+}
+
+/*
+update
+------
+Advances all gates by one time-step (Rush-Larsen) and computes the currents.
+
+IN:
+	*) V		membrane potential (mV)
+OUT:
+	*) I		sum of all currents (pA/pF, outward positive)
+*/
+inline double IonicCurrents::update(double V)
+{
+	m = m_table.step(m, V);
+	h = h_table.step(h, V);
+	j = j_table.step(j, V);
+	d = d_table.step(d, V);
+	f = f_table.step(f, V);
+	f2 = f2_table.step(f2, V);
+
+	I_Na = g_Na*m*m*m*h*j*(V - E_Na);
+	I_K1 = g_K1*xK1_table.steadyState(V)*(V - E_K);
+	I_CaL = g_CaL*d*f*f2*(V - E_CaL);
+	return I_Na + I_K1 + I_CaL;
+}
+
+/*
+Rate functions
+--------------
+Steady states and time constants (ms) of the gates as a function of the
+membrane potential V (mV), after ten Tusscher and Panfilov (2006). Only used to
+build the tables; the second argument is unused except for xK1_inf.
+*/
+inline double IonicCurrents::m_inf(double V, double)
+{
+	double s = 1/(1 + exp((-56.86 - V)/9.03));
+	return s*s;
+}
+
+inline double IonicCurrents::tau_m(double V, double)
+{
+	double alpha = 1/(1 + exp((-60 - V)/5));
+	double beta = 0.1/(1 + exp((V + 35)/5)) + 0.1/(1 + exp((V - 50)/200));
+	return alpha*beta;
+}
+
+inline double IonicCurrents::h_inf(double V, double)
+{
+	double s = 1/(1 + exp((V + 71.55)/7.43));
+	return s*s;
+}
+
+inline double IonicCurrents::tau_h(double V, double)
+{
+	double alpha, beta;
+	if (V >= -40)
+	{
+		alpha = 0;
+		beta = 0.77/(0.13*(1 + exp(-(V + 10.66)/11.1)));
+	}
+	else
+	{
+		alpha = 0.057*exp(-(V + 80)/6.8);
+		beta = 2.7*exp(0.079*V) + 3.1e5*exp(0.3485*V);
+	}
+	return 1/(alpha + beta);
+}
+
+inline double IonicCurrents::tau_j(double V, double)
+{
+	double alpha, beta;
+	if (V >= -40)
+	{
+		alpha = 0;
+		beta = 0.6*exp(0.057*V)/(1 + exp(-0.1*(V + 32)));
+	}
+	else
+	{
+		alpha = (-2.5428e4*exp(0.2444*V) - 6.948e-6*exp(-0.04391*V))*(V + 37.78)/(1 + exp(0.311*(V + 79.23)));
+		beta = 0.02424*exp(-0.01052*V)/(1 + exp(-0.1378*(V + 40.14)));
+	}
+	return 1/(alpha + beta);
+}
+
+inline double IonicCurrents::xK1_inf(double V, double E_K)
+{
+	double alpha = 0.1/(1 + exp(0.06*(V - E_K - 200)));
+	double beta = (3*exp(0.0002*(V - E_K + 100)) + exp(0.1*(V - E_K - 10)))/(1 + exp(-0.5*(V - E_K)));
+	return alpha/(alpha + beta);
+}
+
+inline double IonicCurrents::d_inf(double V, double)
+{
+	return 1/(1 + exp((-8 - V)/7.5));
+}
+
+inline double IonicCurrents::tau_d(double V, double)
+{
+	double alpha = 1.4/(1 + exp((-35 - V)/13)) + 0.25;
+	double beta = 1.4/(1 + exp((V + 5)/5));
+	double gamma = 1/(1 + exp((50 - V)/20));
+	return alpha*beta + gamma;
+}
+
+inline double IonicCurrents::f_inf(double V, double)
+{
+	return 1/(1 + exp((V + 20)/7));
+}
+
+inline double IonicCurrents::tau_f(double V, double)
+{
+	return 1102.5*exp(-(V + 27)*(V + 27)/225) + 200/(1 + exp((13 - V)/10)) + 180/(1 + exp((V + 30)/10)) + 20;
+}
+
+inline double IonicCurrents::f2_inf(double V, double)
+{
+	return 0.67/(1 + exp((V + 35)/7)) + 0.33;
+}
+
+inline double IonicCurrents::tau_f2(double V, double)
+{
+	return 562*exp(-(V + 27)*(V + 27)/240) + 31/(1 + exp((25 - V)/10)) + 80/(1 + exp((V + 30)/10));
+}
+
+#endif
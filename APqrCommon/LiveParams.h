@@ -0,0 +1,133 @@
+/*
+ Copyright (C) 2022 Leiden University Medical Center
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#ifndef APQR_LIVE_PARAMS_H
+#define APQR_LIVE_PARAMS_H
+
+#include <atomic>
+
+/*
+ **************
+ * LiveParams *
+ **************
+
+Hand-over of a block of live-tunable parameters (gains, thresholds) from the
+GUI thread to the real-time thread, without locks and without torn reads. The
+GUI thread fills a complete block and publishes it; the real-time thread picks
+up the newest published block at the start of a time-step and applies it as a
+whole.
+
+The blocks live in three fixed slots (a triple buffer): one that the GUI thread
+writes, one that the real-time thread reads, and one in the middle that holds
+the newest published block. Publishing and picking up each swap their own slot
+with the middle one in a single atomic exchange, so a block is never written
+while the other thread can read it, and neither thread ever waits. A block that
+was published but not yet picked up is replaced by the next one, which is what
+a user pressing Modify twice means.
+
+One thread may publish and one other thread may pick up; P is copied as a whole,
+so it should be a plain struct of numbers.
+*/
+template<typename P>
+class LiveParams
+{
+	public:
+		LiveParams(void);
+
+		void publish(const P& block);
+		bool pending(void) const;
+		const P& acquire(void);
+
+	private:
+		enum {INDEX = 3, FRESH = 4};
+
+		P slot[3];
+		std::atomic<int> middle;	// slot in the middle, plus FRESH when it holds an unread block
+		int back;					// slot of the GUI thread
+		int front;					// slot of the real-time thread
+};
+
+/*
+LiveParams
+----------
+Constructs the exchange without a published block.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+template<typename P>
+inline LiveParams<P>::LiveParams(void) : slot(), middle(1), back(0), front(2)
+{
+}
+
+/*
+publish
+-------
+Publishes a complete parameter block. Only called from the GUI thread.
+
+IN:
+	*) block	the new values of the live-tunable parameters
+OUT:
+	*) None
+*/
+template<typename P>
+inline void LiveParams<P>::publish(const P& block)
+{
+	slot[back] = block;
+	back = middle.exchange(back | FRESH, std::memory_order_acq_rel) & INDEX;
+}
+
+/*
+pending
+-------
+Whether a block was published since the last acquire(). Only called from the
+real-time thread; costs one atomic load.
+
+IN:
+	*) None
+OUT:
+	*) pending	true when acquire() returns a new block
+*/
+template<typename P>
+inline bool LiveParams<P>::pending(void) const
+{
+	return (middle.load(std::memory_order_acquire) & FRESH) != 0;
+}
+
+/*
+acquire
+-------
+Newest published block. Only called from the real-time thread; the block stays
+valid and unchanged until the next call.
+
+IN:
+	*) None
+OUT:
+	*) block	the newest live-tunable parameters
+*/
+template<typename P>
+inline const P& LiveParams<P>::acquire(void)
+{
+	if (middle.load(std::memory_order_acquire) & FRESH)
+		{front = middle.exchange(front, std::memory_order_acq_rel) & INDEX;}
+	return slot[front];
+}
+
+#endif
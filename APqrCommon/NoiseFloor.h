@@ -0,0 +1,174 @@
+/*
+ Copyright (C) 2022 Leiden University Medical Center
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#ifndef APQR_NOISE_FLOOR_H
+#define APQR_NOISE_FLOOR_H
+
+#include <math.h>
+
+/*
+ **************
+ * NoiseFloor *
+ **************
+
+Online estimate of the standard deviation of the recording noise on Vm, for
+thresholds such as noise_tresh, PID_tresh and min_PID. The modules feed it the
+samples between the beats, while no correction is applied.
+
+The slow changes of the membrane potential are removed with a first difference,
+which leaves 2 times the noise variance. The median absolute residual is
+tracked by a streaming quantile estimate: every sample moves it up or down by a
+fixed factor, depending on which side of it the residual lies. Outliers such as
+the foot of an upstroke or a stimulus artefact therefore only push it by one
+step each, as in a median absolute deviation (MAD), and an update costs a
+comparison and a multiplication. For Gaussian noise with standard deviation s
+the median absolute residual is 0.6745*sqrt(2)*s.
+
+With a step of 1%, the estimate follows a ten-fold change of the noise in about
+250 samples. It is valid after MIN_SAMPLES residuals.
+*/
+class NoiseFloor
+{
+	public:
+		enum {MIN_SAMPLES = 500};
+
+		NoiseFloor(void);
+
+		void reset(void);
+		void update(double v);
+		void skip(void);
+		bool valid(void) const;
+		double sigma(void) const;
+
+	private:
+		double v_prev;		// previous sample (mV)
+		bool has_prev;		// whether v_prev belongs to the same stretch of samples
+		double m;			// median absolute residual (mV)
+		long long n;		// number of residuals
+};
+
+/*
+NoiseFloor
+----------
+Constructs an estimator without samples.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+inline NoiseFloor::NoiseFloor(void)
+{
+	reset();
+}
+
+/*
+reset
+-----
+Forgets the estimate.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+inline void NoiseFloor::reset(void)
+{
+	v_prev = 0;
+	has_prev = false;
+	m = 0;
+	n = 0;
+}
+
+/*
+update
+------
+Adds a sample of Vm that contains no correction.
+
+IN:
+	*) v		membrane potential (mV)
+OUT:
+	*) None
+*/
+inline void NoiseFloor::update(double v)
+{
+	static const double STEP = 1.01;
+	static const double FLOOR = 1e-4;	// mV, keeps the multiplicative steps going
+	if (has_prev)
+	{
+		double r = fabs(v - v_prev);
+		if (n == 0)
+			{m = (r > FLOOR ? r : FLOOR);}
+		else
+		{
+			m = (r > m ? m*STEP : m/STEP);
+			if (m < FLOOR){m = FLOOR;}
+		}
+		n++;
+	}
+	v_prev = v;
+	has_prev = true;
+}
+
+/*
+skip
+----
+Marks a sample that is not fed to the estimator, such that the next residual
+is not taken across the gap.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+inline void NoiseFloor::skip(void)
+{
+	has_prev = false;
+}
+
+/*
+valid
+-----
+Whether enough samples were seen for the estimate to be used.
+
+IN:
+	*) None
+OUT:
+	*) valid	true after MIN_SAMPLES residuals
+*/
+inline bool NoiseFloor::valid(void) const
+{
+	return n >= MIN_SAMPLES;
+}
+
+/*
+sigma
+-----
+Estimated standard deviation of the noise.
+
+IN:
+	*) None
+OUT:
+	*) s		(mV), 0 before the first residual
+*/
+inline double NoiseFloor::sigma(void) const
+{
+	return m/(0.6745*sqrt(2.0));
+}
+
+#endif
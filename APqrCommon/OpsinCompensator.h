@@ -0,0 +1,206 @@
+/*
+ Copyright (C) 2022 Leiden University Medical Center
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#ifndef APQR_OPSIN_COMPENSATOR_H
+#define APQR_OPSIN_COMPENSATOR_H
+
+#include <math.h>
+
+/*
+ ********************
+ * OpsinCompensator *
+ ********************
+
+Light-gated channels and pumps do not follow the LED driver voltage
+instantaneously: they open with an activation time constant tau_on and close
+with a deactivation time constant tau_off of a few milliseconds. This class
+keeps a discrete-time model of that lag for one LED channel and applies its
+inverse to the requested driver voltage, so the light-gated current reaches the
+requested level with a much smaller delay.
+
+The actuator is modelled as one (order 1) or two cascaded (order 2) first-order
+stages. Every stage uses tau_on when its input is above its state and tau_off
+otherwise. The inverse command is clipped to [0, v_max] and the model is then
+advanced with the clipped command, so the model never believes the LED gave
+more light than it could (saturation-aware clipping). Order 0 switches the
+compensation off and only applies the clipping.
+
+The per-tick cost is a few multiply-adds per stage and no memory is allocated.
+*/
+class OpsinCompensator
+{
+	public:
+		OpsinCompensator(void);
+
+		void configure(int order, double tau_on, double tau_off, double period, double v_max);
+		void reset(void);
+		double compensate(double target);
+
+	private:
+		double factor(double tau, double period);
+		double invert(double target, double state);
+		double advance(double input, double state);
+
+		int order;			// 0 (off), 1 or 2 first-order stages
+		double a_on;		// exp(-period/tau_on)
+		double a_off;		// exp(-period/tau_off)
+		double v_max;		// maximal LED driver voltage (V)
+		double stage[2];	// modelled output of each stage (V)
+};
+
+/*
+OpsinCompensator
+----------------
+Constructs a compensator that is switched off and clips to 5V.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+inline OpsinCompensator::OpsinCompensator(void)
+{
+	order = 0;
+	a_on = 0;
+	a_off = 0;
+	v_max = 5;
+	reset();
+}
+
+/*
+factor
+------
+Discrete-time pole of a first-order stage with time constant tau, sampled with
+the given period. A non-positive time constant means an instantaneous stage.
+
+IN:
+	*) tau		time constant of the stage (ms)
+	*) period	the length of a single time-step (ms)
+OUT:
+	*) factor	exp(-period/tau), or 0 for an instantaneous stage
+*/
+inline double OpsinCompensator::factor(double tau, double period)
+{
+	if (tau <= 0 || period <= 0){return 0;}
+	return exp(-period/tau);
+}
+
+/*
+configure
+---------
+Sets the kinetics of the modelled actuator. Should be called whenever the
+parameters or the real-time period change.
+
+IN:
+	*) order	number of first-order stages (0, 1 or 2)
+	*) tau_on	activation time constant (ms)
+	*) tau_off	deactivation time constant (ms)
+	*) period	the length of a single time-step (ms)
+	*) v_max	maximal LED driver voltage (V)
+OUT:
+	*) None
+*/
+inline void OpsinCompensator::configure(int order, double tau_on, double tau_off, double period, double v_max)
+{
+	this->order = (order < 0 ? 0 : (order > 2 ? 2 : order));
+	this->a_on = factor(tau_on, period);
+	this->a_off = factor(tau_off, period);
+	this->v_max = v_max;
+}
+
+/*
+reset
+-----
+Puts the modelled actuator back at rest (no light-gated current).
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+inline void OpsinCompensator::reset(void)
+{
+	stage[0] = 0;
+	stage[1] = 0;
+}
+
+/*
+invert
+------
+Input that brings a first-order stage from its current state to the target
+within a single time-step.
+
+IN:
+	*) target	requested output of the stage
+	*) state	current output of the stage
+OUT:
+	*) input	input that has to be applied to the stage
+*/
+inline double OpsinCompensator::invert(double target, double state)
+{
+	double a = (target > state ? a_on : a_off);
+	return (target - a*state)/(1 - a);
+}
+
+/*
+advance
+-------
+Advances a first-order stage by one time-step.
+
+IN:
+	*) input	input that is applied to the stage
+	*) state	current output of the stage
+OUT:
+	*) state	output of the stage after one time-step
+*/
+inline double OpsinCompensator::advance(double input, double state)
+{
+	double a = (input > state ? a_on : a_off);
+	return a*state + (1 - a)*input;
+}
+
+/*
+compensate
+----------
+Computes the LED driver voltage that makes the modelled light-gated current
+follow the requested driver voltage, and advances the model with it. Has to be
+called on every time-step, also when the requested voltage is 0, since the
+model needs to follow the deactivation of the channel.
+
+IN:
+	*) target	requested (uncompensated) LED driver voltage (V)
+OUT:
+	*) command	compensated LED driver voltage, clipped to [0, v_max] (V)
+*/
+inline double OpsinCompensator::compensate(double target)
+{
+	double command = target;
+
+	if (order == 2){command = invert(invert(command, stage[1]), stage[0]);}
+	else if (order == 1){command = invert(command, stage[0]);}
+
+	if (command > v_max){command = v_max;} // Limit the LED driver output to its maximum value
+	if (command < 0){command = 0;} // The LED can not produce negative light
+
+	stage[0] = advance(command, stage[0]);
+	stage[1] = advance(stage[0], stage[1]);
+
+	return command;
+}
+
+#endif
@@ -0,0 +1,388 @@
+/*
+ Copyright (C) 2022 Leiden University Medical Center
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#ifndef APQR_OPSIN_MODELS_H
+#define APQR_OPSIN_MODELS_H
+
+#include <math.h>
+
+/*
+ ***************
+ * OpsinModels *
+ ***************
+
+Photocurrent models of light-gated channels and pumps, to drive simulated cells
+from the LED outputs of APqr8, APqrPID3 and APqrPIDLTLP4 when testing them
+offline. Nothing in this file is used from execute().
+
+The kinetics follow the three- and four-state models of Nikolic et al. (2009)
+as parameterised in PyRhO (Evans et al. 2016):
+
+three-state (C, O, D):
+	dO/dt = Ga*C - Gd*O
+	dD/dt = Gd*O - Gr*D,						C = 1 - O - D
+four-state (C1, O1, O2, C2):
+	dO1/dt = Ga1*C1 + Gb*O2 - (Gd1 + Gf)*O1
+	dO2/dt = Ga2*C2 + Gf*O1 - (Gd2 + Gb)*O2
+	dC2/dt = Gd2*O2 - (Ga2 + Gr0)*C2,			C1 = 1 - O1 - O2 - C2
+
+with the light-dependent rates (phi the irradiance in mW/mm^2)
+	Ga = k_a*h(phi, p), Gr = k_r*h(phi, q) + Gr0,
+	Ga1 = k_a*h(phi, p), Ga2 = k2*h(phi, p), Gf = kf*h(phi, q) + Gf0, Gb = kb*h(phi, q) + Gb0
+	h(phi, x) = phi^x/(phi^x + phi_m^x)
+
+The current through the open states O = O1 + gamma*O2 is (outward positive)
+	channel:	I = g*O*v1*(1 - exp(-(V - E)/v0))	(inward rectification, ohmic when v0 <= 0)
+	pump:		I = g*O								(g is the maximal pump current in pA)
+
+The parameter sets below are starting points only. ChR2 uses the PyRhO
+defaults (with phi_m converted from photons at 470 nm); the others keep the
+structure of ChR2 with reversal potentials, off-kinetics and sensitivities
+scaled to published values, and should be fitted to own recordings before
+closed-loop results are trusted.
+*/
+
+/*
+OpsinParams
+-----------
+Parameters of one opsin model (rates in 1/ms, potentials in mV, irradiance in
+mW/mm^2, conductance in nS).
+*/
+struct OpsinParams
+{
+	int states;		// 3 or 4
+	bool pump;		// true: voltage-independent pump current, false: channel
+	double g;		// maximal conductance (nS), or maximal pump current (pA)
+	double E;		// reversal potential
+	double v0, v1;	// rectification
+	double gamma;	// relative conductance of O2 (four-state only)
+	double phi_m;	// irradiance of half-maximal activation
+	double p, q;	// Hill coefficients of activation and of the other light-dependent rates
+	double k_a;		// activation (Ga or Ga1)
+	double k2;		// activation from C2 (four-state only)
+	double k_r;		// light-dependent recovery (three-state only)
+	double kf, kb;	// light-dependent O1 <-> O2 transitions (four-state only)
+	double Gf0, Gb0;// dark O1 <-> O2 transitions (four-state only)
+	double Gd1, Gd2;// closing of O (or O1) and O2
+	double Gr0;		// dark recovery
+};
+
+/*
+OpsinPresets
+------------
+Parameter sets of commonly used opsins.
+*/
+inline OpsinParams ChR2_3state(void)
+{
+	OpsinParams o = {3, false, 157, 0, 43, 17.1, 0, 212, 0.8, 0.25, 5, 0, 0.1, 0, 0, 0, 0, 0.104, 0, 0.0002};
+	return o;
+}
+
+inline OpsinParams ChR2_4state(void)
+{
+	OpsinParams o = {4, false, 114, 0, 43, 17.1, 0.05, 4.2, 0.7, 0.47, 0.05, 0.015, 0, 0.03, 0.0115, 0.01, 0.006, 0.11, 0.025, 0.0004};
+	return o;
+}
+
+inline OpsinParams CheRiff(void)
+{
+	// ChR2-like kinetics with ~10x higher light sensitivity and slower closing (tau_off ~ 16 ms)
+	OpsinParams o = {3, false, 157, 0, 43, 17.1, 0, 21, 0.8, 0.25, 5, 0, 0.1, 0, 0, 0, 0, 0.0625, 0, 0.0002};
+	return o;
+}
+
+inline OpsinParams Jaws(void)
+{
+	// red-shifted chloride pump (outward current regardless of Vm), tau_off ~ 5 ms
+	OpsinParams o = {3, true, 200, 0, 0, 0, 0, 2, 1, 0.5, 2, 0, 0.5, 0, 0, 0, 0, 0.2, 0, 0.001};
+	return o;
+}
+
+inline OpsinParams GtACR1(void)
+{
+	// light-gated chloride channel (ohmic, E = E_Cl), very sensitive, tau_off ~ 60 ms
+	OpsinParams o = {3, false, 100, -70, 0, 1, 0, 0.1, 1, 0.5, 2, 0, 0.05, 0, 0, 0, 0, 0.016, 0, 0.001};
+	return o;
+}
+
+/*
+ *****************
+ * LEDIrradiance *
+ *****************
+
+Irradiance produced by an LED driver voltage: none below V_on, linear with
+slope 'slope' just above it and saturating towards E_max:
+
+	phi = E_max*(1 - exp(-slope*(V - V_on)/E_max))
+*/
+class LEDIrradiance
+{
+	public:
+		LEDIrradiance(void);
+
+		void configure(double V_on, double slope, double E_max);
+		double irradiance(double V) const;
+
+	private:
+		double V_on;	// turn-on voltage of the driver (V)
+		double slope;	// irradiance per Volt just above V_on (mW/mm^2/V)
+		double E_max;	// saturating irradiance (mW/mm^2)
+};
+
+/*
+LEDIrradiance
+-------------
+Constructs a driver that turns on at 0.1 V and saturates at 20 mW/mm^2.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+inline LEDIrradiance::LEDIrradiance(void)
+{
+	configure(0.1, 5, 20);
+}
+
+/*
+configure
+---------
+Sets the irradiance curve.
+
+IN:
+	*) V_on		turn-on voltage of the driver (V)
+	*) slope	irradiance per Volt just above V_on (mW/mm^2/V)
+	*) E_max	saturating irradiance (mW/mm^2)
+OUT:
+	*) None
+*/
+inline void LEDIrradiance::configure(double V_on, double slope, double E_max)
+{
+	this->V_on = V_on;
+	this->slope = slope;
+	this->E_max = (E_max > 0 ? E_max : 1);
+}
+
+/*
+irradiance
+----------
+Irradiance at the cell for a driver voltage.
+
+IN:
+	*) V		LED driver voltage (V)
+OUT:
+	*) phi		irradiance (mW/mm^2)
+*/
+inline double LEDIrradiance::irradiance(double V) const
+{
+	if (V <= V_on){return 0;}
+	return E_max*(1 - exp(-slope*(V - V_on)/E_max));
+}
+
+/*
+ **************
+ * OpsinBatch *
+ **************
+
+N independent copies (lanes) of one opsin model, e.g. for a batch of simulated
+cells or for a parameter sweep. The states are stored as structure-of-arrays
+and every integration step is a loop over the lanes with the same arithmetic,
+which the compiler turns into SIMD code. The light-dependent rates (which need
+pow()) are only recomputed in setLight(), once per LED update, and the forward
+Euler integration takes as many sub-steps as needed to keep every rate*h below
+0.05.
+*/
+template <int N>
+class OpsinBatch
+{
+	public:
+		OpsinBatch(void);
+
+		void configure(const OpsinParams &params, double period);
+		void reset(void);
+		void setLight(int lane, double phi);
+		void step(const double V[N], double I[N]);
+
+		double O1[N];	// open state (O in the three-state model)
+		double O2[N];	// second open state (four-state only)
+		double C2[N];	// desensitized state (D in the three-state model)
+
+	private:
+		double light(double phi, double x) const;
+
+		OpsinParams par;
+		double period;	// the length of a single time-step (ms)
+		int substeps;	// Euler sub-steps per time-step
+		double h;		// sub-step (ms)
+		// light-dependent rates of every lane (1/ms)
+		double Ga1[N], Ga2[N], Gr[N], Gf[N], Gb[N];
+};
+
+/*
+OpsinBatch
+----------
+Constructs a batch of three-state ChR2 models for a time-step of 0.1 ms.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+template <int N>
+inline OpsinBatch<N>::OpsinBatch(void)
+{
+	configure(ChR2_3state(), 0.1);
+}
+
+/*
+configure
+---------
+Sets the model of all lanes and the time-step, and resets the lanes to the dark
+state.
+
+IN:
+	*) params	opsin model
+	*) period	the length of a single time-step (ms)
+OUT:
+	*) None
+*/
+template <int N>
+inline void OpsinBatch<N>::configure(const OpsinParams &params, double period)
+{
+	par = params;
+	this->period = period;
+
+	// Fastest possible transition rate at saturating light
+	double r_max = par.k_a + par.k2 + par.k_r + par.kf + par.kb + par.Gf0 + par.Gb0 + par.Gd1 + par.Gd2 + par.Gr0;
+	substeps = (int)ceil(r_max*period/0.05);
+	if (substeps < 1){substeps = 1;}
+	h = period/substeps;
+	reset();
+}
+
+/*
+reset
+-----
+Puts all lanes in the dark-adapted state (everything in C or C1).
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+template <int N>
+inline void OpsinBatch<N>::reset(void)
+{
+	for (int n = 0; n < N; n++){
+		O1[n] = 0;
+		O2[n] = 0;
+		C2[n] = 0;
+		setLight(n, 0);
+	}
+}
+
+/*
+light
+-----
+Hill function of the irradiance, h(phi, x) in the description above.
+
+IN:
+	*) phi		irradiance (mW/mm^2)
+	*) x		Hill coefficient
+OUT:
+	*) h		between 0 and 1
+*/
+template <int N>
+inline double OpsinBatch<N>::light(double phi, double x) const
+{
+	if (phi <= 0){return 0;}
+	double a = pow(phi, x);
+	return a/(a + pow(par.phi_m, x));
+}
+
+/*
+setLight
+--------
+Sets the irradiance of one lane until the next call.
+
+IN:
+	*) lane		index of the lane
+	*) phi		irradiance (mW/mm^2), see LEDIrradiance
+OUT:
+	*) None
+*/
+template <int N>
+inline void OpsinBatch<N>::setLight(int lane, double phi)
+{
+	double hp = light(phi, par.p);
+	double hq = light(phi, par.q);
+
+	Ga1[lane] = par.k_a*hp;
+	Ga2[lane] = par.k2*hp;
+	Gr[lane] = par.k_r*hq + par.Gr0;
+	Gf[lane] = par.kf*hq + par.Gf0;
+	Gb[lane] = par.kb*hq + par.Gb0;
+}
+
+/*
+step
+----
+Advances all lanes by one time-step and computes their photocurrents.
+
+IN:
+	*) V[]		membrane potential of every lane (mV)
+OUT:
+	*) I[]		photocurrent of every lane (pA, outward positive)
+*/
+template <int N>
+inline void OpsinBatch<N>::step(const double V[N], double I[N])
+{
+	for (int s = 0; s < substeps; s++){
+		if (par.states == 4)
+		{
+			for (int n = 0; n < N; n++){
+				double C1 = 1 - O1[n] - O2[n] - C2[n];
+				double dO1 = Ga1[n]*C1 + Gb[n]*O2[n] - (par.Gd1 + Gf[n])*O1[n];
+				double dO2 = Ga2[n]*C2[n] + Gf[n]*O1[n] - (par.Gd2 + Gb[n])*O2[n];
+				double dC2 = par.Gd2*O2[n] - (Ga2[n] + par.Gr0)*C2[n];
+				O1[n] += h*dO1;
+				O2[n] += h*dO2;
+				C2[n] += h*dC2;
+			}
+		}
+		else
+		{
+			for (int n = 0; n < N; n++){
+				double C = 1 - O1[n] - C2[n];
+				double dO = Ga1[n]*C - par.Gd1*O1[n];
+				double dD = par.Gd1*O1[n] - Gr[n]*C2[n];
+				O1[n] += h*dO;
+				C2[n] += h*dD;
+			}
+		}
+	}
+
+	for (int n = 0; n < N; n++){
+		double O = O1[n] + par.gamma*O2[n];
+		if (par.pump){I[n] = par.g*O;}
+		else if (par.v0 > 0){I[n] = par.g*O*par.v1*(1 - exp(-(V[n] - par.E)/par.v0));}
+		else {I[n] = par.g*O*(V[n] - par.E);}
+	}
+}
+
+#endif
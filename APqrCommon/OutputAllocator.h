@@ -0,0 +1,265 @@
+/*
+ Copyright (C) 2022 Leiden University Medical Center
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#ifndef APQR_OUTPUT_ALLOCATOR_H
+#define APQR_OUTPUT_ALLOCATOR_H
+
+/*
+ *******************
+ * OutputAllocator *
+ *******************
+
+Maps the corrective action requested by the controller (the PID output) onto
+up to MAX_ACTUATORS actuators, e.g. LED channels of different wavelengths or
+an injected current. Every actuator i has
+	*) gain		PID units produced per Volt of output; negative for depolarizing
+				actuators (blue light), positive for repolarizing ones (red light)
+	*) v_max	saturation of the output (V); the lower bound is always 0
+	*) cost		relative cost of using the actuator (e.g. phototoxicity)
+	*) Vrev		optional reversal potential: a depolarizing actuator only acts
+				while Vm < Vrev, a repolarizing one only while Vm > Vrev. With a
+				positive scale the efficacy also drops linearly to 0 over the
+				last 'scale' mV before Vrev.
+
+allocate() solves
+
+	minimize sum cost_i*v_i^2	subject to	sum gain_i*eff_i(Vm)*v_i = PID,	0 <= v_i <= v_max_i
+
+Only the actuators that push in the requested direction take part. Their
+unconstrained solution is v_i = lambda*gain_i*eff_i/cost_i; actuators that
+exceed v_max are fixed at saturation and the remainder is redistributed over
+the others. Since the solution is monotone in lambda, an actuator that
+saturates never has to be released again, so at most MAX_ACTUATORS passes over
+at most MAX_ACTUATORS actuators are needed. When the request cannot be met,
+all usable actuators end up at saturation.
+
+allocate() tells these cases apart, since only the last one means that the
+output range is too small:
+	*) MET			the request is met (also when it is 0)
+	*) IDLE			no actuator can push in the requested direction, e.g. blue
+					light above its reversal potential; all outputs are 0
+	*) SATURATED	the request exceeds what the usable actuators give at v_max
+
+With one depolarizing (gain -Rm_blue, Vrev blue_Vrev) and one repolarizing
+(gain Rm_red) actuator this reduces to the original two-channel rule:
+VLED_blue = -PID/Rm_blue when PID < 0 and Vm < blue_Vrev, VLED_red = PID/Rm_red
+when PID > 0, both limited to 5V.
+*/
+class OutputAllocator
+{
+	public:
+		enum {MAX_ACTUATORS = 8};
+		enum {MET = 0, IDLE = 1, SATURATED = 2};
+
+		OutputAllocator(void);
+
+		void setCount(int n);
+		void setActuator(int i, double gain, double v_max, double cost);
+		void setReversal(int i, double Vrev, double scale);
+		void clearReversal(int i);
+		double efficacy(int i, double Vm) const;
+		int allocate(double demand, double Vm, double v[]) const;
+
+	private:
+		int n;						// number of actuators in use
+		double gain[MAX_ACTUATORS];	// PID units per Volt
+		double v_max[MAX_ACTUATORS];// saturation (V)
+		double cost[MAX_ACTUATORS];	// relative cost of using the actuator
+		double Vrev[MAX_ACTUATORS];	// reversal potential (mV)
+		double scale[MAX_ACTUATORS];// width of the efficacy ramp before Vrev (mV)
+		bool gated[MAX_ACTUATORS];	// whether the actuator has a reversal potential
+};
+
+/*
+OutputAllocator
+---------------
+Constructs an allocator without actuators.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+inline OutputAllocator::OutputAllocator(void)
+{
+	for (int i = 0; i < MAX_ACTUATORS; i++){
+		setActuator(i, 0, 0, 1);
+		clearReversal(i);
+	}
+	n = 0;
+}
+
+/*
+setCount
+--------
+Sets the number of actuators in use (clipped to [0, MAX_ACTUATORS]).
+
+IN:
+	*) n		number of actuators
+OUT:
+	*) None
+*/
+inline void OutputAllocator::setCount(int n)
+{
+	if (n < 0){n = 0;}
+	if (n > MAX_ACTUATORS){n = MAX_ACTUATORS;}
+	this->n = n;
+}
+
+/*
+setActuator
+-----------
+Sets the gain, saturation and cost of one actuator. A cost that is not
+positive is replaced by 1.
+
+IN:
+	*) i		index of the actuator
+	*) gain		PID units per Volt (negative = depolarizing)
+	*) v_max	saturation of the output (V)
+	*) cost		relative cost of using the actuator
+OUT:
+	*) None
+*/
+inline void OutputAllocator::setActuator(int i, double gain, double v_max, double cost)
+{
+	if (i < 0 || i >= MAX_ACTUATORS){return;}
+	this->gain[i] = gain;
+	this->v_max[i] = (v_max < 0 ? 0 : v_max);
+	this->cost[i] = (cost > 0 ? cost : 1);
+}
+
+/*
+setReversal
+-----------
+Makes the efficacy of an actuator depend on the membrane potential.
+
+IN:
+	*) i		index of the actuator
+	*) Vrev		reversal potential of the actuated current (mV)
+	*) scale	width of the linear efficacy ramp before Vrev (mV), 0 for on/off
+OUT:
+	*) None
+*/
+inline void OutputAllocator::setReversal(int i, double Vrev, double scale)
+{
+	if (i < 0 || i >= MAX_ACTUATORS){return;}
+	this->Vrev[i] = Vrev;
+	this->scale[i] = (scale < 0 ? 0 : scale);
+	gated[i] = true;
+}
+
+/*
+clearReversal
+-------------
+Makes the efficacy of an actuator independent of the membrane potential.
+
+IN:
+	*) i		index of the actuator
+OUT:
+	*) None
+*/
+inline void OutputAllocator::clearReversal(int i)
+{
+	if (i < 0 || i >= MAX_ACTUATORS){return;}
+	Vrev[i] = 0;
+	scale[i] = 0;
+	gated[i] = false;
+}
+
+/*
+efficacy
+--------
+Fraction of the nominal gain of an actuator that is available at the given
+membrane potential.
+
+IN:
+	*) i		index of the actuator
+	*) Vm		membrane potential (mV)
+OUT:
+	*) eff		efficacy between 0 and 1
+*/
+inline double OutputAllocator::efficacy(int i, double Vm) const
+{
+	if (!gated[i]){return 1;}
+	// Distance to the reversal potential in the direction in which the actuator pushes
+	double drive = (gain[i] < 0 ? Vrev[i] - Vm : Vm - Vrev[i]);
+	if (drive <= 0){return 0;}
+	if (scale[i] <= 0 || drive >= scale[i]){return 1;}
+	return drive/scale[i];
+}
+
+/*
+allocate
+--------
+Distributes the requested corrective action over the actuators at the lowest
+total cost.
+
+IN:
+	*) demand	requested action (PID units, negative = depolarize)
+	*) Vm		membrane potential (mV)
+	*) v[]		array of at least the number of actuators in use
+OUT:
+	*) v[]		output of every actuator (V)
+	*) status	MET, IDLE or SATURATED (see above)
+*/
+inline int OutputAllocator::allocate(double demand, double Vm, double v[]) const
+{
+	double b[MAX_ACTUATORS];	// effective gain of every actuator
+	bool free[MAX_ACTUATORS];	// actuators that take part and are not saturated
+	double remaining = demand;
+	bool any = false;
+
+	for (int i = 0; i < n; i++){
+		v[i] = 0;
+		b[i] = gain[i]*efficacy(i, Vm);
+		free[i] = (b[i]*demand > 0 && v_max[i] > 0);
+		any = any || free[i];
+	}
+	if (demand == 0){return MET;}
+	if (!any){return IDLE;}
+
+	for (int pass = 0; pass < n; pass++){
+		double S = 0;
+		for (int i = 0; i < n; i++){
+			if (free[i]){S += b[i]*b[i]/cost[i];}
+		}
+		if (S == 0){return SATURATED;} // every usable actuator is saturated
+
+		double lambda = remaining/S;
+		bool saturated = false;
+		for (int i = 0; i < n; i++){
+			if (free[i] && lambda*b[i]/cost[i] > v_max[i])
+			{
+				v[i] = v_max[i];
+				remaining -= b[i]*v_max[i];
+				free[i] = false;
+				saturated = true;
+			}
+		}
+		if (!saturated)
+		{
+			for (int i = 0; i < n; i++){
+				if (free[i]){v[i] = lambda*b[i]/cost[i];}
+			}
+			return MET;
+		}
+	}
+	return SATURATED;
+}
+
+#endif
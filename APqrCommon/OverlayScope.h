@@ -0,0 +1,276 @@
+/*
+ Copyright (C) 2022 Leiden University Medical Center
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#ifndef APQR_OVERLAY_SCOPE_H
+#define APQR_OVERLAY_SCOPE_H
+
+#include <atomic>
+#include <math.h>
+
+/*
+ ****************
+ * OverlayScope *
+ ****************
+
+Decimated traces of the current and the previous beat, written by the
+real-time thread and drawn by the GUI thread, such that the GUI draws the same
+number of points whatever the sample rate. Every channel of a beat is reduced
+to BINS bins of a fixed number of samples, of which the minimum and maximum are
+kept: an upstroke or a stimulus artefact that falls within a bin still shows as
+a vertical line, which plain down-sampling would miss. A sample costs a
+comparison per channel and bound, and a completed bin a copy into the beat.
+
+The beats are kept in a ring of FRAMES frames. Bins are only written into a
+frame once complete, after which its fill count is advanced, so the GUI thread
+can copy the completed bins of the current beat while the real-time thread is
+still working on the next one. A frame that is reused for a new beat while the
+GUI thread copies it is detected with its beat number, as in Seqlock.h, and the
+copy is dropped.
+
+Samples that are not finite (e.g. the reference between the beats) are left
+out; a bin without finite samples holds NAN for that channel.
+
+One thread may write and one other thread may read.
+*/
+class OverlayScope
+{
+	public:
+		enum {CHANNELS = 4, BINS = 256, FRAMES = 3};
+		enum {REFERENCE = 0, VM = 1, LED_BLUE = 2, LED_RED = 3};
+		enum {CURRENT = 0, PREVIOUS = 1};
+
+		// A copy of one beat for the GUI thread
+		struct Frame
+		{
+			int bins;					// completed bins
+			float lo[CHANNELS][BINS];	// minimum of every bin
+			float hi[CHANNELS][BINS];	// maximum of every bin
+		};
+
+		OverlayScope(void);
+
+		void configure(int samples, double period);
+		void reset(void);
+		void begin(void);
+		void sample(double ref, double vm, double blue, double red);
+		bool read(int which, Frame& frame) const;
+		double binWidth(void) const;
+
+	private:
+		struct Slot
+		{
+			std::atomic<unsigned int> beat;		// beat number the slot holds
+			std::atomic<int> filled;			// completed bins of that beat
+			float lo[CHANNELS][BINS];
+			float hi[CHANNELS][BINS];
+		};
+
+		int per_bin;				// samples per bin
+		double width;				// length of a bin (ms)
+		std::atomic<unsigned int> beat;	// number of the current beat
+		// real-time thread only
+		int bin;					// bin of the current beat being filled
+		int n;						// samples in that bin
+		float acc_lo[CHANNELS];
+		float acc_hi[CHANNELS];
+		Slot ring[FRAMES];		// the last FRAMES beats
+
+		void flush(void);
+};
+
+/*
+OverlayScope
+------------
+Constructs a scope of 10 samples per bin at a time-step of 0.1 ms.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+inline OverlayScope::OverlayScope(void) : beat(0)
+{
+	configure(BINS*10, 0.1);
+}
+
+/*
+configure
+---------
+Chooses the number of samples per bin such that a beat of the given length
+fills all bins, and forgets all beats. Longer beats are cut off. Not called
+while the real-time thread may call sample() or begin(), see reset().
+
+IN:
+	*) samples	longest expected beat (samples)
+	*) period	the length of a single time-step (ms)
+OUT:
+	*) None
+*/
+inline void OverlayScope::configure(int samples, double period)
+{
+	per_bin = (samples + BINS - 1)/BINS;
+	if (per_bin < 1){per_bin = 1;}
+	width = per_bin*(period > 0 ? period : 0.1);
+	reset();
+}
+
+/*
+reset
+-----
+Forgets all beats; the samples that follow form beat 0. Rewrites the bin being
+filled, so it is called from the real-time thread or while that thread is held.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+inline void OverlayScope::reset(void)
+{
+	for (int f = 0; f < FRAMES; f++){
+		ring[f].beat.store(f == 0 ? 0 : ~0u, std::memory_order_relaxed);
+		ring[f].filled.store(0, std::memory_order_relaxed);
+	}
+	bin = 0;
+	n = 0;
+	for (int c = 0; c < CHANNELS; c++){acc_lo[c] = INFINITY; acc_hi[c] = -INFINITY;}
+	beat.store(0, std::memory_order_release);
+}
+
+/*
+begin
+-----
+Beat boundary: the partly filled last bin completes the current beat, which
+becomes the previous one, and a new beat starts. Only called from the
+real-time thread.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+inline void OverlayScope::begin(void)
+{
+	if (n > 0){flush();}
+	unsigned int b = beat.load(std::memory_order_relaxed) + 1;
+	Slot& s = ring[b % FRAMES];
+	s.beat.store(b, std::memory_order_relaxed);
+	s.filled.store(0, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release); // The new number is visible before any new bin
+	beat.store(b, std::memory_order_release);
+	bin = 0;
+}
+
+/*
+sample
+------
+Adds the samples of one time-step. Only called from the real-time thread; never
+waits.
+
+IN:
+	*) ref		reference AP (mV), NAN when there is none
+	*) vm		measured membrane potential (mV)
+	*) blue		command of the blue LED (V)
+	*) red		command of the red LED (V)
+OUT:
+	*) None
+*/
+inline void OverlayScope::sample(double ref, double vm, double blue, double red)
+{
+	if (bin >= BINS){return;} // Beyond the longest expected beat
+	const double v[CHANNELS] = {ref, vm, blue, red};
+	for (int c = 0; c < CHANNELS; c++){
+		if (v[c] < acc_lo[c]){acc_lo[c] = v[c];}
+		if (v[c] > acc_hi[c]){acc_hi[c] = v[c];}
+	}
+	if (++n == per_bin){flush();}
+}
+
+/*
+flush
+-----
+Writes the bin being filled into the frame of the current beat and publishes
+it.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+inline void OverlayScope::flush(void)
+{
+	Slot& s = ring[beat.load(std::memory_order_relaxed) % FRAMES];
+	for (int c = 0; c < CHANNELS; c++){
+		s.lo[c][bin] = (acc_lo[c] <= acc_hi[c] ? acc_lo[c] : NAN);
+		s.hi[c][bin] = (acc_lo[c] <= acc_hi[c] ? acc_hi[c] : NAN);
+		acc_lo[c] = INFINITY;
+		acc_hi[c] = -INFINITY;
+	}
+	bin++;
+	n = 0;
+	s.filled.store(bin, std::memory_order_release);
+}
+
+/*
+read
+----
+Copies the completed bins of the current or the previous beat. Called from the
+GUI thread.
+
+IN:
+	*) which	CURRENT or PREVIOUS
+OUT:
+	*) frame	the bins of that beat; only valid when read is true
+	*) read		false when there is no such beat yet, or when it was
+				overwritten during the copy
+*/
+inline bool OverlayScope::read(int which, Frame& frame) const
+{
+	unsigned int b = beat.load(std::memory_order_acquire);
+	if (which == PREVIOUS){
+		if (b == 0){return false;}
+		b--;
+	}
+	const Slot& s = ring[b % FRAMES];
+	if (s.beat.load(std::memory_order_acquire) != b){return false;}
+	int bins = s.filled.load(std::memory_order_acquire);
+	for (int c = 0; c < CHANNELS; c++){
+		for (int k = 0; k < bins; k++){frame.lo[c][k] = s.lo[c][k]; frame.hi[c][k] = s.hi[c][k];}
+	}
+	std::atomic_thread_fence(std::memory_order_acquire);
+	if (s.beat.load(std::memory_order_relaxed) != b){return false;}
+	frame.bins = bins;
+	return true;
+}
+
+/*
+binWidth
+--------
+Length of a bin, for the time axis. Called from the GUI thread.
+
+IN:
+	*) None
+OUT:
+	*) width	(ms)
+*/
+inline double OverlayScope::binWidth(void) const
+{
+	return width;
+}
+
+#endif
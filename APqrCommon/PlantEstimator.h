@@ -0,0 +1,221 @@
+/*
+ Copyright (C) 2022 Leiden University Medical Center
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#ifndef APQR_PLANT_ESTIMATOR_H
+#define APQR_PLANT_ESTIMATOR_H
+
+#include <math.h>
+#include "RLSEstimator.h"
+
+/*
+ ******************
+ * PlantEstimator *
+ ******************
+
+Online identification of how the error between the measured and the reference
+membrane potential responds to the actuators (LED channels or injected
+current). The cell is described by a first-order discrete model of the error
+
+	err[k] - err[k-1] = theta[0]*err[k-1] + theta[1]*u1[k-1] + theta[2]*u2[k-1] + theta[3]
+
+where u1 and u2 are the outputs that were applied during the previous
+time-step (use u2 = 0 for a single actuator) and theta[3] absorbs the
+unmodelled drift of the error. From these parameters follow:
+	*) gain(i)	the rate of change of Vm per Volt on actuator i (mV/ms/V)
+	*) tau()	the time constant with which an error relaxes on its own (ms)
+
+Every update has a fixed O(16) cost and does not allocate memory, so it can run
+on every time-step inside execute().
+*/
+class PlantEstimator
+{
+	public:
+		PlantEstimator(void);
+
+		void configure(double lambda, double period);
+		void reset(void);
+		void update(double err_prev, double err, double u1, double u2);
+		double gain(int channel) const;
+		double tau(void) const;
+		double coefficient(int i) const;
+		double disturbance(double err_prev, double err, double u1, double u2) const;
+		bool valid(int channel, long long min_samples) const;
+
+	private:
+		RLSEstimator<4> rls;
+		long long excited[2];	// number of samples with actuator i switched on
+		double period;			// the length of a single time-step (ms)
+};
+
+/*
+PlantEstimator
+--------------
+Constructs an estimator with a forgetting factor of 0.9999.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+inline PlantEstimator::PlantEstimator(void)
+{
+	period = 0.1;
+	rls.setForgetting(0.9999);
+	reset();
+}
+
+/*
+configure
+---------
+Sets the forgetting factor and the real-time period.
+
+IN:
+	*) lambda	forgetting factor of the RLS estimator
+	*) period	the length of a single time-step (ms)
+OUT:
+	*) None
+*/
+inline void PlantEstimator::configure(double lambda, double period)
+{
+	rls.setForgetting(lambda);
+	this->period = period;
+}
+
+/*
+reset
+-----
+Forgets everything that was learned so far.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+inline void PlantEstimator::reset(void)
+{
+	rls.reset(1000);
+	excited[0] = 0;
+	excited[1] = 0;
+}
+
+/*
+update
+------
+Includes one time-step in the estimate.
+
+IN:
+	*) err_prev	error Vm - reference at the previous time-step (mV)
+	*) err		error Vm - reference at the current time-step (mV)
+	*) u1		output of the first actuator during the previous time-step (V)
+	*) u2		output of the second actuator during the previous time-step (V)
+OUT:
+	*) None
+*/
+inline void PlantEstimator::update(double err_prev, double err, double u1, double u2)
+{
+	double phi[4] = {err_prev, u1, u2, 1};
+
+	rls.update(phi, err - err_prev);
+	if (u1 != 0){excited[0]++;}
+	if (u2 != 0){excited[1]++;}
+}
+
+/*
+gain
+----
+Estimated effect of an actuator on the membrane potential.
+
+IN:
+	*) channel	0 for the first, 1 for the second actuator
+OUT:
+	*) gain		rate of change of Vm per Volt of output (mV/ms/V)
+*/
+inline double PlantEstimator::gain(int channel) const
+{
+	if (period <= 0){return 0;}
+	return rls.theta[1 + (channel == 1)]/period;
+}
+
+/*
+tau
+---
+Estimated time constant with which an error relaxes without actuation.
+
+IN:
+	*) None
+OUT:
+	*) tau		time constant (ms), or 0 when the estimated model is not stable
+*/
+inline double PlantEstimator::tau(void) const
+{
+	double pole = 1 + rls.theta[0];
+	if (pole <= 0 || pole >= 1){return 0;}
+	return -period/log(pole);
+}
+
+/*
+coefficient
+-----------
+Raw model parameter in per-time-step units, as used in the model equation above.
+
+IN:
+	*) i		index of the parameter (0-3)
+OUT:
+	*) theta	theta[i]
+*/
+inline double PlantEstimator::coefficient(int i) const
+{
+	return rls.theta[i];
+}
+
+/*
+disturbance
+-----------
+Part of the change in error that is not explained by the error itself or by
+the actuators, i.e. the drift of the cell away from the reference.
+
+IN:
+	*) err_prev	error Vm - reference at the previous time-step (mV)
+	*) err		error Vm - reference at the current time-step (mV)
+	*) u1		output of the first actuator during the previous time-step (V)
+	*) u2		output of the second actuator during the previous time-step (V)
+OUT:
+	*) d		unexplained change in error (mV)
+*/
+inline double PlantEstimator::disturbance(double err_prev, double err, double u1, double u2) const
+{
+	return (err - err_prev) - rls.theta[0]*err_prev - rls.theta[1]*u1 - rls.theta[2]*u2;
+}
+
+/*
+valid
+-----
+Whether the actuator was switched on often enough to trust its gain.
+
+IN:
+	*) channel		0 for the first, 1 for the second actuator
+	*) min_samples	number of samples with the actuator on that is needed
+OUT:
+	*) valid		true when enough samples were collected
+*/
+inline bool PlantEstimator::valid(int channel, long long min_samples) const
+{
+	return excited[channel == 1] >= min_samples;
+}
+
+#endif
@@ -0,0 +1,182 @@
+/*
+ Copyright (C) 2022 Leiden University Medical Center
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#ifndef APQR_RLS_ESTIMATOR_H
+#define APQR_RLS_ESTIMATOR_H
+
+/*
+ ****************
+ * RLSEstimator *
+ ****************
+
+Recursive least squares estimator with exponential forgetting for a model that
+is linear in N parameters:
+
+	y = theta[0]*phi[0] + ... + theta[N-1]*phi[N-1]
+
+The number of parameters is fixed at compile time, so all storage lives inside
+the object and an update costs O(N^2) operations without any allocation. This
+makes it safe to call from execute().
+
+The forgetting factor lambda (0 < lambda <= 1) sets the memory of the
+estimator to roughly 1/(1 - lambda) samples. To avoid covariance wind-up when
+the data carry no new information (e.g. when the LEDs are off), the covariance
+is not inflated any further once its trace exceeds p_max.
+*/
+template <int N>
+class RLSEstimator
+{
+	public:
+		RLSEstimator(void);
+
+		void reset(double p0);
+		void setForgetting(double lambda);
+		double update(const double phi[N], double y);
+		double predict(const double phi[N]) const;
+
+		double theta[N];	// estimated parameters
+		long long samples;	// number of updates since the last reset
+
+	private:
+		double P[N][N];		// covariance matrix
+		double lambda;		// forgetting factor
+		double p_max;		// upper bound on the trace of P
+};
+
+/*
+RLSEstimator
+------------
+Constructs an estimator with all parameters at 0, a forgetting factor of 1 and
+an initial covariance of 1000 times the identity matrix.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+template <int N>
+inline RLSEstimator<N>::RLSEstimator(void)
+{
+	lambda = 1;
+	reset(1000);
+}
+
+/*
+reset
+-----
+Forgets everything that was learned so far.
+
+IN:
+	*) p0		initial variance of every parameter (large means uncertain)
+OUT:
+	*) None
+*/
+template <int N>
+inline void RLSEstimator<N>::reset(double p0)
+{
+	for (int r = 0; r < N; r++){
+		theta[r] = 0;
+		for (int c = 0; c < N; c++){P[r][c] = (r == c ? p0 : 0);}
+	}
+	p_max = 10*N*p0;
+	samples = 0;
+}
+
+/*
+setForgetting
+-------------
+Sets the forgetting factor. Values outside of (0, 1] are clipped.
+
+IN:
+	*) lambda	forgetting factor
+OUT:
+	*) None
+*/
+template <int N>
+inline void RLSEstimator<N>::setForgetting(double lambda)
+{
+	if (lambda > 1){lambda = 1;}
+	if (lambda < 0.5){lambda = 0.5;}
+	this->lambda = lambda;
+}
+
+/*
+predict
+-------
+Model output for the given regressors.
+
+IN:
+	*) phi[]	regressor vector
+OUT:
+	*) y		predicted output
+*/
+template <int N>
+inline double RLSEstimator<N>::predict(const double phi[N]) const
+{
+	double y = 0;
+	for (int r = 0; r < N; r++){y += theta[r]*phi[r];}
+	return y;
+}
+
+/*
+update
+------
+Includes one new observation in the estimate.
+
+IN:
+	*) phi[]	regressor vector
+	*) y		measured output
+OUT:
+	*) err		a priori prediction error
+*/
+template <int N>
+inline double RLSEstimator<N>::update(const double phi[N], double y)
+{
+	double Pphi[N];
+	double gain[N];
+	double denom = lambda;
+	double err = y - predict(phi);
+	double trace = 0;
+	double scale;
+
+	for (int r = 0; r < N; r++){
+		Pphi[r] = 0;
+		for (int c = 0; c < N; c++){Pphi[r] += P[r][c]*phi[c];}
+		denom += phi[r]*Pphi[r];
+	}
+	for (int r = 0; r < N; r++){
+		gain[r] = Pphi[r]/denom;
+		theta[r] += gain[r]*err;
+		trace += P[r][r];
+	}
+
+	// Only forget when the covariance is still bounded, such that the estimator
+	// does not blow up during periods without excitation.
+	scale = (trace < p_max ? 1/lambda : 1);
+	for (int r = 0; r < N; r++){
+		for (int c = r; c < N; c++){
+			P[r][c] = (P[r][c] - gain[r]*Pphi[c])*scale;
+			P[c][r] = P[r][c]; // keep P symmetric
+		}
+	}
+
+	samples++;
+	return err;
+}
+
+#endif
@@ -0,0 +1,111 @@
+/*
+ Copyright (C) 2022 Leiden University Medical Center
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#ifndef APQR_RT_MEMORY_H
+#define APQR_RT_MEMORY_H
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <new>
+
+/*
+ ************
+ * RTMemory *
+ ************
+
+Helpers that keep the real-time thread from waiting on memory:
+	*) APQR_CACHE_LINE	alignment of the hot state and of the large buffers;
+						the modules put the loop state that execute() writes on
+						every time-step together behind one alignas(APQR_CACHE_LINE)
+	*) alignedAlloc		allocation on a cache line boundary, used by the
+						operator new of the modules (before C++17, new does not
+						respect alignas beyond 16 bytes)
+	*) lockMemory		touches every page of a range and locks it in RAM, such
+						that execute() never takes a page fault on it
+
+Locking can fail when RLIMIT_MEMLOCK is too small for the process; the modules
+then run as before and publish the failure in their "Memory locked" state.
+Locks are per page and not counted, so unlocking a range would also unlock
+other data that shares its first or last page, such as the hot state of another
+module on the heap. The modules therefore never unlock; their pages stay locked
+until they are unmapped or the process ends.
+*/
+#define APQR_CACHE_LINE 64
+
+/*
+alignedAlloc
+------------
+Allocates memory that starts on a cache line.
+
+IN:
+	*) bytes	size of the allocation
+OUT:
+	*) p		pointer to the memory; throws std::bad_alloc on failure
+*/
+inline void* alignedAlloc(size_t bytes)
+{
+	void* p = NULL;
+	if (posix_memalign(&p, APQR_CACHE_LINE, bytes) != 0){throw std::bad_alloc();}
+	return p;
+}
+
+/*
+alignedFree
+-----------
+Frees memory from alignedAlloc.
+
+IN:
+	*) p		pointer to the memory
+OUT:
+	*) None
+*/
+inline void alignedFree(void* p)
+{
+	free(p);
+}
+
+/*
+lockMemory
+----------
+Reads one byte of every page of a range, such that all its pages are mapped,
+and locks the range in RAM. Meant for MODIFY and PERIOD, not for execute().
+
+IN:
+	*) p		start of the range
+	*) bytes	length of the range
+OUT:
+	*) locked	true when the range is locked
+*/
+inline bool lockMemory(const void* p, size_t bytes)
+{
+	if (p == NULL || bytes == 0){return false;}
+	long page = sysconf(_SC_PAGESIZE);
+	if (page <= 0){page = 4096;}
+
+	const volatile char* c = (const volatile char*)p;
+	char sink = 0;
+	for (size_t k = 0; k < bytes; k += page){sink ^= c[k];}
+	sink ^= c[bytes - 1];
+	(void)sink;
+
+	return mlock(p, bytes) == 0;
+}
+
+#endif
@@ -0,0 +1,77 @@
+/*
+ Copyright (C) 2022 Leiden University Medical Center
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#ifndef APQR_REFERENCE_PREVIEW_H
+#define APQR_REFERENCE_PREVIEW_H
+
+#include <math.h>
+#include <stddef.h>
+#include <vector>
+
+/*
+ ********************
+ * ReferencePreview *
+ ********************
+
+Feedforward from a reference AP that is known in advance (the AP file of
+APqrPIDLTLP4). For every point of the reference the weighted change over the
+next N points is precomputed, such that execute() only needs a single look-up
+per time-step for the preview term:
+	preview[k] = sum_j w_j*(ref[k+j+1] - ref[k]),	w_j ~ exp(-j*dt/tau), sum_j w_j = 1
+Points beyond the end of the reference are taken equal to the last point. The
+result is built in a separate vector, so the GUI thread can compute it while
+execute() still reads the previous one.
+*/
+
+/*
+referencePreview
+----------------
+Computes the preview of a reference.
+
+IN:
+	*) ref		the reference AP (mV)
+	*) N		amount of upcoming points that are taken into account
+	*) tau		time constant of the exponential weighting (ms), uniform when <= 0
+	*) dt		the length of a single time-step (ms)
+OUT:
+	*) preview	weighted upcoming change of ref for every point (mV); all 0
+				when N <= 0
+*/
+inline void referencePreview(const std::vector<double>& ref, double N, double tau, double dt, std::vector<double>& preview)
+{
+	size_t n = ref.size();
+	size_t M = (N > 0 ? (size_t)N : 0);
+	std::vector<double> weight(M);
+	double total = 0;
+
+	for (size_t j = 0; j < M; j++){
+		weight[j] = (tau > 0 ? exp(-(j*dt)/tau) : 1);
+		total += weight[j];
+	}
+
+	preview.assign(n, 0);
+	if (total <= 0) return;
+	for (size_t k = 0; k < n; k++){
+		for (size_t j = 0; j < M; j++){
+			size_t next = (k+j+1 < n-1 ? k+j+1 : n-1);
+			preview[k] += weight[j]/total * (ref[next] - ref[k]);
+		}
+	}
+}
+
+#endif
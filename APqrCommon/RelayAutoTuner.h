@@ -0,0 +1,276 @@
+/*
+ Copyright (C) 2022 Leiden University Medical Center
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#ifndef APQR_RELAY_AUTO_TUNER_H
+#define APQR_RELAY_AUTO_TUNER_H
+
+#include <math.h>
+
+/*
+ ******************
+ * RelayAutoTuner *
+ ******************
+
+Relay-feedback (Astrom-Hagglund) auto-tuning of the PID gains. During a chosen
+window of every AP the PID output is replaced by a relay with hysteresis:
+
+	PID = +h when err > eps (red channel), PID = -h when err < -eps (blue channel)
+
+which makes the error oscillate around 0 at the ultimate period Tu. From the
+oscillation amplitude a the ultimate gain follows as
+
+	Ku = 4*h/(pi*sqrt(a^2 - eps^2))
+
+Periods and amplitudes of all complete oscillations in the windows of a few
+beats are averaged, after which one of the classic tuning rules converts
+(Ku, Tu) into K_p, K_i and K_d in the discrete form used by the PID modules:
+K_i multiplies the sum of the errors over the time-steps and K_d multiplies the
+slope of the error in mV/ms.
+
+Tuning rules:
+	0) Ziegler-Nichols			K_p = 0.6*Ku,	Ti = Tu/2,		Td = Tu/8
+	1) Ziegler-Nichols, no overshoot	K_p = 0.2*Ku,	Ti = Tu/2,		Td = Tu/3
+	2) Tyreus-Luyben			K_p = Ku/2.2,	Ti = 2.2*Tu,	Td = Tu/6.3
+*/
+class RelayAutoTuner
+{
+	public:
+		RelayAutoTuner(void);
+
+		void configure(double h, double eps, int beats);
+		void start(void);
+		void stop(void);
+		bool active(void) const;
+		double relay(double err, double t);
+		bool endBeat(void);
+		bool tune(int rule, double period, double &K_p, double &K_i, double &K_d);
+
+		double Ku;	// ultimate gain (PID units per mV)
+		double Tu;	// ultimate period (ms)
+
+	private:
+		double h;			// relay amplitude (PID units)
+		double eps;			// relay hysteresis (mV)
+		int beats;			// number of beats the experiment lasts
+		int beat;			// number of beats that were completed
+		bool running;		// whether the experiment is ongoing
+		bool in_window;		// whether the relay was used since the last endBeat()
+		double state;		// current relay output (-1 or +1, 0 before the first switch)
+		double t_switch;	// time of the last switch from blue to red (ms, -1 if none)
+		double e_max;		// largest error since the last switch from blue to red (mV)
+		double e_min;		// smallest error since the last switch from blue to red (mV)
+		double sum_T;		// sum of the measured periods (ms)
+		double sum_a;		// sum of the measured amplitudes (mV)
+		int cycles;			// number of measured oscillations
+};
+
+/*
+RelayAutoTuner
+--------------
+Constructs an idle tuner.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+inline RelayAutoTuner::RelayAutoTuner(void)
+{
+	configure(1, 0.5, 3);
+	Ku = 0;
+	Tu = 0;
+	running = false;
+	stop();
+}
+
+/*
+configure
+---------
+Sets the relay and the duration of the experiment.
+
+IN:
+	*) h		relay amplitude (PID units)
+	*) eps		relay hysteresis (mV)
+	*) beats	number of beats the experiment lasts
+OUT:
+	*) None
+*/
+inline void RelayAutoTuner::configure(double h, double eps, int beats)
+{
+	this->h = h;
+	this->eps = (eps < 0 ? 0 : eps);
+	this->beats = (beats < 1 ? 1 : beats);
+}
+
+/*
+start
+-----
+Starts a new experiment from the next relay() call onwards.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+inline void RelayAutoTuner::start(void)
+{
+	stop();
+	running = true;
+}
+
+/*
+stop
+----
+Aborts the experiment and forgets the measured oscillations.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+inline void RelayAutoTuner::stop(void)
+{
+	running = false;
+	in_window = false;
+	beat = 0;
+	state = 0;
+	t_switch = -1;
+	e_max = 0;
+	e_min = 0;
+	sum_T = 0;
+	sum_a = 0;
+	cycles = 0;
+}
+
+/*
+active
+------
+Whether an experiment is ongoing.
+
+IN:
+	*) None
+OUT:
+	*) active	true while the relay should replace the PID output
+*/
+inline bool RelayAutoTuner::active(void) const
+{
+	return running;
+}
+
+/*
+relay
+-----
+Relay output for the current error, while measuring the oscillation.
+
+IN:
+	*) err		error Vm - reference (mV)
+	*) t		time since the upstroke (ms)
+OUT:
+	*) PID		+h (repolarize), -h (depolarize)
+*/
+inline double RelayAutoTuner::relay(double err, double t)
+{
+	in_window = true;
+	if (err > e_max){e_max = err;}
+	if (err < e_min){e_min = err;}
+
+	if (state <= 0 && err > eps)
+	{
+		// Switch from the blue to the red channel. The time between two such switches
+		// is one oscillation period.
+		if (t_switch >= 0)
+		{
+			sum_T += t - t_switch;
+			sum_a += (e_max - e_min)/2;
+			cycles++;
+		}
+		t_switch = t;
+		e_max = err;
+		e_min = err;
+		state = 1;
+	}
+	else if (state >= 0 && err < -eps)
+	{
+		state = -1;
+	}
+
+	return (state > 0 ? h : -h);
+}
+
+/*
+endBeat
+-------
+Closes the relay window of the current beat. Oscillations are never measured
+across two windows, and beats in which the relay was not used do not count.
+
+IN:
+	*) None
+OUT:
+	*) done		true when the requested number of beats was completed
+*/
+inline bool RelayAutoTuner::endBeat(void)
+{
+	if (!in_window){return false;}
+	in_window = false;
+	state = 0;
+	t_switch = -1;
+	beat++;
+	return beat >= beats;
+}
+
+/*
+tune
+----
+Ends the experiment and computes the PID gains from the measured oscillations.
+The gains are left untouched when no complete oscillation was measured.
+
+IN:
+	*) rule		tuning rule (0, 1 or 2, see above)
+	*) period	the length of a single time-step (ms)
+	*) K_p		proportional gain
+	*) K_i		integral gain (per time-step)
+	*) K_d		derivative gain (ms)
+OUT:
+	*) success	true when new gains were computed
+*/
+inline bool RelayAutoTuner::tune(int rule, double period, double &K_p, double &K_i, double &K_d)
+{
+	bool success = false;
+	double a = (cycles > 0 ? sum_a/cycles : 0);
+
+	if (cycles > 0 && a > eps)
+	{
+		Tu = sum_T/cycles;
+		Ku = 4*h/(M_PI*sqrt(a*a - eps*eps));
+
+		double Kp, Ti, Td;
+		if (rule == 1){Kp = 0.2*Ku; Ti = Tu/2; Td = Tu/3;}
+		else if (rule == 2){Kp = Ku/2.2; Ti = 2.2*Tu; Td = Tu/6.3;}
+		else {Kp = 0.6*Ku; Ti = Tu/2; Td = Tu/8;}
+
+		K_p = Kp;
+		K_i = Kp*period/Ti;
+		K_d = Kp*Td;
+		success = true;
+	}
+
+	stop();
+	return success;
+}
+
+#endif
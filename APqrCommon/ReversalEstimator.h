@@ -0,0 +1,201 @@
+/*
+ Copyright (C) 2022 Leiden University Medical Center
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#ifndef APQR_REVERSAL_ESTIMATOR_H
+#define APQR_REVERSAL_ESTIMATOR_H
+
+#include "RLSEstimator.h"
+
+/*
+ *********************
+ * ReversalEstimator *
+ *********************
+
+Online estimate of the apparent reversal potential of a light-gated current.
+
+The light-gated current is taken proportional to the LED driver voltage and to
+the driving force, I = g*VLED*(Vm - Vrev). The rate of change of the membrane
+potential over one time-step is then fitted as
+
+	dVm/dt = theta[0]*(VLED*Vm) + theta[1]*VLED + theta[2] + theta[3]*dref/dt
+
+with theta[0] = -g/Cm and theta[1] = g*Vrev/Cm. The currents of the cell itself
+are taken to follow the reference AP, whose slope dref/dt over the same
+time-step enters with theta[3], while theta[2] absorbs the remaining drift. The
+reversal potential follows as Vrev = -theta[1]/theta[0]. Samples without light
+only inform theta[2] and theta[3], so the estimate is driven by illumination at
+different membrane potentials, which the controller produces anyway during
+correction.
+
+Vm and VLED are those at the start of the time-step over which dVm/dt and
+dref/dt are taken, as two-point differences, such that no filter lag lies
+between the regressors and the fitted slope. The fit is updated with the means
+over blocks of BLOCK time-steps: the two-point differences of a block add up to
+the change of Vm over the whole block, so the noise of Vm only enters it at
+the two ends of the block, instead of at every time-step where it correlates
+with the Vm and the light of the same time-step. Since the model holds at any Vm,
+light that is only given below the gating threshold still gives the reversal
+potential above it.
+
+The estimate is only reported as valid once enough illuminated samples were
+seen, the fitted conductance has the right sign and the reversal potential lies
+within [v_min, v_max].
+*/
+class ReversalEstimator
+{
+	public:
+		ReversalEstimator(void);
+
+		void configure(double lambda, double v_min, double v_max, long long min_samples);
+		void reset(void);
+		void update(double VLED, double Vm, double dVm, double dref);
+		bool valid(void) const;
+		double estimate(void) const;
+
+		enum {BLOCK = 10};	// time-steps per update of the fit
+
+	private:
+		RLSEstimator<4> rls;
+		double sum_phi[4];		// regressors summed over the current block
+		double sum_dVm;			// dVm summed over the current block (mV/ms)
+		int steps;				// time-steps in the current block
+		long long lit_samples;	// number of samples with the LED on
+		long long min_samples;	// illuminated samples needed for a valid estimate
+		double v_min;			// lowest plausible reversal potential (mV)
+		double v_max;			// highest plausible reversal potential (mV)
+};
+
+/*
+ReversalEstimator
+-----------------
+Constructs an estimator with a forgetting factor of 0.9999 that accepts
+reversal potentials between -60 and 60 mV after 1000 illuminated samples.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+inline ReversalEstimator::ReversalEstimator(void)
+{
+	configure(0.9999, -60, 60, 1000);
+	reset();
+}
+
+/*
+configure
+---------
+Sets the forgetting factor and the acceptance criteria of the estimate.
+
+IN:
+	*) lambda		forgetting factor of the RLS estimator
+	*) v_min		lowest plausible reversal potential (mV)
+	*) v_max		highest plausible reversal potential (mV)
+	*) min_samples	illuminated samples needed before the estimate is used
+OUT:
+	*) None
+*/
+inline void ReversalEstimator::configure(double lambda, double v_min, double v_max, long long min_samples)
+{
+	rls.setForgetting(lambda);
+	this->v_min = v_min;
+	this->v_max = v_max;
+	this->min_samples = min_samples;
+}
+
+/*
+reset
+-----
+Forgets everything that was learned so far.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+inline void ReversalEstimator::reset(void)
+{
+	rls.reset(1000);
+	lit_samples = 0;
+	for (int r = 0; r < 4; r++){sum_phi[r] = 0;}
+	sum_dVm = 0;
+	steps = 0;
+}
+
+/*
+update
+------
+Includes one time-step in the estimate.
+
+IN:
+	*) VLED		LED driver voltage that was applied during the time-step (V)
+	*) Vm		measured membrane potential at its start (mV)
+	*) dVm		rate of change of Vm over the time-step (mV/ms)
+	*) dref		rate of change of the reference AP over the time-step (mV/ms)
+OUT:
+	*) None
+*/
+inline void ReversalEstimator::update(double VLED, double Vm, double dVm, double dref)
+{
+	double phi[4] = {VLED*Vm, VLED, 1, dref};
+
+	for (int r = 0; r < 4; r++){sum_phi[r] += phi[r]/BLOCK;}
+	sum_dVm += dVm/BLOCK;
+	if (VLED > 0){lit_samples++;}
+	if (++steps < BLOCK){return;}
+	rls.update(sum_phi, sum_dVm);
+	for (int r = 0; r < 4; r++){sum_phi[r] = 0;}
+	sum_dVm = 0;
+	steps = 0;
+}
+
+/*
+valid
+-----
+Whether the current estimate can be used as a gating threshold.
+
+IN:
+	*) None
+OUT:
+	*) valid	true when the acceptance criteria are met
+*/
+inline bool ReversalEstimator::valid(void) const
+{
+	if (lit_samples < min_samples || rls.theta[0] >= 0){return false;}
+	double Vrev = estimate();
+	return (Vrev >= v_min && Vrev <= v_max);
+}
+
+/*
+estimate
+--------
+Current estimate of the apparent reversal potential. Only meaningful when
+valid() returns true.
+
+IN:
+	*) None
+OUT:
+	*) Vrev		apparent reversal potential (mV)
+*/
+inline double ReversalEstimator::estimate(void) const
+{
+	if (rls.theta[0] == 0){return 0;}
+	return -rls.theta[1]/rls.theta[0];
+}
+
+#endif
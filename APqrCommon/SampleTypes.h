@@ -0,0 +1,115 @@
+/*
+ Copyright (C) 2022 Leiden University Medical Center
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#ifndef APQR_SAMPLE_TYPES_H
+#define APQR_SAMPLE_TYPES_H
+
+#include <limits.h>
+
+/*
+ **************
+ * FixedPoint *
+ **************
+
+Signed fixed-point sample with FRAC fractional bits in a 32-bit integer. With
+FRAC = 16 it covers +-32768 mV with a resolution of 1.5e-5 mV, far below one
+step of a 16-bit DAQ. It converts implicitly from and to double but has no
+arithmetic operators of its own, so expressions in the modules are evaluated in
+double and only the storage is fixed-point; the kernels in ControlKernels.h
+work on the raw integers instead (see SampleTraits).
+*/
+template<int FRAC>
+class FixedPoint
+{
+	public:
+		enum {ONE = 1 << FRAC};
+
+		FixedPoint(void) : v(0) {}
+		FixedPoint(double x) : v(fromDouble(x)) {}
+		operator double() const {return v/(double)ONE;}
+
+		int raw(void) const {return v;}
+
+	private:
+		static int fromDouble(double x);
+
+		int v;	// value times 2^FRAC
+};
+
+/*
+fromDouble
+----------
+Rounds a value to the nearest fixed-point number, saturating at the limits of
+the representation.
+
+IN:
+	*) x		value
+OUT:
+	*) raw		value times 2^FRAC as an integer
+*/
+template<int FRAC>
+inline int FixedPoint<FRAC>::fromDouble(double x)
+{
+	double r = x*ONE;
+	if (r >= (double)INT_MAX){return INT_MAX;}
+	if (r <= (double)INT_MIN){return INT_MIN;}
+	return (int)(r < 0 ? r - 0.5 : r + 0.5);
+}
+
+/*
+ ****************
+ * SampleTraits *
+ ****************
+
+How the kernels accumulate samples of type T: in T itself for floating-point
+samples, and in a 64-bit integer of the raw value for fixed-point samples, such
+that sums over a window are exact and take the same time for every input.
+*/
+template<typename T>
+struct SampleTraits
+{
+	typedef T acc_t;
+	static acc_t load(T x){return x;}
+	static double toDouble(acc_t a){return a;}
+};
+
+template<int FRAC>
+struct SampleTraits< FixedPoint<FRAC> >
+{
+	typedef long long acc_t;
+	static acc_t load(FixedPoint<FRAC> x){return x.raw();}
+	static double toDouble(acc_t a){return a/(double)FixedPoint<FRAC>::ONE;}
+};
+
+/*
+apqr_sample_t
+-------------
+Type of the logged signals and reference APs in the modules (Vm_log, ideal_AP,
+Vm_diff_log). Double by default; building with -DAPQR_SAMPLE_FLOAT or
+-DAPQR_SAMPLE_FIXED halves the size of these logs and makes the kernels run in
+float or in 16.16 fixed point.
+*/
+#if defined(APQR_SAMPLE_FIXED)
+typedef FixedPoint<16> apqr_sample_t;
+#elif defined(APQR_SAMPLE_FLOAT)
+typedef float apqr_sample_t;
+#else
+typedef double apqr_sample_t;
+#endif
+
+#endif
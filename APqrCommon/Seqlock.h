@@ -0,0 +1,120 @@
+/*
+ Copyright (C) 2022 Leiden University Medical Center
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#ifndef APQR_SEQLOCK_H
+#define APQR_SEQLOCK_H
+
+#include <atomic>
+
+/*
+ ***********
+ * Seqlock *
+ ***********
+
+Hand-over of a snapshot of the states (time, APs, BCL, PID terms, ...) from the
+real-time thread to the GUI thread, such that refresh() never shows a mix of
+two time-steps. The real-time thread writes the whole snapshot once per
+time-step and never waits; the GUI thread copies it and retries when the
+sequence number shows that a write overlapped the copy.
+
+The sequence number is odd while a write is in progress and advances by 2 per
+write. A copy is consistent when the sequence number was even before it and
+unchanged after it. The GUI thread gives up after a few attempts and keeps the
+snapshot it had, which only happens when the real-time thread writes faster
+than the GUI thread can copy.
+
+One thread may write and any other threads may read; S is copied as a whole,
+so it should be a plain struct of numbers.
+*/
+template<typename S>
+class Seqlock
+{
+	public:
+		enum {ATTEMPTS = 4};
+
+		Seqlock(void);
+
+		void write(const S& snapshot);
+		bool read(S& snapshot) const;
+
+	private:
+		S data;
+		std::atomic<unsigned int> seq;	// odd while a write is in progress
+};
+
+/*
+Seqlock
+-------
+Constructs the seqlock with a value-initialized snapshot.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+template<typename S>
+inline Seqlock<S>::Seqlock(void) : data(), seq(0)
+{
+}
+
+/*
+write
+-----
+Publishes a snapshot. Only called from the writing thread; never waits.
+
+IN:
+	*) snapshot	the current states
+OUT:
+	*) None
+*/
+template<typename S>
+inline void Seqlock<S>::write(const S& snapshot)
+{
+	unsigned int s = seq.load(std::memory_order_relaxed);
+	seq.store(s + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	data = snapshot;
+	seq.store(s + 2, std::memory_order_release);
+}
+
+/*
+read
+----
+Copies the newest complete snapshot. Called from the GUI thread.
+
+IN:
+	*) None
+OUT:
+	*) snapshot	the states of a single time-step; unchanged when no
+				consistent copy was made
+	*) read		false when every attempt overlapped a write
+*/
+template<typename S>
+inline bool Seqlock<S>::read(S& snapshot) const
+{
+	for (int k = 0; k < ATTEMPTS; k++){
+		unsigned int before = seq.load(std::memory_order_acquire);
+		if (before & 1){continue;}
+		S copy = data;
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (seq.load(std::memory_order_relaxed) == before){snapshot = copy; return true;}
+	}
+	return false;
+}
+
+#endif
@@ -0,0 +1,347 @@
+/*
+ Copyright (C) 2022 Leiden University Medical Center
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#ifndef APQR_SHADOW_CONTROLLERS_H
+#define APQR_SHADOW_CONTROLLERS_H
+
+/*
+ *********************
+ * ShadowControllers *
+ *********************
+
+While the live PID controller drives the LEDs, this class evaluates up to 32
+alternative gain sets (K_p, K_i, K_d, Rm_blue, Rm_red) in parallel. Every
+candidate drives its own copy of the error through the online model of
+PlantEstimator:
+
+	err[k+1] = err[k] + a*err[k] + b_blue*VLED_blue[k] + b_red*VLED_red[k] + d[k]
+
+where d[k] is the drift of the cell away from the reference as measured in the
+live loop, i.e. the part of the change in error that the model does not explain.
+All candidates therefore see the same cell and the same disturbances, and only
+differ in how they respond to them. The squared predicted error is summed per
+beat; the candidate with the lowest sum is the best gain set of that beat.
+
+Every candidate runs the controller of the live loop, so that lane 0 reproduces
+the measured error as long as the model holds:
+	*) D is the slope of the measured error from the live derivative filter, plus
+	   the two-point change of the difference between the predicted and the
+	   measured error. That difference holds no measurement noise, since all
+	   candidates share the drift, so it needs no filtering.
+	*) the integral only grows while the last LED voltage was below 5V and one of
+	   the channels can act (Vm below blue_Vrev or repolarization needed)
+	*) the output is only recomputed from Correction start on and when the PID
+	   output changed by more than PID_tresh, otherwise the previous LED voltages
+	   are kept; it is 0 when |PID| does not exceed min_PID
+	*) blue light only below blue_Vrev, both channels limited to 5V
+	*) the feedforward term of the live loop (APqrPIDLTLP4) is added unchanged
+The LED voltages are the commands before the opsin compensation, which the
+compensation makes the light-gated currents follow. The modules therefore
+identify the model from these commands as well.
+
+The candidates are stored as structure-of-arrays in blocks of two doubles
+(GCC vector extensions, one SSE2 register), and every step runs the same
+branch-free code on all blocks, so the per-tick cost is fixed regardless of the
+number of candidates in use.
+
+Lane 0 always holds the live gains. setCandidates() fills the other lanes with
+a 3x3x3 grid around the live K_p, K_i and K_d (scaled by 1/spread, 1 and
+spread) and four variations of the Rm_blue/Rm_red balance.
+*/
+class ShadowControllers
+{
+	public:
+		enum {LANES = 32, WIDTH = 2, BLOCKS = LANES/WIDTH};
+
+		ShadowControllers(void);
+
+		void setCandidates(double K_p, double K_i, double K_d, double Rm_blue, double Rm_red, double spread);
+		void startBeat(double err, double Int, double PID, double VLED_blue, double VLED_red, double VLED);
+		void step(double ref, double err_live, double slope, double ff, double d, double a, double b_blue, double b_red,
+			double blue_Vrev, double min_PID, double PID_tresh, bool correcting, double period);
+		int best(void) const;
+		double cost(int lane) const;
+		void candidate(int lane, double &K_p, double &K_i, double &K_d, double &Rm_blue, double &Rm_red) const;
+
+	private:
+		typedef double block_t __attribute__((vector_size(WIDTH*sizeof(double))));
+
+		void setLane(int lane, double K_p, double K_i, double K_d, double Rm_blue, double Rm_red);
+
+		// gains of every candidate
+		block_t Kp[BLOCKS];
+		block_t Ki[BLOCKS];
+		block_t Kd[BLOCKS];
+		block_t inv_Rm_blue[BLOCKS];
+		block_t inv_Rm_red[BLOCKS];
+		// predicted state of every candidate
+		block_t err[BLOCKS];
+		block_t err_prev[BLOCKS];
+		block_t Int[BLOCKS];
+		block_t PID_prev[BLOCKS];
+		block_t VLED_blue[BLOCKS];	// LED voltages of the previous time-step
+		block_t VLED_red[BLOCKS];
+		block_t VLED_last[BLOCKS];	// last non-zero LED voltage, which gates the integral
+		block_t sum_err2[BLOCKS];
+		double err_live_prev;		// measured error of the previous time-step (mV)
+};
+
+/*
+ShadowControllers
+-----------------
+Constructs a set of candidates that all have zero gains.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+inline ShadowControllers::ShadowControllers(void)
+{
+	for (int lane = 0; lane < LANES; lane++){setLane(lane, 0, 0, 0, 1, 1);}
+	startBeat(0, 0, 0, 0, 0, 0);
+}
+
+/*
+setLane
+-------
+Stores one gain set.
+
+IN:
+	*) lane		index of the candidate
+	*) K_p		proportional gain
+	*) K_i		integral gain
+	*) K_d		derivative gain
+	*) Rm_blue	LED-specific factor of the blue channel
+	*) Rm_red	LED-specific factor of the red channel
+OUT:
+	*) None
+*/
+inline void ShadowControllers::setLane(int lane, double K_p, double K_i, double K_d, double Rm_blue, double Rm_red)
+{
+	int b = lane/WIDTH, w = lane%WIDTH;
+	Kp[b][w] = K_p;
+	Ki[b][w] = K_i;
+	Kd[b][w] = K_d;
+	inv_Rm_blue[b][w] = (Rm_blue != 0 ? 1/Rm_blue : 0);
+	inv_Rm_red[b][w] = (Rm_red != 0 ? 1/Rm_red : 0);
+}
+
+/*
+setCandidates
+-------------
+Fills all lanes with gain sets around the given (live) gain set.
+
+IN:
+	*) K_p		live proportional gain
+	*) K_i		live integral gain
+	*) K_d		live derivative gain
+	*) Rm_blue	live LED-specific factor of the blue channel
+	*) Rm_red	live LED-specific factor of the red channel
+	*) spread	factor by which the candidates differ from the live gains
+OUT:
+	*) None
+*/
+inline void ShadowControllers::setCandidates(double K_p, double K_i, double K_d, double Rm_blue, double Rm_red, double spread)
+{
+	int lane = 0;
+
+	if (spread <= 0){spread = 1;}
+	double f[3] = {1/spread, 1, spread};
+
+	setLane(lane++, K_p, K_i, K_d, Rm_blue, Rm_red);
+	for (int p = 0; p < 3; p++){
+		for (int i = 0; i < 3; i++){
+			for (int d = 0; d < 3; d++){
+				if (p == 1 && i == 1 && d == 1){continue;} // the live gain set is lane 0
+				setLane(lane++, f[p]*K_p, f[i]*K_i, f[d]*K_d, Rm_blue, Rm_red);
+			}
+		}
+	}
+	setLane(lane++, K_p, K_i, K_d, Rm_blue/spread, Rm_red);
+	setLane(lane++, K_p, K_i, K_d, Rm_blue*spread, Rm_red);
+	setLane(lane++, K_p, K_i, K_d, Rm_blue, Rm_red/spread);
+	setLane(lane++, K_p, K_i, K_d, Rm_blue, Rm_red*spread);
+	while (lane < LANES){setLane(lane++, K_p, K_i, K_d, Rm_blue, Rm_red);}
+}
+
+/*
+startBeat
+---------
+Starts every candidate from the state of the live controller at the beginning
+of a beat, and clears the accumulated costs.
+
+IN:
+	*) err			measured error Vm - reference (mV)
+	*) Int			integral of the live controller
+	*) PID			PID output of the previous time-step
+	*) VLED_blue	blue LED voltage of the previous time-step (V)
+	*) VLED_red		red LED voltage of the previous time-step (V)
+	*) VLED			last non-zero LED voltage (V)
+OUT:
+	*) None
+*/
+inline void ShadowControllers::startBeat(double err, double Int, double PID, double VLED_blue, double VLED_red, double VLED)
+{
+	block_t e = {err, err};
+	block_t zero = {0, 0};
+	block_t i = {Int, Int};
+	block_t p = {PID, PID};
+	block_t blue = {VLED_blue, VLED_blue};
+	block_t red = {VLED_red, VLED_red};
+	block_t last = {VLED, VLED};
+	for (int b = 0; b < BLOCKS; b++){
+		this->err[b] = e;
+		err_prev[b] = e;
+		this->Int[b] = i;
+		PID_prev[b] = p;
+		this->VLED_blue[b] = blue;
+		this->VLED_red[b] = red;
+		VLED_last[b] = last;
+		sum_err2[b] = zero;
+	}
+	err_live_prev = err;
+}
+
+/*
+step
+----
+Advances every candidate by one time-step, lagging one time-step behind the
+live loop: the arguments belong to the previous time-step of the live loop,
+except for d.
+
+IN:
+	*) ref			reference membrane potential (mV)
+	*) err_live		measured error Vm - reference (mV)
+	*) slope		slope of the measured error from the live derivative filter (mV/ms)
+	*) ff			feedforward term of the live PID output, 0 when there is none
+	*) d			drift of the cell measured in the live loop (mV)
+	*) a			PlantEstimator coefficient of the error
+	*) b_blue		PlantEstimator coefficient of the blue channel
+	*) b_red		PlantEstimator coefficient of the red channel
+	*) blue_Vrev	Apparent reversal potential of the 'blue' ChR current (mV)
+	*) min_PID		|PID| below which no light is given
+	*) PID_tresh	change of PID below which the LED voltages are kept
+	*) correcting	whether the live loop was past Correction start
+	*) period		the length of a single time-step (ms)
+OUT:
+	*) None
+*/
+inline void ShadowControllers::step(double ref, double err_live, double slope, double ff, double d, double a, double b_blue, double b_red,
+	double blue_Vrev, double min_PID, double PID_tresh, bool correcting, double period)
+{
+	const block_t zero = {0, 0};
+	const block_t five = {5, 5};
+	const block_t inv_dt = {1/period, 1/period};
+	const block_t vrev = {blue_Vrev - ref, blue_Vrev - ref};
+	const block_t live = {err_live, err_live};
+	const block_t live_prev = {err_live_prev, err_live_prev};
+	const block_t D_live = {slope, slope};
+	const block_t F = {ff, ff};
+	const block_t dead = {min_PID, min_PID};
+	const block_t tresh = {PID_tresh, PID_tresh};
+	const block_t corr = {(double)correcting, (double)correcting};
+
+	for (int b = 0; b < BLOCKS; b++){
+		block_t e = err[b];
+		Int[b] = ((VLED_last[b] < five) & ((e < vrev) | (e > zero))) ? Int[b] + e : Int[b];
+		block_t D = D_live + ((e - live) - (err_prev[b] - live_prev))*inv_dt;
+		block_t PID = Kp[b]*e + Ki[b]*Int[b] + Kd[b]*D + F;
+		block_t PID_diff = PID_prev[b] - PID;
+		PID_prev[b] = PID;
+
+		// Same output stage as the live controller: blue when depolarization is needed and
+		// Vm is below blue_Vrev, red when repolarization is needed, both limited to 5V.
+		block_t blue = -PID*inv_Rm_blue[b];
+		block_t red = PID*inv_Rm_red[b];
+		blue = ((blue > zero) & (e < vrev)) ? blue : zero;
+		blue = (blue > five) ? five : blue;
+		red = (red > zero) ? red : zero;
+		red = (red > five) ? five : red;
+		// Same dead-bands: no light for a small PID, the previous light for a small change
+		block_t abs_PID = (PID < zero) ? -PID : PID;
+		block_t abs_diff = (PID_diff < zero) ? -PID_diff : PID_diff;
+		blue = (abs_PID > dead) ? blue : zero;
+		red = (abs_PID > dead) ? red : zero;
+		VLED_blue[b] = ((corr > zero) & (abs_diff > tresh)) ? blue : VLED_blue[b];
+		VLED_red[b] = ((corr > zero) & (abs_diff > tresh)) ? red : VLED_red[b];
+		VLED_last[b] = ((VLED_blue[b] > zero) | (VLED_red[b] > zero)) ?
+			((VLED_blue[b] > VLED_red[b]) ? VLED_blue[b] : VLED_red[b]) : VLED_last[b];
+
+		err_prev[b] = e;
+		err[b] = e + a*e + b_blue*VLED_blue[b] + b_red*VLED_red[b] + d;
+		sum_err2[b] += err[b]*err[b];
+	}
+	err_live_prev = err_live;
+}
+
+/*
+best
+----
+Candidate with the lowest accumulated squared error in the current beat.
+
+IN:
+	*) None
+OUT:
+	*) lane		index of the best candidate
+*/
+inline int ShadowControllers::best(void) const
+{
+	int lane = 0;
+	for (int l = 1; l < LANES; l++){
+		if (cost(l) < cost(lane)){lane = l;}
+	}
+	return lane;
+}
+
+/*
+cost
+----
+Accumulated squared error of a candidate in the current beat.
+
+IN:
+	*) lane		index of the candidate
+OUT:
+	*) cost		sum of the squared predicted errors (mV^2)
+*/
+inline double ShadowControllers::cost(int lane) const
+{
+	return sum_err2[lane/WIDTH][lane%WIDTH];
+}
+
+/*
+candidate
+---------
+Gain set of a candidate.
+
+IN:
+	*) lane		index of the candidate
+OUT:
+	*) K_p, K_i, K_d, Rm_blue, Rm_red	gain set of the candidate
+*/
+inline void ShadowControllers::candidate(int lane, double &K_p, double &K_i, double &K_d, double &Rm_blue, double &Rm_red) const
+{
+	int b = lane/WIDTH, w = lane%WIDTH;
+	K_p = Kp[b][w];
+	K_i = Ki[b][w];
+	K_d = Kd[b][w];
+	Rm_blue = (inv_Rm_blue[b][w] != 0 ? 1/inv_Rm_blue[b][w] : 0);
+	Rm_red = (inv_Rm_red[b][w] != 0 ? 1/inv_Rm_red[b][w] : 0);
+}
+
+#endif
@@ -0,0 +1,404 @@
+/*
+ Copyright (C) 2022 Leiden University Medical Center
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#ifndef APQR_SLIDING_MEDIAN_H
+#define APQR_SLIDING_MEDIAN_H
+
+#include <math.h>
+
+/*
+ *****************
+ * SlidingMedian *
+ *****************
+
+Median over the last w samples (w odd, at most MAX_WINDOW). The samples live in
+a ring buffer and are divided over two heaps that point into it: a max-heap
+with the lower (w+1)/2 samples and a min-heap with the upper (w-1)/2 samples,
+such that the median is the top of the lower heap. A new sample overwrites the
+oldest one in place, after which it is sifted within its own heap and, when it
+ended up on the wrong side, exchanged with the top of the other heap. A push
+therefore costs O(log w) and does not allocate memory.
+
+The output of the median lags the input by (w-1)/2 samples for a step, and
+spikes that are shorter than (w+1)/2 samples are removed completely.
+*/
+class SlidingMedian
+{
+	public:
+		enum {MAX_WINDOW = 255};
+
+		SlidingMedian(void);
+
+		void configure(int window);
+		void reset(void);
+		double push(double x);
+		double median(void) const;
+
+	private:
+		void fill(double x);
+		bool above(int h, int a, int b) const;
+		void exchange(int h, int i, int j);
+		void siftUp(int h, int i);
+		void siftDown(int h, int i);
+
+		int w;						// window length (samples)
+		int oldest;					// ring slot that is overwritten next
+		bool primed;				// whether the window holds samples
+		double val[MAX_WINDOW];		// ring buffer of samples
+		int heap[2][MAX_WINDOW];	// ring slots in the lower (0) and upper (1) heap
+		int size[2];				// number of slots in each heap
+		int side[MAX_WINDOW];		// heap of every ring slot
+		int pos[MAX_WINDOW];		// position of every ring slot in its heap
+};
+
+/*
+SlidingMedian
+-------------
+Constructs a median over a single sample, which passes its input unchanged.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+inline SlidingMedian::SlidingMedian(void)
+{
+	configure(1);
+}
+
+/*
+configure
+---------
+Sets the window length and empties the window. An even length is rounded up,
+and the length is clipped to [1, MAX_WINDOW].
+
+IN:
+	*) window	number of samples the median is taken over
+OUT:
+	*) None
+*/
+inline void SlidingMedian::configure(int window)
+{
+	if (window < 1){window = 1;}
+	if (window % 2 == 0){window++;}
+	if (window > MAX_WINDOW){window = MAX_WINDOW;}
+	w = window;
+	reset();
+}
+
+/*
+reset
+-----
+Empties the window. The next sample fills the whole window, such that the
+median starts at the first input instead of at 0.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+inline void SlidingMedian::reset(void)
+{
+	fill(0);
+	primed = false;
+}
+
+/*
+push
+----
+Replaces the oldest sample in the window by a new one.
+
+IN:
+	*) x		new sample
+OUT:
+	*) median	median of the window including x
+*/
+inline double SlidingMedian::push(double x)
+{
+	if (!primed)
+	{
+		fill(x);
+		return x;
+	}
+
+	int s = oldest;
+	oldest = (oldest + 1) % w;
+	val[s] = x;
+	siftUp(side[s], pos[s]);
+	siftDown(side[s], pos[s]);
+
+	// Only the new sample can be on the wrong side, in which case it is the top of its
+	// heap and a single exchange of both tops restores the order
+	if (size[1] > 0 && val[heap[0][0]] > val[heap[1][0]])
+	{
+		int a = heap[0][0];
+		int b = heap[1][0];
+		heap[0][0] = b;
+		heap[1][0] = a;
+		side[b] = 0;
+		side[a] = 1;
+		siftDown(0, 0);
+		siftDown(1, 0);
+	}
+	return median();
+}
+
+/*
+median
+------
+Median of the current window.
+
+IN:
+	*) None
+OUT:
+	*) median	median of the last w samples
+*/
+inline double SlidingMedian::median(void) const
+{
+	return val[heap[0][0]];
+}
+
+/*
+fill
+----
+Fills the whole window with one value, which trivially satisfies the order of
+both heaps.
+
+IN:
+	*) x		value of all samples
+OUT:
+	*) None
+*/
+inline void SlidingMedian::fill(double x)
+{
+	size[0] = w/2 + 1;
+	size[1] = w/2;
+	for (int s = 0; s < w; s++){
+		val[s] = x;
+		side[s] = (s < size[0] ? 0 : 1);
+		pos[s] = (s < size[0] ? s : s - size[0]);
+		heap[side[s]][pos[s]] = s;
+	}
+	oldest = 0;
+	primed = true;
+}
+
+/*
+above
+-----
+Whether ring slot a belongs above ring slot b in heap h.
+
+IN:
+	*) h		heap (0 = lower half, max-heap; 1 = upper half, min-heap)
+	*) a, b		ring slots
+OUT:
+	*) above	true when a has to be closer to the top than b
+*/
+inline bool SlidingMedian::above(int h, int a, int b) const
+{
+	return (h == 0 ? val[a] > val[b] : val[a] < val[b]);
+}
+
+/*
+exchange
+--------
+Swaps two positions of heap h and keeps the positions of the ring slots up to
+date.
+
+IN:
+	*) h		heap
+	*) i, j		positions in the heap
+OUT:
+	*) None
+*/
+inline void SlidingMedian::exchange(int h, int i, int j)
+{
+	int t = heap[h][i];
+	heap[h][i] = heap[h][j];
+	heap[h][j] = t;
+	pos[heap[h][i]] = i;
+	pos[heap[h][j]] = j;
+}
+
+/*
+siftUp
+------
+Moves a position of heap h towards the top until the heap order holds.
+
+IN:
+	*) h		heap
+	*) i		position in the heap
+OUT:
+	*) None
+*/
+inline void SlidingMedian::siftUp(int h, int i)
+{
+	while (i > 0)
+	{
+		int p = (i - 1)/2;
+		if (!above(h, heap[h][i], heap[h][p])){break;}
+		exchange(h, i, p);
+		i = p;
+	}
+}
+
+/*
+siftDown
+--------
+Moves a position of heap h away from the top until the heap order holds.
+
+IN:
+	*) h		heap
+	*) i		position in the heap
+OUT:
+	*) None
+*/
+inline void SlidingMedian::siftDown(int h, int i)
+{
+	for (;;)
+	{
+		int l = 2*i + 1;
+		int best = i;
+		if (l < size[h] && above(h, heap[h][l], heap[h][best])){best = l;}
+		if (l + 1 < size[h] && above(h, heap[h][l + 1], heap[h][best])){best = l + 1;}
+		if (best == i){break;}
+		exchange(h, i, best);
+		i = best;
+	}
+}
+
+/*
+ ****************
+ * HampelFilter *
+ ****************
+
+Outlier-rejecting prefilter for the upstroke detector. Depending on the mode
+it passes the input unchanged (OFF), replaces it by the sliding median (MEDIAN),
+or only replaces samples that deviate more than k scaled median absolute
+deviations from the sliding median (HAMPEL). The deviation scale is the sliding
+median of |x - median| at the time each sample arrived, which keeps every step
+at O(log w); 1.4826 makes it equal to the standard deviation for Gaussian noise.
+
+Latency for a clean upstroke: the MEDIAN mode always lags (w-1)/2 samples. The
+HAMPEL mode passes the samples unchanged as long as they stay within the noise
+band, so the lag at an upstroke is between 0 and (w-1)/2 samples, depending on
+how far the first samples of the upstroke jump out of that band. A spike or
+stimulus artifact of fewer than (w+1)/2 samples does not reach the detector in
+either mode.
+*/
+class HampelFilter
+{
+	public:
+		enum {OFF = 0, MEDIAN = 1, HAMPEL = 2};
+
+		HampelFilter(void);
+
+		void configure(int mode, int window, double k);
+		void reset(void);
+		double filter(double x);
+
+		double rejected;	// number of samples replaced since the last reset
+
+	private:
+		int mode;
+		double k;
+		SlidingMedian med;	// median of the input
+		SlidingMedian dev;	// median of the absolute deviations from med
+};
+
+/*
+HampelFilter
+------------
+Constructs a filter that passes its input unchanged.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+inline HampelFilter::HampelFilter(void)
+{
+	configure(OFF, 1, 3);
+}
+
+/*
+configure
+---------
+Sets the mode, window and rejection threshold, and empties the window.
+
+IN:
+	*) mode		OFF, MEDIAN or HAMPEL
+	*) window	number of samples of the sliding window
+	*) k		rejection threshold in scaled median absolute deviations
+OUT:
+	*) None
+*/
+inline void HampelFilter::configure(int mode, int window, double k)
+{
+	this->mode = (mode < OFF || mode > HAMPEL ? OFF : mode);
+	this->k = (k > 0 ? k : 3);
+	med.configure(window);
+	dev.configure(window);
+	reset();
+}
+
+/*
+reset
+-----
+Empties the window, e.g. after a pause.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+inline void HampelFilter::reset(void)
+{
+	med.reset();
+	dev.reset();
+	rejected = 0;
+}
+
+/*
+filter
+------
+Filters one sample.
+
+IN:
+	*) x		new sample
+OUT:
+	*) y		filtered sample
+*/
+inline double HampelFilter::filter(double x)
+{
+	if (mode == OFF){return x;}
+
+	double m = med.push(x);
+	if (mode == MEDIAN){return m;}
+
+	double d = fabs(x - m);
+	double s = dev.push(d);
+	if (d > k*1.4826*s)
+	{
+		rejected++;
+		return m;
+	}
+	return x;
+}
+
+#endif
@@ -0,0 +1,196 @@
+/*
+ Copyright (C) 2022 Leiden University Medical Center
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#ifndef APQR_UPSTROKE_DETECTOR_H
+#define APQR_UPSTROKE_DETECTOR_H
+
+/*
+ ********************
+ * UpstrokeDetector *
+ ********************
+
+Low-latency alternative to the 1 ms rise of Vm_log. Every time-step the slope
+of Vm (mV/ms) is estimated by a least-squares line through the last few samples
+(window of Detect_window ms), which reacts to an upstroke much earlier than the
+mean slope over a whole millisecond. The upstroke is detected when this slope
+crosses Slope_thresh.
+
+Since the crossing happens somewhere between two time-steps, onset() linearly
+interpolates between the previous and the current time-step to find how long
+ago (as a fraction of a time-step) the detection became true. The modules
+detect an upstroke when the slope is above Slope_thresh and Vm above V_cutoff.
+On a real AP the slope usually crosses its threshold in the foot, well before
+Vm crosses V_cutoff, so the crossing of V_cutoff sets the onset. onset() takes
+the latest crossing of both conditions within the last time-step. The modules
+use this fraction to sample the reference AP at the matching fractional index,
+so the alignment to the reference no longer jitters by a whole time-step from
+beat to beat. The least-squares slope lags the true slope by a constant
+(w-1)/2 time-steps; this constant offset is the same for the recording and the
+correction of the reference AP and therefore cancels.
+*/
+class UpstrokeDetector
+{
+	public:
+		enum {MAX_WINDOW = 64};
+
+		UpstrokeDetector(void);
+
+		void configure(double period, double window);
+		void reset(void);
+		double update(double V);
+		double onset(double threshold, double V_cutoff) const;
+
+		double slope;		// latest slope estimate (mV/ms)
+
+	private:
+		int m;						// number of samples in the window
+		int head;					// ring slot of the newest sample
+		int filled;					// number of samples received since the reset
+		double prev_slope;			// slope estimate of the previous time-step (mV/ms)
+		double prev_V;				// sample of the previous time-step (mV)
+		double v[MAX_WINDOW];		// ring buffer of samples (mV)
+		double weight[MAX_WINDOW];	// least-squares weights, oldest sample first (1/ms)
+};
+
+/*
+UpstrokeDetector
+----------------
+Constructs a detector for a time-step of 0.1 ms and a window of 0.3 ms.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+inline UpstrokeDetector::UpstrokeDetector(void)
+{
+	configure(0.1, 0.3);
+}
+
+/*
+configure
+---------
+Sets the length of the window and computes the least-squares weights. The
+window contains at least 2 and at most MAX_WINDOW samples.
+
+IN:
+	*) period	the length of a single time-step (ms)
+	*) window	length of the window over which the slope is fitted (ms)
+OUT:
+	*) None
+*/
+inline void UpstrokeDetector::configure(double period, double window)
+{
+	m = (period > 0 ? (int)(window/period + 0.5) + 1 : 2);
+	if (m < 2){m = 2;}
+	if (m > MAX_WINDOW){m = MAX_WINDOW;}
+
+	// slope = sum (x_j - mean(x))*v_j / sum (x_j - mean(x))^2, with x_j = j*period
+	double mean = (m - 1)/2.0;
+	double sxx = 0;
+	for (int j = 0; j < m; j++){sxx += (j - mean)*(j - mean);}
+	for (int j = 0; j < m; j++){weight[j] = (j - mean)/(sxx*(period > 0 ? period : 1));}
+	reset();
+}
+
+/*
+reset
+-----
+Empties the window, e.g. after a pause.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+inline void UpstrokeDetector::reset(void)
+{
+	for (int j = 0; j < MAX_WINDOW; j++){v[j] = 0;}
+	head = 0;
+	filled = 0;
+	slope = 0;
+	prev_slope = 0;
+	prev_V = 0;
+}
+
+/*
+update
+------
+Adds a sample and updates the slope estimate. The slope stays 0 until the
+window is full.
+
+IN:
+	*) V		membrane potential (mV)
+OUT:
+	*) slope	least-squares slope over the window (mV/ms)
+*/
+inline double UpstrokeDetector::update(double V)
+{
+	prev_V = v[head];
+	head = (head + 1) % m;
+	v[head] = V;
+	if (filled < m){filled++;}
+
+	prev_slope = slope;
+	if (filled < m){return slope;}
+
+	double s = 0;
+	for (int j = 0; j < m; j++){s += weight[j]*v[(head + 1 + j) % m];} // oldest sample first
+	slope = s;
+	return slope;
+}
+
+/*
+onset
+-----
+Interpolated time since the detection conditions became true: the slope above
+the threshold and the membrane potential above V_cutoff. Of the conditions that
+became true within the last time-step the latest crossing is taken; a condition
+that was already true at the previous time-step crossed earlier and does not
+set the onset.
+
+IN:
+	*) threshold	slope threshold (mV/ms)
+	*) V_cutoff		threshold potential (mV)
+OUT:
+	*) onset		time since the crossing as a fraction of a time-step, between
+					0 and 1; 0 when a condition is not true, or when both were
+					already true at the previous time-step
+*/
+inline double UpstrokeDetector::onset(double threshold, double V_cutoff) const
+{
+	double V = v[head];
+	if (slope < threshold || V <= V_cutoff){return 0;}
+
+	double frac = 1;
+	bool crossed = false;
+	if (prev_slope < threshold && slope > prev_slope)
+	{
+		frac = (slope - threshold)/(slope - prev_slope);
+		crossed = true;
+	}
+	if (prev_V <= V_cutoff && V > prev_V)
+	{
+		double f = (V - V_cutoff)/(V - prev_V);
+		if (f < frac){frac = f;}
+		crossed = true;
+	}
+	return (crossed ? frac : 0);
+}
+
+#endif
@@ -0,0 +1,46 @@
+/*
+ Copyright (C) 2022 Leiden University Medical Center
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+#ifndef APQR_TEST_H
+#define APQR_TEST_H
+
+#include <stdio.h>
+
+/*
+ ********
+ * test *
+ ********
+
+Minimal checks for the offline tests: CHECK reports a failed condition with its
+location and counts it, and TEST_RESULT prints the outcome of a test program and
+gives its exit code.
+*/
+static int test_failures = 0;
+
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, #cond); \
+			test_failures++; \
+		} \
+	} while (0)
+
+#define TEST_RESULT(name) \
+	(printf("%s: %s\n", name, test_failures ? "FAILED" : "passed"), test_failures ? 1 : 0)
+
+#endif
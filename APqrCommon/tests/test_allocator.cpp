@@ -0,0 +1,68 @@
+/*
+ Copyright (C) 2022 Leiden University Medical Center
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+/*
+Offline test of OutputAllocator.h with the two LED channels of APqrPID3 and
+APqrPIDLTLP4 (blue: gain -Rm_blue, reversal potential blue_Vrev; red: gain
+Rm_red; both up to 5V). allocate() must report a request that no channel can act
+on (blue light needed above blue_Vrev, the normal case on the plateau) as IDLE
+and only a request beyond 5V as SATURATED.
+*/
+
+#include "../OutputAllocator.h"
+#include "test.h"
+
+#include <math.h>
+
+int main(void)
+{
+	const double Rm_blue = 2, Rm_red = 4, blue_Vrev = 0;
+	OutputAllocator allocator;
+	double v[OutputAllocator::MAX_ACTUATORS];
+
+	allocator.setCount(2);
+	allocator.setActuator(0, -Rm_blue, 5, 1);
+	allocator.setReversal(0, blue_Vrev, 0);
+	allocator.setActuator(1, Rm_red, 5, 1);
+
+	// The original two-channel rule within the range of the LEDs
+	CHECK(allocator.allocate(-4, -50, v) == OutputAllocator::MET);
+	CHECK(fabs(v[0] - 2) < 1e-12 && v[1] == 0);
+	CHECK(allocator.allocate(8, 10, v) == OutputAllocator::MET);
+	CHECK(v[0] == 0 && fabs(v[1] - 2) < 1e-12);
+	CHECK(allocator.allocate(0, 10, v) == OutputAllocator::MET);
+	CHECK(v[0] == 0 && v[1] == 0);
+
+	// Depolarization requested above blue_Vrev: no channel acts, which is not saturation
+	CHECK(allocator.allocate(-4, 10, v) == OutputAllocator::IDLE);
+	CHECK(v[0] == 0 && v[1] == 0);
+
+	// Beyond 5V the channel is clamped
+	CHECK(allocator.allocate(-40, -50, v) == OutputAllocator::SATURATED);
+	CHECK(v[0] == 5 && v[1] == 0);
+	CHECK(allocator.allocate(40, 10, v) == OutputAllocator::SATURATED);
+	CHECK(v[0] == 0 && v[1] == 5);
+
+	// With two repolarizing channels the one that saturates hands the rest to the other
+	allocator.setCount(3);
+	allocator.setActuator(2, Rm_red, 1, 0.1);
+	CHECK(allocator.allocate(20, 10, v) == OutputAllocator::MET);
+	CHECK(v[2] == 1 && fabs(Rm_red*(v[1] + v[2]) - 20) < 1e-12);
+
+	return TEST_RESULT("test_allocator");
+}
@@ -0,0 +1,58 @@
+/*
+ Copyright (C) 2022 Leiden University Medical Center
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+/*
+Offline test of EpochBuffer.h: after invalidate() every slot must read as 0
+until it is written again, also when the log is written out of order, and the
+buffer must be no larger than a plain array.
+*/
+
+#include "../EpochBuffer.h"
+#include "test.h"
+
+int main(void)
+{
+	static EpochBuffer<double, 100> log;
+	CHECK(sizeof(log) <= sizeof(double[100]) + sizeof(double));
+
+	for (int i = 0; i < 100; i++){CHECK(log[i] == 0);}
+	for (int i = 0; i < 100; i++){log.set(i, i + 1);}
+	for (int i = 0; i < 100; i++){CHECK(log[i] == i + 1);}
+
+	// A new epoch reads as zeroed, and written slots return without the stale ones
+	log.invalidate();
+	for (int i = 0; i < 100; i++){CHECK(log[i] == 0);}
+	log.set(0, -1);
+	log.set(1, -2);
+	CHECK(log[0] == -1 && log[1] == -2 && log[2] == 0 && log[99] == 0);
+
+	// Writing ahead leaves the skipped slots at 0
+	log.set(10, -11);
+	for (int i = 2; i < 10; i++){CHECK(log[i] == 0);}
+	CHECK(log[10] == -11 && log[11] == 0);
+
+	// at() starts a new slot at 0, as the rolling average of the reference AP expects
+	log.invalidate();
+	log.at(5) += 3;
+	log.at(5) += 4;
+	CHECK(log[5] == 7 && log[4] == 0 && log[6] == 0);
+	log.at(0) += 1;
+	CHECK(log[0] == 1 && log[5] == 7);
+
+	return TEST_RESULT("test_epoch");
+}
@@ -0,0 +1,120 @@
+/*
+ Copyright (C) 2022 Leiden University Medical Center
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+/*
+Offline test of ErrorStats.h: the streaming RMS, maximum and bias must match a
+two-pass computation over the stored errors, also when a constant offset of
+1000 mV dwarfs their spread.
+A beat must split its samples over the phase windows at the split times, and
+only an ended beat may show up in beat() and window().
+*/
+
+#include "../ErrorStats.h"
+#include "test.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <vector>
+
+static const double dt = 0.1;			// time-step (ms)
+
+/*
+direct
+------
+Two-pass RMS, maximal absolute and mean error of the stored errors.
+*/
+static ErrorSummary direct(const std::vector<double>& e)
+{
+	ErrorSummary s = {0, 0, 0};
+	for (size_t k = 0; k < e.size(); k++){s.bias += e[k]; s.max_abs = fmax(s.max_abs, fabs(e[k]));}
+	s.bias /= e.size();
+	for (size_t k = 0; k < e.size(); k++){s.rms += e[k]*e[k];}
+	s.rms = sqrt(s.rms/e.size());
+	return s;
+}
+
+static bool same(const ErrorSummary& a, const ErrorSummary& b, double tol)
+{
+	return fabs(a.rms - b.rms) <= tol && fabs(a.max_abs - b.max_abs) <= tol && fabs(a.bias - b.bias) <= tol;
+}
+
+int main(void)
+{
+	srand(1);
+
+	// Streaming against two-pass, without and with a large offset
+	const double offsets[2] = {0, 1000};
+	for (int o = 0; o < 2; o++){
+		ErrorStats stats;
+		std::vector<double> e(100000);
+		for (size_t k = 0; k < e.size(); k++){
+			e[k] = offsets[o] + 0.001*(rand()/(double)RAND_MAX - 0.5);
+			stats.update(e[k]);
+		}
+		ErrorSummary s = stats.summary(), r = direct(e);
+		printf("offset %4.0f mV: RMS %.12f mV (%.12f), bias %.12f mV (%.12f)\n", offsets[o], s.rms, r.rms, s.bias, r.bias);
+		CHECK(same(s, r, 1e-12*(1 + offsets[o])));
+	}
+
+	// No samples: all zero
+	ErrorStats empty;
+	ErrorSummary z = empty.summary();
+	CHECK(z.rms == 0 && z.max_abs == 0 && z.bias == 0);
+
+	// Phase windows: split at 50 and 250 ms, a beat of 400 ms with the window number as error
+	BeatErrors beat;
+	beat.configure(dt);
+	beat.setSplits(50, 250);
+	beat.sample(7);						// outside a beat: ignored
+	beat.begin();
+	std::vector<double> all, win[BeatErrors::NUM_WINDOWS];
+	for (int k = 0; k < 4000; k++){
+		int w = (k*dt < 50 ? 0 : (k*dt < 250 ? 1 : 2));
+		double e = (w + 1) + 0.1*sin(k*dt);
+		beat.sample(e);
+		all.push_back(e);
+		win[w].push_back(e);
+		if (k == 100){CHECK(beat.beat().rms == 0);}	// the beat is still open
+	}
+	CHECK(win[0].size() == 500 && win[1].size() == 2000 && win[2].size() == 1500);
+	beat.end();
+	CHECK(same(beat.beat(), direct(all), 1e-9));
+	for (int w = 0; w < BeatErrors::NUM_WINDOWS; w++){CHECK(same(beat.window(w), direct(win[w]), 1e-9));}
+
+	// A second end() and samples after it change nothing; begin() without end() ends the open beat
+	beat.end();
+	beat.sample(100);
+	CHECK(same(beat.beat(), direct(all), 1e-9));
+	beat.begin();
+	beat.sample(-2);
+	beat.begin();
+	CHECK(beat.beat().rms == 2 && beat.beat().bias == -2 && beat.window(0).max_abs == 2 && beat.window(1).rms == 0);
+
+	// A second split before the first leaves the plateau window empty
+	beat.setSplits(50, 20);
+	beat.begin();
+	for (int k = 0; k < 1000; k++){beat.sample(1);}
+	beat.end();
+	CHECK(beat.window(1).rms == 0 && fabs(beat.window(0).rms - 1) < 1e-12 && fabs(beat.window(2).rms - 1) < 1e-12);
+
+	// reset() forgets the previous beat
+	beat.reset();
+	CHECK(beat.beat().rms == 0 && beat.window(0).rms == 0);
+
+	return TEST_RESULT("test_errors");
+}
@@ -0,0 +1,134 @@
+/*
+ Copyright (C) 2022 Leiden University Medical Center
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+/*
+Offline test of SlidingMedian.h: the sliding median must equal the median of
+the last w samples found by sorting, and the prefilter must keep a one-sample
+artifact away from the upstroke detection of the modules (the rise of the
+filtered Vm over 1 ms compared to Slope_thresh) at a limited latency. The
+recording is simulated at 10 kHz: 0.3 mV noise, a 200 mV/ms upstroke with a
+random sub-sample onset and a 60 mV one-sample artifact 100 ms before it.
+*/
+
+#include "../SlidingMedian.h"
+#include "test.h"
+
+#include <algorithm>
+#include <math.h>
+#include <stdlib.h>
+#include <vector>
+
+static double uniform(void)
+{
+	return rand()/(double)RAND_MAX;
+}
+
+static double gauss(void)
+{
+	return sqrt(-2*log(uniform() + 1e-12))*cos(2*M_PI*uniform());
+}
+
+/*
+checkMedian
+-----------
+Compares the sliding median to sorting for a random sequence with repeated
+values. The window starts filled with the first sample, as after reset().
+*/
+static void checkMedian(int w)
+{
+	SlidingMedian med;
+	med.configure(w);
+	std::vector<double> x(3000);
+	for (size_t k = 0; k < x.size(); k++){x[k] = (rand() % 50) - 25 + (k % 7 == 0 ? 0.5 : 0);}
+
+	int wrong = 0;
+	for (size_t k = 0; k < x.size(); k++){
+		std::vector<double> window;
+		for (int j = 0; j < w; j++){window.push_back(x[(int)k - j >= 0 ? k - j : 0]);}
+		std::nth_element(window.begin(), window.begin() + w/2, window.end());
+		wrong += (med.push(x[k]) != window[w/2]);
+	}
+	CHECK(wrong == 0);
+}
+
+/*
+detect
+------
+Filters the simulated beats and returns the number of detections before the
+upstroke and the mean latency of the first detection after its onset (samples).
+*/
+static void detect(int mode, int w, bool artifact, int beats, int& false_triggers, double& latency)
+{
+	const double dt = 0.1, thresh = 10;		// ms, mV per ms
+	const int n = 3000, onset = 2000, lag = (int)(1/dt);
+	HampelFilter prefilter;
+	prefilter.configure(mode, w, 3);
+	false_triggers = 0;
+	latency = 0;
+	srand(7);
+	for (int b = 0; b < beats; b++){
+		std::vector<double> Vm_det(n);
+		double frac = uniform();
+		bool found = false;
+		for (int k = 0; k < n; k++){
+			double t = k - onset + frac;			// samples since the onset
+			double V = (t < 0 ? -80 : fmin(-80 + 20*t, 20)) + 0.3*gauss();
+			if (artifact && k == onset - 1000){V += 60;}
+			Vm_det[k] = prefilter.filter(V);
+			if (k >= lag && Vm_det[k] - Vm_det[k-lag] >= thresh*lag*dt){
+				if (k < onset){false_triggers++; break;}
+				if (!found){latency += k - (onset - frac); found = true;}
+			}
+		}
+		prefilter.reset();
+	}
+	latency /= beats;
+}
+
+int main(void)
+{
+	srand(1);
+	int windows[] = {1, 3, 5, 9, 31, SlidingMedian::MAX_WINDOW};
+	for (size_t j = 0; j < sizeof(windows)/sizeof(windows[0]); j++){checkMedian(windows[j]);}
+
+	// An even window is rounded up, and the first sample fills the window
+	SlidingMedian even;
+	even.configure(4);
+	CHECK(even.push(5) == 5);
+	CHECK(even.push(-1) == 5 && even.push(-1) == 5 && even.push(-1) == -1);
+
+	int f_off, f_med, f_ham;
+	double l_off, l_med, l_ham;
+	// Without the prefilter every artifact is taken for an upstroke; the latency of the
+	// filters is measured relative to the unfiltered detection of beats without artifact
+	detect(HampelFilter::OFF, 1, true, 200, f_off, l_off);
+	CHECK(f_off == 200);
+	detect(HampelFilter::OFF, 1, false, 200, f_off, l_off);
+	CHECK(f_off == 0);
+	for (int w = 3; w <= 9; w += 2){
+		detect(HampelFilter::MEDIAN, w, true, 200, f_med, l_med);
+		detect(HampelFilter::HAMPEL, w, true, 200, f_ham, l_ham);
+		printf("w = %d: false triggers median %d, Hampel %d; extra latency median %+.2f, Hampel %+.2f samples\n",
+			w, f_med, f_ham, l_med - l_off, l_ham - l_off);
+		CHECK(f_med == 0 && f_ham == 0);
+		CHECK(fabs(l_med - l_off - (w - 1)/2) < 0.1);		// the median lags (w-1)/2 samples
+		CHECK(l_ham <= l_med + 0.1);						// the Hampel filter at most as much
+	}
+
+	return TEST_RESULT("test_median");
+}
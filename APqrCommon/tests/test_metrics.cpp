@@ -0,0 +1,137 @@
+/*
+ Copyright (C) 2022 Leiden University Medical Center
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+/*
+Offline test of BeatMetrics.h: a train of synthetic APs (-80 mV rest, sigmoid
+upstroke of about 140 mV/ms, exponential repolarization with a time constant of
+100 ms) is streamed at 10 kHz, with begin() at the detection of every upstroke
+(Vm above -40 mV) as in the modules. The metrics must agree with the same
+definitions evaluated on the continuous AP at a 1 us resolution: APD within
+one time-step, amplitude within 1% and RMP within 0.1 mV. dV/dt max depends on
+where the sample grid falls on the upstroke, and must lie between the lowest
+and the highest value that any position of the grid gives.
+*/
+
+#include "../BeatMetrics.h"
+#include "test.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+static const double dt = 0.1;			// time-step (ms)
+static const double BCL = 400;			// basic cycle length (ms)
+static const int beats = 5;
+static double t0[beats];				// upstroke of every beat (ms)
+
+static double V(double t)
+{
+	double v = -80;
+	for (int b = 0; b < beats; b++){
+		double s = 1/(1 + exp(-(t - t0[b])/0.2));
+		v += 110*s*(t > t0[b] ? exp(-(t - t0[b])/100) : 1);
+	}
+	return v;
+}
+
+/*
+reference
+---------
+The metrics of the beat between the detections at t_a and t_b, with the
+resting potential taken over the previous beat, from a 1 us grid. dvdt_lo is
+the lowest dV/dt max over all positions of the sample grid.
+*/
+static BeatShape reference(double t_prev, double t_a, double t_b, double& dvdt_lo)
+{
+	const double h = 1e-3;
+	const double frac[3] = {0.3, 0.5, 0.9};
+	BeatShape s;
+	double rmp = INFINITY, peak = -INFINITY, t_peak = 0, dvdt = 0, t_act = 0, apd[3] = {0, 0, 0};
+	for (double t = t_prev; t < t_a; t += h){rmp = fmin(rmp, V(t));}
+	for (double t = t_a; t < t_b; t += h){
+		if (V(t) > peak){peak = V(t); t_peak = t;}
+		double d = (V(t + dt) - V(t))/dt; // the steepest pair of samples one time-step apart
+		if (d > dvdt){dvdt = d; t_act = t + dt/2;}
+	}
+	dvdt_lo = INFINITY;
+	for (double phase = 0; phase < dt; phase += h){
+		double d = 0;
+		for (double t = t_act - 2 + phase; t < t_act + 2; t += dt){d = fmax(d, (V(t + dt) - V(t))/dt);}
+		dvdt_lo = fmin(dvdt_lo, d);
+	}
+	for (int k = 0; k < 3; k++){
+		double level = peak - frac[k]*(peak - rmp);
+		for (double t = t_peak; t < t_b; t += h){
+			if (V(t) <= level){apd[k] = t - t_act; break;}
+		}
+	}
+	s.apd30 = apd[0]; s.apd50 = apd[1]; s.apd90 = apd[2];
+	s.amplitude = peak - rmp;
+	s.dvdt_max = dvdt;
+	s.rmp = rmp;
+	return s;
+}
+
+int main(void)
+{
+	srand(1);
+	for (int b = 0; b < beats; b++){t0[b] = 50 + b*BCL + rand()/(double)RAND_MAX;}
+
+	BeatMetrics metrics;
+	metrics.configure(dt);
+	double detect[beats];
+	int b = 0;
+	double v_prev = -80;
+	for (long k = 0; k*dt < beats*BCL; k++){
+		double v = V(k*dt);
+		metrics.sample(v);
+		if (b < beats && v > -40 && v_prev <= -40){
+			detect[b] = k*dt;
+			metrics.begin();
+			if (b == 3){
+				// A second boundary on the same time-step counts once
+				double apd90 = metrics.result().apd90;
+				metrics.begin();
+				CHECK(metrics.result().apd90 == apd90);
+			}
+			if (b >= 2){
+				// The beat between the previous two detections is complete
+				BeatShape m = metrics.result();
+				double dvdt_lo;
+				BeatShape r = reference(detect[b-2], detect[b-1], detect[b], dvdt_lo);
+				printf("beat %d: APD30/50/90 %.2f/%.2f/%.2f ms (%.2f/%.2f/%.2f), amplitude %.2f mV (%.2f), dV/dt max %.1f mV/ms (%.1f-%.1f), RMP %.2f mV (%.2f)\n",
+					b - 1, m.apd30, m.apd50, m.apd90, r.apd30, r.apd50, r.apd90,
+					m.amplitude, r.amplitude, m.dvdt_max, dvdt_lo, r.dvdt_max, m.rmp, r.rmp);
+				CHECK(fabs(m.apd30 - r.apd30) <= dt);
+				CHECK(fabs(m.apd50 - r.apd50) <= dt);
+				CHECK(fabs(m.apd90 - r.apd90) <= dt);
+				CHECK(fabs(m.amplitude - r.amplitude) < 0.01*r.amplitude);
+				CHECK(m.dvdt_max > dvdt_lo - 0.01 && m.dvdt_max < r.dvdt_max + 0.01);
+				CHECK(fabs(m.rmp - r.rmp) < 0.1);
+			}
+			b++;
+		}
+		v_prev = v;
+	}
+	CHECK(b == beats);
+
+	// reset() forgets the beats
+	metrics.reset();
+	CHECK(metrics.result().apd90 == 0 && metrics.result().amplitude == 0);
+
+	return TEST_RESULT("test_metrics");
+}
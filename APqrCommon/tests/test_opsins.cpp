@@ -0,0 +1,186 @@
+/*
+ Copyright (C) 2022 Leiden University Medical Center
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+/*
+Offline test of OpsinModels.h:
+	*) under constant light the open fraction of the three-state model settles
+	   at the analytical steady state Ga*Gr/(Ga*Gr + Gd*Gr + Ga*Gd)
+	*) in the dark the open fraction of the three-state model decays with the
+	   time constant 1/Gd
+	*) every lane of an OpsinBatch follows a light protocol of its own exactly
+	   as a batch of one lane does, and within 2% of the peak current of a
+	   reference integration (classic Runge-Kutta at 1 us), for both models
+*/
+
+#include "../OpsinModels.h"
+#include "test.h"
+
+#include <math.h>
+
+static const double dt = 0.1;			// time-step (ms)
+static const int N = 8;					// lanes
+
+/*
+Reference
+---------
+Scalar integration of the same model with the classic fourth order Runge-Kutta
+method, x = {O1, O2, C2}.
+*/
+struct Reference
+{
+	OpsinParams par;
+	double Ga1, Ga2, Gr, Gf, Gb;
+	double x[3];
+
+	void setLight(double phi)
+	{
+		double hp = (phi > 0 ? pow(phi, par.p)/(pow(phi, par.p) + pow(par.phi_m, par.p)) : 0);
+		double hq = (phi > 0 ? pow(phi, par.q)/(pow(phi, par.q) + pow(par.phi_m, par.q)) : 0);
+		Ga1 = par.k_a*hp;
+		Ga2 = par.k2*hp;
+		Gr = par.k_r*hq + par.Gr0;
+		Gf = par.kf*hq + par.Gf0;
+		Gb = par.kb*hq + par.Gb0;
+	}
+
+	void derivative(const double y[3], double d[3]) const
+	{
+		if (par.states == 4)
+		{
+			double C1 = 1 - y[0] - y[1] - y[2];
+			d[0] = Ga1*C1 + Gb*y[1] - (par.Gd1 + Gf)*y[0];
+			d[1] = Ga2*y[2] + Gf*y[0] - (par.Gd2 + Gb)*y[1];
+			d[2] = par.Gd2*y[1] - (Ga2 + par.Gr0)*y[2];
+		}
+		else
+		{
+			double C = 1 - y[0] - y[2];
+			d[0] = Ga1*C - par.Gd1*y[0];
+			d[1] = 0;
+			d[2] = par.Gd1*y[0] - Gr*y[2];
+		}
+	}
+
+	void step(double period)
+	{
+		const int M = 100;
+		double h = period/M;
+		for (int s = 0; s < M; s++){
+			double k1[3], k2[3], k3[3], k4[3], y[3];
+			derivative(x, k1);
+			for (int r = 0; r < 3; r++){y[r] = x[r] + 0.5*h*k1[r];}
+			derivative(y, k2);
+			for (int r = 0; r < 3; r++){y[r] = x[r] + 0.5*h*k2[r];}
+			derivative(y, k3);
+			for (int r = 0; r < 3; r++){y[r] = x[r] + h*k3[r];}
+			derivative(y, k4);
+			for (int r = 0; r < 3; r++){x[r] += h/6*(k1[r] + 2*k2[r] + 2*k3[r] + k4[r]);}
+		}
+	}
+
+	double current(double V) const
+	{
+		double O = x[0] + par.gamma*x[1];
+		if (par.pump){return par.g*O;}
+		if (par.v0 > 0){return par.g*O*par.v1*(1 - exp(-(V - par.E)/par.v0));}
+		return par.g*O*(V - par.E);
+	}
+};
+
+// Light of lane n at time t: pulses of 20 ms every 100 ms, of a different irradiance per lane
+static double protocol(int n, double t)
+{
+	return (fmod(t, 100) < 20 ? 0.05*pow(2.0, n) : 0);
+}
+
+static void compare(const char* name, const OpsinParams& par)
+{
+	OpsinBatch<N> batch;
+	OpsinBatch<1> single[N];
+	Reference ref[N];
+	batch.configure(par, dt);
+	for (int n = 0; n < N; n++){
+		single[n].configure(par, dt);
+		ref[n].par = par;
+		ref[n].x[0] = ref[n].x[1] = ref[n].x[2] = 0;
+	}
+
+	double V[N], I[N], peak = 0, dev = 0, dev_single = 0;
+	for (long k = 0; k*dt < 500; k++){
+		double t = k*dt;
+		for (int n = 0; n < N; n++){
+			V[n] = -80 + 10*n;
+			batch.setLight(n, protocol(n, t));
+			single[n].setLight(0, protocol(n, t));
+			ref[n].setLight(protocol(n, t));
+		}
+		batch.step(V, I);
+		for (int n = 0; n < N; n++){
+			double I1;
+			single[n].step(&V[n], &I1);
+			ref[n].step(dt);
+			double I_ref = ref[n].current(V[n]);
+			peak = fmax(peak, fabs(I_ref));
+			dev = fmax(dev, fabs(I[n] - I_ref));
+			dev_single = fmax(dev_single, fabs(I[n] - I1));
+		}
+	}
+	printf("%s: peak current %.1f pA, largest deviation %.3f pA from the reference, %.1e pA between lanes and single lanes\n",
+		name, peak, dev, dev_single);
+	CHECK(peak > 0);
+	CHECK(dev < 0.02*peak);
+	CHECK(dev_single <= 1e-12*peak);
+}
+
+int main(void)
+{
+	OpsinParams par = ChR2_3state();
+
+	// Steady state under constant light, from the dark-adapted state
+	OpsinBatch<N> batch;
+	batch.configure(par, dt);
+	double phi[N], V[N], I[N];
+	for (int n = 0; n < N; n++){phi[n] = 0.05*pow(2.0, n); V[n] = -80; batch.setLight(n, phi[n]);}
+	for (long k = 0; k*dt < 60000; k++){batch.step(V, I);}
+	double worst = 0;
+	for (int n = 0; n < N; n++){
+		Reference r;
+		r.par = par;
+		r.setLight(phi[n]);
+		double Ga = r.Ga1, Gd = par.Gd1, Gr = r.Gr;
+		double O = Ga*Gr/(Ga*Gr + Gd*Gr + Ga*Gd);
+		worst = fmax(worst, fabs(batch.O1[n] - O)/O);
+	}
+	printf("steady state: largest relative deviation of the open fraction %.1e\n", worst);
+	CHECK(worst < 1e-6);
+
+	// Off-decay: the open fraction falls by exp(-Gd*t) once the light is off
+	for (int n = 0; n < N; n++){batch.setLight(n, 0);}
+	double O_start = batch.O1[N-1];
+	const double T = 20;				// ms
+	for (long k = 0; k*dt < T - dt/2; k++){batch.step(V, I);}
+	double tau = -T/log(batch.O1[N-1]/O_start);
+	printf("off-decay: tau %.3f ms, 1/Gd %.3f ms\n", tau, 1/par.Gd1);
+	CHECK(fabs(tau*par.Gd1 - 1) < 0.01);
+
+	compare("three-state ChR2", par);
+	compare("four-state ChR2", ChR2_4state());
+	compare("Jaws", Jaws());
+
+	return TEST_RESULT("test_opsins");
+}
@@ -0,0 +1,97 @@
+/*
+ Copyright (C) 2022 Leiden University Medical Center
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+/*
+Offline test of the preview term of APqrPIDLTLP4 (ReferencePreview.h). A
+first-order cell, which relaxes to its resting potential and is pushed down by
+a positive controller output as the red LED does, tracks a step of the
+reference. The controller is P + F as in correctingTick(), with
+F = -K_preview*preview[k]; with the preview the error around the step must be
+smaller and the cell must reach the middle of the step earlier than with P
+alone. The plateau error that P alone leaves is the same in both cases, so the
+error is taken over 5 ms before to 15 ms after the step.
+*/
+
+#include "../ReferencePreview.h"
+#include "test.h"
+
+#include <math.h>
+#include <vector>
+
+static const double dt = 0.1;		// time-step (ms)
+static const double tau_m = 5;		// membrane time constant (ms)
+static const double b = 2;			// response to the controller output (mV/ms)
+static const double V_rest = -80;	// resting potential (mV)
+static const double K_p = 1;
+
+/*
+track
+-----
+Simulates the cell tracking the reference and returns the RMS error between
+15 and 35 ms and the time at which Vm first passes the middle of the step.
+*/
+static void track(const std::vector<double>& ref, const std::vector<double>& preview, double K_preview,
+	double& rms, double& t_half)
+{
+	double V = ref[0];
+	double half = 0.5*(ref.front() + ref.back());
+	double sum = 0;
+	int n = 0;
+	t_half = -1;
+	for (size_t k = 0; k < ref.size(); k++){
+		double PID = K_p*(V - ref[k]) - K_preview*preview[k];
+		V += dt*(-(V - V_rest)/tau_m - b*PID);
+		if (k*dt >= 15 && k*dt < 35){sum += (V - ref[k])*(V - ref[k]); n++;}
+		if (t_half < 0 && V >= half){t_half = k*dt;}
+	}
+	rms = sqrt(sum/n);
+}
+
+int main(void)
+{
+	// Step of 100 mV at 20 ms, as the upstroke of an iAP, followed by 80 ms of plateau
+	std::vector<double> ref(1000);
+	for (size_t k = 0; k < ref.size(); k++){ref[k] = (k*dt < 20 ? -80 : 20);}
+
+	std::vector<double> preview;
+	referencePreview(ref, 20, 2, dt, preview);
+	CHECK(preview.size() == ref.size());
+	CHECK(preview[0] == 0);										// nothing changes in the next 2 ms
+	CHECK(preview[195] > 0);									// the step lies ahead
+	CHECK(preview[199] > preview[195]);							// and closer, so it weighs more
+	CHECK(fabs(preview[199] - 100) < 1e-9);						// all upcoming points lie on the plateau
+	CHECK(preview[200] == 0 && preview.back() == 0);			// beyond the step and at the end
+
+	double rms_p, t_p, rms_f, t_f;
+	track(ref, preview, 0, rms_p, t_p);
+	track(ref, preview, 0.3, rms_f, t_f);
+	printf("P only: RMS %.2f mV, half step at %.2f ms; P + F: RMS %.2f mV, half step at %.2f ms\n",
+		rms_p, t_p, rms_f, t_f);
+	CHECK(t_p > 0 && t_f > 0);
+	CHECK(rms_f < rms_p);
+	CHECK(t_f < t_p);
+
+	// No preview points or a preview of a flat reference gives no feedforward
+	std::vector<double> flat(100, -80);
+	referencePreview(flat, 20, 2, dt, preview);
+	for (size_t k = 0; k < preview.size(); k++){CHECK(preview[k] == 0);}
+	referencePreview(ref, 0, 2, dt, preview);
+	for (size_t k = 0; k < preview.size(); k++){CHECK(preview[k] == 0);}
+
+	return TEST_RESULT("test_preview");
+}
@@ -0,0 +1,99 @@
+/*
+ Copyright (C) 2022 Leiden University Medical Center
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+/*
+Offline test of ReversalEstimator.h: a cell whose own currents follow 80% of
+the slope of a reference AP plus a drift is corrected by blue light through
+a light-gated current g*VLED*(Vm - Vrev), with Vm measured with noise. The
+light is proportional to how far Vm lies below the reference, and only given
+below a gating threshold that is updated at every upstroke as in the modules:
+the hand-entered Blue_Vrev, raised to the estimate once that is valid. The
+estimate must end within 1 mV of Vrev, whether Blue_Vrev lies 20 mV above or
+20 mV below it.
+*/
+
+#include "../ReversalEstimator.h"
+#include "test.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+static const double dt = 0.1;			// time-step (ms)
+static const double BCL = 500;			// basic cycle length (ms)
+
+// Reference AP: -80 mV rest, 1 ms upstroke to +30 mV, plateau and repolarization
+static double ref(double t)
+{
+	t = fmod(t, BCL);
+	if (t < 1){return -80 + 110*t;}
+	if (t < 300){return -80 + 110*(1 - 0.6*(t - 1)/299);}
+	if (t < 350){return -80 + 44*(350 - t)/50;}
+	return -80;
+}
+
+static double noise(double sigma)
+{
+	// Sum of uniform numbers, close enough to a normal distribution
+	double s = 0;
+	for (int k = 0; k < 12; k++){s += rand()/(double)RAND_MAX;}
+	return sigma*(s - 6);
+}
+
+/*
+run
+---
+Corrects 40 beats and returns the estimate of the reversal potential.
+*/
+static double run(double Vrev, double blue_Vrev, bool& valid)
+{
+	const double g = 0.01;				// light-gated conductance over Cm (1/(V ms))
+	ReversalEstimator est;
+	double Vm = -80, Vm_meas = -80, VLED = 0, gate = blue_Vrev;
+	for (long k = 1; k*dt < 40*BCL; k++){
+		if ((k - 1) % (long)(BCL/dt) == 0){gate = (est.valid() ? fmax(blue_Vrev, est.estimate()) : blue_Vrev);}
+		double t = (k - 1)*dt;
+		double dref = (ref(t + dt) - ref(t))/dt;
+		double Vm_next = Vm + dt*(0.8*dref - 0.02 - g*VLED*(Vm - Vrev));
+		double Vm_next_meas = Vm_next + noise(0.2);
+		est.update(VLED, Vm_meas, (Vm_next_meas - Vm_meas)/dt, dref);
+		Vm = Vm_next;
+		Vm_meas = Vm_next_meas;
+		// Blue light in proportion to the error, only below the gate
+		double err = ref(t + dt) - Vm_meas;
+		VLED = (Vm_meas < gate && err > 0 ? fmin(0.5*err, 5) : 0);
+	}
+	valid = est.valid();
+	return est.estimate();
+}
+
+int main(void)
+{
+	srand(1);
+	const double Vrevs[3] = {-10, 0, 10};
+	for (int r = 0; r < 3; r++){
+		for (int above = -20; above <= 20; above += 20){
+			bool valid;
+			double blue_Vrev = Vrevs[r] + above;
+			double e = run(Vrevs[r], blue_Vrev, valid);
+			printf("Vrev %+3.0f mV, Blue_Vrev %+3.0f mV: estimate %+.2f mV%s\n", Vrevs[r], blue_Vrev, e, (valid ? "" : " (not valid)"));
+			CHECK(valid);
+			CHECK(fabs(e - Vrevs[r]) < 1);
+		}
+	}
+	return TEST_RESULT("test_reversal");
+}
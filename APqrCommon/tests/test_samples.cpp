@@ -0,0 +1,108 @@
+/*
+ Copyright (C) 2022 Leiden University Medical Center
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+/*
+Offline test of SampleTypes.h and ControlKernels.h: the regression slope of the
+D term of APqrPID3 (sumy/sumxy with the same normalisation), the rolling
+average of the reference AP and its interpolated look-up are computed on float
+and 16.16 fixed-point samples and compared to the double path. The error
+signal is an AP-shaped error with 0.3 mV noise, stored in a ring of 10000
+samples, and the slope is taken at every index including the wrap of the ring.
+*/
+
+#include "../ControlKernels.h"
+#include "test.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+static const int N = 10000;
+static const double dt = 0.1;		// time-step (ms)
+
+/*
+slope
+-----
+Least-squares slope of the last L samples as in correctingTick() of APqrPID3.
+*/
+template<typename A>
+static double slope(const A& arr, int n, int L)
+{
+	double sumx = 0, sumx2 = 0;
+	for (int i = 0; i < L; i++){sumx += i*dt; sumx2 += i*dt*i*dt;}
+	double num = L*windowMoment(arr, n, L, N)*dt - sumx*windowSum(arr, n, L, N);
+	double denom = L*sumx2 - sumx*sumx;
+	return num/denom;
+}
+
+static double d[N];
+static float f[N];
+static FixedPoint<16> x[N];
+
+int main(void)
+{
+	srand(1);
+	for (int k = 0; k < N; k++){
+		double t = k*dt;
+		d[k] = 30*exp(-t/40)*sin(t/15) + 0.3*(rand()/(double)RAND_MAX - 0.5)*2;
+		f[k] = d[k];
+		x[k] = d[k];
+	}
+
+	int lengths[] = {5, 20, 50};
+	for (int j = 0; j < 3; j++){
+		int L = lengths[j];
+		double dev_f = 0, dev_x = 0;
+		for (int n = 0; n < N; n++){
+			double s = slope(d, n, L);
+			dev_f = fmax(dev_f, fabs(slope(f, n, L) - s));
+			dev_x = fmax(dev_x, fabs(slope(x, n, L) - s));
+		}
+		printf("window %2d: largest deviation of the slope %.2g (float), %.2g (fixed) mV/ms\n", L, dev_f, dev_x);
+		CHECK(dev_f < 1e-4);
+		CHECK(dev_x < 1e-4);
+	}
+
+	// The reference AP as the rolling average of ten recorded APs, and its look-up
+	// at fractional indices
+	static double ad[N];
+	static float af[N];
+	static FixedPoint<16> ax[N];
+	for (int ap = 0; ap < 10; ap++){
+		for (int k = 0; k < N; k++){
+			double V = -80 + 110*exp(-k*dt/200)*(k > 20) + 0.3*(rand()/(double)RAND_MAX - 0.5);
+			averageInto(ad[k], V, ap);
+			averageInto(af[k], V, ap);
+			averageInto(ax[k], V, ap);
+		}
+	}
+	double dev_f = 0, dev_x = 0;
+	for (double pos = -1; pos < N + 1; pos += 0.37){
+		double r = interpolate(ad, N, pos);
+		dev_f = fmax(dev_f, fabs(interpolate(af, N, pos) - r));
+		dev_x = fmax(dev_x, fabs(interpolate(ax, N, pos) - r));
+	}
+	printf("reference AP: largest deviation %.2g (float), %.2g (fixed) mV\n", dev_f, dev_x);
+	CHECK(dev_f < 1e-4);
+	CHECK(dev_x < 1e-4);
+
+	// Fixed point rounds to the nearest step and saturates
+	CHECK(fabs((double)FixedPoint<16>(-12.345678) + 12.345678) <= 0.5/65536);
+	CHECK((double)FixedPoint<16>(1e6) > 32767 && (double)FixedPoint<16>(-1e6) < -32767);
+
+	return TEST_RESULT("test_samples");
+}
@@ -0,0 +1,102 @@
+/*
+ Copyright (C) 2022 Leiden University Medical Center
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+/*
+Offline test of ShadowControllers.h: a live controller as in correctingTick() of
+APqrPID3 (P, gated I, filtered D, dead-bands, blue light only below blue_Vrev)
+corrects a cell that follows the model of PlantEstimator exactly, with a noisy
+drift. The shadows are driven as in the modules; lane 0 holds the live gains
+and must then reproduce the measured error, so its cost equals the summed
+squared error of the live loop.
+*/
+
+#include "../ShadowControllers.h"
+#include "test.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <vector>
+
+static const double dt = 0.1;			// time-step (ms)
+static const double a = -0.02;			// relaxation of the error per time-step
+static const double b_blue = 1.5;		// effect of the blue channel (mV per V)
+static const double b_red = -1.0;		// effect of the red channel (mV per V)
+static const double blue_Vrev = 0;		// (mV)
+static const double K_p = 0.8, K_i = 0.01, K_d = 0.5, Rm_blue = 1, Rm_red = 1;
+static const double min_PID = 0.2, PID_tresh = 0.05, corr_start = 3;
+
+int main(void)
+{
+	const int n = 3000;
+	std::vector<double> ref(n), e(n), drift(n);
+	srand(1);
+	for (int k = 0; k < n; k++){
+		ref[k] = (k*dt < 2 ? -80 + 50*k*dt : (k*dt < 200 ? 20 - 0.5*k*dt : -80));
+		drift[k] = 0.3*sin(k*dt/7) + 0.2*(rand()/(double)RAND_MAX - 0.5);
+	}
+
+	ShadowControllers shadows;
+	shadows.setCandidates(K_p, K_i, K_d, Rm_blue, Rm_red, 2);
+
+	double err = 15, Int = 0, PID = 0, slope = 0, VLED = 0, VLED_blue = 0, VLED_red = 0, live_cost = 0;
+	for (int k = 0; k < n; k++){
+		e[k] = err;
+		if (k == 0)
+			{shadows.startBeat(e[k], Int, PID, VLED_blue, VLED_red, VLED);}
+		else
+		{
+			shadows.step(ref[k-1], e[k-1], slope, 0, drift[k-1], a, b_blue, b_red, blue_Vrev,
+				min_PID, PID_tresh, k-1 >= corr_start-1, dt);
+			live_cost += e[k]*e[k];
+		}
+
+		double Vm = ref[k] + e[k];
+		if (VLED < 5 && (Vm < blue_Vrev || e[k] > 0)){Int += e[k];}
+		// Least-squares slope over the last (up to) 5 errors, as a stand-in for the live filter
+		int m = (k < 4 ? k + 1 : 5);
+		double sx = 0, sy = 0, sxy = 0, sx2 = 0;
+		for (int j = 0; j < m; j++){
+			double x = j*dt, y = e[k-m+1+j];
+			sx += x; sy += y; sxy += x*y; sx2 += x*x;
+		}
+		slope = (m > 1 ? (m*sxy - sx*sy)/(m*sx2 - sx*sx) : 0);
+
+		double PID_diff = PID;
+		PID = K_p*e[k] + K_i*Int + K_d*slope;
+		PID_diff -= PID;
+		if (k >= corr_start-1 && fabs(PID_diff) > PID_tresh){
+			if (fabs(PID) > min_PID){
+				VLED_blue = (PID < 0 && Vm < blue_Vrev ? fmin(-PID/Rm_blue, 5) : 0);
+				VLED_red = (PID > 0 ? fmin(PID/Rm_red, 5) : 0);
+				if (VLED_blue > 0 || VLED_red > 0){VLED = fmax(VLED_blue, VLED_red);}
+			}
+			else {VLED_blue = 0; VLED_red = 0;}
+		}
+		err = err + a*err + b_blue*VLED_blue + b_red*VLED_red + drift[k];
+	}
+
+	printf("live cost %.6g, lane 0 %.6g, best lane %d (%.6g)\n", live_cost, shadows.cost(0), shadows.best(), shadows.cost(shadows.best()));
+	CHECK(live_cost > 0);
+	CHECK(fabs(shadows.cost(0) - live_cost) <= 1e-9*live_cost);
+	CHECK(shadows.cost(shadows.best()) <= shadows.cost(0));
+	int differ = 0;
+	for (int l = 1; l < ShadowControllers::LANES; l++){differ += (shadows.cost(l) != shadows.cost(0));}
+	CHECK(differ > 20);
+
+	return TEST_RESULT("test_shadows");
+}
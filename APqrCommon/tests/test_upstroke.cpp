@@ -0,0 +1,92 @@
+/*
+ Copyright (C) 2022 Leiden University Medical Center
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ */
+
+/*
+Offline test of UpstrokeDetector.h on a realistic upstroke: a sigmoid from -80
+to +30 mV with a maximal slope of about 230 mV/ms, sampled at 10 kHz with a
+random sub-sample onset. With the thresholds of the modules (Slope_thresh
+10 mV/ms, V_cutoff -40 mV) the slope crosses its threshold in the foot and the
+detection is set by V_cutoff. onset() must then give a nonzero fraction, and
+the detection time minus that fraction must follow the true crossing of
+V_cutoff much more closely than the detection time itself.
+*/
+
+#include "../UpstrokeDetector.h"
+#include "test.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+static const double dt = 0.1;			// time-step (ms)
+static const double tau = 0.12;			// steepness of the upstroke (ms)
+static const double thresh = 10;		// Slope_thresh (mV/ms)
+static const double V_cutoff = -40;		// (mV)
+
+static double upstroke(double t)
+{
+	return -80 + 110/(1 + exp(-t/tau));
+}
+
+int main(void)
+{
+	const int beats = 500;
+	UpstrokeDetector detector;
+	double sum1 = 0, sum1_2 = 0, sum2 = 0, sum2_2 = 0;
+	int zero = 0, slope_only = 0;
+
+	srand(1);
+	for (int b = 0; b < beats; b++){
+		double shift = rand()/(double)RAND_MAX;			// sub-sample onset (time-steps)
+		// True crossing of V_cutoff in time-steps, from upstroke(t) = V_cutoff
+		double t_c = (-tau*log(110/(V_cutoff + 80) - 1))/dt + 50 + shift;
+		detector.configure(dt, 0.3);
+		for (int k = 0; k < 100; k++){
+			double V = upstroke((k - 50 - shift)*dt);
+			detector.update(V);
+			if (detector.slope >= thresh && V > V_cutoff){
+				double frac = detector.onset(thresh, V_cutoff);
+				zero += (frac == 0);
+				slope_only += (detector.onset(thresh, -1e9) != 0);	// the slope alone crossed earlier
+				double e1 = k - t_c, e2 = k - frac - t_c;
+				sum1 += e1; sum1_2 += e1*e1;
+				sum2 += e2; sum2_2 += e2*e2;
+				break;
+			}
+		}
+	}
+	double sd1 = sqrt(sum1_2/beats - (sum1/beats)*(sum1/beats));
+	double sd2 = sqrt(sum2_2/beats - (sum2/beats)*(sum2/beats));
+	printf("jitter of the onset: %.3f time-steps detected, %.3f interpolated (mean offset %.3f)\n",
+		sd1, sd2, sum2/beats);
+	CHECK(zero == 0);
+	CHECK(slope_only == 0);
+	CHECK(sd1 > 0.25);
+	CHECK(sd2 < 0.05);
+	CHECK(fabs(sum2/beats) < 0.05);
+
+	// When V_cutoff lies below the foot, the slope sets the onset
+	detector.configure(dt, 0.3);
+	double frac = 0;
+	for (int k = 0; k < 100; k++){
+		detector.update(upstroke((k - 50 - 0.4)*dt));
+		if (detector.slope >= thresh){frac = detector.onset(thresh, -90); break;}
+	}
+	CHECK(frac > 0 && frac <= 1);
+
+	return TEST_RESULT("test_upstroke");
+}
@@ -27,6 +27,7 @@
 
 #include <APqrPID3.h>
 #include <math.h>
+#include <algorithm>
 #include <vector>
 
 /*
@@ -45,6 +46,14 @@ IN:
 						of an AP
 	*) Slope_tresh		Slope threshold that defines the beginning of the
 						AP (mV/ms)
+	*) Prefilter		Outlier rejection of the Vm that is seen by the upstroke
+						detector: 0 = off, 1 = sliding median, 2 = Hampel
+	*) Prefilter_window	Length of the sliding window of the prefilter (samples)
+	*) Hampel_k			Rejection threshold of the Hampel prefilter, in scaled
+						median absolute deviations
+	*) Detector			Upstroke detection: 0 = rise over the last ms, 1 = slope
+						over Detect_window with interpolated onset
+	*) Detect_window	Length of the window of the slope fit (ms)
 	*) BCL_cutoff		Threshold value for the end of an AP, given as a
 						percentage of the total APD
 	*) lognum			Number of APs that need to be logged as a reference
@@ -59,10 +68,65 @@ IN:
 	*) length			Amount of points that need to be taken into account to
 						find the derivative (slope of the linear trend line of
 						these points)
+	*) D_filter			Estimator of the derivative: 0 = linear trend line over
+						length points, 1 = Savitzky-Golay, 2 = noise-robust
+	*) D_window			Amount of points of the Savitzky-Golay and noise-robust
+						filters (5, 7, 9, 11, 15, 21 or 31)
+	*) D_order			Polynomial order of the Savitzky-Golay filter (2 to 4)
 	*) PID_tresh		treshold value under which the same output as before
 						gets repeated
 	*) min_PID			value under which the lights get switched off
+	*) Auto_thresh		value that indicates whether or not PID_tresh and min_PID
+						follow the noise of Vm between the beats
+	*) Auto_k			min_PID in multiples of the noise that this gives on
+						the P term
+	*) Alt_window		Number of beats over which alternans and short-term
+						variability of APD90 are computed
+	*) Alt_thresh		Alternans magnitude of APD90 above which alternans is
+						flagged (ms, 0 = off)
+	*) STV_thresh		Short-term variability of APD90 above which alternans
+						is flagged (ms, 0 = off)
+	*) Alt_backoff		Factor by which the gains are scaled
+						when alternans is flagged (1 = no back-off)
+	*) Err_split1		End of the first phase window of the error statistics
+						after the upstroke (ms)
+	*) Err_split2		End of the second phase window of the error statistics
+						after the upstroke (ms)
 	*) reset_I_on		value that indicates whether or not to reset I at RMP
+	*) Opsin_order		Order of the opsin kinetics model whose inverse is applied
+						to the LED commands (0 = no compensation, 1 or 2)
+	*) tau_on_blue		Activation time constant of the 'blue' ChR current (ms)
+	*) tau_off_blue		Deactivation time constant of the 'blue' ChR current (ms)
+	*) tau_on_red		Activation time constant of the 'red' current (ms)
+	*) tau_off_red		Deactivation time constant of the 'red' current (ms)
+	*) Vrev_estimation	value that indicates whether or not Blue_Vrev is estimated
+						online; at every upstroke the gating threshold is raised
+						to the estimate when that lies above Blue_Vrev
+	*) Vrev_lambda		Forgetting factor of the Blue_Vrev estimator
+	*) RLS_on			value that indicates whether or not the response of the cell
+						is identified online
+	*) RLS_lambda		Forgetting factor of the online identification
+	*) RLS_autoscale	value that indicates whether or not Rm_blue/Rm_red is replaced by
+						the identified value at every upstroke
+	*) RLS_Tc			Time constant (ms) with which the rescaled controller
+						should remove an error
+	*) AutoTune			value that starts (1) a relay auto-tuning experiment at the
+						next upstroke after Modify; the tuned gains replace K_p, K_i
+						and K_d and AutoTune returns to 0 when it is done
+	*) AT_start			Start of the relay window within the AP (ms)
+	*) AT_end			End of the relay window within the AP (ms)
+	*) AT_amplitude		Relay amplitude in PID units
+	*) AT_hysteresis	Relay hysteresis (mV)
+	*) AT_beats			Number of APs the relay experiment lasts
+	*) AT_rule			Tuning rule: 0 = Ziegler-Nichols, 1 = Ziegler-Nichols
+						without overshoot, 2 = Tyreus-Luyben
+	*) Shadow_on		value that indicates whether or not alternative gain sets
+						are evaluated in parallel against the identified cell
+						response (needs RLS_on)
+	*) Shadow_spread	Factor by which the alternative gain sets differ from the
+						live K_p, K_i, K_d, Rm_blue and Rm_red
+	*) Shadow_adopt		value that indicates whether or not the best alternative
+						gain set replaces the live gains at every upstroke
 OUT:
 	*) VLED1 			voltage that is used to power the first LED driver that
 						regulates the light that is shined onto the cells
@@ -105,6 +169,16 @@ static DefaultGUIModel::variable_t vars[] = {
 	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
 	{ "Slope_thresh (mV/ms)", "SLope threshold that defines the beginning of the AP (mV/ms)",
 	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "Prefilter", "Outlier rejection of the Vm seen by the upstroke detector (0 = off, 1 = median, 2 = Hampel)",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "Prefilter_window", "Length of the sliding window of the prefilter (samples)",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "Hampel_k", "Rejection threshold of the Hampel prefilter (scaled median absolute deviations)",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "Detector", "Upstroke detection (0 = rise over the last ms, 1 = slope over Detect_window with interpolated onset)",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "Detect_window (ms)", "Length of the window of the slope fit of the upstroke detector",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
 	{ "BCL_cutoff (pct)", "Threshold value for the end of an AP, given as a percentage of the total APD",
 	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
 	{ "Rm_blue (MOhm)", "MOhm", DefaultGUIModel::PARAMETER
@@ -125,12 +199,88 @@ static DefaultGUIModel::variable_t vars[] = {
 	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
 	{ "length", "Amount of points that need to be taken into account to find the derivative (slope of the linear trend line of these points)",
 	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "D_filter", "Estimator of the derivative (0 = linear trend line, 1 = Savitzky-Golay, 2 = noise-robust)",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "D_window", "Amount of points of the Savitzky-Golay and noise-robust filters (5, 7, 9, 11, 15, 21 or 31)",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "D_order", "Polynomial order of the Savitzky-Golay filter (2 to 4)",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "D_lag (ms)", "Lag of the derivative estimate", DefaultGUIModel::STATE, },
 	{ "PID_tresh", "treshold value under which the same output as before gets repeated",
 	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
 	{ "min_PID", "value under which the lights get switched off",
 	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "Auto_thresh", "value that indicates whether or not PID_tresh and min_PID follow the noise of Vm between the beats (0 or 1)",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "Auto_k", "min_PID in multiples of the estimated noise",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "Alt_window (beats)", "Number of beats over which alternans and short-term variability of APD90 are computed (4-32)",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "Alt_thresh (ms)", "Alternans magnitude of APD90 above which alternans is flagged (0 = off)",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "STV_thresh (ms)", "Short-term variability of APD90 above which alternans is flagged (0 = off)",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "Alt_backoff", "Factor by which K_p, K_i and K_d are scaled when alternans is flagged (1 = no back-off)",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "Err_split1 (ms)", "End of the first phase window (upstroke) of the error statistics after the upstroke",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "Err_split2 (ms)", "End of the second phase window (plateau) of the error statistics after the upstroke",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
 	{ "reset_I_on", "value that indicates whetehr or not to reset I at RMP",
 	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "Opsin_order", "Order of the opsin kinetics model that is inverted on the LED outputs (0 = off, 1 or 2)",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "tau_on_blue (ms)", "Activation time constant of the 'blue' ChR current",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "tau_off_blue (ms)", "Deactivation time constant of the 'blue' ChR current",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "tau_on_red (ms)", "Activation time constant of the 'red' current",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "tau_off_red (ms)", "Deactivation time constant of the 'red' current",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "Vrev_estimation", "value that indicates whether or not Blue_Vrev is estimated online (0 or 1)",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "Vrev_lambda", "Forgetting factor of the Blue_Vrev estimator (0-1)",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "Blue_Vrev_est (mV)", "Estimated apparent reversal potential of the 'blue' ChR current", DefaultGUIModel::STATE, },
+	{ "RLS_on", "value that indicates whether or not the response of the cell is identified online (0 or 1)",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "RLS_lambda", "Forgetting factor of the online identification (0-1)",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "RLS_autoscale", "value that indicates whether or not Rm_blue/Rm_red is rescaled from the identified response (0 or 1)",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "RLS_Tc (ms)", "Time constant with which the rescaled controller should remove an error",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "b_blue (mV/ms/V)", "Identified effect of the blue LED channel on Vm", DefaultGUIModel::STATE, },
+	{ "b_red (mV/ms/V)", "Identified effect of the red LED channel on Vm", DefaultGUIModel::STATE, },
+	{ "tau_est (ms)", "Identified time constant with which an error relaxes without light", DefaultGUIModel::STATE, },
+	{ "AutoTune", "value that starts (1) a relay auto-tuning experiment of K_p, K_i and K_d",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "AT_start (ms)", "Start of the relay window within the AP",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "AT_end (ms)", "End of the relay window within the AP",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "AT_amplitude", "Relay amplitude in PID units",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "AT_hysteresis (mV)", "Relay hysteresis",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "AT_beats", "Number of APs the relay experiment lasts",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "AT_rule", "Tuning rule: 0 = Ziegler-Nichols, 1 = Ziegler-Nichols without overshoot, 2 = Tyreus-Luyben",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "Ku", "Ultimate gain found by the relay experiment", DefaultGUIModel::STATE, },
+	{ "Tu (ms)", "Ultimate period found by the relay experiment", DefaultGUIModel::STATE, },
+	{ "Shadow_on", "value that indicates whether or not alternative gain sets are evaluated in parallel (0 or 1, needs RLS_on)",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "Shadow_spread", "Factor by which the alternative gain sets differ from the live gains",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "Shadow_adopt", "value that indicates whether or not the best alternative gain set is adopted at every upstroke (0 or 1)",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "Shadow_best", "Index of the best gain set of the last AP (0 = live gains)", DefaultGUIModel::STATE, },
+	{ "Shadow_cost_ratio", "Predicted squared error of the best gain set relative to the live gains", DefaultGUIModel::STATE, },
+	{ "Shadow_K_p", "K_p of the best gain set of the last AP", DefaultGUIModel::STATE, },
+	{ "Shadow_K_i", "K_i of the best gain set of the last AP", DefaultGUIModel::STATE, },
+	{ "Shadow_K_d", "K_d of the best gain set of the last AP", DefaultGUIModel::STATE, },
 	{ "P", "P term", DefaultGUIModel::STATE, },
 	{ "I", "I term", DefaultGUIModel::STATE, },
 	{ "D", "D term", DefaultGUIModel::STATE, },
@@ -140,6 +290,39 @@ static DefaultGUIModel::variable_t vars[] = {
 	{ "APs2", "APs", DefaultGUIModel::STATE, },
 	{ "BCL2", "BCL", DefaultGUIModel::STATE, },
 	{ "act2", "0 or 1", DefaultGUIModel::STATE, },
+	{ "Phase", "0 = REST, 1 = LOGGING, 2 = REFRACTORY, 3 = CORRECTING, 4 = PAUSED", DefaultGUIModel::STATE, },
+	{ "Memory locked", "1 when the hot state and the logs of the module are locked in RAM", DefaultGUIModel::STATE, },
+	{ "Saturated", "time-steps on which the requested output exceeded its range", DefaultGUIModel::STATE, },
+	{ "Overruns", "time-steps that started more than 1.5 periods after the previous one", DefaultGUIModel::STATE, },
+	{ "Missed upstrokes", "beats without an upstroke within twice their expected length", DefaultGUIModel::STATE, },
+	{ "APD30 (ms)", "time from dV/dt max to 30% repolarization of the last beat", DefaultGUIModel::STATE, },
+	{ "APD50 (ms)", "time from dV/dt max to 50% repolarization of the last beat", DefaultGUIModel::STATE, },
+	{ "APD90 (ms)", "time from dV/dt max to 90% repolarization of the last beat", DefaultGUIModel::STATE, },
+	{ "AP_amplitude (mV)", "peak minus RMP of the last beat", DefaultGUIModel::STATE, },
+	{ "dVdt_max (mV/ms)", "maximal upstroke velocity of the last beat", DefaultGUIModel::STATE, },
+	{ "RMP (mV)", "lowest potential of the beat before the last beat", DefaultGUIModel::STATE, },
+	{ "Ref_APD30 (ms)", "time from dV/dt max to 30% repolarization of the reference AP of the last beat", DefaultGUIModel::STATE, },
+	{ "Ref_APD50 (ms)", "time from dV/dt max to 50% repolarization of the reference AP of the last beat", DefaultGUIModel::STATE, },
+	{ "Ref_APD90 (ms)", "time from dV/dt max to 90% repolarization of the reference AP of the last beat", DefaultGUIModel::STATE, },
+	{ "Ref_AP_amplitude (mV)", "peak minus RMP of the reference AP of the last beat", DefaultGUIModel::STATE, },
+	{ "Ref_dVdt_max (mV/ms)", "maximal upstroke velocity of the reference AP of the last beat", DefaultGUIModel::STATE, },
+	{ "Ref_RMP (mV)", "lowest potential of the reference AP of the beat before the last beat", DefaultGUIModel::STATE, },
+	{ "Noise (mV)", "estimated standard deviation of the noise of Vm between the beats", DefaultGUIModel::STATE, },
+	{ "Alternans (ms)", "alternans magnitude of APD90 over the last Alt_window beats", DefaultGUIModel::STATE, },
+	{ "STV (ms)", "short-term variability of APD90 over the last Alt_window beats", DefaultGUIModel::STATE, },
+	{ "Alternans_flag", "1 when the last full window crossed Alt_thresh or STV_thresh", DefaultGUIModel::STATE, },
+	{ "Err_RMS (mV)", "root mean square of Vm - reference of the last corrected beat", DefaultGUIModel::STATE, },
+	{ "Err_max (mV)", "largest absolute Vm - reference of the last corrected beat", DefaultGUIModel::STATE, },
+	{ "Err_bias (mV)", "mean Vm - reference of the last corrected beat", DefaultGUIModel::STATE, },
+	{ "Err_RMS_w1 (mV)", "root mean square of Vm - reference in the first phase window of the last corrected beat", DefaultGUIModel::STATE, },
+	{ "Err_max_w1 (mV)", "largest absolute Vm - reference in the first phase window of the last corrected beat", DefaultGUIModel::STATE, },
+	{ "Err_bias_w1 (mV)", "mean Vm - reference in the first phase window of the last corrected beat", DefaultGUIModel::STATE, },
+	{ "Err_RMS_w2 (mV)", "root mean square of Vm - reference in the second phase window of the last corrected beat", DefaultGUIModel::STATE, },
+	{ "Err_max_w2 (mV)", "largest absolute Vm - reference in the second phase window of the last corrected beat", DefaultGUIModel::STATE, },
+	{ "Err_bias_w2 (mV)", "mean Vm - reference in the second phase window of the last corrected beat", DefaultGUIModel::STATE, },
+	{ "Err_RMS_w3 (mV)", "root mean square of Vm - reference after the second split of the last corrected beat", DefaultGUIModel::STATE, },
+	{ "Err_max_w3 (mV)", "largest absolute Vm - reference after the second split of the last corrected beat", DefaultGUIModel::STATE, },
+	{ "Err_bias_w3 (mV)", "mean Vm - reference after the second split of the last corrected beat", DefaultGUIModel::STATE, },
 };
 
 /*
@@ -149,6 +332,63 @@ variable denoting the amount of variables that is displayed in the GUI
 */
 static size_t num_vars = sizeof(vars) / sizeof(DefaultGUIModel::variable_t);
 
+/*
+live_vars[]
+-----------
+Parameters that Modify hands to execute() without a reset (see LiveParams.h).
+All other parameters are structural: changing them resets the module and its logs.
+*/
+static const char* live_vars[] = {
+	"K_p",
+	"K_i",
+	"K_d",
+	"Rm_blue (MOhm)",
+	"Rm_red (MOhm)",
+	"PID_tresh",
+	"min_PID",
+	"Auto_thresh",
+	"Auto_k",
+	"Alt_thresh (ms)",
+	"STV_thresh (ms)",
+	"Alt_backoff",
+	"Err_split1 (ms)",
+	"Err_split2 (ms)",
+	"Blue_Vrev",
+	"reset_I_on",
+	"Slope_thresh (mV/ms)",
+	"V_cutoff (mV)",
+	"BCL_cutoff (pct)",
+};
+
+static size_t num_live_vars = sizeof(live_vars) / sizeof(const char*);
+
+/*
+beat_vars[]
+-----------
+Parameters that Modify hands to execute() as commands, which take effect at a beat
+boundary (see CommandQueue.h): at the next upstroke or at the end of the beat.
+*/
+enum {SET_CORR_START, SET_AUTOTUNE};
+
+static const struct {const char* name; int id; int when;} beat_vars[] = {
+	{"Correction start", SET_CORR_START, BeatCommands::AT_UPSTROKE},
+	{"AutoTune", SET_AUTOTUNE, BeatCommands::AT_UPSTROKE},
+};
+
+static size_t num_beat_vars = sizeof(beat_vars) / sizeof(beat_vars[0]);
+
+/*
+SyncEvent
+---------
+Event without an action. The real-time thread handles events between two
+time-steps, so posting one waits until execute() has returned (see holdExecute).
+*/
+class SyncEvent : public RT::Event
+{
+public:
+	int callback(void){return 0;}
+};
+
 /*
 gAPqrPID3
 ------
@@ -172,13 +412,47 @@ gAPqrPID3::gAPqrPID3(void) : DefaultGUIModel("APqrPID3", ::vars, ::num_vars)
 	resizeMe();
 }
 
+/*
+operator new
+------------
+Allocates the module on a cache line boundary, such that the alignas() of its
+hot state and of its logs holds on the heap (see RTMemory.h).
+
+IN:
+	*) bytes	size of the module
+OUT:
+	*) p		pointer to the memory
+*/
+void* gAPqrPID3::operator new(size_t bytes)
+{
+	return alignedAlloc(bytes);
+}
+
+/*
+operator delete
+---------------
+Frees a module that was allocated with operator new.
+
+IN:
+	*) p		pointer to the module
+OUT:
+	*) None
+*/
+void gAPqrPID3::operator delete(void* p)
+{
+	alignedFree(p);
+}
+
 gAPqrPID3::~gAPqrPID3(void){}
 
 /*
 cleanup
 -------
 The APqr software makes use of three list structures which need cleaning after
-a reset of parameters. The cleanup function takes care of this.
+a reset of parameters. The cleanup function takes care of this by starting a
+new epoch of each log, after which every entry reads as 0 until it is written
+again (see EpochBuffer.h). This takes constant time, so a Modify no longer
+stalls on clearing the logs.
 
 IN:
 	*) None
@@ -187,10 +461,355 @@ OUT:
 */
 void gAPqrPID3::cleanup()
 {
-	for(i=0;i<10000;i++){
-		Vm_log[i]=0;
-		Vm_diff_log[i]=0;
-		ideal_AP[i]=0;
+	Vm_log.invalidate();
+	Vm_diff_log.invalidate();
+	ideal_AP.invalidate();
+}
+
+/*
+lockBuffers
+-----------
+Touches every page of the module, its hot state and its logs, and locks them in
+RAM, such that execute() does not take page faults on them after a swap or a
+fork of the process. Called from MODIFY and PERIOD, outside of the real-time
+loop. Sets memory_locked to 0 when the lock is refused (RLIMIT_MEMLOCK).
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+void gAPqrPID3::lockBuffers()
+{
+	memory_locked = lockMemory(this, sizeof(*this));
+}
+
+/*
+readLive
+--------
+Reads the live-tunable parameters (see live_vars[]) from the GUI.
+
+IN:
+	*) None
+OUT:
+	*) p		block with the live-tunable parameters
+*/
+gAPqrPID3::LiveBlock gAPqrPID3::readLive()
+{
+	LiveBlock p;
+	p.K_p = getParameter("K_p").toDouble();
+	p.K_i = getParameter("K_i").toDouble();
+	p.K_d = getParameter("K_d").toDouble();
+	p.Rm_blue = getParameter("Rm_blue (MOhm)").toDouble();
+	p.Rm_red = getParameter("Rm_red (MOhm)").toDouble();
+	p.PID_tresh = getParameter("PID_tresh").toDouble();
+	p.min_PID = getParameter("min_PID").toDouble();
+	p.auto_thresh = getParameter("Auto_thresh").toDouble();
+	p.auto_k = getParameter("Auto_k").toDouble();
+	p.alt_thresh = getParameter("Alt_thresh (ms)").toDouble();
+	p.stv_thresh = getParameter("STV_thresh (ms)").toDouble();
+	p.alt_backoff = getParameter("Alt_backoff").toDouble();
+	p.err_split1 = getParameter("Err_split1 (ms)").toDouble();
+	p.err_split2 = getParameter("Err_split2 (ms)").toDouble();
+	p.blue_Vrev = getParameter("Blue_Vrev").toDouble();
+	p.reset_I_on = getParameter("reset_I_on").toDouble();
+	p.slope_thresh = getParameter("Slope_thresh (mV/ms)").toDouble();
+	p.V_cutoff = getParameter("V_cutoff (mV)").toDouble();
+	p.BCL_cutoff = getParameter("BCL_cutoff (pct)").toDouble();
+	return p;
+}
+
+/*
+applyLive
+---------
+Takes over a block of live-tunable parameters. Called from execute() when Modify
+published a new block, and from Modify itself before a reset. Only assignments,
+so it is safe in the real-time loop.
+
+IN:
+	*) p		block with the live-tunable parameters
+OUT:
+	*) None
+*/
+void gAPqrPID3::applyLive(const LiveBlock& p)
+{
+	K_p = p.K_p;
+	K_i = p.K_i;
+	K_d = p.K_d;
+	Rm_blue = p.Rm_blue;
+	Rm_red = p.Rm_red;
+	PID_tresh = p.PID_tresh;
+	min_PID = p.min_PID;
+	auto_thresh = p.auto_thresh;
+	auto_k = p.auto_k;
+	alt_thresh = p.alt_thresh;
+	stv_thresh = p.stv_thresh;
+	alt_backoff = p.alt_backoff;
+	err_split1 = p.err_split1;
+	err_split2 = p.err_split2;
+	beat_err.setSplits(err_split1, err_split2);
+	blue_Vrev = p.blue_Vrev;
+	// Modify only changes the hand-entered threshold; an estimate in use is kept
+	if (!vrev_on || !blue_Vrev_estimator.valid()){blue_Vrev_used = blue_Vrev;}
+	reset_I_on = p.reset_I_on;
+	slope_thresh = p.slope_thresh;
+	V_cutoff = p.V_cutoff;
+	BCL_cutoff = p.BCL_cutoff;
+	autoThresholds(); // The hand-entered thresholds only hold while Auto_thresh is off
+}
+
+/*
+structuralChange
+----------------
+Compares the structural parameters in the GUI, i.e. all parameters that are not
+in live_vars[] or beat_vars[], with their values at the previous Modify.
+
+IN:
+	*) None
+OUT:
+	*) changed	true when a structural parameter changed, and at the first Modify
+*/
+bool gAPqrPID3::structuralChange()
+{
+	std::vector<double> values;
+	for (size_t k = 0; k < num_vars; k++)
+	{
+		if (!(vars[k].flags & DefaultGUIModel::PARAMETER)){continue;}
+		bool is_live = false;
+		for (size_t j = 0; j < num_live_vars; j++){is_live = is_live || vars[k].name == live_vars[j];}
+		for (size_t j = 0; j < num_beat_vars; j++){is_live = is_live || vars[k].name == beat_vars[j].name;}
+		if (!is_live){values.push_back(getParameter(QString::fromStdString(vars[k].name)).toDouble());}
+	}
+	bool changed = (structural.empty() || values != structural);
+	structural = values;
+	return changed;
+}
+
+/*
+postCommands
+------------
+Posts the beat-synchronous parameters (see beat_vars[]) that changed since they
+were last posted as commands for the real-time loop. A command that does not fit
+in the queue is posted again at the next Modify.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+void gAPqrPID3::postCommands()
+{
+	beat_posted.resize(num_beat_vars, NAN);
+	for (size_t j = 0; j < num_beat_vars; j++)
+	{
+		double value = getParameter(beat_vars[j].name).toDouble();
+		if (value != beat_posted[j] && commands.post(beat_vars[j].when, beat_vars[j].id, value))
+			{beat_posted[j] = value;}
+	}
+}
+
+/*
+applyCommand
+------------
+Carries out a command from the GUI thread.
+
+IN:
+	*) c		the command
+OUT:
+	*) None
+*/
+void gAPqrPID3::applyCommand(const BeatCommand& c)
+{
+	switch (c.id)
+	{
+	case SET_CORR_START:
+		corr_start = c.value;
+		break;
+	case SET_AUTOTUNE:
+		// A running experiment is left alone, such that a repeated Modify does not restart it
+		autotune_on = c.value;
+		if (!autotune_on){autotune.stop();}
+		else if (!autotune.active()){autotune.start();}
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+drainCommands
+-------------
+Carries out all commands that wait for a beat boundary, in the order in which
+they were posted. Called from the beat boundaries in the real-time loop.
+
+IN:
+	*) when		BeatCommands::AT_UPSTROKE or BeatCommands::AT_BEAT_END
+OUT:
+	*) None
+*/
+void gAPqrPID3::drainCommands(int when)
+{
+	BeatCommand c;
+	while (commands.next(when, c)){applyCommand(c);}
+}
+
+/*
+holdExecute
+-----------
+Deactivates the module and waits until the real-time thread is no longer inside
+execute(), as DefaultGUIModel::modify() does, such that the GUI thread can reset
+the state that execute() works on. pause() only deactivates the module, which
+does not stop a time-step that is already running.
+The caller restores the returned state with setActive() once it is done.
+
+IN:
+	*) None
+OUT:
+	*) active	whether the module was active
+*/
+bool gAPqrPID3::holdExecute()
+{
+	bool active = getActive();
+	setActive(false);
+	SyncEvent sync;
+	RT::System::getInstance()->postEvent(&sync); // Returns once the real-time thread handled it
+	return active;
+}
+
+/*
+publishStates
+-------------
+Copies the states of the current time-step into one snapshot and publishes it
+to the GUI thread (see Seqlock.h), such that refresh() never shows values of two
+different time-steps. Called at the end of execute(), and from the GUI thread
+only while execute() does not run.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+void gAPqrPID3::publishStates()
+{
+	GuiStates s;
+	s.blue_Vrev_est = blue_Vrev_est;
+	s.b_blue = b_blue;
+	s.b_red = b_red;
+	s.tau_est = tau_est;
+	s.Ku = Ku;
+	s.Tu = Tu;
+	s.shadow_best = shadow_best;
+	s.shadow_ratio = shadow_ratio;
+	s.shadow_Kp = shadow_Kp;
+	s.shadow_Ki = shadow_Ki;
+	s.shadow_Kd = shadow_Kd;
+	s.K_p = K_p;
+	s.K_i = K_i;
+	s.K_d = K_d;
+	s.Rm_blue = Rm_blue;
+	s.Rm_red = Rm_red;
+	s.systime = systime;
+	s.APs = APs;
+	s.BCL = BCL;
+	s.act = act;
+	s.phase = (double)phase;
+	s.P = P;
+	s.I = I;
+	s.D = D;
+	s.PID = PID;
+	const BeatShape& vm_shape = vm_beat.result();
+	const BeatShape& ref_shape = ref_beat.result();
+	s.apd30 = vm_shape.apd30;
+	s.apd50 = vm_shape.apd50;
+	s.apd90 = vm_shape.apd90;
+	s.amplitude = vm_shape.amplitude;
+	s.dvdt_max = vm_shape.dvdt_max;
+	s.rmp = vm_shape.rmp;
+	s.ref_apd30 = ref_shape.apd30;
+	s.ref_apd50 = ref_shape.apd50;
+	s.ref_apd90 = ref_shape.apd90;
+	s.ref_amplitude = ref_shape.amplitude;
+	s.ref_dvdt_max = ref_shape.dvdt_max;
+	s.ref_rmp = ref_shape.rmp;
+	s.noise = noise.sigma();
+	s.alternans = alternans.alternans();
+	s.stv = alternans.stv();
+	s.alt_flag = alt_flag;
+	s.err_rms = beat_err.beat().rms;
+	s.err_max = beat_err.beat().max_abs;
+	s.err_bias = beat_err.beat().bias;
+	s.err_rms1 = beat_err.window(0).rms;
+	s.err_max1 = beat_err.window(0).max_abs;
+	s.err_bias1 = beat_err.window(0).bias;
+	s.err_rms2 = beat_err.window(1).rms;
+	s.err_max2 = beat_err.window(1).max_abs;
+	s.err_bias2 = beat_err.window(1).bias;
+	s.err_rms3 = beat_err.window(2).rms;
+	s.err_max3 = beat_err.window(2).max_abs;
+	s.err_bias3 = beat_err.window(2).bias;
+	states.write(s);
+	// Gains changed by execute() are reported only after the snapshot that holds them,
+	// such that refresh() finds them in the copy it reads after taking the event
+	if (gains_tuned)
+	{
+		gains_tuned = false;
+		events.post(EventMailbox::GAINS_TUNED);
+	}
+}
+
+/*
+autoThresholds
+--------------
+When Auto_thresh is on and the noise estimate is valid (see NoiseFloor.h), sets
+the output thresholds from the estimated noise s of Vm. Through the P term
+this noise gives a noise of K_p*s on PID and of sqrt(2)*K_p*s on its change
+between two time-steps, so min_PID = Auto_k*K_p*s and
+PID_tresh = Auto_k*sqrt(2)*K_p*s. Otherwise the hand-entered values stay in use.
+Called at every upstroke and after new live-tunable parameters.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+void gAPqrPID3::autoThresholds()
+{
+	if (!auto_thresh || !noise.valid()){return;}
+	min_PID = auto_k*fabs(K_p)*noise.sigma();
+	PID_tresh = sqrt(2.0)*min_PID;
+}
+
+/*
+checkAlternans
+--------------
+Beat boundary of the alternans detection (see AlternansDetector.h). The APD90
+of the beat that just ended is added to the window, unless the beat did not
+repolarize that far. Once the window is full, alternans is flagged when its
+magnitude exceeds Alt_thresh or the short-term variability exceeds STV_thresh.
+When Alt_backoff is below 1, a flag scales K_p, K_i and K_d by it (not during
+auto-tuning), after which a full window of beats with the new gains is awaited
+before the next back-off.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+void gAPqrPID3::checkAlternans()
+{
+	double apd90 = vm_beat.result().apd90;
+	if (apd90 <= 0){return;}
+	alternans.update(apd90);
+	if (!alternans.full()){return;}
+
+	alt_flag = ((alt_thresh > 0 && alternans.alternans() > alt_thresh) || (stv_thresh > 0 && alternans.stv() > stv_thresh));
+	if (alt_flag && alt_backoff > 0 && alt_backoff < 1 && !autotune.active())
+	{
+		K_p *= alt_backoff;
+		K_i *= alt_backoff;
+		K_d *= alt_backoff;
+		gains_tuned = true; // Handed to refresh() with the states of this time-step
+		alternans.reset(); // A full window with the new gains before the next back-off
 	}
 }
 
@@ -208,16 +827,9 @@ IN:
 OUT:
 	*) sumy		The sum of 'length' elements in the array arr[]
 */
-double gAPqrPID3::sumy(double arr[], int n, double length, double modulo)
+double gAPqrPID3::sumy(const apqr_log_t& arr, int n, double length, double modulo)
 {
-    double sumy = 0; // initialize sum
- 
-    // Iterate through all elements
-    // and add them to sum
-    for (int i = n-length+1 ; i < n+1; i++)
-    sumy += arr[i % (int)modulo];
- 
-    return sumy;
+	return windowSum(arr, n, (int)length, (int)modulo);
 }
 
 /*
@@ -236,20 +848,9 @@ OUT:
 	*) sumxy		The sum of 'length' elements in the array arr[] multiplied
 				by time-step
 */
-double gAPqrPID3::sumxy(double arr[], int n, double length, double period, double modulo)
+double gAPqrPID3::sumxy(const apqr_log_t& arr, int n, double length, double period, double modulo)
 {
-    double sumxy = 0; // initialize sum
-	int j = 0;
-
-    // Iterate through all elements
-    // and add them to sum
-    for (int i = n-length+1 ; i < n+1; i++)
-    {
-		sumxy += arr[i % (int)modulo] * (j*period);
-		j++;
-	}
- 
-    return sumxy;
+	return windowMoment(arr, n, (int)length, (int)modulo) * period;
 }
 
 /*
@@ -297,129 +898,400 @@ double gAPqrPID3::sumx2(double period, double length)
 }
 
 /*
-execute
--------
-This is the main funtcion of the code that is looped through real-time.
-It contains the four main parts of the algorithm:
-	1) Recording the ideal AP
-	2) Detecting AP upstrokes
-	3) Computing AP correction and outputting this
-	4) Updating the necessary variables
+configureOpsins
+---------------
+Passes the opsin kinetics parameters and the real-time period on to the
+compensators of the blue and the red LED channel.
 
 IN:
 	*) None
 OUT:
-	*) VLED1	voltage that is used to power the first LED driver that
-				regulates the light that is shined onto the cells
-	*) VLED2 	voltage that is used to power the second LED driver that
-				regulates the light that is shined onto the cells
+	*) None
 */
-void gAPqrPID3::execute(void)
+void gAPqrPID3::configureOpsins()
 {
-	systime = count * period;	// time in milli-seconds
-	Vm = input(0) * 1e2;		// convert 10V to mV. Divided by 10 because
-								// the amplifier produces 10-fold amplified
-								// voltages. Multiplied by 1000 to convert
-								// V to mV.
+	blue_opsin.configure((int)opsin_order, tau_on_blue, tau_off_blue, period, 5);
+	red_opsin.configure((int)opsin_order, tau_on_red, tau_off_red, period, 5);
+}
 
-	Vm_log[count % (int)modulo] = Vm;	// Logging the measured Vm in a list
-										// where the modulo component makes
-										// sure you keep cycling when you have
-										// reached the maximum number in the list.
+/*
+configureActuators
+------------------
+Describes the LED channels to the output allocator: the blue channel depolarizes
+with a strength set by Rm_blue as long as Vm is below blue_Vrev, the red channel
+repolarizes with a strength set by Rm_red. By lowering Rm_red compared to Rm_blue,
+it is possible to counteract the smaller effect of repolarizing currents than
+depolarizing currents. Both LED drivers accept up to 5V.
+Further actuators (other wavelengths, current injection) are added here.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+void gAPqrPID3::configureActuators()
+{
+	allocator.setCount(2);
+	allocator.setActuator(0, -Rm_blue, 5, 1);
+	allocator.setReversal(0, blue_Vrev_used, 0);
+	allocator.setActuator(1, Rm_red, 5, 1);
+}
+
+/*
+configureDerivative
+-------------------
+Computes the weights of the derivative filter that is selected with D_filter.
+This is not done in execute(), since it involves solving a small linear system.
 
+IN:
+	*) None
+OUT:
+	*) None
+*/
+void gAPqrPID3::configureDerivative()
+{
+	dfilter.configure((int)d_filter, (int)d_window, (int)d_order, period);
+	d_lag = (d_filter == DerivativeFilter::REGRESSION ? (length - 1)/2*period : dfilter.lag());
+}
+
+/*
+rise
+----
+Rise of the membrane potential over the last millisecond, which is compared to
+Slope_thresh to detect upstrokes.
+
+IN:
+	*) None
+OUT:
+	*) rise		Vm minus the Vm of 1 ms ago (mV)
+*/
+double gAPqrPID3::rise()
+{
+	return Vm_det - Vm_log[ringIndex(count-(int)(1/period), (int)modulo)];
+}
+
+/*
+upstroke
+--------
+Whether the membrane potential rises fast enough to be an upstroke: either the
+rise over the last millisecond (Detector = 0) or the slope of the
+UpstrokeDetector (Detector = 1) is compared to Slope_thresh.
+
+IN:
+	*) None
+OUT:
+	*) upstroke	true when the slope threshold is reached
+*/
+bool gAPqrPID3::upstroke()
+{
+	return (detector_mode ? detector.slope : rise()) >= slope_thresh;
+}
+
+/*
+reference
+---------
+Reference AP at the given number of time-steps after the detected upstroke. The
+interpolated onset of the upstroke lies onset_frac time-steps before the
+time-step at which it was detected, so the reference is sampled in between
+two recorded points.
+
+IN:
+	*) n		time-steps since the detection of the upstroke
+OUT:
+	*) V		reference membrane potential (mV)
+*/
+double gAPqrPID3::reference(long long n)
+{
+	return interpolate(ideal_AP, 10000, n + onset_frac);
+}
+
+/*
+setPhase
+--------
+Switches the control loop to another phase (see BeatPhase.h) and keeps the act
+flag in line with it.
+
+IN:
+	*) next		the new phase
+OUT:
+	*) None
+*/
+void gAPqrPID3::setPhase(BeatPhase next)
+{
+	phase = next;
+	act = (next == CORRECTING);
+}
+
+/*
+restTick
+--------
+Tick handler of the REST phase. Waits for an upstroke, which either starts the
+recording of a reference AP or the correction of the AP.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+void gAPqrPID3::restTick()
+{
 	// ****************************
 	// ****************************
-	// ** Recording the ideal AP **
+	// ** Detecting AP upstrokes **
 	// ****************************
 	// ****************************
-	if(count>(int)(1/period)-1 && (Vm - Vm_log[(count-(int)(1/period)) % (int)modulo]) >= slope_thresh && APs<lognum && enter == 0 && Vm > V_cutoff)
+	// The if conditions measure the following:
+	// 1) Whether you are far enough in the recording such that the rise over the last ms is known
+	// 2) Whether the rise is large enough to be identified with an upstroke
+	// 3) Whether the mesured voltage is above a voltage treshold
+	if (count > (int)(1/period)-1 && upstroke() && Vm_det > V_cutoff)
 	{
-		// This statement is entered whenever an upstroke is detected and the amount of
-		// recorded APs is smaller than lognum.
-		// The if conditions measure the following:
-		// 1) Whether you are far enough in the recording such that you don't accidentaly
-		//    start in an ongoing AP
-		// 2) Whether two consecutive measuring points show a large enough slope that can
-		//    be identified with an upstroke
-		// 3) Whether less than lognum APs were recorded
-		// 4) Whether you are currently not in an action potential
-		// 5) Whether the mesured voltage is above a voltage treshold
-
-		BCL = (APs==-1? 0: (BCL*APs + count2)/(APs+1)); // Rolling average of the basic cycle length
-		log_ideal_on = 1; // Switches on logging the AP
-		count2 = 0; // Resets the logging counter
-		enter = 1; // Switches on the indicator that an AP has started
-		APs++; // Counts the AP upstrokes that have passed
+		if (APs < lognum)
+			{logUpstroke();} // Start recording the ideal AP
+		else
+		{
+			startCorrection();
+			correctingTick();
+		}
 	}
+	else if (APs >= lognum && BCL > 0 && count == (long long)(2*BCL))
+		{events.post(EventMailbox::UPSTROKE_MISSED);} // No upstroke within twice the basic cycle length
+}
 
-	if((Vm - Vm_log[(count-(int)(1/period)) % (int)modulo]) < 0 && enter == 1)
-	{
-		// This statement is entered whenever the upstroke phase of an AP is over.
-		// The if conditions measure the following:
-		// 1) Whether two consecutive measuring points show a negative slope
-		// 2) Whether you currently are in an ongoing AP
+/*
+loggingTick
+-----------
+Tick handler of the LOGGING phase. Adds the current sample to the ideal AP,
+unless an upstroke starts the next AP.
 
-		enter = 0; // Switches off the indicator that an AP has started
-	}
+IN:
+	*) None
+OUT:
+	*) None
+*/
+void gAPqrPID3::loggingTick()
+{
+	if (count > (int)(1/period)-1 && upstroke() && Vm_det > V_cutoff)
+		{logUpstroke();}
+	else
+		{logSample();}
+}
 
-	if(APs<lognum && log_ideal_on == 1)
+/*
+refractoryTick
+--------------
+Tick handler of the REFRACTORY phase. Keeps recording the ideal AP, while the
+upstroke that was just detected cannot be detected a second time.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+void gAPqrPID3::refractoryTick()
+{
+	// The upstroke phase of the AP is over as soon as Vm falls again
+	if (rise() < 0){setPhase(LOGGING);}
+	logSample();
+}
+
+/*
+logUpstroke
+-----------
+Handles an upstroke while fewer than lognum APs were recorded: the basic cycle
+length is updated and the recording of the next AP starts. When this upstroke
+completes the ideal AP, the correction of the AP starts instead.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+void gAPqrPID3::logUpstroke()
+{
+	vm_beat.begin(); // The metrics of the previous beat are complete
+	drainCommands(BeatCommands::AT_BEAT_END);
+	drainCommands(BeatCommands::AT_UPSTROKE);
+	BCL = (APs==-1? 0: (BCL*APs + count2)/(APs+1)); // Rolling average of the basic cycle length
+	count2 = 0; // Resets the logging counter
+	onset_frac = (detector_mode ? detector.onset(slope_thresh, V_cutoff) : 0); // Latest crossing of both conditions
+	APs++; // Counts the AP upstrokes that have passed
+
+	if (APs < lognum)
+	{
+		setPhase(REFRACTORY); // Switches on logging the AP
+		logSample();
+	}
+	else
 	{
-		// This statement is entered whenever logging of the AP is on
-		// The if conditions measure the following:
-		// 1) Whether less than lognum APs were recorded
-		// 2) Whether the AP should be logged
+		startCorrection();
+		correctingTick();
+	}
+}
+
+/*
+logSample
+---------
+Adds the current membrane potential to the rolling average of the ideal AP.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+void gAPqrPID3::logSample()
+{
+	// The sample is interpolated back to a whole number of time-steps after the onset of the upstroke
+	double V = Vm - onset_frac*(Vm - Vm_prev);
+	averageInto(ideal_AP.at(count2), V, APs); // Rolling average of the AP values
+	count2++; // Increasing the logging counter
+}
+
+/*
+startCorrection
+---------------
+Beat boundary of the correction. Everything that is updated once per AP happens
+here, after which the correction of the new AP starts.
 
-		ideal_AP[count2] = (ideal_AP[count2]*APs + Vm)/(APs+1); // Rolling average of the AP values
-		count2++; // Increasing the logging counter
+IN:
+	*) None
+OUT:
+	*) None
+*/
+void gAPqrPID3::startCorrection()
+{
+	vm_beat.begin(); // The metrics of the previous beat are complete
+	ref_beat.begin();
+	beat_err.begin();
+	checkAlternans(); // With the APD90 of the beat that just ended
+	autoThresholds(); // From the noise of the rest before this beat
+	drainCommands(BeatCommands::AT_UPSTROKE);
+	// At every upstroke the gating threshold of the blue channel is raised to the online
+	// estimate of the reversal potential, as long as that estimate is reliable. Doing this
+	// at the beat boundary keeps the threshold constant within one AP. The estimate never
+	// lowers the threshold below the hand-entered Blue_Vrev: light is only given below the
+	// threshold, so an estimate that gated its own samples could only drift further down.
+	if (vrev_on && blue_Vrev_estimator.valid())
+		{blue_Vrev_est = blue_Vrev_estimator.estimate();}
+	blue_Vrev_used = (vrev_on && blue_Vrev_estimator.valid() ? std::max(blue_Vrev, blue_Vrev_est) : blue_Vrev);
+
+	// The relay window of the previous AP is closed at every upstroke. After the requested
+	// number of APs the measured oscillations are turned into new PID gains, which are
+	// handed to the GUI with the states (see publishStates).
+	if (autotune.active() && autotune.endBeat())
+	{
+		if (autotune.tune((int)AT_rule, period, K_p, K_i, K_d)){gains_tuned = true;}
+		autotune_on = 0;
+		events.post(EventMailbox::AUTOTUNE_DONE);
+		Ku = autotune.Ku;
+		Tu = autotune.Tu;
+		Int = 0; // The integral of the relay experiment has no meaning for the new gains
 	}
-	
-	// ****************************
-	// ****************************
-	// ** Detecting AP upstrokes **
-	// ****************************
-	// ****************************
-	if (act == 0 && (Vm - Vm_log[(count-(int)(1/period)) % (int)modulo]) >= slope_thresh && APs >= lognum && Vm > V_cutoff)
+
+	// At every upstroke the identified response of the cell is published and, when
+	// requested, used to rescale the LED channels such that an error would be removed
+	// with the time constant RLS_Tc by the proportional term alone (K_p = 1). This comes
+	// before the shadows are spread again, such that they surround the rescaled values.
+	if (rls_on)
 	{
-		// This statement is entered whenever an upstroke is detected after the
-		// ideal APs have been recorded.
-		// The if conditions measure the following:
-		// 1) Whether currently nothing is being done or corrected
-		// 2) Whether two consecutive measuring points show a large enough slope that can
-		//    be identified with an upstroke
-		// 3) Whether lognum APs were already recorded before
-		// 4) Whether the mesured voltage is above a voltage treshold
-
-		count = 0; // Reset the correction counter
-		act = 1; // Switch the correction on
+		b_blue = plant.gain(0);
+		b_red = plant.gain(1);
+		tau_est = plant.tau();
+		if (rls_autoscale && plant.valid(0, 1000) && b_blue > 0){Rm_blue = b_blue*rls_Tc; gains_tuned = true;}
+		if (rls_autoscale && plant.valid(1, 1000) && b_red < 0){Rm_red = -b_red*rls_Tc; gains_tuned = true;}
 	}
 
-	// Part of the code that implements the PID
-	if (act == 1)
+	// At every upstroke the best shadow gain set of the previous AP is reported and, when
+	// requested, adopted as the new live gain set. The shadows are then spread around the
+	// live gains again.
+	if (shadow_on && rls_on)
 	{
-		// This statement is entered whenever the instruction to correct the AP has
-		// been given.
-
-		// ************************************
-		// * Calculate the proportional error *
-		// ************************************
-		Vm_diff_log[count] = Vm - ideal_AP[count]; // Log the errors
-		// ***************************************
-		// * Calculate the integral of the error *
-		// ***************************************
-		if (VLED < 5 && (Vm < blue_Vrev || Vm_diff_log[count] > 0)) 
+		double Rm_blue_best, Rm_red_best;
+		shadow_best = shadows.best();
+		shadow_ratio = (shadows.cost(0) > 0 ? shadows.cost((int)shadow_best)/shadows.cost(0) : 1);
+		shadows.candidate((int)shadow_best, shadow_Kp, shadow_Ki, shadow_Kd, Rm_blue_best, Rm_red_best);
+		if (shadow_adopt && shadow_best != 0 && plant.valid(0, 1000) && plant.valid(1, 1000))
 		{
-			// Int is only calculated when the voltage LED output has not reached
-			// its maximum (5V) and on eof two conditiosn is satisfied: depolarization
-			// is needed (blue ch) and Vm is more negative than blue_Vrev, or
-			// hyperpolarization is needed (red ch).
-			// This step was taken such that the Int term cannot amass further when
-			// the system can not react to it.
-		
-			Int = Int + Vm_diff_log[count];
+			K_p = shadow_Kp;
+			K_i = shadow_Ki;
+			K_d = shadow_Kd;
+			Rm_blue = Rm_blue_best;
+			Rm_red = Rm_red_best;
+			gains_tuned = true;
 		}
-		// *****************************************
-		// * Calculate the derivative of the error *
-		// *****************************************
+		shadows.setCandidates(K_p, K_i, K_d, Rm_blue, Rm_red, shadow_spread);
+	}
+
+	count = 0; // Reset the correction counter
+	onset_frac = (detector_mode ? detector.onset(slope_thresh, V_cutoff) : 0); // Latest crossing of both conditions
+	setPhase(CORRECTING); // Switch the correction on
+}
+
+/*
+correctingTick
+--------------
+Tick handler of the CORRECTING phase. Computes and outputs the correction, and
+returns to REST at the end of the correction window.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+void gAPqrPID3::correctingTick()
+{
+	// Part of the code that implements the PID
+	// This statement is entered whenever the instruction to correct the AP has
+	// been given.
+
+	// ************************************
+	// * Calculate the proportional error *
+	// ************************************
+	Vm_diff_log.set(count, Vm - reference(count)); // Log the errors
+	ref_beat.sample(reference(count)); // Per-beat AP metrics of the reference
+	beat_err.sample(Vm_diff_log[count]); // Error statistics of this beat (see ErrorStats.h)
+	// *************************************
+	// * Identify the response of the cell *
+	// *************************************
+	// The change in error is related to the light of the previous time-step (still in
+	// VLED_blue and VLED_red) to learn how strongly each LED channel acts on the membrane
+	// potential. These are the commands before the opsin compensation, which makes the
+	// light-gated currents follow them, as the shadow gain sets produce them.
+	if (rls_on && count > 0)
+		{plant.update(Vm_diff_log[count-1], Vm_diff_log[count], VLED_blue, VLED_red);}
+
+	// The shadow gain sets are driven through the identified model by the same drift of
+	// the cell that the live controller experiences, lagging one time-step behind. They
+	// run the controller below with the slope and thresholds of the previous time-step,
+	// which are still in slope, min_PID and PID_tresh (see ShadowControllers.h).
+	if (shadow_on && rls_on && count == 0)
+		{shadows.startBeat(Vm_diff_log[count], Int, PID, VLED_blue, VLED_red, VLED);}
+	else if (shadow_on && rls_on)
+	{
+		shadows.step(reference(count-1), Vm_diff_log[count-1], slope, 0,
+			plant.disturbance(Vm_diff_log[count-1], Vm_diff_log[count], VLED_blue, VLED_red),
+			plant.coefficient(0), plant.coefficient(1), plant.coefficient(2), blue_Vrev_used,
+			min_PID, PID_tresh, count-1 >= corr_start-1, period);
+	}
+	// ***************************************
+	// * Calculate the integral of the error *
+	// ***************************************
+	if (VLED < 5 && (Vm < blue_Vrev_used || Vm_diff_log[count] > 0)) 
+	{
+		// Int is only calculated when the voltage LED output has not reached
+		// its maximum (5V) and on eof two conditiosn is satisfied: depolarization
+		// is needed (blue ch) and Vm is more negative than blue_Vrev, or
+		// hyperpolarization is needed (red ch).
+		// This step was taken such that the Int term cannot amass further when
+		// the system can not react to it.
+	
+		Int = Int + Vm_diff_log[count];
+	}
+	// *****************************************
+	// * Calculate the derivative of the error *
+	// *****************************************
+	if (d_filter == DerivativeFilter::REGRESSION)
+	{
 		// Calculate the numerator for a linear regression between the last "length" amount of points.
 		// This larger amount of points is chosen to cut out the noise that is intrinsically present
 		// in a membrane potential recording.
@@ -431,61 +1303,149 @@ void gAPqrPID3::execute(void)
 			{slope = 10000;}
 		else
 			{slope = num/denom;} // Slope is measured in mV/ms
+	}
+	else
+	{
+		// Savitzky-Golay or noise-robust differentiator over D_window points, see DerivativeFilters.h
+		slope = dfilter.slope(Vm_diff_log, count, (int)modulo); // Slope is measured in mV/ms
+	}
 
-		// ************************************
-		// * Calculate the separate PID terms *
-		// ************************************
-		P = K_p * Vm_diff_log[count]; // Term that is proportional to the instantaneous difference in voltage.
-		I = K_i * Int; // Term that speeds up or slows down the rate of change based on the history of voltage differences.
-		D = K_d * slope; // Term that predicts the behaviour that is about to happen and helps in stabilizing.
-
-		PID_diff = PID; // Update the PID difference term
-		PID = P + I + D; // Calculate the sum of all the individual terms
-		PID_diff = PID_diff - PID; // Calculate the PID difference term
-
-		if (count >= corr_start-1 && abs(PID_diff) > PID_tresh){
-			// PID_tresh gives a value that bounds the actions of the output (applies to PID_diff).
-			// When smaller than this value, the previous light-ouput will be repeated.
-			// This explains the lack of an else case.
-			if (PID < 0 && abs(PID) > min_PID && Vm < blue_Vrev)
-			{
-				// If PID is smaller than 0, a depolarizing current is needed. Therefore here the output for
-				// the blue LED driver is calculated. However, blu elight has no influence when the membrane
-				// potential is larger than the reversal potential of the light-gated channel. Hence, an extra limit
-				// was imposed to limit this.
-				// min_PID gives a value where you don't consider it necessary to correct anything (applies to PID).
-				// So when the absolute value is smaller than this value, the output will be set to 0 (in the else case later on).
-
-				VLED = -PID * (1/Rm_blue); // Calculate VLED by applying a LED-specific factor
-				if (VLED > 5){VLED = 5;} // Limit the LED driver output to its maximum value
-				output(0) = VLED; // Send output to the blue LED driver
-				output(1) = 0; // Make sure the red LED driver does not receive any output
-			}
-			else if (PID > 0 && abs(PID) > min_PID)
-			{
-				// If PID is larger than 0, a repolarizing current is needed. Therefore here the output for
-				// the red LED driver is calculated.
-
-				VLED = PID * (1/Rm_red); // Calculate VLED by applying a LED-specific factor
-				// Rm_red scales the amount of applied light for the red channel.
-				// By lowering this value compared to Rm_blue, it is possible to counteract the smaller effect of repolarizing currents than depolarizing currents.
-				if (VLED > 5){VLED = 5;} // Limit the LED driver output to its maximum value
-				output(1) = VLED; // Send output to the red LED driver
-				output(0) = 0; // Make sure the blue LED driver does not receive any output
-			}
-			else
-			{
-				// In all other cases, don't shine any light
-				output(0) = 0; // Make sure the blue LED driver does not receive any output
-				output(1) = 0; // Make sure the red LED driver does not receive any output
-			}			
+	// The change of Vm over the last time-step, together with the Vm and the blue light
+	// at its start (the light is still present on output(0)) and the change of the
+	// reference over the same time-step, feeds the online estimate of the reversal
+	// potential. The filtered slope is not used, since its lag would pair it with the
+	// wrong Vm and light.
+	if (vrev_on && count > 0)
+	{
+		double ref_prev = reference(count-1);
+		double ref_now = reference(count);
+		blue_Vrev_estimator.update(output(0), Vm_diff_log[count-1] + ref_prev,
+			(Vm_diff_log[count] - Vm_diff_log[count-1] + ref_now - ref_prev)/period, (ref_now - ref_prev)/period);
+	}
+
+	// ************************************
+	// * Calculate the separate PID terms *
+	// ************************************
+	P = K_p * Vm_diff_log[count]; // Term that is proportional to the instantaneous difference in voltage.
+	I = K_i * Int; // Term that speeds up or slows down the rate of change based on the history of voltage differences.
+	D = K_d * slope; // Term that predicts the behaviour that is about to happen and helps in stabilizing.
+
+	PID_diff = PID; // Update the PID difference term
+	PID = P + I + D; // Calculate the sum of all the individual terms
+	// During auto-tuning the PID output is replaced by a relay within the chosen window of the AP
+	if (autotune.active() && count*period >= AT_start && count*period < AT_end)
+		{PID = autotune.relay(Vm_diff_log[count], count*period);}
+	PID_diff = PID_diff - PID; // Calculate the PID difference term
+
+	if (count >= corr_start-1 && abs(PID_diff) > PID_tresh){
+		// PID_tresh gives a value that bounds the actions of the output (applies to PID_diff).
+		// When smaller than this value, the previous light-ouput will be repeated.
+		// This explains the lack of an else case.
+		if (abs(PID) > min_PID)
+		{
+			// The requested action is distributed over the actuators by the allocator. With the
+			// blue (depolarizing) and red (repolarizing) channel this gives blue light when PID < 0
+			// and Vm < blue_Vrev (blue light has no influence above the reversal potential of the
+			// light-gated channel), and red light when PID > 0, both limited to 5V.
+			// min_PID gives a value where you don't consider it necessary to correct anything (applies to PID).
+			// So when the absolute value is smaller than this value, the output will be set to 0 (in the else case later on).
+			// The actuators are set up again here, since Rm_blue, Rm_red and blue_Vrev can change at every upstroke.
+			configureActuators();
+			// Only a request beyond v_max counts as saturated, not one that no channel can act on
+			if (allocator.allocate(PID, Vm, VLED_act) == OutputAllocator::SATURATED){events.post(EventMailbox::SATURATED);}
+			VLED_blue = VLED_act[0]; // Send output to the blue LED driver
+			VLED_red = VLED_act[1]; // Send output to the red LED driver
+			// VLED keeps the last non-zero LED voltage, which limits the integral term above
+			if (VLED_blue > 0 || VLED_red > 0){VLED = (VLED_blue > VLED_red ? VLED_blue : VLED_red);}
 		}
+		else
+		{
+			// In all other cases, don't shine any light
+			VLED_blue = 0; // Make sure the blue LED driver does not receive any output
+			VLED_red = 0; // Make sure the red LED driver does not receive any output
+		}			
 	}
-	else
+
+
+	if (count > BCL_cutoff*BCL){
+		// This statement is entered whenever the end of an AP is reached.
+		// The if condition measures the following:
+		// 1) Whether the current AP is further than a chosen cutoff of the pre-determined basic cycle length
+
+		setPhase(REST); // Stop correcting during the last phase of the AP (is RMP)
+		VLED_blue = 0; // Send a 0 output since the last output is otherwise kept
+		VLED_red = 0; // Send a 0 output since the last output is otherwise kept
+		beat_err.end(); // The error statistics of this beat are complete
+		drainCommands(BeatCommands::AT_BEAT_END);
+	}
+}
+
+/*
+execute
+-------
+This is the main funtcion of the code that is looped through real-time.
+Every time-step the tick handler of the current phase (see BeatPhase.h) is run:
+	1) REST: detecting AP upstrokes
+	2) LOGGING, REFRACTORY: recording the ideal AP
+	3) CORRECTING: computing AP correction and outputting this, and updating
+	   the necessary variables
+
+IN:
+	*) None
+OUT:
+	*) VLED1	voltage that is used to power the first LED driver that
+				regulates the light that is shined onto the cells
+	*) VLED2 	voltage that is used to power the second LED driver that
+				regulates the light that is shined onto the cells
+*/
+void gAPqrPID3::execute(void)
+{
+	if (live.pending()){applyLive(live.acquire());} // Parameters changed by Modify without a reset
+	// A time-step that starts more than 1.5 periods after the previous one means that
+	// the real-time loop fell behind
+	long long now = RT::OS::getTime();
+	if (t_prev && now - t_prev > 1.5e6*period){events.post(EventMailbox::OVERRUN);}
+	t_prev = now;
+	systime = count * period;	// time in milli-seconds
+	Vm = input(0) * 1e2;		// convert 10V to mV. Divided by 10 because
+								// the amplifier produces 10-fold amplified
+								// voltages. Multiplied by 1000 to convert
+								// V to mV.
+
+	Vm_det = prefilter.filter(Vm); // Only the upstroke detector sees the prefiltered Vm
+	detector.update(Vm_det);
+	vm_beat.sample(Vm); // Per-beat AP metrics of the measured Vm (see BeatMetrics.h)
+	if (phase == REST){noise.update(Vm);} else {noise.skip();} // Noise of Vm between the beats
+	Vm_log.set(count % (int)modulo, Vm_det);	// Logging the measured Vm in a list
+										// where the modulo component makes
+										// sure you keep cycling when you have
+										// reached the maximum number in the list.
+
+	// Only the tick handler of the current phase runs, and it only tests the transitions
+	// that can occur from that phase (see BeatPhase.h)
+	switch (phase)
 	{
-		// When not acting (act=0), don't shine any light
-		output(0) = 0; // Make sure the blue LED driver does not receive any output
-		output(1) = 0; // Make sure the red LED driver does not receive any output
+	case REST:
+		restTick();
+		break;
+	case LOGGING:
+		loggingTick();
+		break;
+	case REFRACTORY:
+		refractoryTick();
+		break;
+	case CORRECTING:
+		correctingTick();
+		break;
+	default:
+		break;
+	}
+
+	if (phase != CORRECTING)
+	{
+		// When not correcting, don't shine any light
+		VLED_blue = 0; // Make sure the blue LED driver does not receive any output
+		VLED_red = 0; // Make sure the red LED driver does not receive any output
 	}
 
 	// This part of the code resets the I and D terms when the measured AP is very close to resting membrane potential (This
@@ -508,16 +1468,16 @@ void gAPqrPID3::execute(void)
 	}
 
 	// This part of the code makes sure no output is produced in the last part of the action potential to let the cell come to rest.
-	if (count > BCL_cutoff*BCL){
-		// This statement is entered whenever the end of an AP is reached.
-		// The if condition measures the following:
-		// 1) Whether the current AP is further than a chosen cutoff of the pre-determined basic cycle length
 
-		act = 0; // Stop correcting during the last phase of the AP (is RMP)
-		output(0) = 0; // Send a 0 output since the last output is otherwise kept
-		output(1) = 0; // Send a 0 output since the last output is otherwise kept
-	}
+	// The requested LED voltages are passed through the inverse of the opsin kinetics
+	// such that the light-gated currents follow the PID output with less delay.
+	// This has to happen on every time-step, since the opsin model also needs to follow
+	// the deactivation of the channels when the LEDs are switched off.
+	output(0) = blue_opsin.compensate(VLED_blue); // Send output to the blue LED driver
+	output(1) = red_opsin.compensate(VLED_red); // Send output to the red LED driver
 
+	Vm_prev = Vm;
+	publishStates(); // One consistent snapshot of this time-step for the GUI
 	count++; // End of the real-time loop, adjust the counter
 }
 
@@ -549,70 +1509,272 @@ void gAPqrPID3::update(DefaultGUIModel::update_flags_t flag)
 		setParameter("lognum", lognum);
 		setParameter("BCL_cutoff (pct)", BCL_cutoff);
 		setParameter("Slope_thresh (mV/ms)", slope_thresh);
+		setParameter("Prefilter", prefilter_mode);
+		setParameter("Prefilter_window", prefilter_window);
+		setParameter("Hampel_k", hampel_k);
+		setParameter("Detector", detector_mode);
+		setParameter("Detect_window (ms)", detect_window);
 		setParameter("Correction start", corr_start);
 		setParameter("Blue_Vrev", blue_Vrev);
 		setParameter("K_p", K_p);
 		setParameter("K_i", K_i);
 		setParameter("K_d", K_d);
 		setParameter("length", length);
+		setParameter("D_filter", d_filter);
+		setParameter("D_window", d_window);
+		setParameter("D_order", d_order);
+		setState("D_lag (ms)", d_lag);
 		setParameter("PID_tresh", PID_tresh);
 		setParameter("min_PID", min_PID);
+		setParameter("Auto_thresh", auto_thresh);
+		setParameter("Auto_k", auto_k);
+		setParameter("Alt_window (beats)", alt_window);
+		setParameter("Alt_thresh (ms)", alt_thresh);
+		setParameter("STV_thresh (ms)", stv_thresh);
+		setParameter("Alt_backoff", alt_backoff);
+		setParameter("Err_split1 (ms)", err_split1);
+		setParameter("Err_split2 (ms)", err_split2);
 		setParameter("reset_I_on", reset_I_on);
-		setState("Time (ms)", systime);
+		setParameter("Opsin_order", opsin_order);
+		setParameter("tau_on_blue (ms)", tau_on_blue);
+		setParameter("tau_off_blue (ms)", tau_off_blue);
+		setParameter("tau_on_red (ms)", tau_on_red);
+		setParameter("tau_off_red (ms)", tau_off_red);
+		setParameter("Vrev_estimation", vrev_on);
+		setParameter("Vrev_lambda", vrev_lambda);
+		setState("Blue_Vrev_est (mV)", shown.blue_Vrev_est);
+		setParameter("RLS_on", rls_on);
+		setParameter("RLS_lambda", rls_lambda);
+		setParameter("RLS_autoscale", rls_autoscale);
+		setParameter("RLS_Tc (ms)", rls_Tc);
+		setState("b_blue (mV/ms/V)", shown.b_blue);
+		setState("b_red (mV/ms/V)", shown.b_red);
+		setState("tau_est (ms)", shown.tau_est);
+		setParameter("AutoTune", autotune_on);
+		setParameter("AT_start (ms)", AT_start);
+		setParameter("AT_end (ms)", AT_end);
+		setParameter("AT_amplitude", AT_amplitude);
+		setParameter("AT_hysteresis (mV)", AT_hysteresis);
+		setParameter("AT_beats", AT_beats);
+		setParameter("AT_rule", AT_rule);
+		setState("Ku", shown.Ku);
+		setState("Tu (ms)", shown.Tu);
+		setParameter("Shadow_on", shadow_on);
+		setParameter("Shadow_spread", shadow_spread);
+		setParameter("Shadow_adopt", shadow_adopt);
+		setState("Shadow_best", shown.shadow_best);
+		setState("Shadow_cost_ratio", shown.shadow_ratio);
+		setState("Shadow_K_p", shown.shadow_Kp);
+		setState("Shadow_K_i", shown.shadow_Ki);
+		setState("Shadow_K_d", shown.shadow_Kd);
+		setState("Time (ms)", shown.systime);
 		setState("Period (ms)", period);
-		setState("APs2", APs);
-		setState("BCL2", BCL);
-		setState("act2", act);
-		setState("P", P);
-		setState("I", I);
-		setState("D", D);
-		setState("PID", PID);
+		setState("APs2", shown.APs);
+		setState("BCL2", shown.BCL);
+		setState("act2", shown.act);
+		setState("Phase", shown.phase);
+		setState("Memory locked", memory_locked);
+		setState("Saturated", saturated);
+		setState("Overruns", overruns);
+		setState("Missed upstrokes", missed);
+		setState("APD30 (ms)", shown.apd30);
+		setState("APD50 (ms)", shown.apd50);
+		setState("APD90 (ms)", shown.apd90);
+		setState("AP_amplitude (mV)", shown.amplitude);
+		setState("dVdt_max (mV/ms)", shown.dvdt_max);
+		setState("RMP (mV)", shown.rmp);
+		setState("Ref_APD30 (ms)", shown.ref_apd30);
+		setState("Ref_APD50 (ms)", shown.ref_apd50);
+		setState("Ref_APD90 (ms)", shown.ref_apd90);
+		setState("Ref_AP_amplitude (mV)", shown.ref_amplitude);
+		setState("Ref_dVdt_max (mV/ms)", shown.ref_dvdt_max);
+		setState("Ref_RMP (mV)", shown.ref_rmp);
+		setState("Noise (mV)", shown.noise);
+		setState("Alternans (ms)", shown.alternans);
+		setState("STV (ms)", shown.stv);
+		setState("Alternans_flag", shown.alt_flag);
+		setState("Err_RMS (mV)", shown.err_rms);
+		setState("Err_max (mV)", shown.err_max);
+		setState("Err_bias (mV)", shown.err_bias);
+		setState("Err_RMS_w1 (mV)", shown.err_rms1);
+		setState("Err_max_w1 (mV)", shown.err_max1);
+		setState("Err_bias_w1 (mV)", shown.err_bias1);
+		setState("Err_RMS_w2 (mV)", shown.err_rms2);
+		setState("Err_max_w2 (mV)", shown.err_max2);
+		setState("Err_bias_w2 (mV)", shown.err_bias2);
+		setState("Err_RMS_w3 (mV)", shown.err_rms3);
+		setState("Err_max_w3 (mV)", shown.err_max3);
+		setState("Err_bias_w3 (mV)", shown.err_bias3);
+		setState("P", shown.P);
+		setState("I", shown.I);
+		setState("D", shown.D);
+		setState("PID", shown.PID);
 		break;
 	case MODIFY:
-		lognum = getParameter("lognum").toDouble();
-		BCL_cutoff = getParameter("BCL_cutoff (pct)").toDouble();
-		Rm_blue = getParameter("Rm_blue (MOhm)").toDouble();
-		Rm_red = getParameter("Rm_red (MOhm)").toDouble();
-		slope_thresh = getParameter("Slope_thresh (mV/ms)").toDouble();
-		V_cutoff = getParameter("V_cutoff (mV)").toDouble();
+		// The live-tunable parameters are always handed to execute(), which applies them
+		// at its next time-step, and the beat-synchronous ones are queued for the next beat
+		// boundary. Only a change of a structural parameter resets the module.
+		live_gui = readLive();
+		live.publish(live_gui);
+		postCommands();
+		if (!structuralChange()){break;}
+		applyLive(live_gui);
+		alt_window = getParameter("Alt_window (beats)").toDouble();
+		alternans.configure((int)alt_window);
+		alt_flag = 0;
 		corr_start = getParameter("Correction start").toDouble();
-		blue_Vrev = getParameter("Blue_Vrev").toDouble();
-		K_p = getParameter("K_p").toDouble();
-		K_i = getParameter("K_i").toDouble();
-		K_d = getParameter("K_d").toDouble();
+		lognum = getParameter("lognum").toDouble();
+		prefilter_mode = getParameter("Prefilter").toDouble();
+		prefilter_window = getParameter("Prefilter_window").toDouble();
+		hampel_k = getParameter("Hampel_k").toDouble();
+		detector_mode = getParameter("Detector").toDouble();
+		detect_window = getParameter("Detect_window (ms)").toDouble();
 		length = getParameter("length").toDouble();
-		PID_tresh = getParameter("PID_tresh").toDouble();
-		min_PID = getParameter("min_PID").toDouble();
-		reset_I_on = getParameter("reset_I_on").toDouble();
+		d_filter = getParameter("D_filter").toDouble();
+		d_window = getParameter("D_window").toDouble();
+		d_order = getParameter("D_order").toDouble();
+		opsin_order = getParameter("Opsin_order").toDouble();
+		tau_on_blue = getParameter("tau_on_blue (ms)").toDouble();
+		tau_off_blue = getParameter("tau_off_blue (ms)").toDouble();
+		tau_on_red = getParameter("tau_on_red (ms)").toDouble();
+		tau_off_red = getParameter("tau_off_red (ms)").toDouble();
+		vrev_on = getParameter("Vrev_estimation").toDouble();
+		vrev_lambda = getParameter("Vrev_lambda").toDouble();
+		rls_on = getParameter("RLS_on").toDouble();
+		rls_lambda = getParameter("RLS_lambda").toDouble();
+		rls_autoscale = getParameter("RLS_autoscale").toDouble();
+		rls_Tc = getParameter("RLS_Tc (ms)").toDouble();
+		autotune_on = getParameter("AutoTune").toDouble();
+		AT_start = getParameter("AT_start (ms)").toDouble();
+		AT_end = getParameter("AT_end (ms)").toDouble();
+		AT_amplitude = getParameter("AT_amplitude").toDouble();
+		AT_hysteresis = getParameter("AT_hysteresis (mV)").toDouble();
+		AT_beats = getParameter("AT_beats").toDouble();
+		AT_rule = getParameter("AT_rule").toDouble();
+		shadow_on = getParameter("Shadow_on").toDouble();
+		shadow_spread = getParameter("Shadow_spread").toDouble();
+		shadow_adopt = getParameter("Shadow_adopt").toDouble();
 		systime = 0;
 		count = 0;
 		APs = -1;
 		BCL = 0;
-		log_ideal_on = 0;
-		enter = 0;
+		setPhase(REST);
 		count2 = 0;
 		PID = 0;
 		PID_diff = 0;
 		Int = 0;
+		VLED_blue = 0;
+		VLED_red = 0;
+		configureOpsins();
+		blue_opsin.reset();
+		red_opsin.reset();
+		blue_Vrev_estimator.configure(vrev_lambda, -60, 60, 1000);
+		blue_Vrev_estimator.reset();
+		plant.configure(rls_lambda, period);
+		plant.reset();
+		prefilter.configure((int)prefilter_mode, (int)prefilter_window, hampel_k);
+		detector.configure(period, detect_window);
+		configureDerivative();
+		autotune.configure(AT_amplitude, AT_hysteresis, (int)AT_beats);
+		if (autotune_on){autotune.start();}
+		else {autotune.stop();}
+		shadows.setCandidates(K_p, K_i, K_d, Rm_blue, Rm_red, shadow_spread);
+		blue_Vrev_est = blue_Vrev;
+		blue_Vrev_used = blue_Vrev;
+		vm_beat.reset();
+		ref_beat.reset();
+		beat_err.reset();
 		cleanup();
+		lockBuffers();
 		break;
 	case PERIOD:
 		period = RT::System::getInstance()->getPeriod() * 1e-6; // time in milli-seconds
+		t_prev = 0;
+		vm_beat.configure(period);
+		ref_beat.configure(period);
+		beat_err.configure(period);
 		modulo = (1.0/(RT::System::getInstance()->getPeriod() * 1e-6)) * 1000.0;
+		configureOpsins();
+		plant.configure(rls_lambda, period);
+		detector.configure(period, detect_window);
+		configureDerivative();
+		lockBuffers();
 		break;
 	case PAUSE:
+	{
+		// pause() does not wait for a time-step that is still running
+		bool active = holdExecute();
 		output(0) = 0.0;
 		output(1) = 0.0;
-		act = 0;
+		VLED_blue = 0;
+		VLED_red = 0;
+		blue_opsin.reset();
+		red_opsin.reset();
+		prefilter.reset();
+		detector.reset();
+		if (phase != PAUSED){resume_phase = (phase == CORRECTING ? REST : phase);}
+		setPhase(PAUSED);
 		systime = 0;
+		t_prev = 0;
+		vm_beat.reset(); // A pause breaks the beat
+		ref_beat.reset();
+		beat_err.reset();
+		noise.skip();
+		publishStates(); // execute() is held, so the GUI thread is the only writer
+		setActive(active);
 		break;
+	}
 	case UNPAUSE:
+		setPhase(resume_phase); // Continue recording where it was left, or wait for the next upstroke
 		break;
 	default:
 		break;
 	}
 }
 
+/*
+refresh
+-------
+This function is called periodically by the GUI timer. Gains that were found
+by a finished auto-tuning experiment, adopted from the shadow controllers,
+rescaled by RLS_autoscale or backed off after alternans are written back to
+the parameter fields here, such that a later Modify keeps them. They are taken
+from the copy of the states, after the GAINS_TUNED event, and never from the
+variables of the real-time thread.
+The events reported by the real-time thread are counted (see EventMailbox.h).
+Then the newest snapshot of the states is copied from the real-time thread
+(see Seqlock.h), after which the default refresh updates the displayed states.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+void gAPqrPID3::refresh(void)
+{
+	unsigned int tuned = events.take(EventMailbox::GAINS_TUNED);
+	if (events.take(EventMailbox::AUTOTUNE_DONE) > 0)
+	{
+		// The experiment stopped itself, so AutoTune = 1 is posted again at a later Modify
+		setParameter("AutoTune", 0.0);
+		for (size_t j = 0; j < beat_posted.size(); j++)
+			{if (beat_vars[j].id == SET_AUTOTUNE){beat_posted[j] = 0;}}
+	}
+	saturated += events.take(EventMailbox::SATURATED);
+	overruns += events.take(EventMailbox::OVERRUN);
+	missed += events.take(EventMailbox::UPSTROKE_MISSED);
+	states.read(shown);
+	if (tuned > 0)
+	{
+		setParameter("K_p", shown.K_p);
+		setParameter("K_i", shown.K_i);
+		setParameter("K_d", shown.K_d);
+		setParameter("Rm_blue (MOhm)", shown.Rm_blue);
+		setParameter("Rm_red (MOhm)", shown.Rm_red);
+	}
+	DefaultGUIModel::refresh();
+}
+
 /*
 initParameters
 --------------
@@ -628,6 +1790,11 @@ void gAPqrPID3::initParameters()
 {
 	// system related parameters
 	systime = 0;
+	memory_locked = 0;
+	t_prev = 0;
+	saturated = 0;
+	overruns = 0;
+	missed = 0;
 	period = RT::System::getInstance()->getPeriod() * 1e-6; // ms
 	// cell related parameters
 	Vm = -80; 			// mV
@@ -636,16 +1803,40 @@ void gAPqrPID3::initParameters()
 	// upstroke related parameters
 	slope_thresh = 5.0; // mV
 	V_cutoff = -40;		// mV
+	prefilter_mode = 0;
+	prefilter_window = 5;	// samples
+	hampel_k = 3;
+	prefilter.configure((int)prefilter_mode, (int)prefilter_window, hampel_k);
+	detector_mode = 0;
+	detect_window = 0.3;	// ms
+	detector.configure(period, detect_window);
+	onset_frac = 0;
+	Vm_prev = Vm;
 	// logging parameters
-	log_ideal_on = 0;
 	lognum = 3;
 	APs = -1;
 	count2 = 0;
 	// correction parameters
-	act = 0;
+	setPhase(REST);
+	resume_phase = REST;
 	corr_start = 0;
 	PID_tresh = 0.1;
 	min_PID = 0.2;
+	auto_thresh = 0;
+	auto_k = 3;
+
+	// alternans detection
+	alt_window = 16;		// beats
+	alt_thresh = 5;			// ms
+	stv_thresh = 0;			// ms, off
+	alt_backoff = 1;		// no back-off
+	alt_flag = 0;
+	alternans.configure((int)alt_window);
+
+	// error statistics per beat
+	err_split1 = 50;		// ms, upstroke
+	err_split2 = 250;		// ms, plateau
+	beat_err.setSplits(err_split1, err_split2);
 	blue_Vrev = -20;	// mV
 
 	PID = 0;
@@ -657,6 +1848,10 @@ void gAPqrPID3::initParameters()
 	K_d = 0.1;
 	Int = 0;
 	length = 10;
+	d_filter = DerivativeFilter::REGRESSION;
+	d_window = 9;
+	d_order = 2;
+	configureDerivative();
 	num = 0;
 	denom = 1;
 	slope = 0;
@@ -669,11 +1864,69 @@ void gAPqrPID3::initParameters()
 
 	// standard loop parameters
 	count = 0;
-	enter = 0;
 	BCL = 0;			// ms
 	BCL_cutoff = 0.8;
 	modulo = (1.0/(RT::System::getInstance()->getPeriod() * 1e-6)) * 1000.0;
 	VLED = 0;
+	VLED_blue = 0;
+	VLED_red = 0;
 	output(0) = 0;
 	output(1) = 0;
+
+	// opsin kinetics compensation
+	opsin_order = 0;	// no compensation
+	tau_on_blue = 2;	// ms
+	tau_off_blue = 10;	// ms
+	tau_on_red = 2;		// ms
+	tau_off_red = 5;	// ms
+	configureOpsins();
+
+	// reversal potential estimation
+	vrev_on = 0;
+	vrev_lambda = 0.9999;
+	blue_Vrev_est = blue_Vrev;	// mV
+	blue_Vrev_used = blue_Vrev;	// mV
+	blue_Vrev_estimator.configure(vrev_lambda, -60, 60, 1000);
+
+	// plant identification
+	rls_on = 0;
+	rls_lambda = 0.9999;
+	rls_autoscale = 0;
+	rls_Tc = 1;			// ms
+	b_blue = 0;			// mV/ms/V
+	b_red = 0;			// mV/ms/V
+	tau_est = 0;		// ms
+	plant.configure(rls_lambda, period);
+
+	// relay auto-tuning
+	autotune_on = 0;
+	AT_start = 10;		// ms
+	AT_end = 100;		// ms
+	AT_amplitude = 100;
+	AT_hysteresis = 0.5;	// mV
+	AT_beats = 3;
+	AT_rule = 0;		// Ziegler-Nichols
+	Ku = 0;
+	Tu = 0;				// ms
+	gains_tuned = false;
+
+	// shadow controllers
+	shadow_on = 0;
+	shadow_spread = 1.5;
+	shadow_adopt = 0;
+	shadow_best = 0;
+	shadow_ratio = 1;
+	shadow_Kp = K_p;
+	shadow_Ki = K_i;
+	shadow_Kd = K_d;
+	shadows.setCandidates(K_p, K_i, K_d, Rm_blue, Rm_red, shadow_spread);
+
+	// output allocation
+	for (int n = 0; n < OutputAllocator::MAX_ACTUATORS; n++){VLED_act[n] = 0;}
+	configureActuators();
+	vm_beat.configure(period);
+	ref_beat.configure(period);
+	beat_err.configure(period);
+
+	publishStates();
 }
@@ -19,6 +19,7 @@
 #include "APqrPIDLTLP4.h"
 #include <math.h>
 #include <time.h>
+#include <algorithm>
 #include <main_window.h>
 
 /*
@@ -45,6 +46,14 @@ IN:
 						of an AP
 	*) Slope_tresh		Slope threshold that defines the beginning of the
 						AP (mV/ms)
+	*) Prefilter		Outlier rejection of the Vm that is seen by the upstroke
+						detector: 0 = off, 1 = sliding median, 2 = Hampel
+	*) Prefilter_window	Length of the sliding window of the prefilter (samples)
+	*) Hampel_k			Rejection threshold of the Hampel prefilter, in scaled
+						median absolute deviations
+	*) Detector			Upstroke detection: 0 = rise over the last ms, 1 = slope
+						over Detect_window with interpolated onset
+	*) Detect_window	Length of the window of the slope fit (ms)
 	*) Rm_blue			Initial resistance for the blue LED channel
 	*) Rm_red			Initial resistance for the red LED channel
 	*) corr_start		Gives the possibility to start at a later time than
@@ -56,9 +65,70 @@ IN:
 	*) dlength			Amount of points that need to be taken into account to
 						find the derivative (slope of the linear trend line of
 						these points)
+	*) D_filter			Estimator of the derivative: 0 = linear trend line over
+						dlength points, 1 = Savitzky-Golay, 2 = noise-robust
+	*) D_window			Amount of points of the Savitzky-Golay and noise-robust
+						filters (5, 7, 9, 11, 15, 21 or 31)
+	*) D_order			Polynomial order of the Savitzky-Golay filter (2 to 4)
 	*) PID_tresh		treshold value under which the same output as before
 						gets repeated
 	*) min_PID			value under which the lights get switched off
+	*) Auto_thresh		value that indicates whether or not PID_tresh and min_PID
+						follow the noise of Vm between the beats
+	*) Auto_k			min_PID in multiples of the noise that this gives on
+						the P term
+	*) Alt_window		Number of beats over which alternans and short-term
+						variability of APD90 are computed
+	*) Alt_thresh		Alternans magnitude of APD90 above which alternans is
+						flagged (ms, 0 = off)
+	*) STV_thresh		Short-term variability of APD90 above which alternans
+						is flagged (ms, 0 = off)
+	*) Alt_backoff		Factor by which the gains are scaled
+						when alternans is flagged (1 = no back-off)
+	*) Err_split1		End of the first phase window of the error statistics
+						after the upstroke (ms)
+	*) Err_split2		End of the second phase window of the error statistics
+						after the upstroke (ms)
+	*) Opsin_order		Order of the opsin kinetics model whose inverse is applied
+						to the LED commands (0 = no compensation, 1 or 2)
+	*) tau_on_blue		Activation time constant of the 'blue' ChR current (ms)
+	*) tau_off_blue		Deactivation time constant of the 'blue' ChR current (ms)
+	*) tau_on_red		Activation time constant of the 'red' current (ms)
+	*) tau_off_red		Deactivation time constant of the 'red' current (ms)
+	*) Vrev_estimation	value that indicates whether or not Blue_Vrev is estimated
+						online; at every upstroke the gating threshold is raised
+						to the estimate when that lies above Blue_Vrev
+	*) Vrev_lambda		Forgetting factor of the Blue_Vrev estimator
+	*) RLS_on			value that indicates whether or not the response of the cell
+						is identified online
+	*) RLS_lambda		Forgetting factor of the online identification
+	*) RLS_autoscale	value that indicates whether or not Rm_blue/Rm_red is replaced by
+						the identified value at every upstroke
+	*) RLS_Tc			Time constant (ms) with which the rescaled controller
+						should remove an error
+	*) AutoTune			value that starts (1) a relay auto-tuning experiment at the
+						next upstroke after Modify; the tuned gains replace K_p, K_i
+						and K_d and AutoTune returns to 0 when it is done
+	*) AT_start			Start of the relay window within the AP (ms)
+	*) AT_end			End of the relay window within the AP (ms)
+	*) AT_amplitude		Relay amplitude in PID units
+	*) AT_hysteresis	Relay hysteresis (mV)
+	*) AT_beats			Number of APs the relay experiment lasts
+	*) AT_rule			Tuning rule: 0 = Ziegler-Nichols, 1 = Ziegler-Nichols
+						without overshoot, 2 = Tyreus-Luyben
+	*) Shadow_on		value that indicates whether or not alternative gain sets
+						are evaluated in parallel against the identified cell
+						response (needs RLS_on)
+	*) Shadow_spread	Factor by which the alternative gain sets differ from the
+						live K_p, K_i, K_d, Rm_blue and Rm_red
+	*) Shadow_adopt		value that indicates whether or not the best alternative
+						gain set replaces the live gains at every upstroke
+	*) K_preview		Scale factor for the preview (feedforward) term, which acts
+						on the upcoming change of the iAP
+	*) Preview_N		Amount of upcoming iAP points that are taken into account
+						by the preview term
+	*) Preview_tau		Time constant of the exponential weighting of the upcoming
+						iAP points (ms)
 OUT:
 	*) VLED_blue		voltage that is used to power the first LED driver that
 						regulates the light that is shined onto the cells
@@ -125,6 +195,16 @@ static DefaultGUIModel::variable_t vars[] = {
 	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
 	{ "Slope_thresh (mV/ms)", "SLope threshold that defines the beginning of the AP (mV/ms)",
 	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "Prefilter", "Outlier rejection of the Vm seen by the upstroke detector (0 = off, 1 = median, 2 = Hampel)",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "Prefilter_window", "Length of the sliding window of the prefilter (samples)",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "Hampel_k", "Rejection threshold of the Hampel prefilter (scaled median absolute deviations)",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "Detector", "Upstroke detection (0 = rise over the last ms, 1 = slope over Detect_window with interpolated onset)",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "Detect_window (ms)", "Length of the window of the slope fit of the upstroke detector",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
 	{ "Rm_blue (MOhm)", "MOhm", DefaultGUIModel::PARAMETER
 	| DefaultGUIModel::DOUBLE, },
 	{ "Rm_red (MOhm)", "MOhm", DefaultGUIModel::PARAMETER
@@ -141,10 +221,93 @@ static DefaultGUIModel::variable_t vars[] = {
 	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
 	{ "dlength", "Amount of points that need to be taken into account to find the derivative (slope of the linear trend line of these points)",
 	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "D_filter", "Estimator of the derivative (0 = linear trend line, 1 = Savitzky-Golay, 2 = noise-robust)",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "D_window", "Amount of points of the Savitzky-Golay and noise-robust filters (5, 7, 9, 11, 15, 21 or 31)",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "D_order", "Polynomial order of the Savitzky-Golay filter (2 to 4)",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "D_lag (ms)", "Lag of the derivative estimate", DefaultGUIModel::STATE, },
 	{ "PID_tresh", "treshold value under which the same output as before gets repeated",
 	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
 	{ "min_PID", "value under which the lights get switched off",
 	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "Auto_thresh", "value that indicates whether or not PID_tresh and min_PID follow the noise of Vm between the beats (0 or 1)",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "Auto_k", "min_PID in multiples of the estimated noise",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "Alt_window (beats)", "Number of beats over which alternans and short-term variability of APD90 are computed (4-32)",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "Alt_thresh (ms)", "Alternans magnitude of APD90 above which alternans is flagged (0 = off)",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "STV_thresh (ms)", "Short-term variability of APD90 above which alternans is flagged (0 = off)",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "Alt_backoff", "Factor by which K_p, K_i and K_d are scaled when alternans is flagged (1 = no back-off)",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "Err_split1 (ms)", "End of the first phase window (upstroke) of the error statistics after the upstroke",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "Err_split2 (ms)", "End of the second phase window (plateau) of the error statistics after the upstroke",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "Opsin_order", "Order of the opsin kinetics model that is inverted on the LED outputs (0 = off, 1 or 2)",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "tau_on_blue (ms)", "Activation time constant of the 'blue' ChR current",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "tau_off_blue (ms)", "Deactivation time constant of the 'blue' ChR current",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "tau_on_red (ms)", "Activation time constant of the 'red' current",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "tau_off_red (ms)", "Deactivation time constant of the 'red' current",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "Vrev_estimation", "value that indicates whether or not Blue_Vrev is estimated online (0 or 1)",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "Vrev_lambda", "Forgetting factor of the Blue_Vrev estimator (0-1)",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "Blue_Vrev_est (mV)", "Estimated apparent reversal potential of the 'blue' ChR current", DefaultGUIModel::STATE, },
+	{ "RLS_on", "value that indicates whether or not the response of the cell is identified online (0 or 1)",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "RLS_lambda", "Forgetting factor of the online identification (0-1)",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "RLS_autoscale", "value that indicates whether or not Rm_blue/Rm_red is rescaled from the identified response (0 or 1)",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "RLS_Tc (ms)", "Time constant with which the rescaled controller should remove an error",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "b_blue (mV/ms/V)", "Identified effect of the blue LED channel on Vm", DefaultGUIModel::STATE, },
+	{ "b_red (mV/ms/V)", "Identified effect of the red LED channel on Vm", DefaultGUIModel::STATE, },
+	{ "tau_est (ms)", "Identified time constant with which an error relaxes without light", DefaultGUIModel::STATE, },
+	{ "AutoTune", "value that starts (1) a relay auto-tuning experiment of K_p, K_i and K_d",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "AT_start (ms)", "Start of the relay window within the AP",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "AT_end (ms)", "End of the relay window within the AP",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "AT_amplitude", "Relay amplitude in PID units",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "AT_hysteresis (mV)", "Relay hysteresis",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "AT_beats", "Number of APs the relay experiment lasts",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "AT_rule", "Tuning rule: 0 = Ziegler-Nichols, 1 = Ziegler-Nichols without overshoot, 2 = Tyreus-Luyben",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "Ku", "Ultimate gain found by the relay experiment", DefaultGUIModel::STATE, },
+	{ "Tu (ms)", "Ultimate period found by the relay experiment", DefaultGUIModel::STATE, },
+	{ "Shadow_on", "value that indicates whether or not alternative gain sets are evaluated in parallel (0 or 1, needs RLS_on)",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "Shadow_spread", "Factor by which the alternative gain sets differ from the live gains",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "Shadow_adopt", "value that indicates whether or not the best alternative gain set is adopted at every upstroke (0 or 1)",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "Shadow_best", "Index of the best gain set of the last AP (0 = live gains)", DefaultGUIModel::STATE, },
+	{ "Shadow_cost_ratio", "Predicted squared error of the best gain set relative to the live gains", DefaultGUIModel::STATE, },
+	{ "Shadow_K_p", "K_p of the best gain set of the last AP", DefaultGUIModel::STATE, },
+	{ "Shadow_K_i", "K_i of the best gain set of the last AP", DefaultGUIModel::STATE, },
+	{ "Shadow_K_d", "K_d of the best gain set of the last AP", DefaultGUIModel::STATE, },
+	{ "K_preview", "Scale factor for the preview term that acts on the upcoming change of the iAP",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "Preview_N", "Amount of upcoming iAP points that are taken into account by the preview term",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "Preview_tau (ms)", "Time constant of the weighting of the upcoming iAP points",
+	DefaultGUIModel::PARAMETER | DefaultGUIModel::DOUBLE, },
+	{ "F", "Preview term", DefaultGUIModel::STATE, },
 	{ "P", "P term", DefaultGUIModel::STATE, },
 	{ "I", "I term", DefaultGUIModel::STATE, },
 	{ "D", "D term", DefaultGUIModel::STATE, },
@@ -152,6 +315,39 @@ static DefaultGUIModel::variable_t vars[] = {
 	{ "Time (ms)", "Time (ms)", DefaultGUIModel::STATE, },
 	{ "PID", "PID", DefaultGUIModel::STATE, },
 	{ "act", "act", DefaultGUIModel::STATE, },
+	{ "Phase", "0 = REST, 3 = CORRECTING, 4 = PAUSED", DefaultGUIModel::STATE, },
+	{ "Memory locked", "1 when the hot state and the logs of the module are locked in RAM", DefaultGUIModel::STATE, },
+	{ "Saturated", "time-steps on which the requested output exceeded its range", DefaultGUIModel::STATE, },
+	{ "Overruns", "time-steps that started more than 1.5 periods after the previous one", DefaultGUIModel::STATE, },
+	{ "Missed upstrokes", "beats without an upstroke within twice their expected length", DefaultGUIModel::STATE, },
+	{ "APD30 (ms)", "time from dV/dt max to 30% repolarization of the last beat", DefaultGUIModel::STATE, },
+	{ "APD50 (ms)", "time from dV/dt max to 50% repolarization of the last beat", DefaultGUIModel::STATE, },
+	{ "APD90 (ms)", "time from dV/dt max to 90% repolarization of the last beat", DefaultGUIModel::STATE, },
+	{ "AP_amplitude (mV)", "peak minus RMP of the last beat", DefaultGUIModel::STATE, },
+	{ "dVdt_max (mV/ms)", "maximal upstroke velocity of the last beat", DefaultGUIModel::STATE, },
+	{ "RMP (mV)", "lowest potential of the beat before the last beat", DefaultGUIModel::STATE, },
+	{ "Ref_APD30 (ms)", "time from dV/dt max to 30% repolarization of the reference AP of the last beat", DefaultGUIModel::STATE, },
+	{ "Ref_APD50 (ms)", "time from dV/dt max to 50% repolarization of the reference AP of the last beat", DefaultGUIModel::STATE, },
+	{ "Ref_APD90 (ms)", "time from dV/dt max to 90% repolarization of the reference AP of the last beat", DefaultGUIModel::STATE, },
+	{ "Ref_AP_amplitude (mV)", "peak minus RMP of the reference AP of the last beat", DefaultGUIModel::STATE, },
+	{ "Ref_dVdt_max (mV/ms)", "maximal upstroke velocity of the reference AP of the last beat", DefaultGUIModel::STATE, },
+	{ "Ref_RMP (mV)", "lowest potential of the reference AP of the beat before the last beat", DefaultGUIModel::STATE, },
+	{ "Noise (mV)", "estimated standard deviation of the noise of Vm between the beats", DefaultGUIModel::STATE, },
+	{ "Alternans (ms)", "alternans magnitude of APD90 over the last Alt_window beats", DefaultGUIModel::STATE, },
+	{ "STV (ms)", "short-term variability of APD90 over the last Alt_window beats", DefaultGUIModel::STATE, },
+	{ "Alternans_flag", "1 when the last full window crossed Alt_thresh or STV_thresh", DefaultGUIModel::STATE, },
+	{ "Err_RMS (mV)", "root mean square of Vm - reference of the last corrected beat", DefaultGUIModel::STATE, },
+	{ "Err_max (mV)", "largest absolute Vm - reference of the last corrected beat", DefaultGUIModel::STATE, },
+	{ "Err_bias (mV)", "mean Vm - reference of the last corrected beat", DefaultGUIModel::STATE, },
+	{ "Err_RMS_w1 (mV)", "root mean square of Vm - reference in the first phase window of the last corrected beat", DefaultGUIModel::STATE, },
+	{ "Err_max_w1 (mV)", "largest absolute Vm - reference in the first phase window of the last corrected beat", DefaultGUIModel::STATE, },
+	{ "Err_bias_w1 (mV)", "mean Vm - reference in the first phase window of the last corrected beat", DefaultGUIModel::STATE, },
+	{ "Err_RMS_w2 (mV)", "root mean square of Vm - reference in the second phase window of the last corrected beat", DefaultGUIModel::STATE, },
+	{ "Err_max_w2 (mV)", "largest absolute Vm - reference in the second phase window of the last corrected beat", DefaultGUIModel::STATE, },
+	{ "Err_bias_w2 (mV)", "mean Vm - reference in the second phase window of the last corrected beat", DefaultGUIModel::STATE, },
+	{ "Err_RMS_w3 (mV)", "root mean square of Vm - reference after the second split of the last corrected beat", DefaultGUIModel::STATE, },
+	{ "Err_max_w3 (mV)", "largest absolute Vm - reference after the second split of the last corrected beat", DefaultGUIModel::STATE, },
+	{ "Err_bias_w3 (mV)", "mean Vm - reference after the second split of the last corrected beat", DefaultGUIModel::STATE, },
 	{ "idx", "idx", DefaultGUIModel::STATE, },	
 	{ "idx2", "idx2", DefaultGUIModel::STATE, },
 };
@@ -163,6 +359,67 @@ variable denoting the amount of variables that is displayed in the GUI
 */
 static size_t num_vars = sizeof(vars) / sizeof(DefaultGUIModel::variable_t);
 
+/*
+live_vars[]
+-----------
+Parameters that Modify hands to execute() without a reset (see LiveParams.h).
+All other parameters are structural: changing them resets the module and its logs.
+*/
+static const char* live_vars[] = {
+	"K_p",
+	"K_i",
+	"K_d",
+	"Rm_blue (MOhm)",
+	"Rm_red (MOhm)",
+	"PID_tresh",
+	"min_PID",
+	"Auto_thresh",
+	"Auto_k",
+	"Alt_thresh (ms)",
+	"STV_thresh (ms)",
+	"Alt_backoff",
+	"Err_split1 (ms)",
+	"Err_split2 (ms)",
+	"Blue_Vrev",
+	"Slope_thresh (mV/ms)",
+	"V_cutoff (mV)",
+	"Gain",
+	"Offset",
+	"Pulse_strength (V)",
+	"V_light_on (mV)",
+	"K_preview",
+};
+
+static size_t num_live_vars = sizeof(live_vars) / sizeof(const char*);
+
+/*
+beat_vars[]
+-----------
+Parameters that Modify hands to execute() as commands, which take effect at a beat
+boundary (see CommandQueue.h): at the next upstroke or at the end of the beat.
+*/
+enum {SET_CORR_START, SET_LOOPS, SET_AUTOTUNE};
+
+static const struct {const char* name; int id; int when;} beat_vars[] = {
+	{"Correction start", SET_CORR_START, BeatCommands::AT_UPSTROKE},
+	{"Loops", SET_LOOPS, BeatCommands::AT_BEAT_END},
+	{"AutoTune", SET_AUTOTUNE, BeatCommands::AT_UPSTROKE},
+};
+
+static size_t num_beat_vars = sizeof(beat_vars) / sizeof(beat_vars[0]);
+
+/*
+SyncEvent
+---------
+Event without an action. The real-time thread handles events between two
+time-steps, so posting one waits until execute() has returned (see holdExecute).
+*/
+class SyncEvent : public RT::Event
+{
+public:
+	int callback(void){return 0;}
+};
+
 /*
 gAPqrPIDLTLP4
 ------
@@ -187,13 +444,47 @@ APqrPIDLTLP4::APqrPIDLTLP4(void) : DefaultGUIModel("APqr PIDLTLP4", ::vars, ::nu
 	QTimer::singleShot(0, this, SLOT(resizeMe()));
 }
 
+/*
+operator new
+------------
+Allocates the module on a cache line boundary, such that the alignas() of its
+hot state and of its logs holds on the heap (see RTMemory.h).
+
+IN:
+	*) bytes	size of the module
+OUT:
+	*) p		pointer to the memory
+*/
+void* APqrPIDLTLP4::operator new(size_t bytes)
+{
+	return alignedAlloc(bytes);
+}
+
+/*
+operator delete
+---------------
+Frees a module that was allocated with operator new.
+
+IN:
+	*) p		pointer to the module
+OUT:
+	*) None
+*/
+void APqrPIDLTLP4::operator delete(void* p)
+{
+	alignedFree(p);
+}
+
 APqrPIDLTLP4::~APqrPIDLTLP4(void) {}
 
 /*
 cleanup
 -------
 The APqr software makes use of two list structures which need cleaning after
-a reset of parameters. The cleanup function takes care of this.
+a reset of parameters. The cleanup function takes care of this by starting a
+new epoch of each log, after which every entry reads as 0 until it is written
+again (see EpochBuffer.h). This takes constant time, so a Modify no longer
+stalls on clearing the logs.
 
 IN:
 	*) None
@@ -202,10 +493,346 @@ OUT:
 */
 void APqrPIDLTLP4::cleanup()
 {
-	int i;
-	for(i=0;i<10000;i++){
-		Vm_log[i]=0;
-		Vm_diff_log[i]=0;
+	Vm_log.invalidate();
+	Vm_diff_log.invalidate();
+}
+
+/*
+lockBuffers
+-----------
+Touches every page of the module, its hot state and its logs, and of the loaded
+reference AP and its preview, and locks them in RAM, such that execute() does
+not take page faults on them after a swap or a fork of the process. Called from
+MODIFY, PERIOD and after a file is loaded, outside of the real-time loop. Sets
+memory_locked to 0 when a lock is refused (RLIMIT_MEMLOCK).
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+void APqrPIDLTLP4::lockBuffers()
+{
+	memory_locked = lockMemory(this, sizeof(*this));
+	// the reference AP is read on every time-step as well
+	if (wave.size()){memory_locked = lockMemory(wave.data(), wave.size()*sizeof(double)) && memory_locked;}
+	if (wave_preview.size()){memory_locked = lockMemory(wave_preview.data(), wave_preview.size()*sizeof(double)) && memory_locked;}
+}
+
+/*
+readLive
+--------
+Reads the live-tunable parameters (see live_vars[]) from the GUI.
+
+IN:
+	*) None
+OUT:
+	*) p		block with the live-tunable parameters
+*/
+APqrPIDLTLP4::LiveBlock APqrPIDLTLP4::readLive()
+{
+	LiveBlock p;
+	p.K_p = getParameter("K_p").toDouble();
+	p.K_i = getParameter("K_i").toDouble();
+	p.K_d = getParameter("K_d").toDouble();
+	p.Rm_blue = getParameter("Rm_blue (MOhm)").toDouble();
+	p.Rm_red = getParameter("Rm_red (MOhm)").toDouble();
+	p.PID_tresh = getParameter("PID_tresh").toDouble();
+	p.min_PID = getParameter("min_PID").toDouble();
+	p.auto_thresh = getParameter("Auto_thresh").toDouble();
+	p.auto_k = getParameter("Auto_k").toDouble();
+	p.alt_thresh = getParameter("Alt_thresh (ms)").toDouble();
+	p.stv_thresh = getParameter("STV_thresh (ms)").toDouble();
+	p.alt_backoff = getParameter("Alt_backoff").toDouble();
+	p.err_split1 = getParameter("Err_split1 (ms)").toDouble();
+	p.err_split2 = getParameter("Err_split2 (ms)").toDouble();
+	p.blue_Vrev = getParameter("Blue_Vrev").toDouble();
+	p.slope_thresh = getParameter("Slope_thresh (mV/ms)").toDouble();
+	p.V_cutoff = getParameter("V_cutoff (mV)").toDouble();
+	p.gain = getParameter("Gain").toDouble();
+	p.offset = getParameter("Offset").toDouble();
+	p.pulse_strength = getParameter("Pulse_strength (V)").toDouble();
+	p.V_light_on = getParameter("V_light_on (mV)").toDouble();
+	p.K_preview = getParameter("K_preview").toDouble();
+	return p;
+}
+
+/*
+applyLive
+---------
+Takes over a block of live-tunable parameters. Called from execute() when Modify
+published a new block, and from Modify itself before a reset. Only assignments,
+so it is safe in the real-time loop.
+
+IN:
+	*) p		block with the live-tunable parameters
+OUT:
+	*) None
+*/
+void APqrPIDLTLP4::applyLive(const LiveBlock& p)
+{
+	K_p = p.K_p;
+	K_i = p.K_i;
+	K_d = p.K_d;
+	Rm_blue = p.Rm_blue;
+	Rm_red = p.Rm_red;
+	PID_tresh = p.PID_tresh;
+	min_PID = p.min_PID;
+	auto_thresh = p.auto_thresh;
+	auto_k = p.auto_k;
+	alt_thresh = p.alt_thresh;
+	stv_thresh = p.stv_thresh;
+	alt_backoff = p.alt_backoff;
+	err_split1 = p.err_split1;
+	err_split2 = p.err_split2;
+	beat_err.setSplits(err_split1, err_split2);
+	blue_Vrev = p.blue_Vrev;
+	// Modify only changes the hand-entered threshold; an estimate in use is kept
+	if (!vrev_on || !blue_Vrev_estimator.valid()){blue_Vrev_used = blue_Vrev;}
+	slope_thresh = p.slope_thresh;
+	V_cutoff = p.V_cutoff;
+	gain = p.gain;
+	offset = p.offset;
+	pulse_strength = p.pulse_strength;
+	V_light_on = p.V_light_on;
+	K_preview = p.K_preview;
+	autoThresholds(); // The hand-entered thresholds only hold while Auto_thresh is off
+}
+
+/*
+structuralChange
+----------------
+Compares the structural parameters in the GUI, i.e. all parameters that are not
+in live_vars[] or beat_vars[], with their values at the previous Modify.
+
+IN:
+	*) None
+OUT:
+	*) changed	true when a structural parameter changed, and at the first Modify
+*/
+bool APqrPIDLTLP4::structuralChange()
+{
+	std::vector<double> values;
+	for (size_t k = 0; k < num_vars; k++)
+	{
+		if (!(vars[k].flags & DefaultGUIModel::PARAMETER)){continue;}
+		bool is_live = false;
+		for (size_t j = 0; j < num_live_vars; j++){is_live = is_live || vars[k].name == live_vars[j];}
+		for (size_t j = 0; j < num_beat_vars; j++){is_live = is_live || vars[k].name == beat_vars[j].name;}
+		if (!is_live){values.push_back(getParameter(QString::fromStdString(vars[k].name)).toDouble());}
+	}
+	bool changed = (structural.empty() || values != structural);
+	structural = values;
+	return changed;
+}
+
+/*
+postCommands
+------------
+Posts the beat-synchronous parameters (see beat_vars[]) that changed since they
+were last posted as commands for the real-time loop. A command that does not fit
+in the queue is posted again at the next Modify.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+void APqrPIDLTLP4::postCommands()
+{
+	beat_posted.resize(num_beat_vars, NAN);
+	for (size_t j = 0; j < num_beat_vars; j++)
+	{
+		double value = getParameter(beat_vars[j].name).toDouble();
+		if (value != beat_posted[j] && commands.post(beat_vars[j].when, beat_vars[j].id, value))
+			{beat_posted[j] = value;}
+	}
+}
+
+/*
+applyCommand
+------------
+Carries out a command from the GUI thread.
+
+IN:
+	*) c		the command
+OUT:
+	*) None
+*/
+void APqrPIDLTLP4::applyCommand(const BeatCommand& c)
+{
+	switch (c.id)
+	{
+	case SET_CORR_START:
+		corr_start = c.value;
+		break;
+	case SET_LOOPS:
+		nloops = c.value;
+		break;
+	case SET_AUTOTUNE:
+		// A running experiment is left alone, such that a repeated Modify does not restart it
+		autotune_on = c.value;
+		if (!autotune_on){autotune.stop();}
+		else if (!autotune.active()){autotune.start();}
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+drainCommands
+-------------
+Carries out all commands that wait for a beat boundary, in the order in which
+they were posted. Called from the beat boundaries in the real-time loop.
+
+IN:
+	*) when		BeatCommands::AT_UPSTROKE or BeatCommands::AT_BEAT_END
+OUT:
+	*) None
+*/
+void APqrPIDLTLP4::drainCommands(int when)
+{
+	BeatCommand c;
+	while (commands.next(when, c)){applyCommand(c);}
+}
+
+/*
+publishStates
+-------------
+Copies the states of the current time-step into one snapshot and publishes it
+to the GUI thread (see Seqlock.h), such that refresh() never shows values of two
+different time-steps. Called at the end of execute(), and from the GUI thread
+only while execute() does not run.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+void APqrPIDLTLP4::publishStates()
+{
+	GuiStates s;
+	s.blue_Vrev_est = blue_Vrev_est;
+	s.b_blue = b_blue;
+	s.b_red = b_red;
+	s.tau_est = tau_est;
+	s.Ku = Ku;
+	s.Tu = Tu;
+	s.shadow_best = shadow_best;
+	s.shadow_ratio = shadow_ratio;
+	s.shadow_Kp = shadow_Kp;
+	s.shadow_Ki = shadow_Ki;
+	s.shadow_Kd = shadow_Kd;
+	s.K_p = K_p;
+	s.K_i = K_i;
+	s.K_d = K_d;
+	s.Rm_blue = Rm_blue;
+	s.Rm_red = Rm_red;
+	s.systime = systime;
+	s.PID = PID;
+	s.act = act;
+	s.phase = (double)phase;
+	s.idx = (double)idx;
+	s.idx2 = (double)idx2;
+	s.iAP = iAP;
+	s.P = P;
+	s.I = I;
+	s.D = D;
+	s.F = F;
+	const BeatShape& vm_shape = vm_beat.result();
+	const BeatShape& ref_shape = ref_beat.result();
+	s.apd30 = vm_shape.apd30;
+	s.apd50 = vm_shape.apd50;
+	s.apd90 = vm_shape.apd90;
+	s.amplitude = vm_shape.amplitude;
+	s.dvdt_max = vm_shape.dvdt_max;
+	s.rmp = vm_shape.rmp;
+	s.ref_apd30 = ref_shape.apd30;
+	s.ref_apd50 = ref_shape.apd50;
+	s.ref_apd90 = ref_shape.apd90;
+	s.ref_amplitude = ref_shape.amplitude;
+	s.ref_dvdt_max = ref_shape.dvdt_max;
+	s.ref_rmp = ref_shape.rmp;
+	s.noise = noise.sigma();
+	s.alternans = alternans.alternans();
+	s.stv = alternans.stv();
+	s.alt_flag = alt_flag;
+	s.err_rms = beat_err.beat().rms;
+	s.err_max = beat_err.beat().max_abs;
+	s.err_bias = beat_err.beat().bias;
+	s.err_rms1 = beat_err.window(0).rms;
+	s.err_max1 = beat_err.window(0).max_abs;
+	s.err_bias1 = beat_err.window(0).bias;
+	s.err_rms2 = beat_err.window(1).rms;
+	s.err_max2 = beat_err.window(1).max_abs;
+	s.err_bias2 = beat_err.window(1).bias;
+	s.err_rms3 = beat_err.window(2).rms;
+	s.err_max3 = beat_err.window(2).max_abs;
+	s.err_bias3 = beat_err.window(2).bias;
+	states.write(s);
+	// Gains changed by execute() are reported only after the snapshot that holds them,
+	// such that refresh() finds them in the copy it reads after taking the event
+	if (gains_tuned)
+	{
+		gains_tuned = false;
+		events.post(EventMailbox::GAINS_TUNED);
+	}
+}
+
+/*
+autoThresholds
+--------------
+When Auto_thresh is on and the noise estimate is valid (see NoiseFloor.h), sets
+the output thresholds from the estimated noise s of Vm. Through the P term
+this noise gives a noise of K_p*s on PID and of sqrt(2)*K_p*s on its change
+between two time-steps, so min_PID = Auto_k*K_p*s and
+PID_tresh = Auto_k*sqrt(2)*K_p*s. Otherwise the hand-entered values stay in use.
+Called at every upstroke and after new live-tunable parameters.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+void APqrPIDLTLP4::autoThresholds()
+{
+	if (!auto_thresh || !noise.valid()){return;}
+	min_PID = auto_k*fabs(K_p)*noise.sigma();
+	PID_tresh = sqrt(2.0)*min_PID;
+}
+
+/*
+checkAlternans
+--------------
+Beat boundary of the alternans detection (see AlternansDetector.h). The APD90
+of the beat that just ended is added to the window, unless the beat did not
+repolarize that far. Once the window is full, alternans is flagged when its
+magnitude exceeds Alt_thresh or the short-term variability exceeds STV_thresh.
+When Alt_backoff is below 1, a flag scales K_p, K_i and K_d by it (not during
+auto-tuning), after which a full window of beats with the new gains is awaited
+before the next back-off.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+void APqrPIDLTLP4::checkAlternans()
+{
+	double apd90 = vm_beat.result().apd90;
+	if (apd90 <= 0){return;}
+	alternans.update(apd90);
+	if (!alternans.full()){return;}
+
+	alt_flag = ((alt_thresh > 0 && alternans.alternans() > alt_thresh) || (stv_thresh > 0 && alternans.stv() > stv_thresh));
+	if (alt_flag && alt_backoff > 0 && alt_backoff < 1 && !autotune.active())
+	{
+		K_p *= alt_backoff;
+		K_i *= alt_backoff;
+		K_d *= alt_backoff;
+		gains_tuned = true; // Handed to refresh() with the states of this time-step
+		alternans.reset(); // A full window with the new gains before the next back-off
 	}
 }
 
@@ -223,16 +850,9 @@ IN:
 OUT:
 	*) sumy		The sum of 'length' elements in the array arr[]
 */
-double APqrPIDLTLP4::sumy(double arr[], int n, double dlength, double modulo)
+double APqrPIDLTLP4::sumy(const apqr_log_t& arr, int n, double length, double modulo)
 {
-    double sumy = 0; // initialize sum
- 
-    // Iterate through all elements
-    // and add them to sum
-    for (int i = n-dlength+1 ; i < n+1; i++)
-    sumy += arr[i % (int)modulo];
- 
-    return sumy;
+	return windowSum(arr, n, (int)length, (int)modulo);
 }
 
 /*
@@ -251,20 +871,9 @@ OUT:
 	*) sumxy		The sum of 'length' elements in the array arr[] multiplied
 				by time-step
 */
-double APqrPIDLTLP4::sumxy(double arr[], int n, double dlength, double period, double modulo)
+double APqrPIDLTLP4::sumxy(const apqr_log_t& arr, int n, double length, double period, double modulo)
 {
-    double sumxy = 0; // initialize sum
-	int j = 0;
-
-    // Iterate through all elements
-    // and add them to sum
-    for (int i = n-dlength+1 ; i < n+1; i++)
-    {
-	sumxy += arr[i % (int)modulo] * (j*period);
-	j++;
-    }
- 
-    return sumxy;
+	return windowMoment(arr, n, (int)length, (int)modulo) * period;
 }
 
 /*
@@ -312,49 +921,176 @@ double APqrPIDLTLP4::sumx2(double period, double dlength)
 }
 
 /*
-execute
--------
-This is the main funtcion of the code that is looped through real-time.
-It contains the four main parts of the algorithm:
-	1) Reading in the ideal AP
-	2) Detecting AP upstrokes
-	3) Computing AP correction and outputting this
-	4) Updating the necessary variables
+configureOpsins
+---------------
+Passes the opsin kinetics parameters and the real-time period on to the
+compensators of the blue and the red LED channel.
 
 IN:
 	*) None
 OUT:
-	*) VLED1	voltage that is used to power the first LED driver that
-				regulates the light that is shined onto the cells
-	*) VLED2 	voltage that is used to power the second LED driver that
-				regulates the light that is shined onto the cells
+	*) None
 */
-void APqrPIDLTLP4::execute(void)
+void APqrPIDLTLP4::configureOpsins()
 {
-	systime = idx * dt; // time in milli-seconds
-	Vm = input(0) * 1e2; // convert 10V to mV. Divided by 10 because the amplifier produces 10-fold amplified voltages. Multiplied by 1000 to vonvert V to mV.
+	blue_opsin.configure((int)opsin_order, tau_on_blue, tau_off_blue, dt, 5);
+	red_opsin.configure((int)opsin_order, tau_on_red, tau_off_red, dt, 5);
+}
 
-	Vm_log[idx2 % wave.size()] = Vm; 	// Logging the measured Vm in a list
-										// where the wave.size component makes
-										// sure you keep cycling when you have
-										// reached the maximum number in the list.
+/*
+holdExecute
+-----------
+Deactivates the module and waits until the real-time thread is no longer inside
+execute(), as DefaultGUIModel::modify() does, such that the GUI thread can swap
+in data that execute() reads on every time-step (the AP file, its preview) or
+reset the state that it works on. pause() only deactivates the module, which
+does not stop a time-step that is already running.
+The caller restores the returned state with setActive() once it is done.
 
-	if ((nloops && loop >= nloops) || !wave.size()) {
-		// Pause the working of this module as long as no File has been provided, or as soon
-		// as the maximal number of loops through this file has been reached
-		pauseButton->setChecked(true);
-		return;
-	}
+IN:
+	*) None
+OUT:
+	*) active	whether the module was active
+*/
+bool APqrPIDLTLP4::holdExecute()
+{
+	bool active = getActive();
+	setActive(false);
+	SyncEvent sync;
+	RT::System::getInstance()->postEvent(&sync); // Returns once the real-time thread handled it
+	return active;
+}
 
-	if (act == 0 && Vm < V_light_on){
-		// This statement is entered whenever the cell is no longer in a state where an AP
-		// is forced upon it
-		// The if-conditions measure the following:
-		// 1) That you are currently not imprinting anything any more
-		// 2) That you are below the stimulation threshold
+/*
+configureActuators
+------------------
+Describes the LED channels to the output allocator: the blue channel depolarizes
+with a strength set by Rm_blue as long as Vm is below blue_Vrev, the red channel
+repolarizes with a strength set by Rm_red. By lowering Rm_red compared to Rm_blue,
+it is possible to counteract the smaller effect of repolarizing currents than
+depolarizing currents. Both LED drivers accept up to 5V.
+Further actuators (other wavelengths, current injection) are added here.
 
-		output(0) = pulse_strength;
-		output(1) = 0;
+IN:
+	*) None
+OUT:
+	*) None
+*/
+void APqrPIDLTLP4::configureActuators()
+{
+	allocator.setCount(2);
+	allocator.setActuator(0, -Rm_blue, 5, 1);
+	allocator.setReversal(0, blue_Vrev_used, 0);
+	allocator.setActuator(1, Rm_red, 5, 1);
+}
+
+/*
+configureDerivative
+-------------------
+Computes the weights of the derivative filter that is selected with D_filter.
+This is not done in execute(), since it involves solving a small linear system.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+void APqrPIDLTLP4::configureDerivative()
+{
+	dfilter.configure((int)d_filter, (int)d_window, (int)d_order, dt);
+	d_lag = (d_filter == DerivativeFilter::REGRESSION ? (dlength - 1)/2*dt : dfilter.lag());
+}
+
+/*
+rise
+----
+Rise of the membrane potential over the last millisecond, which is compared to
+Slope_thresh to detect upstrokes.
+
+IN:
+	*) None
+OUT:
+	*) rise		Vm minus the Vm of 1 ms ago (mV)
+*/
+double APqrPIDLTLP4::rise()
+{
+	return Vm_det - Vm_log[ringIndex((int)idx2-(int)(1/dt), (int)wave.size())];
+}
+
+/*
+upstroke
+--------
+Whether the membrane potential rises fast enough to be an upstroke: either the
+rise over the last millisecond (Detector = 0) or the slope of the
+UpstrokeDetector (Detector = 1) is compared to Slope_thresh.
+
+IN:
+	*) None
+OUT:
+	*) upstroke	true when the slope threshold is reached
+*/
+bool APqrPIDLTLP4::upstroke()
+{
+	return (detector_mode ? detector.slope : rise()) >= slope_thresh;
+}
+
+/*
+reference
+---------
+Reference AP from the file (after Gain and Offset) at the given number of time-steps after the detected upstroke. The
+interpolated onset of the upstroke lies onset_frac time-steps before the
+time-step at which it was detected, so the reference is sampled in between
+two recorded points.
+
+IN:
+	*) n		time-steps since the detection of the upstroke
+OUT:
+	*) V		reference membrane potential (mV)
+*/
+double APqrPIDLTLP4::reference(size_t n)
+{
+	if (n + 1 >= wave.size()){return wave[wave.size()-1] * gain + offset;}
+	return (wave[n] + onset_frac*(wave[n+1] - wave[n])) * gain + offset;
+}
+
+/*
+setPhase
+--------
+Switches the control loop to another phase (see BeatPhase.h) and keeps the act
+flag in line with it.
+
+IN:
+	*) next		the new phase
+OUT:
+	*) None
+*/
+void APqrPIDLTLP4::setPhase(BeatPhase next)
+{
+	phase = next;
+	act = (next == CORRECTING);
+}
+
+/*
+restTick
+--------
+Tick handler of the REST phase. Paces the cell with blue light while it is
+below V_light_on and waits for the upstroke, which starts the correction of the
+AP. Since the iAP is read from a file, this module does not use the LOGGING and
+REFRACTORY phases.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+void APqrPIDLTLP4::restTick()
+{
+	if (Vm < V_light_on){
+		// This statement is entered whenever the cell is below the stimulation threshold
+		// while no AP is imprinted on it
+
+		VLED_blue = pulse_strength;
+		VLED_red = 0;
 	}
 
 	// ****************************
@@ -362,48 +1098,165 @@ void APqrPIDLTLP4::execute(void)
 	// ** Detecting AP upstrokes **
 	// ****************************
 	// ****************************
-	if (act == 0 && (Vm - Vm_log[(idx2-(int)(1/dt)) % wave.size()]) >= slope_thresh && Vm > V_cutoff)
+	// The if conditions measure the following:
+	// 1) Whether the rise over the last ms is large enough to be identified with an upstroke
+	// 2) Whether the mesured voltage is above a voltage treshold
+	if (upstroke() && Vm_det > V_cutoff)
+	{
+		startCorrection();
+		correctingTick();
+	}
+	else if (idx == 2*wave.size())
+		{events.post(EventMailbox::UPSTROKE_MISSED);} // No upstroke within twice the length of the AP file
+}
+
+/*
+startCorrection
+---------------
+Beat boundary at a detected upstroke. The estimators and tuners that work per
+beat are updated here, after which the correction of the new AP starts.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+void APqrPIDLTLP4::startCorrection()
+{
+	vm_beat.begin(); // The metrics of the previous beat are complete
+	ref_beat.begin();
+	beat_err.begin();
+	scope.begin();
+	checkAlternans(); // With the APD90 of the beat that just ended
+	autoThresholds(); // From the noise of the rest before this beat
+	drainCommands(BeatCommands::AT_UPSTROKE);
+	// At every upstroke the gating threshold of the blue channel is raised to the online
+	// estimate of the reversal potential, as long as that estimate is reliable. Doing this
+	// at the beat boundary keeps the threshold constant within one AP. The estimate never
+	// lowers the threshold below the hand-entered Blue_Vrev: light is only given below the
+	// threshold, so an estimate that gated its own samples could only drift further down.
+	if (vrev_on && blue_Vrev_estimator.valid())
+		{blue_Vrev_est = blue_Vrev_estimator.estimate();}
+	blue_Vrev_used = (vrev_on && blue_Vrev_estimator.valid() ? std::max(blue_Vrev, blue_Vrev_est) : blue_Vrev);
+
+	// The relay window of the previous AP is closed at every upstroke. After the requested
+	// number of APs the measured oscillations are turned into new PID gains, which are
+	// handed to the GUI with the states (see publishStates).
+	if (autotune.active() && autotune.endBeat())
+	{
+		if (autotune.tune((int)AT_rule, dt, K_p, K_i, K_d)){gains_tuned = true;}
+		autotune_on = 0;
+		events.post(EventMailbox::AUTOTUNE_DONE);
+		Ku = autotune.Ku;
+		Tu = autotune.Tu;
+		Int = 0; // The integral of the relay experiment has no meaning for the new gains
+	}
+
+	// At every upstroke the identified response of the cell is published and, when
+	// requested, used to rescale the LED channels such that an error would be removed
+	// with the time constant RLS_Tc by the proportional term alone (K_p = 1). This comes
+	// before the shadows are spread again, such that they surround the rescaled values.
+	if (rls_on)
 	{
-		// This statement is entered whenever an upstroke is detected after the
-		// ideal APs have been recorded.
-		// The if conditions measure the following:
-		// 1) Whether currently nothing is being done or corrected
-		// 2) Whether two consecutive measuring points show a large enough slope that can
-		//    be identified with an upstroke
-		// 3) Whether the mesured voltage is above a voltage treshold
-
-		idx = 0; // Reset the correction index/counter
-		act = 1; // Switch the correction on
+		b_blue = plant.gain(0);
+		b_red = plant.gain(1);
+		tau_est = plant.tau();
+		if (rls_autoscale && plant.valid(0, 1000) && b_blue > 0){Rm_blue = b_blue*rls_Tc; gains_tuned = true;}
+		if (rls_autoscale && plant.valid(1, 1000) && b_red < 0){Rm_red = -b_red*rls_Tc; gains_tuned = true;}
 	}
 
-	// Part of the code that implements the PID
-	if (act == 1){
-		// This statement is entered whenever the instruction to correct the AP has
-		// been given.
-
-		iAP = wave[idx] * gain + offset; // adjust the values from the AP-file in case necessary
-
-		// ************************************
-		// * Calculate the proportional error *
-		// ************************************
-		Vm_diff_log[idx] = Vm - iAP; // Log the errors
-		// ***************************************
-		// * Calculate the integral of the error *
-		// ***************************************
-		if (VLED < 5 && (Vm < blue_Vrev || Vm_diff_log[idx] > 0))
+	// At every upstroke the best shadow gain set of the previous AP is reported and, when
+	// requested, adopted as the new live gain set. The shadows are then spread around the
+	// live gains again.
+	if (shadow_on && rls_on)
+	{
+		double Rm_blue_best, Rm_red_best;
+		shadow_best = shadows.best();
+		shadow_ratio = (shadows.cost(0) > 0 ? shadows.cost((int)shadow_best)/shadows.cost(0) : 1);
+		shadows.candidate((int)shadow_best, shadow_Kp, shadow_Ki, shadow_Kd, Rm_blue_best, Rm_red_best);
+		if (shadow_adopt && shadow_best != 0 && plant.valid(0, 1000) && plant.valid(1, 1000))
 		{
-			// Int is only calculated when the voltage LED output has not reached
-			// its maximum (5V) and on eof two conditiosn is satisfied: depolarization
-			// is needed (blue ch) and Vm is more negative than blue_Vrev, or
-			// hyperpolarization is needed (red ch).
-			// This step was taken such that the Int term cannot amass further when
-			// the system can not react to it.
-
-			Int = Int + Vm_diff_log[idx];
+			K_p = shadow_Kp;
+			K_i = shadow_Ki;
+			K_d = shadow_Kd;
+			Rm_blue = Rm_blue_best;
+			Rm_red = Rm_red_best;
+			gains_tuned = true;
 		}
-		// *****************************************
-		// * Calculate the derivative of the error *
-		// *****************************************
+		shadows.setCandidates(K_p, K_i, K_d, Rm_blue, Rm_red, shadow_spread);
+	}
+
+	idx = 0; // Reset the correction index/counter
+	onset_frac = (detector_mode ? detector.onset(slope_thresh, V_cutoff) : 0); // Latest crossing of both conditions
+	setPhase(CORRECTING); // Switch the correction on
+}
+
+/*
+correctingTick
+--------------
+Tick handler of the CORRECTING phase. Computes and outputs the correction. The
+phase returns to REST when the end of the file is reached (see execute).
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+void APqrPIDLTLP4::correctingTick()
+{
+	// This statement is entered whenever the instruction to correct the AP has
+	// been given.
+
+	iAP = reference(idx); // adjust the values from the AP-file in case necessary
+
+	// ************************************
+	// * Calculate the proportional error *
+	// ************************************
+	Vm_diff_log.set(idx, Vm - iAP); // Log the errors
+	ref_beat.sample(iAP); // Per-beat AP metrics of the reference
+	beat_err.sample(Vm_diff_log[idx]); // Error statistics of this beat (see ErrorStats.h)
+	// *************************************
+	// * Identify the response of the cell *
+	// *************************************
+	// The change in error is related to the light of the previous time-step (still in
+	// VLED_blue and VLED_red) to learn how strongly each LED channel acts on the membrane
+	// potential. These are the commands before the opsin compensation, which makes the
+	// light-gated currents follow them, as the shadow gain sets produce them.
+	if (rls_on && idx > 0)
+		{plant.update(Vm_diff_log[idx-1], Vm_diff_log[idx], VLED_blue, VLED_red);}
+
+	// The shadow gain sets are driven through the identified model by the same drift of
+	// the cell that the live controller experiences, lagging one time-step behind. They
+	// run the controller below with the slope, feedforward and thresholds of the previous time-step,
+	// which are still in slope, F, min_PID and PID_tresh (see ShadowControllers.h).
+	if (shadow_on && rls_on && idx == 0)
+		{shadows.startBeat(Vm_diff_log[idx], Int, PID, VLED_blue, VLED_red, VLED);}
+	else if (shadow_on && rls_on)
+	{
+		shadows.step(reference(idx-1), Vm_diff_log[idx-1], slope, F,
+			plant.disturbance(Vm_diff_log[idx-1], Vm_diff_log[idx], VLED_blue, VLED_red),
+			plant.coefficient(0), plant.coefficient(1), plant.coefficient(2), blue_Vrev_used,
+			min_PID, PID_tresh, idx-1 >= corr_start-1, dt);
+	}
+	// ***************************************
+	// * Calculate the integral of the error *
+	// ***************************************
+	if (VLED < 5 && (Vm < blue_Vrev_used || Vm_diff_log[idx] > 0))
+	{
+		// Int is only calculated when the voltage LED output has not reached
+		// its maximum (5V) and on eof two conditiosn is satisfied: depolarization
+		// is needed (blue ch) and Vm is more negative than blue_Vrev, or
+		// hyperpolarization is needed (red ch).
+		// This step was taken such that the Int term cannot amass further when
+		// the system can not react to it.
+
+		Int = Int + Vm_diff_log[idx];
+	}
+	// *****************************************
+	// * Calculate the derivative of the error *
+	// *****************************************
+	if (d_filter == DerivativeFilter::REGRESSION)
+	{
 		// Calculate the numerator for a linear regression between the last "length" amount of points.
 		// This larger amount of points is chosen to cut out the noise that is intrinsically present
 		// in a membrane potential recording.
@@ -415,75 +1268,161 @@ void APqrPIDLTLP4::execute(void)
 			{slope = 10000;}
 		else
 			{slope = num/denom;} // Slope is measured in mV/ms
-	
-		// ************************************
-		// * Calculate the separate PID terms *
-		// ************************************	
-		P = K_p * Vm_diff_log[idx]; // Term that is proportional to the instantaneous difference in voltage.
-		I = K_i * Int; // Term that speeds up or slows down the rate of change based on the history of voltage differences.
-		D = K_d * slope; // Term that predicts the bahviour that is about to happen and helps in stabilizing.
-
-		PID_diff = PID; // Update the PID difference term
-		PID = P + I + D; // Calculate the sum of all the individual terms
-		PID_diff = PID_diff - PID; // Calculate the PID difference term
-
-		if (idx >= corr_start-1 && abs(PID_diff) > PID_tresh){
-			// PID_tresh gives a value that bounds the actions of the output (applies to PID_diff).
-			// When smaller than this value, the previous light-ouput will be repeated.
-			// This explains the lack of an else case.
-			if (PID < 0 && abs(PID) > min_PID && Vm < blue_Vrev)
-			{
-				// If PID is smaller than 0, a depolarizing current is needed. Therefore here the output for
-				// the blue LED driver is calculated. However, blu elight has no influence when the membrane
-				// potential is larger than the reversal potential of the light-gated channel. Hence, an extra limit
-				// was imposed to limit this.
-				// min_PID gives a value where you don't consider it necessary to correct anything (applies to PID).
-				// So when the absolute value is smaller than this value, the output will be set to 0 (in the else case later on).
-
-				VLED = -PID * (1/Rm_blue); // Calculate VLED by applying a LED-specific factor
-				if (VLED > 5){VLED = 5;} // Limit the LED driver output to its maximum value
-				output(0) = VLED; // Send output to the blue LED driver
-				output(1) = 0; // Make sure the red LED driver does not receive any output
-			}
-			else if (PID > 0 && abs(PID) > min_PID)
-			{
-				// If PID is larger than 0, a repolarizing current is needed. Therefore here the output for
-				// the red LED driver is calculated.
-
-				VLED = PID * (1/Rm_red); // Calculate VLED by applying a LED-specific factor
-				// Rm_red scales the amount of applied light for the red channel.
-				// By lowering this value compared to Rm_blue, it is possible to counteract the smaller effect of repolarizing currents than depolarizing currents.
-				if (VLED > 5){VLED = 5;} // Limit the LED driver output to its maximum value
-				output(1) = VLED; // Send output to the red LED driver
-				output(0) = 0; // Make sure the blue LED driver does not receive any output
-			}
-			else
-			{
-				// In all other cases, don't shine any light
-				output(0) = 0; // Make sure the blue LED driver does not receive any output
-				output(1) = 0; // Make sure the red LED driver does not receive any output
-			}			
+	}
+	else
+	{
+		// Savitzky-Golay or noise-robust differentiator over D_window points, see DerivativeFilters.h
+		slope = dfilter.slope(Vm_diff_log, idx, (int)modulo); // Slope is measured in mV/ms
+	}
+
+	// The change of Vm over the last time-step, together with the Vm and the blue light
+	// at its start (the light is still present on output(0)) and the change of the
+	// reference over the same time-step, feeds the online estimate of the reversal
+	// potential. The filtered slope is not used, since its lag would pair it with the
+	// wrong Vm and light.
+	if (vrev_on && idx > 0)
+	{
+		double ref_prev = reference(idx-1);
+		double ref_now = reference(idx);
+		blue_Vrev_estimator.update(output(0), Vm_diff_log[idx-1] + ref_prev,
+			(Vm_diff_log[idx] - Vm_diff_log[idx-1] + ref_now - ref_prev)/dt, (ref_now - ref_prev)/dt);
+	}
+
+	// ************************************
+	// * Calculate the separate PID terms *
+	// ************************************	
+	P = K_p * Vm_diff_log[idx]; // Term that is proportional to the instantaneous difference in voltage.
+	I = K_i * Int; // Term that speeds up or slows down the rate of change based on the history of voltage differences.
+	D = K_d * slope; // Term that predicts the bahviour that is about to happen and helps in stabilizing.
+	// Term that anticipates the upcoming change of the iAP. Since the whole file is known in advance,
+	// the weighted change over the next Preview_N points was computed when loading it. A rising iAP
+	// asks for depolarization (negative PID), hence the minus sign.
+	F = (idx < wave_preview.size() ? -K_preview * gain * wave_preview[idx] : 0);
+
+	PID_diff = PID; // Update the PID difference term
+	PID = P + I + D + F; // Calculate the sum of all the individual terms
+	// During auto-tuning the PID output is replaced by a relay within the chosen window of the AP
+	if (autotune.active() && idx*dt >= AT_start && idx*dt < AT_end)
+		{PID = autotune.relay(Vm_diff_log[idx], idx*dt);}
+	PID_diff = PID_diff - PID; // Calculate the PID difference term
+
+	if (idx >= corr_start-1 && abs(PID_diff) > PID_tresh){
+		// PID_tresh gives a value that bounds the actions of the output (applies to PID_diff).
+		// When smaller than this value, the previous light-ouput will be repeated.
+		// This explains the lack of an else case.
+		if (abs(PID) > min_PID)
+		{
+			// The requested action is distributed over the actuators by the allocator. With the
+			// blue (depolarizing) and red (repolarizing) channel this gives blue light when PID < 0
+			// and Vm < blue_Vrev (blue light has no influence above the reversal potential of the
+			// light-gated channel), and red light when PID > 0, both limited to 5V.
+			// min_PID gives a value where you don't consider it necessary to correct anything (applies to PID).
+			// So when the absolute value is smaller than this value, the output will be set to 0 (in the else case later on).
+			// The actuators are set up again here, since Rm_blue, Rm_red and blue_Vrev can change at every upstroke.
+			configureActuators();
+			// Only a request beyond v_max counts as saturated, not one that no channel can act on
+			if (allocator.allocate(PID, Vm, VLED_act) == OutputAllocator::SATURATED){events.post(EventMailbox::SATURATED);}
+			VLED_blue = VLED_act[0]; // Send output to the blue LED driver
+			VLED_red = VLED_act[1]; // Send output to the red LED driver
+			// VLED keeps the last non-zero LED voltage, which limits the integral term above
+			if (VLED_blue > 0 || VLED_red > 0){VLED = (VLED_blue > VLED_red ? VLED_blue : VLED_red);}
 		}
-		
+		else
+		{
+			// In all other cases, don't shine any light
+			VLED_blue = 0; // Make sure the blue LED driver does not receive any output
+			VLED_red = 0; // Make sure the red LED driver does not receive any output
+		}			
+	}
+}
+
+/*
+execute
+-------
+This is the main funtcion of the code that is looped through real-time.
+Every time-step the tick handler of the current phase (see BeatPhase.h) is run:
+	1) REST: pacing the cell and detecting AP upstrokes
+	2) CORRECTING: reading in the ideal AP, computing AP correction and
+	   outputting this
+after which the necessary variables are updated.
+
+IN:
+	*) None
+OUT:
+	*) VLED1	voltage that is used to power the first LED driver that
+				regulates the light that is shined onto the cells
+	*) VLED2 	voltage that is used to power the second LED driver that
+				regulates the light that is shined onto the cells
+*/
+void APqrPIDLTLP4::execute(void)
+{
+	if (live.pending()){applyLive(live.acquire());} // Parameters changed by Modify without a reset
+	// A time-step that starts more than 1.5 periods after the previous one means that
+	// the real-time loop fell behind
+	long long now = RT::OS::getTime();
+	if (t_prev && now - t_prev > 1.5e6*dt){events.post(EventMailbox::OVERRUN);}
+	t_prev = now;
+	systime = idx * dt; // time in milli-seconds
+	Vm = input(0) * 1e2; // convert 10V to mV. Divided by 10 because the amplifier produces 10-fold amplified voltages. Multiplied by 1000 to vonvert V to mV.
+
+	Vm_det = prefilter.filter(Vm); // Only the upstroke detector sees the prefiltered Vm
+	detector.update(Vm_det);
+	vm_beat.sample(Vm); // Per-beat AP metrics of the measured Vm (see BeatMetrics.h)
+	if (phase == REST){noise.update(Vm);} else {noise.skip();} // Noise of Vm between the beats
+
+	if ((nloops && loop >= nloops) || !wave.size()) {
+		// Stop the working of this module as long as no File has been provided, or as soon
+		// as the maximal number of loops through this file has been reached. The GUI thread
+		// pauses the module in refresh().
+		events.post(wave.size() ? EventMailbox::LOOPS_FINISHED : EventMailbox::FILE_MISSING);
+		output(0) = 0;
+		output(1) = 0;
+		return;
+	}
+
+	// Only after the check above, since there is nothing to cycle through without a file
+	Vm_log.set(idx2 % wave.size(), Vm_det); 	// Logging the measured Vm in a list
+										// where the wave.size component makes
+										// sure you keep cycling when you have
+										// reached the maximum number in the list.
+
+	// Only the tick handler of the current phase runs (see BeatPhase.h)
+	switch (phase)
+	{
+	case REST:
+		restTick();
+		break;
+	case CORRECTING:
+		correctingTick();
+		break;
+	default:
+		break;
 	}
 
 	idx++; // This is the total counter and does not get reset
 	idx2++; // This is the counter within one AP. WIll be reset after every upstroke
 
-	PID_copy = (double)PID;
-	act_copy = (double)act;
-	idx_copy = (double)idx;
-	idx2_copy = (double)idx2;
-
 	// This part of the code makes sure no output is produced in the last part of the action potential to let the cell come to rest.
 	// It also makes sure that the necessary variables are reset when the ASCII file came to an end.
 	if (idx2 >= wave.size()){
 		idx2 = 0; // Reset the AP counter
-		act = 0; // Stop imprinting after the end of the file has been reached
-		output(0) = 0; // Send a 0 output since the last output is otherwise kept
-		output(1) = 0; // Send a 0 output since the last output is otherwise kept
+		setPhase(REST); // Stop imprinting after the end of the file has been reached
+		VLED_blue = 0; // Send a 0 output since the last output is otherwise kept
+		VLED_red = 0; // Send a 0 output since the last output is otherwise kept
 		if (nloops) ++loop; // Increase the loop counter for the amount of times we go through the ASCII file
+		beat_err.end(); // The error statistics of this beat are complete
+		drainCommands(BeatCommands::AT_BEAT_END);
 	}
+
+	// The requested LED voltages are passed through the inverse of the opsin kinetics
+	// such that the light-gated currents follow the PID output with less delay.
+	// This has to happen on every time-step, since the opsin model also needs to follow
+	// the deactivation of the channels when the LEDs are switched off.
+	output(0) = blue_opsin.compensate(VLED_blue); // Send output to the blue LED driver
+	output(1) = red_opsin.compensate(VLED_red); // Send output to the red LED driver
+	scope.sample((phase == CORRECTING ? iAP : NAN), Vm, output(0), output(1)); // Live overlay (see OverlayScope.h)
+
+	publishStates(); // One consistent snapshot of this time-step for the GUI
 }
 
 /*
@@ -510,6 +1449,11 @@ void APqrPIDLTLP4::customizeGUI(void)
 	fileBoxLayout->addWidget(previewBttn);
 	QObject::connect(loadBttn, SIGNAL(clicked()), this, SLOT(loadFile()));
 	QObject::connect(previewBttn, SIGNAL(clicked()), this, SLOT(previewFile()));
+	// The scope redraws itself while it is shown, so the button only needs its show() slot
+	scope_dialog = new ScopeDialog(this, &scope);
+	QPushButton *scopeBttn = new QPushButton("Live Scope");
+	fileBoxLayout->addWidget(scopeBttn);
+	QObject::connect(scopeBttn, SIGNAL(clicked()), scope_dialog, SLOT(show()));
 
 	customlayout->addWidget(fileBox, 0, 0);
 	setLayout(customlayout);
@@ -543,6 +1487,11 @@ void APqrPIDLTLP4::update(DefaultGUIModel::update_flags_t flag)
 			setComment("File Name", filename);
 			setState("Length (ms)", length);
 			setParameter("Slope_thresh (mV/ms)", slope_thresh);
+			setParameter("Prefilter", prefilter_mode);
+			setParameter("Prefilter_window", prefilter_window);
+			setParameter("Hampel_k", hampel_k);
+			setParameter("Detector", detector_mode);
+			setParameter("Detect_window (ms)", detect_window);
           		setParameter("Blue_Vrev", blue_Vrev);
 			setParameter("Rm_blue (MOhm)", Rm_blue);
 			setParameter("Rm_red (MOhm)", Rm_red);
@@ -555,71 +1504,289 @@ void APqrPIDLTLP4::update(DefaultGUIModel::update_flags_t flag)
 			setParameter("V_light_on (mV)", V_light_on);
 			setParameter("V_cutoff (mV)", V_cutoff);
 			setParameter("dlength", dlength);
+			setParameter("D_filter", d_filter);
+			setParameter("D_window", d_window);
+			setParameter("D_order", d_order);
+			setState("D_lag (ms)", d_lag);
 			setParameter("PID_tresh", PID_tresh);
 			setParameter("min_PID", min_PID);
-			setState("Time (ms)", systime);
+			setParameter("Auto_thresh", auto_thresh);
+			setParameter("Auto_k", auto_k);
+			setParameter("Alt_window (beats)", alt_window);
+			setParameter("Alt_thresh (ms)", alt_thresh);
+			setParameter("STV_thresh (ms)", stv_thresh);
+			setParameter("Alt_backoff", alt_backoff);
+			setParameter("Err_split1 (ms)", err_split1);
+			setParameter("Err_split2 (ms)", err_split2);
+			setParameter("Opsin_order", opsin_order);
+			setParameter("tau_on_blue (ms)", tau_on_blue);
+			setParameter("tau_off_blue (ms)", tau_off_blue);
+			setParameter("tau_on_red (ms)", tau_on_red);
+			setParameter("tau_off_red (ms)", tau_off_red);
+			setParameter("Vrev_estimation", vrev_on);
+			setParameter("Vrev_lambda", vrev_lambda);
+			setState("Blue_Vrev_est (mV)", shown.blue_Vrev_est);
+			setParameter("RLS_on", rls_on);
+			setParameter("RLS_lambda", rls_lambda);
+			setParameter("RLS_autoscale", rls_autoscale);
+			setParameter("RLS_Tc (ms)", rls_Tc);
+			setState("b_blue (mV/ms/V)", shown.b_blue);
+			setState("b_red (mV/ms/V)", shown.b_red);
+			setState("tau_est (ms)", shown.tau_est);
+			setParameter("AutoTune", autotune_on);
+			setParameter("AT_start (ms)", AT_start);
+			setParameter("AT_end (ms)", AT_end);
+			setParameter("AT_amplitude", AT_amplitude);
+			setParameter("AT_hysteresis (mV)", AT_hysteresis);
+			setParameter("AT_beats", AT_beats);
+			setParameter("AT_rule", AT_rule);
+			setState("Ku", shown.Ku);
+			setState("Tu (ms)", shown.Tu);
+			setParameter("Shadow_on", shadow_on);
+			setParameter("Shadow_spread", shadow_spread);
+			setParameter("Shadow_adopt", shadow_adopt);
+			setState("Shadow_best", shown.shadow_best);
+			setState("Shadow_cost_ratio", shown.shadow_ratio);
+			setState("Shadow_K_p", shown.shadow_Kp);
+			setState("Shadow_K_i", shown.shadow_Ki);
+			setState("Shadow_K_d", shown.shadow_Kd);
+			setState("Time (ms)", shown.systime);
 			setState("Period (ms)", dt);
-			setState("PID", PID_copy);			
-			setState("act", act_copy);			
-			setState("idx", idx_copy);			
-			setState("idx2", idx2_copy);
-			setState("iAP", iAP);
-			setState("P", P);
-			setState("I", I);
-			setState("D", D);
+			setState("PID", shown.PID);			
+			setState("act", shown.act);			
+			setState("Phase", shown.phase);
+			setState("Memory locked", memory_locked);
+			setState("Saturated", saturated);
+			setState("Overruns", overruns);
+			setState("Missed upstrokes", missed);
+			setState("APD30 (ms)", shown.apd30);
+			setState("APD50 (ms)", shown.apd50);
+			setState("APD90 (ms)", shown.apd90);
+			setState("AP_amplitude (mV)", shown.amplitude);
+			setState("dVdt_max (mV/ms)", shown.dvdt_max);
+			setState("RMP (mV)", shown.rmp);
+			setState("Ref_APD30 (ms)", shown.ref_apd30);
+			setState("Ref_APD50 (ms)", shown.ref_apd50);
+			setState("Ref_APD90 (ms)", shown.ref_apd90);
+			setState("Ref_AP_amplitude (mV)", shown.ref_amplitude);
+			setState("Ref_dVdt_max (mV/ms)", shown.ref_dvdt_max);
+			setState("Ref_RMP (mV)", shown.ref_rmp);
+			setState("Noise (mV)", shown.noise);
+			setState("Alternans (ms)", shown.alternans);
+			setState("STV (ms)", shown.stv);
+			setState("Alternans_flag", shown.alt_flag);
+			setState("Err_RMS (mV)", shown.err_rms);
+			setState("Err_max (mV)", shown.err_max);
+			setState("Err_bias (mV)", shown.err_bias);
+			setState("Err_RMS_w1 (mV)", shown.err_rms1);
+			setState("Err_max_w1 (mV)", shown.err_max1);
+			setState("Err_bias_w1 (mV)", shown.err_bias1);
+			setState("Err_RMS_w2 (mV)", shown.err_rms2);
+			setState("Err_max_w2 (mV)", shown.err_max2);
+			setState("Err_bias_w2 (mV)", shown.err_bias2);
+			setState("Err_RMS_w3 (mV)", shown.err_rms3);
+			setState("Err_max_w3 (mV)", shown.err_max3);
+			setState("Err_bias_w3 (mV)", shown.err_bias3);
+			setState("idx", shown.idx);			
+			setState("idx2", shown.idx2);
+			setState("iAP", shown.iAP);
+			setState("P", shown.P);
+			setState("I", shown.I);
+			setState("D", shown.D);
+			setParameter("K_preview", K_preview);
+			setParameter("Preview_N", preview_N);
+			setParameter("Preview_tau (ms)", preview_tau);
+			setState("F", shown.F);
 			break;
 
 		case MODIFY:
+			// The live-tunable parameters are always handed to execute(), which applies them
+			// at its next time-step, and the beat-synchronous ones are queued for the next beat
+			// boundary. Only a change of a structural parameter resets the module.
+			live_gui = readLive();
+			live.publish(live_gui);
+			postCommands();
+			if (!structuralChange()){break;}
+			applyLive(live_gui);
+			alt_window = getParameter("Alt_window (beats)").toDouble();
+			alternans.configure((int)alt_window);
+			alt_flag = 0;
+			corr_start = getParameter("Correction start").toDouble();
 			nloops = getParameter("Loops").toUInt();
-			gain = getParameter("Gain").toDouble();
-			offset = getParameter("Offset").toDouble();
-			pulse_strength = getParameter("Pulse_strength (V)").toDouble();
 			filename = getComment("File Name");
-			Rm_blue = getParameter("Rm_blue (MOhm)").toDouble();
-			Rm_red = getParameter("Rm_red (MOhm)").toDouble();
-			slope_thresh = getParameter("Slope_thresh (mV/ms)").toDouble();
-			V_light_on = getParameter("V_light_on (mV)").toDouble();
-			V_cutoff = getParameter("V_cutoff (mV)").toDouble();
-			corr_start = getParameter("Correction start").toDouble();
-			blue_Vrev = getParameter("Blue_Vrev").toDouble();
-			K_p = getParameter("K_p").toDouble();
-			K_i = getParameter("K_i").toDouble();
-			K_d = getParameter("K_d").toDouble();
+			prefilter_mode = getParameter("Prefilter").toDouble();
+			prefilter_window = getParameter("Prefilter_window").toDouble();
+			hampel_k = getParameter("Hampel_k").toDouble();
+			detector_mode = getParameter("Detector").toDouble();
+			detect_window = getParameter("Detect_window (ms)").toDouble();
 			dlength = getParameter("dlength").toDouble();
-			PID_tresh = getParameter("PID_tresh").toDouble();
-			min_PID = getParameter("min_PID").toDouble();
+			d_filter = getParameter("D_filter").toDouble();
+			d_window = getParameter("D_window").toDouble();
+			d_order = getParameter("D_order").toDouble();
+			opsin_order = getParameter("Opsin_order").toDouble();
+			tau_on_blue = getParameter("tau_on_blue (ms)").toDouble();
+			tau_off_blue = getParameter("tau_off_blue (ms)").toDouble();
+			tau_on_red = getParameter("tau_on_red (ms)").toDouble();
+			tau_off_red = getParameter("tau_off_red (ms)").toDouble();
+			vrev_on = getParameter("Vrev_estimation").toDouble();
+			vrev_lambda = getParameter("Vrev_lambda").toDouble();
+			rls_on = getParameter("RLS_on").toDouble();
+			rls_lambda = getParameter("RLS_lambda").toDouble();
+			rls_autoscale = getParameter("RLS_autoscale").toDouble();
+			rls_Tc = getParameter("RLS_Tc (ms)").toDouble();
+			autotune_on = getParameter("AutoTune").toDouble();
+			AT_start = getParameter("AT_start (ms)").toDouble();
+			AT_end = getParameter("AT_end (ms)").toDouble();
+			AT_amplitude = getParameter("AT_amplitude").toDouble();
+			AT_hysteresis = getParameter("AT_hysteresis (mV)").toDouble();
+			AT_beats = getParameter("AT_beats").toDouble();
+			AT_rule = getParameter("AT_rule").toDouble();
+			shadow_on = getParameter("Shadow_on").toDouble();
+			shadow_spread = getParameter("Shadow_spread").toDouble();
+			shadow_adopt = getParameter("Shadow_adopt").toDouble();
+			preview_N = getParameter("Preview_N").toDouble();
+			preview_tau = getParameter("Preview_tau (ms)").toDouble();
 			systime = 0;
 			idx = 0;
 			idx2 = 0;
+			setPhase(REST);
 			PID = 0;
 			PID_diff = 0;
 			Int = 0;
+			VLED_blue = 0;
+			VLED_red = 0;
+			configureOpsins();
+			blue_opsin.reset();
+			red_opsin.reset();
+			blue_Vrev_estimator.configure(vrev_lambda, -60, 60, 1000);
+			blue_Vrev_estimator.reset();
+			plant.configure(rls_lambda, dt);
+			plant.reset();
+			prefilter.configure((int)prefilter_mode, (int)prefilter_window, hampel_k);
+			detector.configure(dt, detect_window);
+			configureDerivative();
+			autotune.configure(AT_amplitude, AT_hysteresis, (int)AT_beats);
+			if (autotune_on){autotune.start();}
+			else {autotune.stop();}
+			shadows.setCandidates(K_p, K_i, K_d, Rm_blue, Rm_red, shadow_spread);
+			blue_Vrev_est = blue_Vrev;
+			blue_Vrev_used = blue_Vrev;
+			{
+				// Preview_N and Preview_tau may have changed; modify() already holds execute() here
+				std::vector<double> preview;
+				referencePreview(wave, preview_N, preview_tau, dt, preview);
+				wave_preview.swap(preview);
+			}
+			vm_beat.reset();
+			ref_beat.reset();
+			beat_err.reset();
+			scope.reset();
 			cleanup();
+			lockBuffers();
 			break;
 
 		case PAUSE:
+		{
+			// pause() does not wait for a time-step that is still running
+			bool active = holdExecute();
 			output(0) = 0;
 			output(1) = 0;
-			act = 0;
+			VLED_blue = 0;
+			VLED_red = 0;
+			blue_opsin.reset();
+			red_opsin.reset();
+			prefilter.reset();
+			detector.reset();
+			setPhase(PAUSED);
 			idx = 0;
 			loop = 0;
 			systime = 0;
 			idx2 = 0;
+			t_prev = 0;
+			vm_beat.reset(); // A pause breaks the beat
+			ref_beat.reset();
+			beat_err.reset();
+			scope.reset();
+			noise.skip();
+			events.take(EventMailbox::LOOPS_FINISHED); // Posted by the last time-steps before the pause took effect
+			events.take(EventMailbox::FILE_MISSING);
+			publishStates(); // execute() is held, so the GUI thread is the only writer
+			setActive(active);
 			break;
+		}
 
 		case UNPAUSE:
+			setPhase(REST); // The AP counter was reset, so wait for the next upstroke
 			break;
 
 		case PERIOD:
 			dt = RT::System::getInstance()->getPeriod() * 1e-6; // time in milli-seconds
+			t_prev = 0;
+			vm_beat.configure(dt);
+			ref_beat.configure(dt);
+			beat_err.configure(dt);
 			modulo = (1.0/(RT::System::getInstance()->getPeriod() * 1e-6)) * 1000.0;
+			configureOpsins();
+			plant.configure(rls_lambda, dt);
+			detector.configure(dt, detect_window);
+			configureDerivative();
 			loadFile(filename);
+			lockBuffers();
 
 		default:
 			break;
 	}
 }
 
+/*
+refresh
+-------
+This function is called periodically by the GUI timer. Gains that were found
+by a finished auto-tuning experiment, adopted from the shadow controllers,
+rescaled by RLS_autoscale or backed off after alternans are written back to
+the parameter fields here, such that a later Modify keeps them. They are taken
+from the copy of the states, after the GAINS_TUNED event, and never from the
+variables of the real-time thread.
+The events reported by the real-time thread are handled (see EventMailbox.h):
+the module is paused when the loops are done or no file is loaded, and the
+others are counted. Then the newest snapshot of the states is copied from the
+real-time thread (see Seqlock.h), after which the default refresh updates the
+displayed states.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+void APqrPIDLTLP4::refresh(void)
+{
+	unsigned int tuned = events.take(EventMailbox::GAINS_TUNED);
+	if (events.take(EventMailbox::AUTOTUNE_DONE) > 0)
+	{
+		// The experiment stopped itself, so AutoTune = 1 is posted again at a later Modify
+		setParameter("AutoTune", 0.0);
+		for (size_t j = 0; j < beat_posted.size(); j++)
+			{if (beat_vars[j].id == SET_AUTOTUNE){beat_posted[j] = 0;}}
+	}
+	// The module is paused here, in the GUI thread, when execute() reports that it
+	// has nothing left to do
+	if (events.take(EventMailbox::LOOPS_FINISHED) + events.take(EventMailbox::FILE_MISSING) > 0 && !pauseButton->isChecked())
+		{pauseButton->setChecked(true);}
+	saturated += events.take(EventMailbox::SATURATED);
+	overruns += events.take(EventMailbox::OVERRUN);
+	missed += events.take(EventMailbox::UPSTROKE_MISSED);
+	states.read(shown);
+	if (tuned > 0)
+	{
+		setParameter("K_p", shown.K_p);
+		setParameter("K_i", shown.K_i);
+		setParameter("K_d", shown.K_d);
+		setParameter("Rm_blue (MOhm)", shown.Rm_blue);
+		setParameter("Rm_red (MOhm)", shown.Rm_red);
+	}
+	DefaultGUIModel::refresh();
+}
+
 /*
 initParameters
 --------------
@@ -635,6 +1802,11 @@ void APqrPIDLTLP4::initParameters()
 {
 	// system related parameters
 	systime = 0;
+	memory_locked = 0;
+	t_prev = 0;
+	saturated = 0;
+	overruns = 0;
+	missed = 0;
 	dt = RT::System::getInstance()->getPeriod() * 1e-6; // ms
 	// cell related parameters
 	Vm = -80; 			// mV
@@ -643,6 +1815,14 @@ void APqrPIDLTLP4::initParameters()
 	// upstroke related parameters
 	slope_thresh = 5.0; // mV
 	V_cutoff = -40;		// mV
+	prefilter_mode = 0;
+	prefilter_window = 5;	// samples
+	hampel_k = 3;
+	prefilter.configure((int)prefilter_mode, (int)prefilter_window, hampel_k);
+	detector_mode = 0;
+	detect_window = 0.3;	// ms
+	detector.configure(dt, detect_window);
+	onset_frac = 0;
 	V_light_on = -60; // mV
 	pulse_strength = 3; //V
 	// file reading related parameters
@@ -654,10 +1834,25 @@ void APqrPIDLTLP4::initParameters()
 	length = 0;
 	iAP=-80;
 	// correction parameters
-	act = 0;
+	setPhase(REST);
 	corr_start = 0;
 	PID_tresh = 0.1;
 	min_PID = 0.2;
+	auto_thresh = 0;
+	auto_k = 3;
+
+	// alternans detection
+	alt_window = 16;		// beats
+	alt_thresh = 5;			// ms
+	stv_thresh = 0;			// ms, off
+	alt_backoff = 1;		// no back-off
+	alt_flag = 0;
+	alternans.configure((int)alt_window);
+
+	// error statistics per beat
+	err_split1 = 50;		// ms, upstroke
+	err_split2 = 250;		// ms, plateau
+	beat_err.setSplits(err_split1, err_split2);
 	blue_Vrev = -20;	// mV
 
 	PID = 0;
@@ -669,6 +1864,10 @@ void APqrPIDLTLP4::initParameters()
 	K_d = 0.1;
 	Int = 0;
 	dlength = 10;
+	d_filter = DerivativeFilter::REGRESSION;
+	d_window = 9;
+	d_order = 2;
+	configureDerivative();
 	num = 0;
 	denom = 1;
 	slope = 0;
@@ -679,8 +1878,74 @@ void APqrPIDLTLP4::initParameters()
 	idx2 = 0;
 	modulo = (1.0/(RT::System::getInstance()->getPeriod() * 1e-6)) * 1000.0;
 	VLED = 0;
+	VLED_blue = 0;
+	VLED_red = 0;
 	output(0) = 0;
 	output(1) = 0;
+
+	// opsin kinetics compensation
+	opsin_order = 0;	// no compensation
+	tau_on_blue = 2;	// ms
+	tau_off_blue = 10;	// ms
+	tau_on_red = 2;		// ms
+	tau_off_red = 5;	// ms
+	configureOpsins();
+
+	// reversal potential estimation
+	vrev_on = 0;
+	vrev_lambda = 0.9999;
+	blue_Vrev_est = blue_Vrev;	// mV
+	blue_Vrev_used = blue_Vrev;	// mV
+	blue_Vrev_estimator.configure(vrev_lambda, -60, 60, 1000);
+
+	// plant identification
+	rls_on = 0;
+	rls_lambda = 0.9999;
+	rls_autoscale = 0;
+	rls_Tc = 1;			// ms
+	b_blue = 0;			// mV/ms/V
+	b_red = 0;			// mV/ms/V
+	tau_est = 0;		// ms
+	plant.configure(rls_lambda, dt);
+
+	// reference preview
+	K_preview = 0;
+	preview_N = 20;
+	preview_tau = 2;	// ms
+	F = 0;
+
+	// relay auto-tuning
+	autotune_on = 0;
+	AT_start = 10;		// ms
+	AT_end = 100;		// ms
+	AT_amplitude = 100;
+	AT_hysteresis = 0.5;	// mV
+	AT_beats = 3;
+	AT_rule = 0;		// Ziegler-Nichols
+	Ku = 0;
+	Tu = 0;				// ms
+	gains_tuned = false;
+
+	// shadow controllers
+	shadow_on = 0;
+	shadow_spread = 1.5;
+	shadow_adopt = 0;
+	shadow_best = 0;
+	shadow_ratio = 1;
+	shadow_Kp = K_p;
+	shadow_Ki = K_i;
+	shadow_Kd = K_d;
+	shadows.setCandidates(K_p, K_i, K_d, Rm_blue, Rm_red, shadow_spread);
+
+	// output allocation
+	for (int n = 0; n < OutputAllocator::MAX_ACTUATORS; n++){VLED_act[n] = 0;}
+	configureActuators();
+	vm_beat.configure(dt);
+	ref_beat.configure(dt);
+	beat_err.configure(dt);
+	scope.configure(2*wave.size(), dt);
+
+	publishStates();
 }
 
 /*
@@ -704,17 +1969,28 @@ void APqrPIDLTLP4::loadFile()
 		QStringList files = fd->selectedFiles();
 		if (!files.isEmpty()) fileName = files.takeFirst();
 		setComment("File Name", fileName);
-		wave.clear();
+		// The file and its preview are read into new vectors, since execute() keeps reading
+		// the current ones until they are swapped in while it is held
+		std::vector<double> loaded;
 		QFile file(fileName);
 		if (file.open(QIODevice::ReadOnly)) {
 			QTextStream stream(&file);
 			double value;
 			while (!stream.atEnd()) {
 				stream >> value;
-				wave.push_back(value);
+				loaded.push_back(value);
 			}
 			filename = fileName;
 		}
+		std::vector<double> preview;
+		referencePreview(loaded, preview_N, preview_tau, dt, preview);
+		bool active = holdExecute();
+		wave.swap(loaded);
+		wave_preview.swap(preview);
+		// configure() resets the bins that execute() writes, so it also runs while execute() is held
+		scope.configure(2*wave.size(), dt); // A beat lasts up to twice the file when an upstroke is missed
+		setActive(active);
+		lockBuffers();
 		length = wave.size() * dt;
 		setState("Length (ms)", length); // initialized in ms, display in ms
 	} else setComment("File Name", "No file loaded.");
@@ -735,16 +2011,26 @@ void APqrPIDLTLP4::loadFile(QString fileName)
 	if (fileName == "No file loaded.") {
 		return;
 	} else {
-		wave.clear();
+		// The file and its preview are read into new vectors, since execute() keeps reading
+		// the current ones until they are swapped in while it is held
+		std::vector<double> loaded;
 		QFile file(fileName);
 		if (file.open(QIODevice::ReadOnly)) {
 			QTextStream stream(&file);
 			double value;
 			while (!stream.atEnd()) {
 				stream >> value;
-				wave.push_back(value);
+				loaded.push_back(value);
 			}
 		}
+		std::vector<double> preview;
+		referencePreview(loaded, preview_N, preview_tau, dt, preview);
+		bool active = holdExecute();
+		wave.swap(loaded);
+		wave_preview.swap(preview);
+		// configure() resets the bins that execute() writes, so it also runs while execute() is held
+		scope.configure(2*wave.size(), dt); // A beat lasts up to twice the file when an upstroke is missed
+		setActive(active);
 		length = wave.size() * dt;
 		setState("Length (ms)", length); // initialized in ms, display in ms
 	}
@@ -773,3 +2059,137 @@ void APqrPIDLTLP4::previewFile()
 
 	preview->show();
 }
+
+/*
+ScopeDialog
+-----------
+Constructs the live scope: the reference and Vm on the left axis and the LED
+commands on the right axis, solid for the current beat and dotted for the
+previous one.
+
+IN:
+	*) parent	the module
+	*) scope	the decimated traces that execute() writes
+OUT:
+	*) None
+*/
+ScopeDialog::ScopeDialog(QWidget *parent, const OverlayScope *scope) : QDialog(parent), scope(scope), timer(0)
+{
+	static const Qt::GlobalColor colors[OverlayScope::CHANNELS] = {Qt::black, Qt::darkGreen, Qt::blue, Qt::red};
+	static const char* names[OverlayScope::CHANNELS] = {"Reference", "Vm", "Blue LED", "Red LED"};
+
+	setWindowTitle("APqr PIDLTLP4 Live Scope");
+	plot = new BasicPlot(this);
+	plot->setAxisTitle(QwtPlot::xBottom, "Time after the upstroke (ms)");
+	plot->setAxisTitle(QwtPlot::yLeft, "Membrane potential (mV)");
+	plot->enableAxis(QwtPlot::yRight);
+	plot->setAxisTitle(QwtPlot::yRight, "LED command (V)");
+	for (int b = 0; b < 2; b++) {
+		for (int c = 0; c < OverlayScope::CHANNELS; c++) {
+			curves[b][c] = new QwtPlotCurve(QString(names[c]) + (b == OverlayScope::PREVIOUS ? " (previous beat)" : ""));
+			curves[b][c]->setPen(QPen(QColor(colors[c]), 1, (b == OverlayScope::PREVIOUS ? Qt::DotLine : Qt::SolidLine)));
+			if (c == OverlayScope::LED_BLUE || c == OverlayScope::LED_RED) {
+				curves[b][c]->setYAxis(QwtPlot::yRight);
+			}
+			curves[b][c]->attach(plot);
+		}
+	}
+	x.resize(2*OverlayScope::BINS);
+	y.resize(2*OverlayScope::BINS);
+
+	QVBoxLayout *layout = new QVBoxLayout;
+	layout->addWidget(plot);
+	setLayout(layout);
+	resize(800, 500);
+}
+
+/*
+showEvent
+---------
+Starts redrawing at 20 frames per second when the scope is shown.
+
+IN:
+	*) event	the show event
+OUT:
+	*) None
+*/
+void ScopeDialog::showEvent(QShowEvent *event)
+{
+	QDialog::showEvent(event);
+	if (!timer) {
+		timer = startTimer(50);
+	}
+}
+
+/*
+hideEvent
+---------
+Stops redrawing when the scope is closed, such that a hidden scope costs nothing.
+
+IN:
+	*) event	the hide event
+OUT:
+	*) None
+*/
+void ScopeDialog::hideEvent(QHideEvent *event)
+{
+	if (timer) {
+		killTimer(timer);
+		timer = 0;
+	}
+	QDialog::hideEvent(event);
+}
+
+/*
+timerEvent
+----------
+Redraws the scope on every tick of its timer, the only timer of the dialog.
+
+IN:
+	*) event	the timer event, not used
+OUT:
+	*) None
+*/
+void ScopeDialog::timerEvent(QTimerEvent *event)
+{
+	Q_UNUSED(event);
+	redraw();
+}
+
+/*
+redraw
+------
+Copies the current and the previous beat from the scope buffer and redraws
+them. Every bin gives two points at the same time, its minimum and its maximum,
+such that a curve holds at most 2*BINS points whatever the sample rate. A beat
+that could not be copied, because it does not exist yet or was overwritten
+during the copy, keeps the curves of its last copy.
+
+IN:
+	*) None
+OUT:
+	*) None
+*/
+void ScopeDialog::redraw(void)
+{
+	double w = scope->binWidth();
+	for (int b = 0; b < 2; b++) {
+		if (!scope->read(b, frame)) {
+			continue;
+		}
+		for (int c = 0; c < OverlayScope::CHANNELS; c++) {
+			int n = 0;
+			for (int k = 0; k < frame.bins; k++) {
+				if (isnan(frame.lo[c][k])) {
+					continue; // No samples of this channel in this bin (e.g. the reference between the beats)
+				}
+				x[n] = (k + 0.5)*w;
+				y[n++] = frame.lo[c][k];
+				x[n] = (k + 0.5)*w;
+				y[n++] = frame.hi[c][k];
+			}
+			curves[b][c]->setSamples(x.data(), y.data(), n);
+		}
+	}
+	plot->replot();
+}
@@ -19,6 +19,53 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <default_gui_model.h>
 #include <plotdialog.h>
 #include <basicplot.h>
+#include <qwt_plot_curve.h>
+#include "../APqrCommon/BeatPhase.h"
+#include "../APqrCommon/RTMemory.h"
+#include "../APqrCommon/LiveParams.h"
+#include "../APqrCommon/CommandQueue.h"
+#include "../APqrCommon/Seqlock.h"
+#include "../APqrCommon/EventMailbox.h"
+#include "../APqrCommon/BeatMetrics.h"
+#include "../APqrCommon/NoiseFloor.h"
+#include "../APqrCommon/AlternansDetector.h"
+#include "../APqrCommon/ErrorStats.h"
+#include "../APqrCommon/OverlayScope.h"
+#include "../APqrCommon/ControlKernels.h"
+#include "../APqrCommon/DerivativeFilters.h"
+#include "../APqrCommon/SlidingMedian.h"
+#include "../APqrCommon/UpstrokeDetector.h"
+#include "../APqrCommon/OpsinCompensator.h"
+#include "../APqrCommon/OutputAllocator.h"
+#include "../APqrCommon/ReversalEstimator.h"
+#include "../APqrCommon/PlantEstimator.h"
+#include "../APqrCommon/RelayAutoTuner.h"
+#include "../APqrCommon/ShadowControllers.h"
+#include "../APqrCommon/ReferencePreview.h"
+
+// Live overlay of the reference, Vm and the LED commands of the current and the
+// previous beat (see OverlayScope.h), redrawn by a timer while it is shown.
+class ScopeDialog : public QDialog
+{
+public:
+    ScopeDialog(QWidget *parent, const OverlayScope *scope);
+
+protected:
+    void showEvent(QShowEvent *event);
+    void hideEvent(QHideEvent *event);
+    void timerEvent(QTimerEvent *event);
+
+private:
+	void redraw(void);
+
+	const OverlayScope *scope;	// written by execute()
+	BasicPlot *plot;
+	QwtPlotCurve *curves[2][OverlayScope::CHANNELS];	// [CURRENT/PREVIOUS][channel]
+	OverlayScope::Frame frame;	// copy of the beat being drawn
+	std::vector<double> x;		// points of a curve, a minimum and a maximum per bin
+	std::vector<double> y;
+	int timer;					// 0 while hidden
+};
 
 // All parameters and functions related to the gAPqrPIDLTLP4 class.
 class APqrPIDLTLP4 : public DefaultGUIModel
@@ -30,33 +77,187 @@ public:
     virtual ~APqrPIDLTLP4(void);
 
     void execute(void);
+    virtual void refresh(void);
     void customizeGUI(void);
 
+    static void* operator new(size_t bytes);
+    static void operator delete(void* p);
+
 protected:
     virtual void update(DefaultGUIModel::update_flags_t);
 
 private:
+	// parameters that Modify changes without a reset (see live_vars[])
+	struct LiveBlock
+	{
+		double K_p;
+		double K_i;
+		double K_d;
+		double Rm_blue;
+		double Rm_red;
+		double PID_tresh;
+		double min_PID;
+		double auto_thresh;
+		double auto_k;
+		double alt_thresh;
+		double stv_thresh;
+		double alt_backoff;
+		double err_split1;
+		double err_split2;
+		double blue_Vrev;
+		double slope_thresh;
+		double V_cutoff;
+		double gain;
+		double offset;
+		double pulse_strength;
+		double V_light_on;
+		double K_preview;
+	};
+
+	// states that execute() publishes for refresh() (see Seqlock.h)
+	struct GuiStates
+	{
+		double blue_Vrev_est;
+		double b_blue;
+		double b_red;
+		double tau_est;
+		double Ku;
+		double Tu;
+		double shadow_best;
+		double shadow_ratio;
+		double shadow_Kp;
+		double shadow_Ki;
+		double shadow_Kd;
+		double K_p;
+		double K_i;
+		double K_d;
+		double Rm_blue;
+		double Rm_red;
+		double systime;
+		double PID;
+		double act;
+		double phase;
+		double idx;
+		double idx2;
+		double iAP;
+		double P;
+		double I;
+		double D;
+		double F;
+		double apd30;
+		double apd50;
+		double apd90;
+		double amplitude;
+		double dvdt_max;
+		double rmp;
+		double ref_apd30;
+		double ref_apd50;
+		double ref_apd90;
+		double ref_amplitude;
+		double ref_dvdt_max;
+		double ref_rmp;
+		double noise;
+		double alternans;
+		double stv;
+		double alt_flag;
+		double err_rms;
+		double err_max;
+		double err_bias;
+		double err_rms1;
+		double err_max1;
+		double err_bias1;
+		double err_rms2;
+		double err_max2;
+		double err_bias2;
+		double err_rms3;
+		double err_max3;
+		double err_bias3;
+	};
+
 	// functions
 	void cleanup();
 	long long i;
 	void initParameters();
-	double sumy(double arr[], int n, double length, double modulo);
-	double sumxy(double arr[], int n, double length, double period, double modulo);
+	void configureOpsins();
+	void configureActuators();
+	void configureDerivative();
+	void lockBuffers();
+	LiveBlock readLive();
+	void applyLive(const LiveBlock& p);
+	bool structuralChange();
+	void postCommands();
+	void applyCommand(const BeatCommand& c);
+	void drainCommands(int when);
+	void publishStates();
+	void autoThresholds();
+	void checkAlternans();
+	bool holdExecute();
+	double rise();
+	bool upstroke();
+	double reference(size_t n);
+	void setPhase(BeatPhase next);
+	void restTick();
+	void startCorrection();
+	void correctingTick();
+	double sumy(const apqr_log_t& arr, int n, double length, double modulo);
+	double sumxy(const apqr_log_t& arr, int n, double length, double period, double modulo);
 	double sumx(double period, double length);
 	double sumx2(double period, double length);
-	// system related parameters
-	double systime;
+	// hot state: the loop state that execute() writes on every time-step, packed
+	// together from the start of a cache line (see RTMemory.h): 144 bytes, three cache lines.
+	// The parameters that it reads on every time-step (K_p, K_i, K_d, slope_thresh, V_cutoff, gain, ...)
+	// stay with their groups below.
+	alignas(APQR_CACHE_LINE) size_t idx;
+	size_t idx2;
 	double dt;
+	double systime;
+	double Vm;
+	double Vm_det;				// Vm as seen by the upstroke detector
+	long long t_prev;			// start of the previous time-step (ns), 0 after a pause
+	BeatPhase phase;	// phase of the control loop
+	double act;
+	double Int;
+	double PID;
+	double PID_diff;
+	double slope;
+	double VLED;
+	double VLED_blue;
+	double VLED_red;
+	size_t loop;
+	size_t nloops;
+	// system related parameters
+	double memory_locked;		// 1 when the module is locked in RAM
+	LiveParams<LiveBlock> live;	// live-tunable parameters on their way to execute()
+	LiveBlock live_gui;			// live-tunable parameters last read by Modify
+	std::vector<double> structural;	// structural parameters at the previous Modify
+	BeatCommands commands;		// beat-synchronous parameters on their way to execute()
+	std::vector<double> beat_posted;	// beat-synchronous parameters as last posted
+	Seqlock<GuiStates> states;	// states of the last time-step on their way to refresh()
+	GuiStates shown;			// states as displayed by refresh()
+	EventMailbox events;		// events of execute() on their way to refresh()
+	double saturated;			// time-steps with a saturated output
+	double overruns;			// time-steps that started too late
+	double missed;				// beats without a detected upstroke
 	// arrays
-	double Vm_log[10000] = {0};		
-	double Vm_diff_log[10000] = {0};
+	alignas(APQR_CACHE_LINE) apqr_log_t Vm_log;
+	alignas(APQR_CACHE_LINE) apqr_log_t Vm_diff_log;
+	// AP metrics per beat
+	BeatMetrics vm_beat;		// of the measured Vm
+	BeatMetrics ref_beat;		// of the reference AP
 	// cell related parameters
-	double Vm;
 	double Rm_blue;
 	double Rm_red;
 	// Upstroke related parameters
 	double slope_thresh;
 	double V_cutoff;
+	double prefilter_mode;
+	double prefilter_window;
+	double hampel_k;
+	HampelFilter prefilter;
+	double detector_mode;
+	double detect_window;
+	double onset_frac;			// interpolated onset of the last upstroke (time-steps before its detection)
+	UpstrokeDetector detector;
     double pulse_strength;
     double V_light_on;
     // file reading related parameters
@@ -64,40 +265,110 @@ private:
     std::vector<double> wave;
     double gain;
     double offset;
-    size_t loop;
-    size_t nloops;
     double length;
     double iAP;
 	// correction parameters
-	double act;
 	double corr_start;
 	double PID_tresh;
 	double min_PID;
+	double auto_thresh;		// 1 when the thresholds follow the noise estimate
+	double auto_k;			// thresholds in multiples of the noise
+	NoiseFloor noise;		// noise of Vm between the beats
+	// alternans detection
+	double alt_window;
+	double alt_thresh;
+	double stv_thresh;
+	double alt_backoff;
+	double alt_flag;			// 1 when the last full window crossed a threshold
+	AlternansDetector alternans;	// beat-to-beat variability of APD90
+	// error statistics per beat
+	double err_split1;
+	double err_split2;
+	BeatErrors beat_err;			// RMS, maximal and mean error of the corrected beat
 	double blue_Vrev;
 
-	double PID;
 	double P;
 	double I;
 	double D;
 	double K_p;
 	double K_i;
 	double K_d;
-	double Int;
 	double dlength;
+	double d_filter;
+	double d_window;
+	double d_order;
+	double d_lag;
+	DerivativeFilter dfilter;
 	double num;
 	double denom;
-	double slope;
-	double PID_diff;
 
 	// standard loop parameters
-    size_t idx;
-    size_t idx2;
-    double act_copy;
-    double PID_copy;
-    double idx_copy;
-    double idx2_copy;
 	double modulo;
-	double VLED;
+
+	// opsin kinetics compensation
+	double opsin_order;
+	double tau_on_blue;
+	double tau_off_blue;
+	double tau_on_red;
+	double tau_off_red;
+	OpsinCompensator blue_opsin;
+	OpsinCompensator red_opsin;
+
+	// output allocation over the actuators (0 = blue LED, 1 = red LED)
+	OutputAllocator allocator;
+	double VLED_act[OutputAllocator::MAX_ACTUATORS];
+
+	// reversal potential estimation
+	double vrev_on;
+	double vrev_lambda;
+	double blue_Vrev_est;
+	double blue_Vrev_used;		// gating threshold in use: Blue_Vrev, or the estimate once it is reliable
+	ReversalEstimator blue_Vrev_estimator;
+
+	// plant identification
+	double rls_on;
+	double rls_lambda;
+	double rls_autoscale;
+	double rls_Tc;
+	double b_blue;
+	double b_red;
+	double tau_est;
+	PlantEstimator plant;
+
+	// relay auto-tuning
+	double autotune_on;
+	double AT_start;
+	double AT_end;
+	double AT_amplitude;
+	double AT_hysteresis;
+	double AT_beats;
+	double AT_rule;
+	double Ku;
+	double Tu;
+	bool gains_tuned;		// real-time thread only, handed over in publishStates()
+	RelayAutoTuner autotune;
+
+	// shadow controllers
+	double shadow_on;
+	double shadow_spread;
+	double shadow_adopt;
+	double shadow_best;
+	double shadow_ratio;
+	double shadow_Kp;
+	double shadow_Ki;
+	double shadow_Kd;
+	ShadowControllers shadows;
+
+	// reference preview
+	std::vector<double> wave_preview;
+	double K_preview;
+	double preview_N;
+	double preview_tau;
+	double F;
+
+	// live overlay scope
+	OverlayScope scope;			// decimated traces of the current and the previous beat
+	ScopeDialog *scope_dialog;	// draws them while it is shown
 
 private slots:
     // all custom slots